@@ -31,12 +31,26 @@ freely, subject to the following restrictions:
 #define MQTT_INLINE inline
 #endif
 
+/* Storage for a variable of which every thread has its own copy */
+#if defined(_MSC_VER)
+#define MQTT_THREAD_LOCAL __declspec(thread)
+#elif __STDC_VERSION__ >= 201112L
+#define MQTT_THREAD_LOCAL _Thread_local
+#else
+#define MQTT_THREAD_LOCAL __thread
+#endif
+
 #if __STDC_VERSION__ >= 199901L
 #define _XOPEN_SOURCE 600
 #else
 #define _XOPEN_SOURCE 500
 #endif
 
+/* The io_uring backend uses syscall() and Linux specific mmap() flags */
+#if defined(MQTT_USE_IO_URING) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #endif
 
 /**********************************************************************/
@@ -990,6 +1004,21 @@ static MQTT_INLINE const char *log_basename(const char *s)
 */
 int64_t MqttGetCurrentTime();
 
+/* Same as MqttGetCurrentTime but in microseconds. */
+int64_t MqttGetCurrentTimeUs();
+
+/*
+    Reads size bytes of the file from offset unless the file ends first,
+    without using the file position (except on Windows). Returns the number
+    of bytes read or -1 on error.
+*/
+int64_t MqttFileReadAt(int fd, void *buf, size_t size, int64_t offset);
+
+/* Returns a new descriptor for the same open file or -1. */
+int MqttFileDup(int fd);
+
+void MqttFileClose(int fd);
+
 /*
     Simple hexdump to stdout.
 */
@@ -1005,6 +1034,14 @@ void DumpHex(const void* data, size_t size);
 #include <stdio.h>
 #include <time.h>
 
+#if defined(_WIN32)
+#include <io.h>
+#include <limits.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 #if defined(_WIN32)
 int64_t MqttGetCurrentTime()
 {
@@ -1020,6 +1057,22 @@ int64_t MqttGetCurrentTime()
     counter.QuadPart /= frequency.QuadPart;
     return counter.QuadPart;
 }
+
+int64_t MqttGetCurrentTimeUs()
+{
+    static volatile long once = 0;
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (InterlockedCompareExchange(&once, 1, 0) == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    /* split to avoid overflowing the multiplication */
+    return (counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (counter.QuadPart % frequency.QuadPart) * 1000000 /
+           frequency.QuadPart;
+}
 #else
 int64_t MqttGetCurrentTime()
 {
@@ -1030,7 +1083,64 @@ int64_t MqttGetCurrentTime()
 
     return ((int64_t) t.tv_sec * 1000) + (int64_t) t.tv_nsec / 1000 / 1000;
 }
+
+int64_t MqttGetCurrentTimeUs()
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1)
+        return -1;
+
+    return ((int64_t) t.tv_sec * 1000000) + (int64_t) t.tv_nsec / 1000;
+}
+#endif
+
+int64_t MqttFileReadAt(int fd, void *buf, size_t size, int64_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+#if defined(_WIN32)
+        int rv;
+        unsigned int chunk = size - done > INT_MAX ?
+            INT_MAX : (unsigned int) (size - done);
+        if (_lseeki64(fd, offset + done, SEEK_SET) == -1)
+            return -1;
+        rv = _read(fd, (char *) buf + done, chunk);
+#else
+        ssize_t rv = pread(fd, (char *) buf + done, size - done,
+                           (off_t) (offset + done));
+        if (rv == -1 && errno == EINTR)
+            continue;
+#endif
+        if (rv == -1)
+            return -1;
+        if (rv == 0)
+            break;
+        done += (size_t) rv;
+    }
+
+    return (int64_t) done;
+}
+
+int MqttFileDup(int fd)
+{
+#if defined(_WIN32)
+    return _dup(fd);
+#else
+    return dup(fd);
+#endif
+}
+
+void MqttFileClose(int fd)
+{
+#if defined(_WIN32)
+    _close(fd);
+#else
+    close(fd);
 #endif
+}
 
 /* https://gist.github.com/ccbrown/9722406 */
 void DumpHex(const void* data, size_t size) {
@@ -1062,6 +1172,161 @@ void DumpHex(const void* data, size_t size) {
     }
 }
 
+/**********************************************************************/
+/*                              alloc.h                               */
+/**********************************************************************/
+
+#ifndef MQTT_ALLOC_H
+#define MQTT_ALLOC_H
+
+#include "mqtt.h"
+
+#include <stdlib.h>
+
+/*
+    All the memory of the library comes from these. They use the allocator
+    of the calling thread set with MqttAllocatorEnter, or the global one set
+    with MqttSetAllocator, or the C library.
+*/
+
+void *MqttMalloc(size_t size);
+
+void *MqttCalloc(size_t count, size_t size);
+
+void *MqttRealloc(void *ptr, size_t size);
+
+void MqttFree(void *ptr);
+
+/*
+    Makes allocator (NULL for the global one) the allocator of the calling
+    thread and returns the previous one to pass to MqttAllocatorLeave. The
+    public functions of a client wrap their work in these so that everything
+    allocated for the client, strings included, comes from its allocator.
+*/
+const MqttAllocator *MqttAllocatorEnter(const MqttAllocator *allocator);
+
+void MqttAllocatorLeave(const MqttAllocator *previous);
+
+#endif
+
+/**********************************************************************/
+/*                              alloc.c                               */
+/**********************************************************************/
+
+
+#include <string.h>
+#include <stdint.h>
+
+static MqttAllocator MqttGlobalAllocator;
+static int MqttGlobalAllocatorSet = 0;
+
+static MQTT_THREAD_LOCAL const MqttAllocator *MqttCurrentAllocator = NULL;
+
+static MQTT_INLINE const MqttAllocator *MqttAllocatorGet(void)
+{
+    if (MqttCurrentAllocator)
+        return MqttCurrentAllocator;
+    if (MqttGlobalAllocatorSet)
+        return &MqttGlobalAllocator;
+    return NULL;
+}
+
+void MqttSetAllocator(const MqttAllocator *allocator)
+{
+    if (allocator)
+    {
+        MqttGlobalAllocator = *allocator;
+        MqttGlobalAllocatorSet = 1;
+    }
+    else
+    {
+        MqttGlobalAllocatorSet = 0;
+    }
+}
+
+void *MqttMalloc(size_t size)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+
+    if (allocator)
+        return allocator->alloc(allocator->userData, size);
+
+    return malloc(size);
+}
+
+void *MqttCalloc(size_t count, size_t size)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+    void *ptr;
+
+    if (!allocator)
+        return calloc(count, size);
+
+    if (size > 0 && count > SIZE_MAX / size)
+        return NULL;
+
+    ptr = allocator->alloc(allocator->userData, count * size);
+
+    if (ptr)
+        memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+void *MqttRealloc(void *ptr, size_t size)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+
+    if (allocator)
+        return allocator->realloc(allocator->userData, ptr, size);
+
+    return realloc(ptr, size);
+}
+
+void MqttFree(void *ptr)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+
+    if (!ptr)
+        return;
+
+    if (allocator)
+        allocator->free(allocator->userData, ptr);
+    else
+        free(ptr);
+}
+
+const MqttAllocator *MqttAllocatorEnter(const MqttAllocator *allocator)
+{
+    const MqttAllocator *previous = MqttCurrentAllocator;
+    MqttCurrentAllocator = allocator;
+    return previous;
+}
+
+void MqttAllocatorLeave(const MqttAllocator *previous)
+{
+    MqttCurrentAllocator = previous;
+}
+
+/**********************************************************************/
+/*                              memdbg.h                              */
+/**********************************************************************/
+
+#ifndef MQTT_MEMDBG_H
+#define MQTT_MEMDBG_H
+
+/*
+    Bstrlib includes this when BSTRLIB_MEMORY_DEBUG is defined. It routes the
+    string allocations through the allocator of the library.
+*/
+
+
+#define bstr__alloc(x) MqttMalloc(x)
+#define bstr__realloc(p, x) MqttRealloc((p), (x))
+#define bstr__free(p) MqttFree(p)
+
+#endif
+
 /**********************************************************************/
 /*                             bstrlib.h                              */
 /**********************************************************************/
@@ -4547,11 +4812,16 @@ int n, r, l;
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#if defined(__linux__)
+/* SO_ZEROCOPY, hidden by _XOPEN_SOURCE */
+#include <asm/socket.h>
+#endif
 #define SocketErrno (errno)
 #define SOCKET_EINPROGRESS (EINPROGRESS)
 #endif
@@ -4562,18 +4832,68 @@ int SocketDisconnect(int sock);
 
 int SocketSendAll(int sock, const char *buf, size_t *len);
 
+/* Same values as MqttEventRead and MqttEventWrite */
 enum
 {
     EV_READ = 1,
     EV_WRITE = 2
 };
 
+/*
+    Waits at most timeout milliseconds for the events (EV_READ, EV_WRITE) in
+    *events. On return *events has every requested event that is ready, so
+    both EV_READ and EV_WRITE can be set. Uses poll() instead of select() if
+    SOCKET_USE_POLL is defined (not on Windows).
+*/
 int SocketSelect(int sock, int *events, int timeout);
 
 int64_t SocketRecv(int sock, void *buf, size_t len, int flags);
 
 int64_t SocketSend(int sock, const void *buf, size_t len, int flags);
 
+/* Maximum number of buffers SocketSendv accepts */
+#define SOCKET_IOV_MAX 64
+
+typedef struct SocketIoVec SocketIoVec;
+
+struct SocketIoVec
+{
+    const void *base;
+    size_t len;
+};
+
+/* Sends all the buffers with a single sendmsg (WSASend on Windows). */
+int64_t SocketSendv(int sock, const SocketIoVec *iov, int count, int flags);
+
+/*
+    Sends at most size bytes of the file fd from offset, with sendfile() on
+    Linux and by reading the file into a buffer elsewhere. Returns the number
+    of bytes sent, 0 if the file ended or -1 on error.
+*/
+int64_t SocketSendFile(int sock, int fd, int64_t offset, size_t size);
+
+/* Linux (4.14) can send from user memory without copying it, see
+   SocketEnableZeroCopy. */
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define SOCKET_HAVE_ZEROCOPY 1
+#endif
+
+/*
+    Allows sending with the MSG_ZEROCOPY flag. Each such send that succeeds
+    gets the next id starting from 0, and the kernel reports when it no longer
+    needs the memory of the send, see SocketReadZeroCopyCompletions. Returns
+    -1 if the platform or the socket doesn't support it.
+*/
+int SocketEnableZeroCopy(int sock);
+
+/*
+    Reads the zero copy completions from the error queue of the socket without
+    blocking. Sends complete in order, so *done is raised to one past the
+    highest completed id. Returns the number of completions read or -1 on
+    error.
+*/
+int SocketReadZeroCopyCompletions(int sock, uint32_t *done);
+
 void SocketSetNonblocking(int sock, int nb);
 
 int SocketGetError(int sock, int *error);
@@ -4591,6 +4911,24 @@ int SocketWouldBlock(int error);
 #include <stdio.h>
 #include <assert.h>
 
+#if defined(SOCKET_USE_POLL) && !defined(_WIN32)
+#include <poll.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+/* Size of the buffer SocketSendFile reads the file into without sendfile */
+#if !defined(SOCKET_SENDFILE_BUFFER_SIZE)
+#define SOCKET_SENDFILE_BUFFER_SIZE (16*1024)
+#endif
+
+#if defined(SOCKET_HAVE_ZEROCOPY)
+#include <time.h>
+#include <linux/errqueue.h>
+#endif
+
 #if defined(_WIN32)
 static int InitializeWsa()
 {
@@ -4694,6 +5032,48 @@ int64_t SocketSend(int sock, const void *buf, size_t len, int flags)
     return send(sock, buf, len, flags);
 }
 
+int64_t SocketSendv(int sock, const SocketIoVec *iov, int count, int flags)
+{
+#if defined(_WIN32)
+    WSABUF bufs[SOCKET_IOV_MAX];
+    DWORD sent = 0;
+    int i;
+
+    assert(count <= SOCKET_IOV_MAX);
+
+    for (i = 0; i < count; ++i)
+    {
+        bufs[i].buf = (char *) iov[i].base;
+        bufs[i].len = (ULONG) iov[i].len;
+    }
+
+    if (WSASend(sock, bufs, count, &sent, flags, NULL, NULL) == SOCKET_ERROR)
+    {
+        return -1;
+    }
+
+    return sent;
+#else
+    struct iovec bufs[SOCKET_IOV_MAX];
+    struct msghdr msg;
+    int i;
+
+    assert(count <= SOCKET_IOV_MAX);
+
+    for (i = 0; i < count; ++i)
+    {
+        bufs[i].iov_base = (void *) iov[i].base;
+        bufs[i].iov_len = iov[i].len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = bufs;
+    msg.msg_iovlen = count;
+
+    return sendmsg(sock, &msg, flags);
+#endif
+}
+
 int SocketSendAll(int sock, const char *buf, size_t *len)
 {
     size_t total = 0;
@@ -4715,6 +5095,58 @@ int SocketSendAll(int sock, const char *buf, size_t *len)
     return rv == -1 ? -1 : 0;
 }
 
+#if defined(SOCKET_USE_POLL) && !defined(_WIN32)
+int SocketSelect(int sock, int *events, int timeout)
+{
+    struct pollfd pfd;
+    int wanted;
+    int rv;
+
+    assert(sock != -1);
+    assert(events != NULL);
+    assert(*events != 0);
+
+    wanted = *events;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = sock;
+
+    if (wanted & EV_READ)
+    {
+        pfd.events |= POLLIN;
+    }
+
+    if (wanted & EV_WRITE)
+    {
+        pfd.events |= POLLOUT;
+    }
+
+    *events = 0;
+
+    rv = poll(&pfd, 1, timeout);
+
+    if (rv <= 0)
+    {
+        return rv;
+    }
+
+    /* Errors and hangups are reported as readable so that the following
+       read notices them. */
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+    {
+        *events |= EV_READ;
+    }
+
+    if (pfd.revents & POLLOUT)
+    {
+        *events |= EV_WRITE;
+    }
+
+    *events &= wanted;
+
+    return rv;
+}
+#else
 int SocketSelect(int sock, int *events, int timeout)
 {
     fd_set rfd, wfd;
@@ -4753,38 +5185,120 @@ int SocketSelect(int sock, int *events, int timeout)
 
     if (FD_ISSET(sock, &wfd))
     {
-        *events = EV_WRITE;
+        *events |= EV_WRITE;
     }
 
     if (FD_ISSET(sock, &rfd))
     {
-        *events = EV_READ;
+        *events |= EV_READ;
     }
 
     return rv;
 }
+#endif
 
-void SocketSetNonblocking(int sock, int nb)
+int64_t SocketSendFile(int sock, int fd, int64_t offset, size_t size)
 {
-#if defined(_WIN32)
-    unsigned int yes = nb;
-    ioctlsocket(s, FIONBIO, &yes);
+#if defined(__linux__)
+    off_t off = (off_t) offset;
+    return sendfile(sock, fd, &off, size);
 #else
-    int flags = fcntl(sock, F_GETFL, 0);
-    if (nb)
-        flags |= O_NONBLOCK;
-    else
-        flags &= ~O_NONBLOCK;
-    fcntl(sock, F_SETFL, flags);
+    char buf[SOCKET_SENDFILE_BUFFER_SIZE];
+    int64_t rv;
+
+    if (size > sizeof(buf))
+        size = sizeof(buf);
+
+    if ((rv = MqttFileReadAt(fd, buf, size, offset)) <= 0)
+        return rv;
+
+    /* What isn't sent now is read again on the next call */
+    return SocketSend(sock, buf, (size_t) rv, 0);
 #endif
 }
 
-int SocketGetOpt(int sock, int level, int name, void *val, int *len)
+int SocketEnableZeroCopy(int sock)
 {
-#if defined(_WIN32)
-    return getsockopt(sock, level, name, (char *) val, len);
+#if defined(SOCKET_HAVE_ZEROCOPY)
+    int one = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
 #else
-    socklen_t _len = *len;
+    (void) sock;
+    return -1;
+#endif
+}
+
+int SocketReadZeroCopyCompletions(int sock, uint32_t *done)
+{
+#if defined(SOCKET_HAVE_ZEROCOPY)
+    int count = 0;
+
+    for (;;)
+    {
+        /* Completions carry no data, only a control message */
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (SocketWouldBlock(SocketErrno))
+                return count;
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            struct sock_extended_err err;
+
+            if (cmsg->cmsg_len < CMSG_LEN(sizeof(err)))
+                continue;
+
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* The range [ee_info, ee_data] of sends has completed */
+            if ((int32_t) (err.ee_data + 1 - *done) > 0)
+                *done = err.ee_data + 1;
+
+            ++count;
+        }
+    }
+#else
+    (void) sock;
+    (void) done;
+    return 0;
+#endif
+}
+
+void SocketSetNonblocking(int sock, int nb)
+{
+#if defined(_WIN32)
+    unsigned int yes = nb;
+    ioctlsocket(s, FIONBIO, &yes);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (nb)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+    fcntl(sock, F_SETFL, flags);
+#endif
+}
+
+int SocketGetOpt(int sock, int level, int name, void *val, int *len)
+{
+#if defined(_WIN32)
+    return getsockopt(sock, level, name, (char *) val, len);
+#else
+    socklen_t _len = *len;
     int rc = getsockopt(sock, level, name, val, &_len);
     *len = _len;
     return rc;
@@ -4817,8 +5331,18 @@ int SocketWouldBlock(int error)
 #include <stdlib.h>
 #include <stdint.h>
 
+/* Maximum number of buffers passed to StreamWritev at a time */
+#define STREAM_IOV_MAX 64
+
 typedef struct Stream Stream;
 typedef struct StreamOps StreamOps;
+typedef struct StreamIoVec StreamIoVec;
+
+struct StreamIoVec
+{
+    const void *data;
+    size_t size;
+};
 
 struct Stream
 {
@@ -4832,6 +5356,7 @@ struct StreamOps
     int (*close)(Stream *stream);
     int (*seek)(Stream *stream, int64_t offset, int whence);
     int64_t (*tell)(Stream *stream);
+    int64_t (*writev)(const StreamIoVec *iov, int iovcnt, Stream *stream);
 };
 
 int StreamClose(Stream *stream);
@@ -4844,6 +5369,13 @@ int64_t StreamWrite(const void *ptr, size_t size, Stream *stream);
 int64_t StreamWriteUint16Be(uint16_t v, Stream *stream);
 int64_t StreamWriteByte(unsigned char byte, Stream *stream);
 
+/*
+    Writes the buffers in order with as few calls to the underlying stream as
+    possible. Returns the number of bytes written, which can be less than the
+    total size of the buffers, or -1 on error.
+*/
+int64_t StreamWritev(const StreamIoVec *iov, int iovcnt, Stream *stream);
+
 int StreamSeek(Stream *stream, int64_t offset, int whence);
 
 int64_t StreamTell(Stream *stream);
@@ -4882,10 +5414,10 @@ int64_t StreamRead(void *ptr, size_t size, Stream *stream)
     STREAM_CHECK_OP(stream, read);
     rv = stream->ops->read(ptr, size, stream);
 #if defined(STREAM_HEXDUMP_READ)
-    if (rv >= 0)
+    if (rv > 0)
     {
-        printf("READ %lu bytes:\n", size);
-        DumpHex(ptr, size);
+        printf("READ %lu bytes:\n", (unsigned long) rv);
+        DumpHex(ptr, (size_t) rv);
     }
 #endif
     return rv;
@@ -4897,7 +5429,7 @@ int64_t StreamReadUint16Be(uint16_t *v, Stream *stream)
     STREAM_CHECK_OP(stream, read);
     if (StreamRead(data, 2, stream) != 2)
         return -1;
-    *v = (data[1] << 0) | (data[0] << 1);
+    *v = (data[1] << 0) | (data[0] << 8);
     return 2;
 }
 
@@ -4916,6 +5448,39 @@ int64_t StreamWrite(const void *ptr, size_t size, Stream *stream)
     return stream->ops->write(ptr, size, stream);
 }
 
+int64_t StreamWritev(const StreamIoVec *iov, int iovcnt, Stream *stream)
+{
+    int64_t total = 0;
+    int i;
+
+    STREAM_CHECK_OP(stream, write);
+
+#if defined(STREAM_HEXDUMP_WRITE)
+    for (i = 0; i < iovcnt; ++i)
+    {
+        printf("WRITE %lu bytes:\n", iov[i].size);
+        DumpHex(iov[i].data, iov[i].size);
+    }
+#endif
+
+    if (stream->ops->writev)
+    {
+        return stream->ops->writev(iov, iovcnt, stream);
+    }
+
+    for (i = 0; i < iovcnt; ++i)
+    {
+        int64_t rv = stream->ops->write(iov[i].data, iov[i].size, stream);
+        if (rv == -1)
+            return total > 0 ? total : -1;
+        total += rv;
+        if ((size_t) rv < iov[i].size)
+            break;
+    }
+
+    return total;
+}
+
 int64_t StreamWriteUint16Be(uint16_t v, Stream *stream)
 {
     unsigned char data[2];
@@ -4949,1442 +5514,6428 @@ int64_t StreamTell(Stream *stream)
 #define SOCKETSTREAM_H
 
 
+/* Size of the per-stream receive buffer. Reads at least this big bypass the
+   buffer and go straight to the caller's memory. */
+#if !defined(SOCKET_STREAM_RECV_BUFFER_SIZE)
+#define SOCKET_STREAM_RECV_BUFFER_SIZE (16*1024)
+#endif
+
 typedef struct SocketStream SocketStream;
 
+struct UringStream;
+
 struct SocketStream
 {
     Stream base;
     int sock;
+    /* received data not yet consumed is rbuf[rpos..rlen) */
+    unsigned char *rbuf;
+    size_t rpos;
+    size_t rlen;
+    /* set while the I/O goes through io_uring, see uringstream.h */
+    struct UringStream *uring;
+    /* 1 if SocketStreamWritevZeroCopy can send without copying. The ids
+       of such sends below zeroCopyDone have completed and the rest up to
+       zeroCopySent are pending. */
+    int zeroCopy;
+    uint32_t zeroCopySent;
+    uint32_t zeroCopyDone;
 };
 
 int SocketStreamOpen(SocketStream *stream, int sock);
 
+/* Returns the number of received bytes that can be read without touching the
+   socket. */
+size_t SocketStreamAvailable(SocketStream *stream);
+
+/*
+    Writes at most size bytes of the file fd from offset, see SocketSendFile.
+    With io_uring the file is read into memory and queued like other writes.
+*/
+int64_t SocketStreamSendFile(SocketStream *stream, int fd, int64_t offset,
+                             size_t size);
+
+/*
+    Enables SocketStreamWritevZeroCopy if the platform supports MSG_ZEROCOPY.
+    Not available with io_uring. Returns -1 if not enabled.
+*/
+int SocketStreamEnableZeroCopy(SocketStream *stream);
+
+/*
+    Same as StreamWritev but, if enabled, the kernel sends straight from the
+    buffers which must stay unchanged until the send has completed. Such a
+    send gets the id zeroCopySent had before the call and increments it.
+*/
+int64_t SocketStreamWritevZeroCopy(SocketStream *stream,
+                                   const StreamIoVec *iov, int iovcnt);
+
+/* Updates zeroCopyDone from the completions reported by the kernel. */
+int SocketStreamReapZeroCopy(SocketStream *stream);
+
+/* Returns 1 if the zero copy send with the id has completed. */
+static MQTT_INLINE int SocketStreamZeroCopyDone(const SocketStream *stream,
+                                                uint32_t id)
+{
+    return (int32_t) (id - stream->zeroCopyDone) < 0;
+}
+
 #endif
 
 /**********************************************************************/
-/*                           socketstream.c                           */
+/*                              uring.h                               */
 /**********************************************************************/
 
+#ifndef MQTT_URING_H
+#define MQTT_URING_H
 
-#include <assert.h>
-#include <string.h>
 
-static int SocketStreamClose(Stream *base)
-{
-    int rv;
-    SocketStream *stream = (SocketStream *) base;
-    rv = SocketDisconnect(stream->sock);
-    stream->sock = -1;
-    return rv;
-}
+#if defined(MQTT_USE_IO_URING)
 
-static int64_t SocketStreamRead(void *ptr, size_t size, Stream *stream)
-{
-    SocketStream *ss = (SocketStream *) stream;
-    size_t received = 0;
-    if (ss->sock == -1)
-        return -1;
-    while (received < size)
-    {
-        char *p = ((char *) ptr) + received;
-        int64_t rv = SocketRecv(ss->sock, p, size - received, 0);
-        /* Error */
-        if (rv == -1)
-            return -1;
-        /* TODO: Closed? */
-        if (rv == 0)
-            break;
-        received += (size_t) rv;
-    }
-    return received;
-}
+#include <linux/io_uring.h>
 
-static int64_t SocketStreamWrite(const void *ptr, size_t size, Stream *stream)
-{
-    SocketStream *ss = (SocketStream *) stream;
-    size_t written = 0;
-    if (ss->sock == -1)
-        return -1;
-    while (written < size)
-    {
-        const char *p = ((char *) ptr) + written;
-        int64_t rv = SocketSend(ss->sock, p, size - written, 0);
-        if (rv == -1)
-            return -1;
-        written += (size_t) rv;
-    }
-    return written;
-}
+#include <stdlib.h>
+#include <stdint.h>
 
-static const StreamOps SocketStreamOps =
+/*
+    Minimal io_uring wrapper on top of the raw system calls so that we don't
+    depend on liburing.
+*/
+
+typedef struct Uring Uring;
+
+struct Uring
 {
-    SocketStreamRead,
-    SocketStreamWrite,
-    SocketStreamClose,
-    NULL,
-    NULL
+    int fd;
+    unsigned features;
+    /* submission queue */
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe *sqes;
+    /* SQEs handed out by UringGetSqe but not yet made visible to the kernel */
+    unsigned sqPending;
+    /* completion queue */
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    /* mappings */
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
 };
 
-int SocketStreamOpen(SocketStream *stream, int sock)
-{
-    assert(stream != NULL);
-    assert(sock != -1);
-    memset(stream, 0, sizeof(*stream));
-    stream->sock = sock;
-    stream->base.ops = &SocketStreamOps;
-    return 0;
-}
+/* Returns -1 (with errno set) if io_uring is not available. */
+int UringInit(Uring *ring, unsigned entries);
 
-/**********************************************************************/
-/*                           stringstream.h                           */
-/**********************************************************************/
+void UringFree(Uring *ring);
 
-#ifndef STRINGSTREAM_H
-#define STRINGSTREAM_H
+/*
+    Returns a zeroed SQE, flushing the submission queue to the kernel first if
+    it is full. Returns NULL only if that fails.
+*/
+struct io_uring_sqe *UringGetSqe(Uring *ring);
 
-#include <stdio.h>
+/*
+    Submits all pending SQEs and, if waitNr > 0, waits at most timeout
+    milliseconds (indefinitely if negative) for that many completions. Returns
+    -1 on error, 0 otherwise (also on timeout).
+*/
+int UringSubmit(Uring *ring, unsigned waitNr, int timeout);
 
-typedef struct StringStream StringStream;
+/* Returns the next completion or NULL if there is none. */
+struct io_uring_cqe *UringPeekCqe(Uring *ring);
 
-struct StringStream
-{
-    Stream base;
-    bstring buffer;
-    int64_t pos;
-};
+/* Releases the completion returned by UringPeekCqe. */
+void UringCqeSeen(Uring *ring);
 
-int StringStreamInit(StringStream *stream);
+int UringRegister(Uring *ring, unsigned opcode, void *arg, unsigned nrArgs);
 
-int StringStreamInitFromBstring(StringStream *stream, bstring buffer);
+#endif
 
 #endif
 
 /**********************************************************************/
-/*                           stringstream.c                           */
+/*                              uring.c                               */
 /**********************************************************************/
 
 
-#include <assert.h>
+#if defined(MQTT_USE_IO_URING)
 
-static int StringStreamClose(Stream *base)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+static int UringSetup(unsigned entries, struct io_uring_params *params)
 {
-    StringStream *ss = (StringStream *) base;
-    bdestroy(ss->buffer);
-    ss->buffer = NULL;
-    return 0;
+    return (int) syscall(__NR_io_uring_setup, entries, params);
 }
 
-static int64_t StringStreamRead(void *ptr, size_t size, Stream *stream)
+static int UringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                      unsigned flags, void *arg, size_t argSize)
 {
-    StringStream *ss = (StringStream *) stream;
-    int64_t available = blength(ss->buffer) - ss->pos;
-    void *bufptr;
-
-    if (available <= 0)
-    {
-        return -1;
-    }
-
-    if (size > (size_t) available)
-        size = available;
-
-    /* Use a temp buffer pointer to make some warnings disappear when using
-       GCC */
-    bufptr = bdataofs(ss->buffer, ss->pos);
-    memcpy(ptr, bufptr, size);
-
-    ss->pos += size;
-
-    return size;
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+                         flags, arg, argSize);
 }
 
-static int64_t StringStreamWrite(const void *ptr, size_t size, Stream *stream)
+int UringRegister(Uring *ring, unsigned opcode, void *arg, unsigned nrArgs)
 {
-    StringStream *ss = (StringStream *) stream;
-    struct tagbstring buf;
-    if (ss->buffer->mlen <= 0)
-        return -1;
-    btfromblk(buf, ptr, size);
-    bsetstr(ss->buffer, ss->pos, &buf, '\0');
-    ss->pos += size;
-    return size;
+    return (int) syscall(__NR_io_uring_register, ring->fd, opcode, arg,
+                         nrArgs);
 }
 
-int StringStreamSeek(Stream *base, int64_t offset, int whence)
+int UringInit(Uring *ring, unsigned entries)
 {
-    StringStream *ss = (StringStream *) base;
-    int64_t newpos = 0;
+    struct io_uring_params params;
+    unsigned char *sq, *cq;
+    unsigned *sqArray;
+    unsigned i;
 
-    if (whence == SEEK_SET)
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = UringSetup(entries, &params);
+
+    if (ring->fd == -1)
     {
-        newpos = offset;
+        return -1;
     }
-    else if (whence == SEEK_CUR)
+
+    /* We wait with a timeout through IORING_ENTER_EXT_ARG (Linux 5.11) */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG))
     {
-        newpos = ss->pos + offset;
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
     }
-    else if (whence == SEEK_END)
+
+    ring->features = params.features;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (ring->cqRingSize > ring->sqRingSize)
+        ring->sqRingSize = ring->cqRingSize;
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+
+    if (ring->sqRing == MAP_FAILED)
     {
-        newpos = blength(ss->buffer) - offset;
+        close(ring->fd);
+        return -1;
     }
-    else
+
+    /* With IORING_FEAT_SINGLE_MMAP both rings live in the same mapping */
+    ring->cqRing = ring->sqRing;
+    ring->cqRingSize = 0;
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED)
     {
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
         return -1;
     }
 
-    if (newpos > blength(ss->buffer))
-        return -1;
+    sq = (unsigned char *) ring->sqRing;
+    cq = (unsigned char *) ring->cqRing;
 
-    if (newpos < 0)
-        return -1;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned *) (sq + params.sq_off.ring_entries);
 
-    ss->pos = newpos;
+    /* SQE i is always at array slot i */
+    sqArray = (unsigned *) (sq + params.sq_off.array);
+    for (i = 0; i < ring->sqEntries; ++i)
+        sqArray[i] = i;
+
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
 
     return 0;
 }
 
-int64_t StringStreamTell(Stream *base)
+void UringFree(Uring *ring)
 {
-    StringStream *ss = (StringStream *) base;
-    return ss->pos;
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    ring->fd = -1;
 }
 
-static const StreamOps StringStreamOps =
+/* Makes the SQEs handed out so far visible to the kernel. */
+static unsigned UringFlush(Uring *ring)
 {
-    StringStreamRead,
-    StringStreamWrite,
-    StringStreamClose,
-    StringStreamSeek,
-    StringStreamTell
-};
+    unsigned tail = *ring->sqTail;
+    unsigned pending = ring->sqPending;
+    __atomic_store_n(ring->sqTail, tail + pending, __ATOMIC_RELEASE);
+    ring->sqPending = 0;
+    return pending;
+}
 
-int StringStreamInit(StringStream *stream)
+struct io_uring_sqe *UringGetSqe(Uring *ring)
 {
-    assert(stream != NULL);
-    memset(stream, 0, sizeof(*stream));
-    stream->pos = 0;
-    stream->buffer = bfromcstr("");
-    stream->base.ops = &StringStreamOps;
-    return 0;
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned next = *ring->sqTail + ring->sqPending;
+    struct io_uring_sqe *sqe;
+
+    if (next - head >= ring->sqEntries)
+    {
+        /* Full, let the kernel consume what we have so far */
+        if (UringSubmit(ring, 0, 0) == -1)
+            return NULL;
+        head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        next = *ring->sqTail + ring->sqPending;
+        if (next - head >= ring->sqEntries)
+            return NULL;
+    }
+
+    sqe = &ring->sqes[next & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sqPending;
+
+    return sqe;
 }
 
-int StringStreamInitFromBstring(StringStream *stream, bstring buffer)
+int UringSubmit(Uring *ring, unsigned waitNr, int timeout)
 {
-    assert(stream != NULL);
-    memset(stream, 0, sizeof(*stream));
-    stream->pos = 0;
-    stream->buffer = buffer;
-    stream->base.ops = &StringStreamOps;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned toSubmit = UringFlush(ring);
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    int rv;
+
+    if (waitNr > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    else if (toSubmit == 0)
+    {
+        return 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+
+    if (waitNr > 0 && timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    do
+    {
+        rv = UringEnter(ring->fd, toSubmit, waitNr, flags, &arg, sizeof(arg));
+    }
+    while (rv == -1 && errno == EINTR);
+
+    if (rv == -1 && errno != ETIME)
+    {
+        LOG_ERROR("io_uring_enter failed: %d", errno);
+        return -1;
+    }
+
     return 0;
 }
 
+struct io_uring_cqe *UringPeekCqe(Uring *ring)
+{
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return NULL;
+
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void UringCqeSeen(Uring *ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
+
 /**********************************************************************/
-/*                           stream_mqtt.h                            */
+/*                           uringstream.h                            */
 /**********************************************************************/
 
-#ifndef STREAM_MQTT_H
-#define STREAM_MQTT_H
+#ifndef URINGSTREAM_H
+#define URINGSTREAM_H
 
 
+#if defined(MQTT_USE_IO_URING)
 
-int64_t StreamReadMqttString(bstring *buf, Stream *stream);
-int64_t StreamWriteMqttString(const_bstring buf, Stream *stream);
 
-int64_t StreamReadRemainingLength(size_t *remainingLength, size_t *mul,
-                                  Stream *stream);
-int64_t StreamWriteRemainingLength(size_t *remainingLength, Stream *stream);
+/* Number and size of the buffers the kernel receives into. The buffers are
+   shared by all the streams of a UringIo. */
+#if !defined(URING_IO_BUFFER_COUNT)
+#define URING_IO_BUFFER_COUNT 512
+#endif
 
+#if !defined(URING_IO_BUFFER_SIZE)
+#define URING_IO_BUFFER_SIZE (8*1024)
 #endif
 
-/**********************************************************************/
-/*                           stream_mqtt.c                            */
-/**********************************************************************/
+/* Size of the per-stream buffer that outgoing data is staged in while the
+   kernel sends it. */
+#if !defined(URING_STREAM_SEND_BUFFER_SIZE)
+#define URING_STREAM_SEND_BUFFER_SIZE (64*1024)
+#endif
 
+typedef struct UringIo UringIo;
+typedef struct UringStream UringStream;
 
-#include <string.h>
+/*
+    An io_uring instance with a registered ring of provided receive buffers.
+    SocketStreams attached to it do their I/O through the ring instead of
+    recv() and send().
+*/
+struct UringIo
+{
+    Uring ring;
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    unsigned char *buffers;
+    /* bytes received into each buffer */
+    uint32_t *bufferLength;
+    /* next buffer in the receive list of the stream owning the buffer */
+    int *bufferNext;
+    /* buffers currently owned by the kernel */
+    unsigned freeBuffers;
+    uint16_t bufferTail;
+    /* streams whose receive stopped because the kernel ran out of buffers */
+    TAILQ_HEAD(, UringStream) starved;
+    /* streams not yet freed (detached ones wait for their operations) */
+    int streams;
+};
 
-int64_t StreamReadMqttString(bstring *buf, Stream *stream)
+struct UringStream
 {
-    uint16_t len;
-    bstring result;
+    UringIo *io;
+    /* NULL once detached, the state lives until the kernel is done with it */
+    SocketStream *stream;
+    void *userData;
+    int fd;
+    /* 1 if fd is a duplicate the stream closes itself, see
+       UringStreamDetach */
+    int ownsFd;
+    /* operations owned by the kernel */
+    int inflight;
+    int started;
+    int recvArmed;
+    int multishot;
+    int isStarved;
+    int pollArmed;
+    int pollReady;
+    int eof;
+    int error;
+    /* received buffers, the first one consumed up to headOffset */
+    int head;
+    int tail;
+    size_t headOffset;
+    size_t available;
+    /* unsent data is sbuf[spos..slen), the first sending bytes of which are
+       owned by an in-flight send */
+    unsigned char *sbuf;
+    size_t spos;
+    size_t slen;
+    size_t sending;
+    TAILQ_ENTRY(UringStream) starvedQueue;
+};
 
-    if (StreamReadUint16Be(&len, stream) == -1)
-        return -1;
+/* Returns -1 if io_uring or provided buffer rings are not available. */
+int UringIoInit(UringIo *io);
 
-    /* We need 1 extra byte for a NULL terminator. bfromcstralloc doesn't do
-       any size snapping. */
-    result = bfromcstralloc(len+1, "");
+/* Waits for the operations of detached streams to finish and frees io. */
+void UringIoFree(UringIo *io);
 
-    if (!result)
-        return -1;
+/*
+    Takes the completion cqe. Returns the stream it has news for, or NULL if
+    there is none (e.g. the stream has been detached).
+*/
+UringStream *UringIoComplete(UringIo *io, struct io_uring_cqe *cqe);
 
-    if (StreamRead(bdata(result), len, stream) == -1)
-    {
-        bdestroy(result);
-        return -1;
-    }
+/* Restarts receiving on starved streams if buffers have been returned. */
+void UringIoRearm(UringIo *io);
 
-    result->slen = len;
-    result->data[len] = '\0';
+/* Routes the I/O of stream through io. userData is kept for the caller. */
+int UringStreamAttach(UringIo *io, SocketStream *stream, void *userData);
 
-    *buf = result;
+/*
+    Cancels the receive of the stream and detaches it. Called before the
+    socket is closed. Data that hasn't been sent yet is still sent through
+    a duplicate of the socket.
+*/
+void UringStreamDetach(SocketStream *stream);
 
-    return len+2;
-}
+/* Starts receiving once the socket has connected. */
+int UringStreamStart(UringStream *us);
 
-int64_t StreamWriteMqttString(const_bstring buf, Stream *stream)
-{
-    if (StreamWriteUint16Be(blength(buf), stream) == -1)
-        return -1;
+/* Waits for the socket to become writable, i.e. connect to finish. */
+int UringStreamPollWrite(UringStream *us);
 
-    if (StreamWrite(bdata(buf), blength(buf), stream) == -1)
-        return -1;
+/* Returns the EV_READ and EV_WRITE events that would not block. */
+int UringStreamEvents(UringStream *us);
 
-    return 2 + blength(buf);
-}
+int64_t UringStreamRead(UringStream *us, void *ptr, size_t size);
 
-int64_t StreamReadRemainingLength(size_t *remainingLength, size_t *mul,
-                                  Stream *stream)
-{
-    unsigned char encodedByte;
-    do
-    {
-        if (StreamRead(&encodedByte, 1, stream) != 1)
-            return -1;
-        *remainingLength += (encodedByte & 127) * (*mul);
-        if ((*mul) > 128*128*128)
-            return -1;
-        (*mul) *= 128;
-    }
-    while ((encodedByte & 128) != 0);
-    *mul = 0;
-    return 0;
-}
+int64_t UringStreamWritev(UringStream *us, const StreamIoVec *iov,
+                          int iovcnt);
 
-int64_t StreamWriteRemainingLength(size_t *remainingLength, Stream *stream)
-{
-    do
-    {
-        size_t tmp = *remainingLength;
-        unsigned char encodedByte = tmp % 128;
-        tmp /= 128;
-        if (tmp > 0)
-            encodedByte |= 128;
-        if (StreamWrite(&encodedByte, 1, stream) != 1)
-        {
-            return -1;
-        }
-        *remainingLength = tmp;
-    }
-    while (*remainingLength > 0);
-    return 0;
-}
+size_t UringStreamAvailable(UringStream *us);
+
+#endif
+
+#endif
 
 /**********************************************************************/
-/*                              packet.h                              */
+/*                           uringstream.c                            */
 /**********************************************************************/
 
-#ifndef PACKET_H
-#define PACKET_H
 
+#if defined(MQTT_USE_IO_URING)
 
-#include <stdlib.h>
-#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
 #include <assert.h>
 
+/* Submission queue size of the ring */
+#define URING_IO_ENTRIES 1024
 
+/* Provided buffer group used for all receives */
+#define URING_IO_BUFFER_GROUP 0
 
+/* The operation is stored in the low bits of the user_data of each SQE, the
+   rest is the UringStream pointer. */
 enum
 {
-    MqttPacketTypeConnect = 0x1,
-    MqttPacketTypeConnAck = 0x2,
-    MqttPacketTypePublish = 0x3,
-    MqttPacketTypePubAck = 0x4,
-    MqttPacketTypePubRec = 0x5,
-    MqttPacketTypePubRel = 0x6,
-    MqttPacketTypePubComp = 0x7,
-    MqttPacketTypeSubscribe = 0x8,
-    MqttPacketTypeSubAck = 0x9,
-    MqttPacketTypeUnsubscribe = 0xA,
-    MqttPacketTypeUnsubAck = 0xB,
-    MqttPacketTypePingReq = 0xC,
-    MqttPacketTypePingResp = 0xD,
-    MqttPacketTypeDisconnect = 0xE
+    UringOpRecv = 1,
+    UringOpSend = 2,
+    UringOpPoll = 3,
+    UringOpMask = 3
 };
 
-enum MqttPacketState
+static uint64_t UringUserData(UringStream *us, int op)
 {
-    MqttPacketStateReadType,
-    MqttPacketStateReadRemainingLength,
-    MqttPacketStateReadPayload,
-    MqttPacketStateReadComplete,
+    return (uint64_t) (uintptr_t) us | op;
+}
 
-    MqttPacketStateWriteType,
-    MqttPacketStateWriteRemainingLength,
-    MqttPacketStateWritePayload,
-    MqttPacketStateWriteComplete
-};
+/* Hands the buffer bid back to the kernel. */
+static void UringIoRecycle(UringIo *io, int bid)
+{
+    struct io_uring_buf *buf;
 
-struct MqttMessage;
+    buf = &io->bufRing->bufs[io->bufferTail & (URING_IO_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t) (uintptr_t)
+        (io->buffers + (size_t) bid * URING_IO_BUFFER_SIZE);
+    buf->len = URING_IO_BUFFER_SIZE;
+    buf->bid = (uint16_t) bid;
 
-typedef struct MqttPacket MqttPacket;
+    ++io->bufferTail;
+    ++io->freeBuffers;
 
-struct MqttPacket
+    __atomic_store_n(&io->bufRing->tail, io->bufferTail, __ATOMIC_RELEASE);
+}
+
+int UringIoInit(UringIo *io)
 {
-    int type;
-    int flags;
-    int state;
-    uint16_t id;
-    size_t remainingLength;
-    size_t remainingLengthMul;
-    /* TODO: maybe switch to have a StringStream here? */
-    bstring payload;
-    struct MqttMessage *message;
-    SIMPLEQ_ENTRY(MqttPacket) sendQueue;
-};
+    struct io_uring_buf_reg reg;
+    int bid;
 
-const char *MqttPacketName(int type);
+    memset(io, 0, sizeof(*io));
+    TAILQ_INIT(&io->starved);
 
-MqttPacket *MqttPacketNew(int type);
+    if (UringInit(&io->ring, URING_IO_ENTRIES) == -1)
+    {
+        LOG_DEBUG("io_uring not available: %d", errno);
+        return -1;
+    }
 
-MqttPacket *MqttPacketWithIdNew(int type, uint16_t id);
+    io->bufRingSize = URING_IO_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    io->bufRing = mmap(NULL, io->bufRingSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-void MqttPacketFree(MqttPacket *packet);
+    if (io->bufRing == MAP_FAILED)
+    {
+        UringFree(&io->ring);
+        return -1;
+    }
 
-#endif
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) io->bufRing;
+    reg.ring_entries = URING_IO_BUFFER_COUNT;
+    reg.bgid = URING_IO_BUFFER_GROUP;
 
-/**********************************************************************/
-/*                              packet.c                              */
-/**********************************************************************/
+    /* Provided buffer rings need Linux 5.19 */
+    if (UringRegister(&io->ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        LOG_DEBUG("provided buffer rings not available: %d", errno);
+        munmap(io->bufRing, io->bufRingSize);
+        UringFree(&io->ring);
+        return -1;
+    }
 
+    io->buffers = MqttMalloc((size_t) URING_IO_BUFFER_COUNT *
+                             URING_IO_BUFFER_SIZE);
+    io->bufferLength = MqttCalloc(URING_IO_BUFFER_COUNT, sizeof(uint32_t));
+    io->bufferNext = MqttCalloc(URING_IO_BUFFER_COUNT, sizeof(int));
 
-#include <string.h>
-#include <stdio.h>
-#include <assert.h>
-#include <errno.h>
+    if (!io->buffers || !io->bufferLength || !io->bufferNext)
+    {
+        MqttFree(io->buffers);
+        MqttFree(io->bufferLength);
+        MqttFree(io->bufferNext);
+        munmap(io->bufRing, io->bufRingSize);
+        UringFree(&io->ring);
+        return -1;
+    }
 
-const char *MqttPacketName(int type)
-{
-    switch (type)
+    for (bid = 0; bid < URING_IO_BUFFER_COUNT; ++bid)
     {
-        case MqttPacketTypeConnect: return "CONNECT";
-        case MqttPacketTypeConnAck: return "CONNACK";
-        case MqttPacketTypePublish: return "PUBLISH";
-        case MqttPacketTypePubAck: return "PUBACK";
-        case MqttPacketTypePubRec: return "PUBREC";
-        case MqttPacketTypePubRel: return "PUBREL";
-        case MqttPacketTypePubComp: return "PUBCOMP";
-        case MqttPacketTypeSubscribe: return "SUBSCRIBE";
-        case MqttPacketTypeSubAck: return "SUBACK";
-        case MqttPacketTypeUnsubscribe: return "UNSUBSCRIBE";
-        case MqttPacketTypeUnsubAck: return "UNSUBACK";
-        case MqttPacketTypePingReq: return "PINGREQ";
-        case MqttPacketTypePingResp: return "PINGRESP";
-        case MqttPacketTypeDisconnect: return "DISCONNECT";
-        default: return NULL;
+        UringIoRecycle(io, bid);
     }
+
+    return 0;
 }
 
-MqttPacket *MqttPacketNew(int type)
+void UringIoFree(UringIo *io)
 {
-    MqttPacket *packet = NULL;
+    struct io_uring_cqe *cqe;
+    int tries = 0;
 
-    packet = (MqttPacket *) calloc(1, sizeof(*packet));
-    if (!packet)
-        return NULL;
+    /* The kernel may still write to the buffers of detached streams */
+    while (io->streams > 0 && tries++ < 100)
+    {
+        if (UringSubmit(&io->ring, 1, 10) == -1)
+            break;
 
-    packet->type = type;
+        while ((cqe = UringPeekCqe(&io->ring)) != NULL)
+        {
+            UringIoComplete(io, cqe);
+            UringCqeSeen(&io->ring);
+        }
+    }
 
-    return packet;
+    if (io->streams > 0)
+    {
+        LOG_WARNING("%d io_uring streams still busy", io->streams);
+    }
+
+    /* Closing the ring waits for the remaining operations */
+    UringFree(&io->ring);
+
+    munmap(io->bufRing, io->bufRingSize);
+    MqttFree(io->buffers);
+    MqttFree(io->bufferLength);
+    MqttFree(io->bufferNext);
 }
 
-MqttPacket *MqttPacketWithIdNew(int type, uint16_t id)
+static struct io_uring_sqe *UringStreamSqe(UringStream *us, int op)
 {
-    MqttPacket *packet = MqttPacketNew(type);
-    if (!packet)
+    struct io_uring_sqe *sqe = UringGetSqe(&us->io->ring);
+
+    if (!sqe)
+    {
+        LOG_ERROR("io_uring submission queue full");
         return NULL;
-    packet->id = id;
-    return packet;
-}
+    }
 
-void MqttPacketFree(MqttPacket *packet)
+    sqe->fd = us->fd;
+    sqe->user_data = UringUserData(us, op);
+
+    return sqe;
+}
+
+static int UringStreamArmRecv(UringStream *us)
 {
-    bdestroy(packet->payload);
-    free(packet);
+    struct io_uring_sqe *sqe = UringStreamSqe(us, UringOpRecv);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_IO_BUFFER_GROUP;
+
+    /* One multishot receive keeps delivering data until it is stopped */
+    if (us->multishot)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    us->recvArmed = 1;
+    ++us->inflight;
+
+    return 0;
 }
 
-/**********************************************************************/
-/*                             message.h                              */
-/**********************************************************************/
+static int UringStreamArmSend(UringStream *us)
+{
+    struct io_uring_sqe *sqe = UringStreamSqe(us, UringOpSend);
 
-#ifndef MESSAGE_H
-#define MESSAGE_H
+    if (!sqe)
+        return -1;
 
-#include <stdint.h>
+    us->sending = us->slen - us->spos;
 
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t) (uintptr_t) (us->sbuf + us->spos);
+    sqe->len = (uint32_t) us->sending;
+    sqe->msg_flags = MSG_NOSIGNAL;
 
-enum MqttMessageState
+    ++us->inflight;
+
+    return 0;
+}
+
+/* Frees a detached stream once the kernel is done with it. */
+static void UringStreamRelease(UringStream *us)
 {
-    MqttMessageStateQueued,
-    MqttMessageStatePublish,
-    MqttMessageStateWaitPubAck,
-    MqttMessageStateWaitPubRec,
-    MqttMessageStateWaitPubComp,
-    MqttMessageStateWaitPubRel
-};
+    const MqttAllocator *previous;
 
-typedef struct MqttMessage MqttMessage;
+    if (us->stream || us->inflight > 0)
+        return;
 
-struct MqttMessage
+    if (us->isStarved)
+        TAILQ_REMOVE(&us->io->starved, us, starvedQueue);
+
+    /* Closing the duplicate finally closes the connection */
+    if (us->ownsFd)
+        close(us->fd);
+
+    --us->io->streams;
+
+    /* Streams may outlive their connection so they always come from the
+       global allocator, see UringStreamAttach */
+    previous = MqttAllocatorEnter(NULL);
+    MqttFree(us->sbuf);
+    MqttFree(us);
+    MqttAllocatorLeave(previous);
+}
+
+static void UringStreamDropReceived(UringStream *us)
 {
-    int state;
-    int qos;
-    int retain;
-    int dup;
-    int padding;
-    uint16_t id;
-    int64_t timestamp;
-    bstring topic;
-    bstring payload;
-    TAILQ_ENTRY(MqttMessage) chain;
-};
+    while (us->head != -1)
+    {
+        int bid = us->head;
+        us->head = us->io->bufferNext[bid];
+        UringIoRecycle(us->io, bid);
+    }
 
-typedef struct MqttMessageList MqttMessageList;
-TAILQ_HEAD(MqttMessageList, MqttMessage);
+    us->tail = -1;
+    us->headOffset = 0;
+    us->available = 0;
+}
 
-void MqttMessageFree(MqttMessage *msg);
+static void UringStreamCompleteRecv(UringStream *us,
+                                    struct io_uring_cqe *cqe)
+{
+    UringIo *io = us->io;
 
-#endif
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        us->recvArmed = 0;
+        --us->inflight;
+    }
 
-/**********************************************************************/
-/*                             message.c                              */
-/**********************************************************************/
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
 
+        --io->freeBuffers;
 
-void MqttMessageFree(MqttMessage *msg)
+        if (cqe->res > 0 && us->stream)
+        {
+            io->bufferLength[bid] = (uint32_t) cqe->res;
+            io->bufferNext[bid] = -1;
+
+            if (us->tail == -1)
+                us->head = bid;
+            else
+                io->bufferNext[us->tail] = bid;
+
+            us->tail = bid;
+            us->available += (size_t) cqe->res;
+        }
+        else
+        {
+            UringIoRecycle(io, bid);
+        }
+    }
+
+    if (cqe->res == 0)
+    {
+        us->eof = 1;
+    }
+    else if (cqe->res == -ENOBUFS)
+    {
+        if (us->stream && !us->isStarved)
+        {
+            us->isStarved = 1;
+            TAILQ_INSERT_TAIL(&io->starved, us, starvedQueue);
+        }
+    }
+    else if (cqe->res == -EINVAL && us->multishot)
+    {
+        /* Multishot receive needs Linux 6.0, receive one buffer at a time */
+        LOG_DEBUG("multishot receive not supported");
+        us->multishot = 0;
+    }
+    else if (cqe->res < 0 && cqe->res != -ECANCELED)
+    {
+        us->error = -cqe->res;
+    }
+
+    if (us->stream && !us->recvArmed && !us->isStarved && !us->eof &&
+        !us->error)
+    {
+        if (UringStreamArmRecv(us) == -1)
+            us->error = ENOMEM;
+    }
+}
+
+static void UringStreamCompleteSend(UringStream *us,
+                                    struct io_uring_cqe *cqe)
 {
-    bdestroy(msg->topic);
-    bdestroy(msg->payload);
-    free(msg);
+    --us->inflight;
+    us->sending = 0;
+
+    if (cqe->res < 0)
+    {
+        us->error = -cqe->res;
+        return;
+    }
+
+    us->spos += (size_t) cqe->res;
+
+    /* A detached stream keeps sending until everything is sent too */
+    if (us->spos == us->slen)
+    {
+        us->spos = us->slen = 0;
+    }
+    else if (!us->error)
+    {
+        /* Short send, continue with the rest */
+        if (UringStreamArmSend(us) == -1)
+            us->error = ENOMEM;
+    }
 }
 
-/**********************************************************************/
-/*                              client.c                              */
-/**********************************************************************/
+UringStream *UringIoComplete(UringIo *io, struct io_uring_cqe *cqe)
+{
+    UringStream *us;
+    int op;
 
-#include "mqtt.h"
+    (void) io;
 
+    op = (int) (cqe->user_data & UringOpMask);
+    us = (UringStream *) (uintptr_t) (cqe->user_data & ~(uint64_t) UringOpMask);
 
+    /* Cancellations are not tracked */
+    if (!us)
+        return NULL;
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <assert.h>
-#include <time.h>
-#include <inttypes.h>
+    switch (op)
+    {
+        case UringOpRecv:
+            UringStreamCompleteRecv(us, cqe);
+            break;
 
-#if (LOG_LEVEL == LOG_LEVEL_DEBUG) && !defined(PRId64)
-#error define PRId64 for your platform
-#endif
+        case UringOpSend:
+            UringStreamCompleteSend(us, cqe);
+            break;
 
-typedef enum MqttClientState MqttClientState;
+        case UringOpPoll:
+            --us->inflight;
+            us->pollArmed = 0;
+            us->pollReady = 1;
+            break;
+    }
 
-enum MqttClientState
+    if (!us->stream)
+    {
+        UringStreamRelease(us);
+        return NULL;
+    }
+
+    return us;
+}
+
+void UringIoRearm(UringIo *io)
 {
-    MqttClientStateDisconnected,
-    MqttClientStateConnecting,
-    MqttClientStateConnected,
-};
+    while (io->freeBuffers > 0 && !TAILQ_EMPTY(&io->starved))
+    {
+        UringStream *us = TAILQ_FIRST(&io->starved);
+        TAILQ_REMOVE(&io->starved, us, starvedQueue);
+        us->isStarved = 0;
+        if (!us->recvArmed && UringStreamArmRecv(us) == -1)
+            us->error = ENOMEM;
+    }
+}
 
-struct MqttClient
+int UringStreamAttach(UringIo *io, SocketStream *stream, void *userData)
 {
-    SocketStream stream;
-    /* client id, NULL if we want to have server generated id */
-    bstring clientId;
-    /* set to 1 if we want to have a clean session */
-    int cleanSession;
-    /* remote host and port */
-    bstring host;
-    short port;
-    /* keepalive interval in seconds */
-    int keepAlive;
-    /* user specified data, not used by us */
-    void *userData;
-    /* callback called after connection is made */
-    MqttClientOnConnectCallback onConnect;
-    /* callback called after subscribe is done */
-    MqttClientOnSubscribeCallback onSubscribe;
-    /* callback called after subscribe is done */
-    MqttClientOnUnsubscribeCallback onUnsubscribe;
-    /* callback called when a message is received */
-    MqttClientOnMessageCallback onMessage;
-    /* callback called after publish is done and acknowledged */
-    MqttClientOnPublishCallback onPublish;
-    int stopped;
-    /* packets waiting to be sent over network */
-    SIMPLEQ_HEAD(, MqttPacket) sendQueue;
-    /* sent messages that are not done yet */
-    MqttMessageList outMessages;
-    /* received messages that are not done yet  */
-    MqttMessageList inMessages;
-    int sessionPresent;
-    /* when was the last packet sent */
-    int64_t lastPacketSentTime;
-    /* next packet id */
-    uint16_t packetId;
-    /* timeout after which to retry sending messages */
-    int retryTimeout;
-    /* maximum number of inflight messages (not packets!) */
-    int maxInflight;
-    /* maximum number of queued messages (not packets!) */
-    int maxQueued;
-    /* 1 if PINGREQ is sent and we are waiting for PINGRESP, 0 otherwise */
-    int pingSent;
-    bstring willTopic;
-    bstring willMessage;
-    int willQos;
-    int willRetain;
-    /* 1 if client should ignore incoming PUBLISH messages, 0 handle them */
-    int paused;
-    bstring userName;
-    bstring password;
-    /* The packet we are receiving */
-    MqttPacket inPacket;
-    MqttClientState state;
-};
+    const MqttAllocator *previous;
+    UringStream *us;
 
-static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet);
-static int MqttClientQueueSimplePacket(MqttClient *client, int type);
-static int MqttClientSendPacket(MqttClient *client);
-static int MqttClientRecvPacket(MqttClient *client);
-static uint16_t MqttClientNextPacketId(MqttClient *client);
-static void MqttClientProcessMessageQueue(MqttClient *client);
-static void MqttClientClearQueues(MqttClient *client);
+    assert(io != NULL);
+    assert(stream != NULL);
+    assert(stream->uring == NULL);
 
-static MQTT_INLINE int MqttClientInflightMessageCount(MqttClient *client)
+    /* The stream is freed when the kernel is done with it, which can be
+       after the client is gone, so it belongs to the loop rather than to
+       the client */
+    previous = MqttAllocatorEnter(NULL);
+
+    us = MqttCalloc(1, sizeof(*us));
+
+    if (us && !(us->sbuf = MqttMalloc(URING_STREAM_SEND_BUFFER_SIZE)))
+    {
+        MqttFree(us);
+        us = NULL;
+    }
+
+    MqttAllocatorLeave(previous);
+
+    if (!us)
+        return -1;
+
+    us->io = io;
+    us->stream = stream;
+    us->userData = userData;
+    us->fd = stream->sock;
+    us->multishot = 1;
+    us->head = us->tail = -1;
+
+    stream->uring = us;
+
+    ++io->streams;
+
+    return 0;
+}
+
+static void UringStreamCancel(UringStream *us, int op)
 {
-    MqttMessage *msg;
-    int queued = 0;
-    int inMessagesCount = 0;
-    int outMessagesCount = 0;
+    struct io_uring_sqe *sqe = UringGetSqe(&us->io->ring);
+
+    if (!sqe)
+        return;
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UringUserData(us, op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+void UringStreamDetach(SocketStream *stream)
+{
+    UringStream *us = stream->uring;
+
+    if (!us)
+        return;
+
+    stream->uring = NULL;
+    us->stream = NULL;
+    us->userData = NULL;
+
+    UringStreamDropReceived(us);
+
+    /* What is left to send, such as a DISCONNECT, is still sent, through a
+       duplicate of the socket since the caller closes it. The send in
+       flight (if any) already has the socket. */
+    if (us->slen > us->spos && !us->error)
     {
-        if (msg->state == MqttMessageStateQueued)
+        int fd = dup(us->fd);
+
+        if (fd != -1)
         {
-            ++queued;
-        }
+            us->fd = fd;
+            us->ownsFd = 1;
 
-        ++outMessagesCount;
+            if (us->sending == 0 && UringStreamArmSend(us) == -1)
+                us->error = ENOMEM;
+        }
     }
 
-    TAILQ_FOREACH(msg, &client->inMessages, chain)
+    /* The socket is closed by the caller but stays open as long as the
+       kernel has operations on it, cancel them. The cancellations are matched
+       by user_data since the descriptor may be reused right away. */
+    if (us->recvArmed)
+        UringStreamCancel(us, UringOpRecv);
+
+    if (us->sending && !us->ownsFd)
+        UringStreamCancel(us, UringOpSend);
+
+    if (us->pollArmed)
+        UringStreamCancel(us, UringOpPoll);
+
+    /* Operations still in the submission queue refer to the socket by its
+       number, submit them while it is open */
+    if (UringSubmit(&us->io->ring, 0, 0) == -1)
     {
-        ++inMessagesCount;
+        LOG_ERROR("failed to submit the operations of a detached stream");
     }
 
-    return inMessagesCount + outMessagesCount - queued;
+    UringStreamRelease(us);
 }
 
-MqttClient *MqttClientNew(const char *clientId)
+int UringStreamStart(UringStream *us)
+{
+    us->pollReady = 0;
+
+    if (us->started)
+        return 0;
+
+    us->started = 1;
+
+    return UringStreamArmRecv(us);
+}
+
+int UringStreamPollWrite(UringStream *us)
+{
+    struct io_uring_sqe *sqe;
+
+    if (us->pollArmed || us->pollReady)
+        return 0;
+
+    sqe = UringStreamSqe(us, UringOpPoll);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLOUT;
+
+    us->pollArmed = 1;
+    ++us->inflight;
+
+    return 0;
+}
+
+static size_t UringStreamSendSpace(UringStream *us)
+{
+    size_t space = URING_STREAM_SEND_BUFFER_SIZE - us->slen;
+
+    /* Unsent data can be moved to the front when no send is in flight */
+    if (us->sending == 0)
+        space += us->spos;
+
+    return space;
+}
+
+int UringStreamEvents(UringStream *us)
+{
+    int events = 0;
+
+    if (us->available > 0 || us->eof || us->error)
+        events |= EV_READ;
+
+    if (us->pollReady ||
+        (us->started && (us->error || UringStreamSendSpace(us) > 0)))
+        events |= EV_WRITE;
+
+    return events;
+}
+
+int64_t UringStreamRead(UringStream *us, void *ptr, size_t size)
+{
+    UringIo *io = us->io;
+    unsigned char *p = (unsigned char *) ptr;
+    size_t received = 0;
+
+    while (received < size && us->head != -1)
+    {
+        int bid = us->head;
+        size_t left = io->bufferLength[bid] - us->headOffset;
+        size_t count = size - received;
+
+        if (count > left)
+            count = left;
+
+        memcpy(p + received, io->buffers + (size_t) bid * URING_IO_BUFFER_SIZE
+               + us->headOffset, count);
+
+        received += count;
+        us->headOffset += count;
+        us->available -= count;
+
+        if (us->headOffset == io->bufferLength[bid])
+        {
+            us->head = io->bufferNext[bid];
+            if (us->head == -1)
+                us->tail = -1;
+            us->headOffset = 0;
+            UringIoRecycle(io, bid);
+        }
+    }
+
+    if (received > 0)
+        return (int64_t) received;
+
+    if (us->error)
+    {
+        errno = us->error;
+        return -1;
+    }
+
+    if (us->eof)
+        return 0;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int64_t UringStreamWritev(UringStream *us, const StreamIoVec *iov,
+                          int iovcnt)
+{
+    size_t written = 0;
+    int i;
+
+    if (us->error)
+    {
+        errno = us->error;
+        return -1;
+    }
+
+    if (us->sending == 0 && us->spos > 0)
+    {
+        memmove(us->sbuf, us->sbuf + us->spos, us->slen - us->spos);
+        us->slen -= us->spos;
+        us->spos = 0;
+    }
+
+    for (i = 0; i < iovcnt && us->slen < URING_STREAM_SEND_BUFFER_SIZE; ++i)
+    {
+        size_t count = URING_STREAM_SEND_BUFFER_SIZE - us->slen;
+
+        if (count > iov[i].size)
+            count = iov[i].size;
+
+        memcpy(us->sbuf + us->slen, iov[i].data, count);
+        us->slen += count;
+        written += count;
+
+        if (count < iov[i].size)
+            break;
+    }
+
+    if (us->sending == 0 && us->slen > us->spos &&
+        UringStreamArmSend(us) == -1)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (written == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return (int64_t) written;
+}
+
+size_t UringStreamAvailable(UringStream *us)
+{
+    return us->available;
+}
+
+#endif
+
+/**********************************************************************/
+/*                           socketstream.h                           */
+/**********************************************************************/
+
+#ifndef SOCKETSTREAM_H
+#define SOCKETSTREAM_H
+
+
+/* Size of the per-stream receive buffer. Reads at least this big bypass the
+   buffer and go straight to the caller's memory. */
+#if !defined(SOCKET_STREAM_RECV_BUFFER_SIZE)
+#define SOCKET_STREAM_RECV_BUFFER_SIZE (16*1024)
+#endif
+
+typedef struct SocketStream SocketStream;
+
+struct UringStream;
+
+struct SocketStream
+{
+    Stream base;
+    int sock;
+    /* received data not yet consumed is rbuf[rpos..rlen) */
+    unsigned char *rbuf;
+    size_t rpos;
+    size_t rlen;
+    /* set while the I/O goes through io_uring, see uringstream.h */
+    struct UringStream *uring;
+    /* 1 if SocketStreamWritevZeroCopy can send without copying. The ids
+       of such sends below zeroCopyDone have completed and the rest up to
+       zeroCopySent are pending. */
+    int zeroCopy;
+    uint32_t zeroCopySent;
+    uint32_t zeroCopyDone;
+};
+
+int SocketStreamOpen(SocketStream *stream, int sock);
+
+/* Returns the number of received bytes that can be read without touching the
+   socket. */
+size_t SocketStreamAvailable(SocketStream *stream);
+
+/*
+    Writes at most size bytes of the file fd from offset, see SocketSendFile.
+    With io_uring the file is read into memory and queued like other writes.
+*/
+int64_t SocketStreamSendFile(SocketStream *stream, int fd, int64_t offset,
+                             size_t size);
+
+/*
+    Enables SocketStreamWritevZeroCopy if the platform supports MSG_ZEROCOPY.
+    Not available with io_uring. Returns -1 if not enabled.
+*/
+int SocketStreamEnableZeroCopy(SocketStream *stream);
+
+/*
+    Same as StreamWritev but, if enabled, the kernel sends straight from the
+    buffers which must stay unchanged until the send has completed. Such a
+    send gets the id zeroCopySent had before the call and increments it.
+*/
+int64_t SocketStreamWritevZeroCopy(SocketStream *stream,
+                                   const StreamIoVec *iov, int iovcnt);
+
+/* Updates zeroCopyDone from the completions reported by the kernel. */
+int SocketStreamReapZeroCopy(SocketStream *stream);
+
+/* Returns 1 if the zero copy send with the id has completed. */
+static MQTT_INLINE int SocketStreamZeroCopyDone(const SocketStream *stream,
+                                                uint32_t id)
+{
+    return (int32_t) (id - stream->zeroCopyDone) < 0;
+}
+
+#endif
+
+/**********************************************************************/
+/*                           socketstream.c                           */
+/**********************************************************************/
+
+
+#include <assert.h>
+#include <string.h>
+
+static int SocketStreamClose(Stream *base)
+{
+    int rv;
+    SocketStream *stream = (SocketStream *) base;
+#if defined(MQTT_USE_IO_URING)
+    UringStreamDetach(stream);
+#endif
+    rv = SocketDisconnect(stream->sock);
+    stream->sock = -1;
+    MqttFree(stream->rbuf);
+    stream->rbuf = NULL;
+    stream->rpos = stream->rlen = 0;
+    return rv;
+}
+
+/* Copy up to size buffered bytes to ptr. */
+static size_t SocketStreamDrain(SocketStream *ss, unsigned char *ptr,
+                                size_t size)
+{
+    size_t available = ss->rlen - ss->rpos;
+    if (size > available)
+        size = available;
+    memcpy(ptr, ss->rbuf + ss->rpos, size);
+    ss->rpos += size;
+    return size;
+}
+
+/* Refill the (empty) receive buffer with a single recv(). */
+static int64_t SocketStreamFill(SocketStream *ss)
+{
+    int64_t rv;
+    assert(ss->rpos == ss->rlen);
+    ss->rpos = ss->rlen = 0;
+    rv = SocketRecv(ss->sock, ss->rbuf, SOCKET_STREAM_RECV_BUFFER_SIZE, 0);
+    if (rv > 0)
+        ss->rlen = (size_t) rv;
+    return rv;
+}
+
+/*
+    Reads whatever is buffered and, if that is not enough, does at most one
+    recv(). Returns the number of bytes read, which may be less than size, 0 if
+    the peer has closed the connection or -1 on error. Bytes read before a
+    would-block error are returned instead of being dropped.
+*/
+static int64_t SocketStreamRead(void *ptr, size_t size, Stream *stream)
+{
+    SocketStream *ss = (SocketStream *) stream;
+    unsigned char *p = (unsigned char *) ptr;
+    size_t received;
+    int64_t rv;
+    if (ss->sock == -1)
+        return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (ss->uring)
+        return UringStreamRead(ss->uring, ptr, size);
+#endif
+    received = SocketStreamDrain(ss, p, size);
+    if (received == size)
+        return received;
+    if (size - received >= SOCKET_STREAM_RECV_BUFFER_SIZE)
+        rv = SocketRecv(ss->sock, p + received, size - received, 0);
+    else if ((rv = SocketStreamFill(ss)) > 0)
+        rv = SocketStreamDrain(ss, p + received, size - received);
+    if (rv == -1)
+        return received > 0 ? (int64_t) received : -1;
+    return received + rv;
+}
+
+static int64_t SocketStreamWrite(const void *ptr, size_t size, Stream *stream)
+{
+    SocketStream *ss = (SocketStream *) stream;
+    size_t written = 0;
+    if (ss->sock == -1)
+        return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (ss->uring)
+    {
+        StreamIoVec iov;
+        iov.data = ptr;
+        iov.size = size;
+        return UringStreamWritev(ss->uring, &iov, 1);
+    }
+#endif
+    while (written < size)
+    {
+        const char *p = ((char *) ptr) + written;
+        int64_t rv = SocketSend(ss->sock, p, size - written, 0);
+        if (rv == -1)
+            return written > 0 ? (int64_t) written : -1;
+        written += (size_t) rv;
+    }
+    return written;
+}
+
+static int64_t SocketStreamSendv(SocketStream *ss, const StreamIoVec *iov,
+                                 int iovcnt, int flags)
+{
+    SocketIoVec bufs[SOCKET_IOV_MAX];
+    int i;
+    if (iovcnt > SOCKET_IOV_MAX)
+        iovcnt = SOCKET_IOV_MAX;
+    for (i = 0; i < iovcnt; ++i)
+    {
+        bufs[i].base = iov[i].data;
+        bufs[i].len = iov[i].size;
+    }
+    return SocketSendv(ss->sock, bufs, iovcnt, flags);
+}
+
+static int64_t SocketStreamWritev(const StreamIoVec *iov, int iovcnt,
+                                  Stream *stream)
+{
+    SocketStream *ss = (SocketStream *) stream;
+    if (ss->sock == -1)
+        return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (ss->uring)
+        return UringStreamWritev(ss->uring, iov, iovcnt);
+#endif
+    return SocketStreamSendv(ss, iov, iovcnt, 0);
+}
+
+static const StreamOps SocketStreamOps =
+{
+    SocketStreamRead,
+    SocketStreamWrite,
+    SocketStreamClose,
+    NULL,
+    NULL,
+    SocketStreamWritev
+};
+
+int SocketStreamOpen(SocketStream *stream, int sock)
+{
+    assert(stream != NULL);
+    assert(sock != -1);
+    memset(stream, 0, sizeof(*stream));
+    stream->rbuf = MqttMalloc(SOCKET_STREAM_RECV_BUFFER_SIZE);
+    if (!stream->rbuf)
+        return -1;
+    stream->sock = sock;
+    stream->base.ops = &SocketStreamOps;
+    return 0;
+}
+
+int64_t SocketStreamSendFile(SocketStream *stream, int fd, int64_t offset,
+                             size_t size)
+{
+    assert(stream != NULL);
+    if (stream->sock == -1)
+        return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (stream->uring)
+    {
+        /* The ring keeps the writes in order so the file must go through
+           it too */
+        unsigned char buf[16*1024];
+        StreamIoVec iov;
+        int64_t rv;
+        if (size > sizeof(buf))
+            size = sizeof(buf);
+        if ((rv = MqttFileReadAt(fd, buf, size, offset)) <= 0)
+            return rv;
+        iov.data = buf;
+        iov.size = (size_t) rv;
+        return UringStreamWritev(stream->uring, &iov, 1);
+    }
+#endif
+    return SocketSendFile(stream->sock, fd, offset, size);
+}
+
+int SocketStreamEnableZeroCopy(SocketStream *stream)
+{
+    assert(stream != NULL);
+    if (stream->sock == -1 || stream->uring)
+        return -1;
+    if (SocketEnableZeroCopy(stream->sock) == -1)
+        return -1;
+    stream->zeroCopy = 1;
+    return 0;
+}
+
+int64_t SocketStreamWritevZeroCopy(SocketStream *stream,
+                                   const StreamIoVec *iov, int iovcnt)
+{
+#if defined(SOCKET_HAVE_ZEROCOPY)
+    int64_t rv;
+    assert(stream != NULL);
+    if (stream->zeroCopy && stream->sock != -1 && !stream->uring)
+    {
+        rv = SocketStreamSendv(stream, iov, iovcnt, MSG_ZEROCOPY);
+        if (rv >= 0)
+        {
+            ++stream->zeroCopySent;
+            return rv;
+        }
+        /* Out of memory for pinning pages, fall back to copying */
+        if (SocketErrno != ENOBUFS)
+            return rv;
+    }
+#endif
+    return StreamWritev(iov, iovcnt, &stream->base);
+}
+
+int SocketStreamReapZeroCopy(SocketStream *stream)
+{
+    assert(stream != NULL);
+    if (!stream->zeroCopy || stream->sock == -1 || stream->uring)
+        return 0;
+    return SocketReadZeroCopyCompletions(stream->sock, &stream->zeroCopyDone);
+}
+
+size_t SocketStreamAvailable(SocketStream *stream)
+{
+    assert(stream != NULL);
+#if defined(MQTT_USE_IO_URING)
+    if (stream->uring)
+        return UringStreamAvailable(stream->uring);
+#endif
+    return stream->rlen - stream->rpos;
+}
+
+/**********************************************************************/
+/*                           stringstream.h                           */
+/**********************************************************************/
+
+#ifndef STRINGSTREAM_H
+#define STRINGSTREAM_H
+
+#include <stdio.h>
+
+typedef struct StringStream StringStream;
+
+struct StringStream
+{
+    Stream base;
+    bstring buffer;
+    int64_t pos;
+};
+
+int StringStreamInit(StringStream *stream);
+
+int StringStreamInitFromBstring(StringStream *stream, bstring buffer);
+
+#endif
+
+/**********************************************************************/
+/*                           stringstream.c                           */
+/**********************************************************************/
+
+
+#include <assert.h>
+
+static int StringStreamClose(Stream *base)
+{
+    StringStream *ss = (StringStream *) base;
+    bdestroy(ss->buffer);
+    ss->buffer = NULL;
+    return 0;
+}
+
+static int64_t StringStreamRead(void *ptr, size_t size, Stream *stream)
+{
+    StringStream *ss = (StringStream *) stream;
+    int64_t available = blength(ss->buffer) - ss->pos;
+    void *bufptr;
+
+    if (available <= 0)
+    {
+        return -1;
+    }
+
+    if (size > (size_t) available)
+        size = available;
+
+    /* Use a temp buffer pointer to make some warnings disappear when using
+       GCC */
+    bufptr = bdataofs(ss->buffer, ss->pos);
+    memcpy(ptr, bufptr, size);
+
+    ss->pos += size;
+
+    return size;
+}
+
+static int64_t StringStreamWrite(const void *ptr, size_t size, Stream *stream)
+{
+    StringStream *ss = (StringStream *) stream;
+    struct tagbstring buf;
+    if (ss->buffer->mlen <= 0)
+        return -1;
+    btfromblk(buf, ptr, size);
+    bsetstr(ss->buffer, ss->pos, &buf, '\0');
+    ss->pos += size;
+    return size;
+}
+
+int StringStreamSeek(Stream *base, int64_t offset, int whence)
+{
+    StringStream *ss = (StringStream *) base;
+    int64_t newpos = 0;
+
+    if (whence == SEEK_SET)
+    {
+        newpos = offset;
+    }
+    else if (whence == SEEK_CUR)
+    {
+        newpos = ss->pos + offset;
+    }
+    else if (whence == SEEK_END)
+    {
+        newpos = blength(ss->buffer) - offset;
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (newpos > blength(ss->buffer))
+        return -1;
+
+    if (newpos < 0)
+        return -1;
+
+    ss->pos = newpos;
+
+    return 0;
+}
+
+int64_t StringStreamTell(Stream *base)
+{
+    StringStream *ss = (StringStream *) base;
+    return ss->pos;
+}
+
+static const StreamOps StringStreamOps =
+{
+    StringStreamRead,
+    StringStreamWrite,
+    StringStreamClose,
+    StringStreamSeek,
+    StringStreamTell,
+    NULL
+};
+
+int StringStreamInit(StringStream *stream)
+{
+    assert(stream != NULL);
+    memset(stream, 0, sizeof(*stream));
+    stream->pos = 0;
+    stream->buffer = bfromcstr("");
+    stream->base.ops = &StringStreamOps;
+    return 0;
+}
+
+int StringStreamInitFromBstring(StringStream *stream, bstring buffer)
+{
+    assert(stream != NULL);
+    memset(stream, 0, sizeof(*stream));
+    stream->pos = 0;
+    stream->buffer = buffer;
+    stream->base.ops = &StringStreamOps;
+    return 0;
+}
+
+/**********************************************************************/
+/*                           stream_mqtt.h                            */
+/**********************************************************************/
+
+#ifndef STREAM_MQTT_H
+#define STREAM_MQTT_H
+
+
+
+int64_t StreamReadMqttString(bstring *buf, Stream *stream);
+int64_t StreamWriteMqttString(const_bstring buf, Stream *stream);
+
+int64_t StreamReadRemainingLength(size_t *remainingLength, size_t *mul,
+                                  Stream *stream);
+int64_t StreamWriteRemainingLength(size_t *remainingLength, Stream *stream);
+
+#endif
+
+/**********************************************************************/
+/*                           stream_mqtt.c                            */
+/**********************************************************************/
+
+
+#include <string.h>
+
+int64_t StreamReadMqttString(bstring *buf, Stream *stream)
+{
+    uint16_t len;
+    bstring result;
+
+    if (StreamReadUint16Be(&len, stream) == -1)
+        return -1;
+
+    /* We need 1 extra byte for a NULL terminator. bfromcstralloc doesn't do
+       any size snapping. */
+    result = bfromcstralloc(len+1, "");
+
+    if (!result)
+        return -1;
+
+    if (StreamRead(bdata(result), len, stream) == -1)
+    {
+        bdestroy(result);
+        return -1;
+    }
+
+    result->slen = len;
+    result->data[len] = '\0';
+
+    *buf = result;
+
+    return len+2;
+}
+
+int64_t StreamWriteMqttString(const_bstring buf, Stream *stream)
+{
+    if (StreamWriteUint16Be(blength(buf), stream) == -1)
+        return -1;
+
+    if (StreamWrite(bdata(buf), blength(buf), stream) == -1)
+        return -1;
+
+    return 2 + blength(buf);
+}
+
+int64_t StreamReadRemainingLength(size_t *remainingLength, size_t *mul,
+                                  Stream *stream)
+{
+    unsigned char encodedByte;
+    do
+    {
+        if (StreamRead(&encodedByte, 1, stream) != 1)
+            return -1;
+        *remainingLength += (encodedByte & 127) * (*mul);
+        if ((*mul) > 128*128*128)
+            return -1;
+        (*mul) *= 128;
+    }
+    while ((encodedByte & 128) != 0);
+    *mul = 0;
+    return 0;
+}
+
+int64_t StreamWriteRemainingLength(size_t *remainingLength, Stream *stream)
+{
+    do
+    {
+        size_t tmp = *remainingLength;
+        unsigned char encodedByte = tmp % 128;
+        tmp /= 128;
+        if (tmp > 0)
+            encodedByte |= 128;
+        if (StreamWrite(&encodedByte, 1, stream) != 1)
+        {
+            return -1;
+        }
+        *remainingLength = tmp;
+    }
+    while (*remainingLength > 0);
+    return 0;
+}
+
+/**********************************************************************/
+/*                              packet.h                              */
+/**********************************************************************/
+
+#ifndef PACKET_H
+#define PACKET_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+
+
+enum
+{
+    MqttPacketTypeConnect = 0x1,
+    MqttPacketTypeConnAck = 0x2,
+    MqttPacketTypePublish = 0x3,
+    MqttPacketTypePubAck = 0x4,
+    MqttPacketTypePubRec = 0x5,
+    MqttPacketTypePubRel = 0x6,
+    MqttPacketTypePubComp = 0x7,
+    MqttPacketTypeSubscribe = 0x8,
+    MqttPacketTypeSubAck = 0x9,
+    MqttPacketTypeUnsubscribe = 0xA,
+    MqttPacketTypeUnsubAck = 0xB,
+    MqttPacketTypePingReq = 0xC,
+    MqttPacketTypePingResp = 0xD,
+    MqttPacketTypeDisconnect = 0xE
+};
+
+enum MqttPacketState
+{
+    MqttPacketStateReadType,
+    MqttPacketStateReadRemainingLength,
+    MqttPacketStateReadPayload,
+    /* a PUBLISH passed on as it arrives, see MqttClientSetOnMessageStream */
+    MqttPacketStateReadPublishHeader,
+    MqttPacketStateReadPublishPayload,
+    MqttPacketStateReadComplete,
+
+    MqttPacketStateWriteData,
+    /* the payload is sent from a file or produced as it is sent, see
+       MqttPacketAllocateFile and MqttPacketAllocateProduced */
+    MqttPacketStateWritePayload,
+    MqttPacketStateWriteComplete
+};
+
+/* Largest remaining length that fits in the four encoded bytes */
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
+/* Packets whose encoding fits in this many bytes (PUBACK, PUBREC, PUBREL,
+   PUBCOMP, PINGREQ and DISCONNECT) are stored inside MqttPacket. */
+#define MQTT_PACKET_INLINE_SIZE 4
+
+struct MqttMessage;
+
+/*
+    An encoded packet that a message keeps for sending it again and shares
+    with the packets that send it, see MqttPacketAllocateShared, or several
+    packets encoded back to back, see MqttClientPublishMany. It is freed
+    when the last reference is dropped.
+*/
+typedef struct MqttPacketBuffer MqttPacketBuffer;
+
+struct MqttPacketBuffer
+{
+    int refs;
+    size_t size;
+    unsigned char *data;
+};
+
+typedef struct MqttPacket MqttPacket;
+
+struct MqttPacket
+{
+    int type;
+    int flags;
+    int state;
+    uint16_t id;
+    /* the priority of a PUBLISH (one of MqttPriority) and the lane of
+       the send queue the packet is in */
+    int priority;
+    int lane;
+    /* bytes of a QoS 0 PUBLISH counted in the limits of the client while
+       it is queued, 0 for other packets */
+    size_t queuedSize;
+    /* when writing, the number of bytes left to write in the current state */
+    size_t remainingLength;
+    size_t remainingLengthMul;
+    /* 1 once any of the packet has been written */
+    int writeStarted;
+    /* the whole encoded packet when writing, see MqttPacketAllocate */
+    unsigned char *data;
+    size_t size;
+    /* storage for data of small packets */
+    unsigned char inlineData[MQTT_PACKET_INLINE_SIZE];
+    /* the buffer data belongs to if it is shared */
+    MqttPacketBuffer *shared;
+    /* the first byte of the packet, written from here instead of from
+       data if ownHeader is 1, see MqttPacketPrepareWrite */
+    unsigned char header;
+    int ownHeader;
+    /* end of the payload, written after data from memory the packet doesn't
+       own, see MqttPacketAllocateExternal */
+    const unsigned char *external;
+    size_t externalSize;
+    /* or end of the payload (streamSize bytes if more than 0) written after
+       data in MqttPacketStateWritePayload, from fd at fileOffset (see
+       MqttPacketAllocateFile) or, if produced is 1, from the producer of the
+       message (see MqttPacketAllocateProduced) */
+    int fd;
+    int64_t fileOffset;
+    int produced;
+    size_t streamSize;
+    /* the received payload when reading */
+    bstring payload;
+    struct MqttMessage *message;
+    SIMPLEQ_ENTRY(MqttPacket) sendQueue;
+};
+
+const char *MqttPacketName(int type);
+
+MqttPacket *MqttPacketNew(int type);
+
+MqttPacket *MqttPacketWithIdNew(int type, uint16_t id);
+
+void MqttPacketFree(MqttPacket *packet);
+
+/* Frees the data of the packet and clears it for reuse. */
+void MqttPacketReset(MqttPacket *packet);
+
+/* Returns 1 if the encoded packet is stored inside the packet. */
+static MQTT_INLINE int MqttPacketIsInline(const MqttPacket *packet)
+{
+    return packet->data == packet->inlineData;
+}
+
+/*
+    Allocates the buffer for the encoded packet with a body (variable header
+    and payload) of bodyLength bytes and encodes the fixed header into it.
+    Small packets use the storage inside the packet and don't allocate.
+    Returns where the caller must write exactly bodyLength bytes of body, or
+    NULL on failure.
+*/
+unsigned char *MqttPacketAllocate(MqttPacket *packet, size_t bodyLength);
+
+/*
+    Same as MqttPacketAllocate but the encoded packet goes to a new shared
+    buffer, see MqttPacketBufferRef.
+*/
+unsigned char *MqttPacketAllocateShared(MqttPacket *packet, size_t bodyLength);
+
+/* Returns a new buffer of size bytes with one reference or NULL. */
+MqttPacketBuffer *MqttPacketBufferNew(size_t size);
+
+/*
+    Makes the packet send the encoded packet of size bytes at offset in
+    buffer, taking a reference.
+*/
+void MqttPacketUseShared(MqttPacket *packet, MqttPacketBuffer *buffer,
+                         size_t offset, size_t size);
+
+/* Takes a reference to the buffer and returns it. */
+static MQTT_INLINE MqttPacketBuffer *MqttPacketBufferRef(
+    MqttPacketBuffer *buffer)
+{
+    ++buffer->refs;
+    return buffer;
+}
+
+/* Drops a reference to the buffer (which may be NULL). */
+void MqttPacketBufferUnref(MqttPacketBuffer *buffer);
+
+/*
+    Same as MqttPacketAllocate but the last externalSize bytes of the body are
+    written straight from external, which must stay valid until the packet
+    has been written or MqttPacketCopyExternal is called. The caller writes
+    the first bodyLength - externalSize bytes.
+*/
+unsigned char *MqttPacketAllocateExternal(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          const void *external,
+                                          size_t externalSize);
+
+/*
+    Same as MqttPacketAllocateExternal but the last fileSize bytes of the body
+    are fileSize bytes of fd from fileOffset. They are not part of what
+    MqttPacketWriteIov returns. Once the rest has been written, the packet is
+    in MqttPacketStateWritePayload until remainingLength bytes from
+    MqttPacketFilePosition have been written. fd must stay open until then.
+*/
+unsigned char *MqttPacketAllocateFile(MqttPacket *packet, size_t bodyLength,
+                                      int fd, int64_t fileOffset,
+                                      size_t fileSize);
+
+/*
+    Same as MqttPacketAllocateFile but the caller produces the last
+    streamSize bytes of the body in MqttPacketStateWritePayload.
+*/
+unsigned char *MqttPacketAllocateProduced(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          size_t streamSize);
+
+/* Returns 1 if any of the packet has been written. */
+static MQTT_INLINE int MqttPacketWriteStarted(const MqttPacket *packet)
+{
+    return packet->writeStarted;
+}
+
+/*
+    Replaces what is left to write of the packet with size bytes of data
+    allocated with MqttMalloc, which the packet takes over.
+*/
+void MqttPacketSetRemainder(MqttPacket *packet, unsigned char *data,
+                            size_t size);
+
+/* Returns the offset in fd to write from in MqttPacketStateWritePayload. */
+static MQTT_INLINE int64_t MqttPacketFilePosition(const MqttPacket *packet)
+{
+    return packet->fileOffset +
+        (int64_t) (packet->streamSize - packet->remainingLength);
+}
+
+/*
+    Copies the external part of the packet, from memory or from a file, into
+    its own data so that the memory can be released or the file closed. Can
+    be called in the middle of writing the packet. Returns -1 on failure and
+    for produced packets.
+*/
+int MqttPacketCopyExternal(MqttPacket *packet);
+
+/*
+    Updates the type and flags in the encoded packet and sets the packet to
+    MqttPacketStateWriteData. A shared buffer is left as it is for the
+    other packets using it, the packet writes a first byte of its own if
+    it needs another one.
+*/
+void MqttPacketPrepareWrite(MqttPacket *packet);
+
+/*
+    Fills iov with at most max buffers holding the unwritten part of the
+    packet. Returns the number of buffers used.
+*/
+int MqttPacketWriteIov(MqttPacket *packet, StreamIoVec *iov, int max);
+
+/*
+    Marks up to size bytes of the packet written. Returns the number of bytes
+    consumed from size. The packet is in MqttPacketStateWriteComplete when
+    all of it has been written.
+*/
+size_t MqttPacketWriteAdvance(MqttPacket *packet, size_t size);
+
+/* Returns the size of the fixed header of a packet with bodyLength bytes
+   of body. */
+size_t MqttPacketHeaderSize(size_t bodyLength);
+
+/*
+    Helpers for writing the body returned by MqttPacketAllocate, or whole
+    packets into a buffer of MqttPacketBufferNew. They return the position
+    following what was written.
+*/
+
+unsigned char *MqttEncodeFixedHeader(unsigned char *p, int type, int flags,
+                                     size_t bodyLength);
+
+static MQTT_INLINE unsigned char *MqttEncodeByte(unsigned char *p,
+                                                 unsigned char value)
+{
+    *p++ = value;
+    return p;
+}
+
+static MQTT_INLINE unsigned char *MqttEncodeUint16Be(unsigned char *p,
+                                                     uint16_t value)
+{
+    *p++ = (unsigned char) (value >> 8);
+    *p++ = (unsigned char) (value & 0xFF);
+    return p;
+}
+
+static MQTT_INLINE unsigned char *MqttEncodeBytes(unsigned char *p,
+                                                  const void *data,
+                                                  size_t size)
+{
+    if (size > 0)
+        memcpy(p, data, size);
+    return p + size;
+}
+
+/* Writes a length prefixed string, see MqttStringSize. */
+static MQTT_INLINE unsigned char *MqttEncodeString(unsigned char *p,
+                                                   const void *data,
+                                                   size_t size)
+{
+    p = MqttEncodeUint16Be(p, (uint16_t) size);
+    return MqttEncodeBytes(p, data, size);
+}
+
+/* Returns the encoded size of a string of size bytes. */
+static MQTT_INLINE size_t MqttStringSize(size_t size)
+{
+    return 2 + size;
+}
+
+#endif
+
+/**********************************************************************/
+/*                              packet.c                              */
+/**********************************************************************/
+
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+
+const char *MqttPacketName(int type)
+{
+    switch (type)
+    {
+        case MqttPacketTypeConnect: return "CONNECT";
+        case MqttPacketTypeConnAck: return "CONNACK";
+        case MqttPacketTypePublish: return "PUBLISH";
+        case MqttPacketTypePubAck: return "PUBACK";
+        case MqttPacketTypePubRec: return "PUBREC";
+        case MqttPacketTypePubRel: return "PUBREL";
+        case MqttPacketTypePubComp: return "PUBCOMP";
+        case MqttPacketTypeSubscribe: return "SUBSCRIBE";
+        case MqttPacketTypeSubAck: return "SUBACK";
+        case MqttPacketTypeUnsubscribe: return "UNSUBSCRIBE";
+        case MqttPacketTypeUnsubAck: return "UNSUBACK";
+        case MqttPacketTypePingReq: return "PINGREQ";
+        case MqttPacketTypePingResp: return "PINGRESP";
+        case MqttPacketTypeDisconnect: return "DISCONNECT";
+        default: return NULL;
+    }
+}
+
+MqttPacket *MqttPacketNew(int type)
+{
+    MqttPacket *packet = NULL;
+
+    packet = (MqttPacket *) MqttCalloc(1, sizeof(*packet));
+    if (!packet)
+        return NULL;
+
+    packet->type = type;
+
+    return packet;
+}
+
+MqttPacket *MqttPacketWithIdNew(int type, uint16_t id)
+{
+    MqttPacket *packet = MqttPacketNew(type);
+    if (!packet)
+        return NULL;
+    packet->id = id;
+    return packet;
+}
+
+void MqttPacketFree(MqttPacket *packet)
+{
+    MqttPacketReset(packet);
+    MqttFree(packet);
+}
+
+/* Frees data unless it is stored inside the packet or shared. */
+static void MqttPacketFreeData(MqttPacket *packet)
+{
+    if (packet->shared)
+    {
+        MqttPacketBufferUnref(packet->shared);
+        packet->shared = NULL;
+    }
+    else if (!MqttPacketIsInline(packet))
+    {
+        MqttFree(packet->data);
+    }
+}
+
+void MqttPacketReset(MqttPacket *packet)
+{
+    bdestroy(packet->payload);
+    MqttPacketFreeData(packet);
+    memset(packet, 0, sizeof(*packet));
+}
+
+void MqttPacketBufferUnref(MqttPacketBuffer *buffer)
+{
+    if (buffer && --buffer->refs == 0)
+        MqttFree(buffer);
+}
+
+MqttPacketBuffer *MqttPacketBufferNew(size_t size)
+{
+    /* The buffer and its data are allocated together */
+    MqttPacketBuffer *buffer = MqttMalloc(sizeof(*buffer) + size);
+
+    if (!buffer)
+        return NULL;
+
+    buffer->refs = 1;
+    buffer->size = size;
+    buffer->data = (unsigned char *) (buffer + 1);
+
+    return buffer;
+}
+
+size_t MqttPacketHeaderSize(size_t bodyLength)
+{
+    size_t headerLength = 1;
+
+    do
+    {
+        bodyLength /= 128;
+        ++headerLength;
+    }
+    while (bodyLength > 0);
+
+    return headerLength;
+}
+
+unsigned char *MqttEncodeFixedHeader(unsigned char *p, int type, int flags,
+                                     size_t bodyLength)
+{
+    *p++ = ((type & 0x0F) << 4) | (flags & 0x0F);
+
+    do
+    {
+        unsigned char encodedByte = bodyLength % 128;
+        bodyLength /= 128;
+        if (bodyLength > 0)
+            encodedByte |= 128;
+        *p++ = encodedByte;
+    }
+    while (bodyLength > 0);
+
+    return p;
+}
+
+/* Encodes the fixed header for bodyLength but allocates only what the
+   packet writes from its own data, the last unowned bytes excluded, into a
+   new shared buffer if shared is 1. */
+static unsigned char *MqttPacketAllocateOwned(MqttPacket *packet,
+                                              size_t bodyLength,
+                                              size_t unowned, int shared)
+{
+    size_t size;
+
+    assert(packet->data == NULL);
+    assert(unowned <= bodyLength);
+
+    if (bodyLength > MQTT_MAX_REMAINING_LENGTH)
+    {
+        LOG_ERROR("packet too big: %lu bytes", (unsigned long) bodyLength);
+        return NULL;
+    }
+
+    size = MqttPacketHeaderSize(bodyLength) + bodyLength - unowned;
+
+    if (shared)
+    {
+        if ((packet->shared = MqttPacketBufferNew(size)) != NULL)
+            packet->data = packet->shared->data;
+    }
+    else if (size <= MQTT_PACKET_INLINE_SIZE)
+        packet->data = packet->inlineData;
+    else
+        packet->data = MqttMalloc(size);
+
+    if (!packet->data)
+        return NULL;
+
+    packet->size = size;
+
+    return MqttEncodeFixedHeader(packet->data, packet->type, packet->flags,
+                                 bodyLength);
+}
+
+unsigned char *MqttPacketAllocate(MqttPacket *packet, size_t bodyLength)
+{
+    return MqttPacketAllocateOwned(packet, bodyLength, 0, 0);
+}
+
+unsigned char *MqttPacketAllocateShared(MqttPacket *packet, size_t bodyLength)
+{
+    return MqttPacketAllocateOwned(packet, bodyLength, 0, 1);
+}
+
+void MqttPacketUseShared(MqttPacket *packet, MqttPacketBuffer *buffer,
+                         size_t offset, size_t size)
+{
+    assert(packet->data == NULL);
+    assert(offset + size <= buffer->size);
+    packet->shared = MqttPacketBufferRef(buffer);
+    packet->data = buffer->data + offset;
+    packet->size = size;
+}
+
+unsigned char *MqttPacketAllocateExternal(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          const void *external,
+                                          size_t externalSize)
+{
+    unsigned char *p = MqttPacketAllocateOwned(packet, bodyLength,
+                                               externalSize, 0);
+    if (p)
+    {
+        packet->external = (const unsigned char *) external;
+        packet->externalSize = externalSize;
+    }
+    return p;
+}
+
+unsigned char *MqttPacketAllocateFile(MqttPacket *packet, size_t bodyLength,
+                                      int fd, int64_t fileOffset,
+                                      size_t fileSize)
+{
+    unsigned char *p = MqttPacketAllocateOwned(packet, bodyLength, fileSize,
+                                               0);
+    if (p)
+    {
+        packet->fd = fd;
+        packet->fileOffset = fileOffset;
+        packet->streamSize = fileSize;
+    }
+    return p;
+}
+
+unsigned char *MqttPacketAllocateProduced(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          size_t streamSize)
+{
+    unsigned char *p = MqttPacketAllocateOwned(packet, bodyLength,
+                                               streamSize, 0);
+    if (p)
+    {
+        packet->produced = 1;
+        packet->streamSize = streamSize;
+    }
+    return p;
+}
+
+void MqttPacketSetRemainder(MqttPacket *packet, unsigned char *data,
+                            size_t size)
+{
+    MqttPacketFreeData(packet);
+
+    packet->data = data;
+    packet->size = size;
+    packet->external = NULL;
+    packet->externalSize = 0;
+    packet->fd = 0;
+    packet->fileOffset = 0;
+    packet->produced = 0;
+    packet->streamSize = 0;
+    packet->ownHeader = 0;
+    packet->state = MqttPacketStateWriteData;
+    packet->remainingLength = size;
+}
+
+void MqttPacketPrepareWrite(MqttPacket *packet)
+{
+    assert(packet->data != NULL);
+
+    /* Flags such as DUP may have changed since the packet was encoded */
+    packet->header = ((packet->type & 0x0F) << 4) | (packet->flags & 0x0F);
+    packet->ownHeader = packet->shared && packet->data[0] != packet->header;
+
+    if (!packet->shared)
+        packet->data[0] = packet->header;
+
+    packet->state = MqttPacketStateWriteData;
+    packet->remainingLength = packet->size + packet->externalSize;
+    packet->writeStarted = 0;
+}
+
+int MqttPacketWriteIov(MqttPacket *packet, StreamIoVec *iov, int max)
+{
+    size_t written;
+    int count = 0;
+
+    if (max <= 0 || packet->state != MqttPacketStateWriteData)
+        return 0;
+
+    written = packet->size + packet->externalSize - packet->remainingLength;
+
+    if (written == 0 && packet->ownHeader)
+    {
+        iov[count].data = &packet->header;
+        iov[count].size = 1;
+        ++count;
+        written = 1;
+    }
+
+    if (count < max && written < packet->size)
+    {
+        iov[count].data = packet->data + written;
+        iov[count].size = packet->size - written;
+        ++count;
+        written = packet->size;
+    }
+
+    if (count < max && packet->externalSize > 0)
+    {
+        written -= packet->size;
+        iov[count].data = packet->external + written;
+        iov[count].size = packet->externalSize - written;
+        ++count;
+    }
+
+    return count;
+}
+
+/* Reads the unwritten part of the file into the data of the packet. */
+static int MqttPacketCopyFile(MqttPacket *packet)
+{
+    size_t skip = 0;
+    size_t head = packet->size;
+    unsigned char *data;
+
+    /* Once the file is being written, what has been written from it and
+       the data before it aren't needed */
+    if (packet->state == MqttPacketStateWritePayload)
+    {
+        skip = packet->streamSize - packet->remainingLength;
+        head = 0;
+    }
+
+    data = MqttMalloc(head + packet->streamSize - skip);
+
+    if (!data)
+        return -1;
+
+    if (head > 0)
+        memcpy(data, packet->data, head);
+
+    if (MqttFileReadAt(packet->fd, data + head, packet->streamSize - skip,
+                       packet->fileOffset + (int64_t) skip) !=
+        (int64_t) (packet->streamSize - skip))
+    {
+        LOG_ERROR("failed to read the payload from the file");
+        MqttFree(data);
+        return -1;
+    }
+
+    MqttPacketFreeData(packet);
+
+    if (packet->state == MqttPacketStateWritePayload)
+    {
+        /* Continue from the start of what was read */
+        packet->state = MqttPacketStateWriteData;
+        packet->data = data;
+        packet->remainingLength = packet->streamSize - skip;
+        packet->size = packet->remainingLength;
+    }
+    else
+    {
+        if (packet->state == MqttPacketStateWriteData)
+            packet->remainingLength += packet->streamSize;
+        packet->data = data;
+        packet->size += packet->streamSize;
+    }
+
+    packet->fd = 0;
+    packet->fileOffset = 0;
+    packet->streamSize = 0;
+
+    return 0;
+}
+
+int MqttPacketCopyExternal(MqttPacket *packet)
+{
+    unsigned char *data;
+
+    if (packet->produced)
+        return -1;
+
+    if (packet->streamSize > 0)
+        return MqttPacketCopyFile(packet);
+
+    if (packet->externalSize == 0)
+        return 0;
+
+    data = MqttMalloc(packet->size + packet->externalSize);
+
+    if (!data)
+        return -1;
+
+    memcpy(data, packet->data, packet->size);
+    memcpy(data + packet->size, packet->external, packet->externalSize);
+
+    MqttPacketFreeData(packet);
+
+    /* The offsets don't change, remainingLength stays valid */
+    packet->data = data;
+    packet->size += packet->externalSize;
+    packet->external = NULL;
+    packet->externalSize = 0;
+
+    return 0;
+}
+
+size_t MqttPacketWriteAdvance(MqttPacket *packet, size_t size)
+{
+    if (packet->state != MqttPacketStateWriteData &&
+        packet->state != MqttPacketStateWritePayload)
+        return 0;
+
+    if (size > packet->remainingLength)
+        size = packet->remainingLength;
+
+    if (size > 0)
+        packet->writeStarted = 1;
+
+    packet->remainingLength -= size;
+
+    if (packet->remainingLength == 0)
+    {
+        if (packet->state == MqttPacketStateWriteData &&
+            packet->streamSize > 0)
+        {
+            packet->state = MqttPacketStateWritePayload;
+            packet->remainingLength = packet->streamSize;
+        }
+        else
+        {
+            packet->state = MqttPacketStateWriteComplete;
+        }
+    }
+
+    return size;
+}
+
+/**********************************************************************/
+/*                             message.h                              */
+/**********************************************************************/
+
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include "mqtt.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+enum MqttMessageState
+{
+    MqttMessageStateQueued,
+    MqttMessageStatePublish,
+    MqttMessageStateWaitPubAck,
+    MqttMessageStateWaitPubRec,
+    MqttMessageStateWaitPubComp,
+    MqttMessageStateWaitPubRel
+};
+
+struct MqttPacketBuffer;
+
+typedef struct MqttMessage MqttMessage;
+
+struct MqttMessage
+{
+    int state;
+    int qos;
+    int retain;
+    int dup;
+    int padding;
+    /* one of MqttPriority, see MqttClientPublishWithPriority */
+    int priority;
+    uint16_t id;
+    /* when the message or its last acknowledgement was sent */
+    int64_t timestamp;
+    bstring topic;
+    bstring payload;
+    /* the encoded PUBLISH (encodedSize bytes at encodedOffset), sent again
+       as is, which replaces topic and payload of a message published with
+       MqttClientPublish or MqttClientPublishMany */
+    struct MqttPacketBuffer *encoded;
+    size_t encodedOffset;
+    size_t encodedSize;
+    TAILQ_ENTRY(MqttMessage) chain;
+    /* link in the queued messages of the client */
+    TAILQ_ENTRY(MqttMessage) queue;
+    /* link in the retry list of the client, valid if retryArmed is 1 */
+    TAILQ_ENTRY(MqttMessage) retry;
+    int retryArmed;
+    /* number of packets in the send queue that refer to this message */
+    int queuedPackets;
+    /* payload borrowed from the user instead of payload, given back with
+       release, see MqttClientPublishZeroCopy */
+    const void *userPayload;
+    size_t userPayloadSize;
+    MqttClientReleaseCallback release;
+    void *releaseContext;
+    /* 1 if the payload is fileSize bytes of the file fd (owned by the
+       message) from fileOffset, see MqttClientPublishFile */
+    int file;
+    int fd;
+    int64_t fileOffset;
+    size_t fileSize;
+    /* or a payload of producedSize bytes from producer, which gets
+       releaseContext, see MqttClientPublishStream */
+    MqttClientProducerCallback producer;
+    size_t producedSize;
+    /* 1 if userPayload was sent with MSG_ZEROCOPY, zeroCopyId being the id
+       of the last such send */
+    int zeroCopyPending;
+    uint32_t zeroCopyId;
+};
+
+typedef struct MqttMessageList MqttMessageList;
+TAILQ_HEAD(MqttMessageList, MqttMessage);
+
+void MqttMessageFree(MqttMessage *msg);
+
+/* Frees the topic, payload and encoded packet of the message and clears it
+   for reuse. */
+void MqttMessageReset(MqttMessage *msg);
+
+/*
+    Maps packet ids to messages with an open addressing hash table so that
+    acknowledgements can be matched to messages in constant time. The table
+    doesn't own the messages.
+*/
+typedef struct MqttMessageIndex MqttMessageIndex;
+
+struct MqttMessageIndex
+{
+    MqttMessage **slots;
+    /* number of slots, zero or a power of two */
+    size_t capacity;
+    size_t count;
+};
+
+/* Adds a message, replacing one with the same id. Returns -1 on failure. */
+int MqttMessageIndexInsert(MqttMessageIndex *index, MqttMessage *msg);
+
+/* Returns the message with the id or NULL. */
+MqttMessage *MqttMessageIndexFind(const MqttMessageIndex *index, uint16_t id);
+
+/* Removes the message with the id if there is one. */
+void MqttMessageIndexRemove(MqttMessageIndex *index, uint16_t id);
+
+/* Removes all messages but keeps the table allocated. */
+void MqttMessageIndexClear(MqttMessageIndex *index);
+
+/* Frees the table. */
+void MqttMessageIndexFree(MqttMessageIndex *index);
+
+#endif
+
+/**********************************************************************/
+/*                             message.c                              */
+/**********************************************************************/
+
+
+#include <string.h>
+#include <assert.h>
+
+void MqttMessageFree(MqttMessage *msg)
+{
+    MqttMessageReset(msg);
+    MqttFree(msg);
+}
+
+void MqttMessageReset(MqttMessage *msg)
+{
+    bdestroy(msg->topic);
+    bdestroy(msg->payload);
+    MqttPacketBufferUnref(msg->encoded);
+    memset(msg, 0, sizeof(*msg));
+}
+
+/* Smallest table allocated when the first message is added */
+#define MQTT_MESSAGE_INDEX_MIN_CAPACITY 16
+
+/*
+    Packet ids are mostly allocated sequentially so the low bits of the id
+    spread them over the table well enough.
+*/
+static MQTT_INLINE size_t MqttMessageIndexSlot(const MqttMessageIndex *index,
+                                               uint16_t id)
+{
+    return id & (index->capacity - 1);
+}
+
+static int MqttMessageIndexGrow(MqttMessageIndex *index)
+{
+    MqttMessageIndex grown;
+    size_t i;
+
+    grown.capacity = index->capacity > 0 ?
+        index->capacity * 2 : MQTT_MESSAGE_INDEX_MIN_CAPACITY;
+    grown.count = 0;
+    grown.slots = MqttCalloc(grown.capacity, sizeof(*grown.slots));
+
+    if (!grown.slots)
+        return -1;
+
+    for (i = 0; i < index->capacity; ++i)
+    {
+        if (index->slots[i])
+            MqttMessageIndexInsert(&grown, index->slots[i]);
+    }
+
+    MqttFree(index->slots);
+    *index = grown;
+
+    return 0;
+}
+
+int MqttMessageIndexInsert(MqttMessageIndex *index, MqttMessage *msg)
+{
+    size_t mask, i;
+
+    assert(index != NULL);
+    assert(msg != NULL);
+
+    /* Keep the load factor at most 3/4 */
+    if ((index->count + 1) * 4 > index->capacity * 3)
+    {
+        if (MqttMessageIndexGrow(index) == -1)
+            return -1;
+    }
+
+    mask = index->capacity - 1;
+
+    for (i = MqttMessageIndexSlot(index, msg->id); index->slots[i];
+         i = (i + 1) & mask)
+    {
+        if (index->slots[i]->id == msg->id)
+        {
+            index->slots[i] = msg;
+            return 0;
+        }
+    }
+
+    index->slots[i] = msg;
+    ++index->count;
+
+    return 0;
+}
+
+static MQTT_INLINE size_t MqttMessageIndexLookup(const MqttMessageIndex *index,
+                                                 uint16_t id)
+{
+    size_t mask = index->capacity - 1;
+    size_t i;
+
+    for (i = MqttMessageIndexSlot(index, id); index->slots[i];
+         i = (i + 1) & mask)
+    {
+        if (index->slots[i]->id == id)
+            return i;
+    }
+
+    return index->capacity;
+}
+
+MqttMessage *MqttMessageIndexFind(const MqttMessageIndex *index, uint16_t id)
+{
+    size_t i;
+
+    assert(index != NULL);
+
+    if (index->count == 0)
+        return NULL;
+
+    i = MqttMessageIndexLookup(index, id);
+
+    return i < index->capacity ? index->slots[i] : NULL;
+}
+
+void MqttMessageIndexRemove(MqttMessageIndex *index, uint16_t id)
+{
+    size_t mask, i, j, home;
+
+    assert(index != NULL);
+
+    if (index->count == 0)
+        return;
+
+    if ((i = MqttMessageIndexLookup(index, id)) == index->capacity)
+        return;
+
+    mask = index->capacity - 1;
+
+    /* Shift the following entries of the probe sequence back so that no
+       tombstones are needed */
+    for (j = (i + 1) & mask; index->slots[j]; j = (j + 1) & mask)
+    {
+        home = MqttMessageIndexSlot(index, index->slots[j]->id);
+
+        /* The entry stays if its home slot is cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+
+    index->slots[i] = NULL;
+    --index->count;
+}
+
+void MqttMessageIndexClear(MqttMessageIndex *index)
+{
+    assert(index != NULL);
+
+    if (index->slots)
+        memset(index->slots, 0, index->capacity * sizeof(*index->slots));
+
+    index->count = 0;
+}
+
+void MqttMessageIndexFree(MqttMessageIndex *index)
+{
+    assert(index != NULL);
+    MqttFree(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+/**********************************************************************/
+/*                             private.h                              */
+/**********************************************************************/
+
+#ifndef MQTT_PRIVATE_H
+#define MQTT_PRIVATE_H
+
+#include "mqtt.h"
+
+#include <stdint.h>
+
+void MqttClientPause(MqttClient *client);
+
+void MqttClientResume(MqttClient *client);
+
+/*
+    Returns the time (see MqttGetCurrentTime) of the next retry or keepalive
+    action of the client, or -1 if there is none.
+*/
+int64_t MqttClientNextDeadline(MqttClient *client);
+
+#endif
+
+/**********************************************************************/
+/*                               loop.h                               */
+/**********************************************************************/
+
+#ifndef MQTT_LOOP_H
+#define MQTT_LOOP_H
+
+#include "mqtt.h"
+
+#include <stdint.h>
+
+typedef struct MqttLoopEntry MqttLoopEntry;
+
+/*
+    Per client bookkeeping of a MqttLoop. Embedded in MqttClient so that adding
+    a client to a loop doesn't allocate.
+*/
+struct MqttLoopEntry
+{
+    /* the loop the client belongs to, NULL if none */
+    MqttLoop *loop;
+    MqttClient *client;
+    /* socket registered with the loop, -1 if none */
+    int fd;
+    /* events the client waits for */
+    int events;
+    /* next retry or keepalive deadline in milliseconds, -1 if none */
+    int64_t deadline;
+    /* position in the timer heap, -1 if not in the heap */
+    int heapIndex;
+    /* 1 if the client must be re-examined before the loop waits again */
+    int dirty;
+    /* 1 if the client has completed I/O to handle (io_uring only) */
+    int ready;
+    TAILQ_ENTRY(MqttLoopEntry) clients;
+    SIMPLEQ_ENTRY(MqttLoopEntry) dirtyQueue;
+    SIMPLEQ_ENTRY(MqttLoopEntry) readyQueue;
+};
+
+/* Returns the loop bookkeeping embedded in client. */
+MqttLoopEntry *MqttClientLoopEntry(MqttClient *client);
+
+/* Returns the socket stream of client. */
+SocketStream *MqttClientSocketStream(MqttClient *client);
+
+/* Returns the allocator of client or NULL if it uses the global one. */
+const MqttAllocator *MqttClientAllocator(MqttClient *client);
+
+/*
+    Tells the loop of the entry that the client's wanted events or deadline may
+    have changed. Does nothing if the client is not in a loop.
+*/
+void MqttLoopEntryChanged(MqttLoopEntry *entry);
+
+/*
+    Tells the loop of the entry that the client closed its socket, which also
+    removed it from epoll. A new socket of the client is registered again
+    even if it gets the same number.
+*/
+void MqttLoopEntryClosed(MqttLoopEntry *entry);
+
+#endif
+
+/**********************************************************************/
+/*                               loop.c                               */
+/**********************************************************************/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+
+#if defined(MQTT_USE_IO_URING)
+#endif
+
+/* Maximum number of ready sockets taken from epoll_wait at a time */
+#define MQTT_LOOP_MAX_EVENTS 256
+
+struct MqttLoop
+{
+    /* -1 when io_uring is used */
+    int epfd;
+#if defined(MQTT_USE_IO_URING)
+    /* NULL if io_uring is not available, epoll is used instead */
+    UringIo *uring;
+    /* clients with completed I/O to handle */
+    SIMPLEQ_HEAD(, MqttLoopEntry) readyQueue;
+#endif
+    /* all clients added to the loop */
+    TAILQ_HEAD(, MqttLoopEntry) clients;
+    /* clients whose events or deadline must be updated before waiting */
+    SIMPLEQ_HEAD(, MqttLoopEntry) dirtyQueue;
+    /* binary min-heap of clients ordered by deadline */
+    MqttLoopEntry **heap;
+    int heapSize;
+    int heapCapacity;
+};
+
+static void MqttLoopHeapSwap(MqttLoop *loop, int a, int b)
+{
+    MqttLoopEntry *tmp = loop->heap[a];
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = tmp;
+    loop->heap[a]->heapIndex = a;
+    loop->heap[b]->heapIndex = b;
+}
+
+static void MqttLoopHeapUp(MqttLoop *loop, int index)
+{
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (loop->heap[parent]->deadline <= loop->heap[index]->deadline)
+            break;
+        MqttLoopHeapSwap(loop, parent, index);
+        index = parent;
+    }
+}
+
+static void MqttLoopHeapDown(MqttLoop *loop, int index)
+{
+    while (1)
+    {
+        int left = index * 2 + 1;
+        int right = left + 1;
+        int smallest = index;
+
+        if (left < loop->heapSize &&
+            loop->heap[left]->deadline < loop->heap[smallest]->deadline)
+            smallest = left;
+
+        if (right < loop->heapSize &&
+            loop->heap[right]->deadline < loop->heap[smallest]->deadline)
+            smallest = right;
+
+        if (smallest == index)
+            break;
+
+        MqttLoopHeapSwap(loop, index, smallest);
+        index = smallest;
+    }
+}
+
+static void MqttLoopHeapRemove(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    int index = entry->heapIndex;
+
+    if (index == -1)
+        return;
+
+    entry->heapIndex = -1;
+
+    if (index == --loop->heapSize)
+        return;
+
+    loop->heap[index] = loop->heap[loop->heapSize];
+    loop->heap[index]->heapIndex = index;
+
+    MqttLoopHeapUp(loop, index);
+    MqttLoopHeapDown(loop, loop->heap[index]->heapIndex);
+}
+
+static int MqttLoopHeapSet(MqttLoop *loop, MqttLoopEntry *entry,
+                           int64_t deadline)
+{
+    if (deadline == -1)
+    {
+        MqttLoopHeapRemove(loop, entry);
+        entry->deadline = -1;
+        return 0;
+    }
+
+    if (entry->heapIndex == -1)
+    {
+        if (loop->heapSize == loop->heapCapacity)
+        {
+            int capacity = loop->heapCapacity ? loop->heapCapacity * 2 : 64;
+            MqttLoopEntry **heap = MqttRealloc(loop->heap,
+                                               capacity * sizeof(*heap));
+            if (!heap)
+                return -1;
+            loop->heap = heap;
+            loop->heapCapacity = capacity;
+        }
+
+        entry->deadline = deadline;
+        entry->heapIndex = loop->heapSize++;
+        loop->heap[entry->heapIndex] = entry;
+        MqttLoopHeapUp(loop, entry->heapIndex);
+    }
+    else
+    {
+        entry->deadline = deadline;
+        MqttLoopHeapUp(loop, entry->heapIndex);
+        MqttLoopHeapDown(loop, entry->heapIndex);
+    }
+
+    return 0;
+}
+
+static int MqttLoopEpollEvents(int events)
+{
+    int epollEvents = 0;
+
+    if (events & EV_READ)
+        epollEvents |= EPOLLIN;
+
+    if (events & EV_WRITE)
+        epollEvents |= EPOLLOUT;
+
+    return epollEvents;
+}
+
+#if defined(MQTT_USE_IO_URING)
+
+static void MqttLoopReady(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    if (entry->ready)
+        return;
+
+    entry->ready = 1;
+    SIMPLEQ_INSERT_TAIL(&loop->readyQueue, entry, readyQueue);
+}
+
+/*
+    With io_uring the socket is attached to the ring when first seen. A
+    connecting client polls for writability, a connected one keeps a receive
+    armed. Clients that can already make progress are queued right away.
+*/
+static int MqttLoopUringUpdate(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    MqttClient *client = entry->client;
+    SocketStream *stream = MqttClientSocketStream(client);
+    int events = MqttClientWantedEvents(client);
+
+    entry->fd = stream->sock;
+    entry->events = events;
+
+    if (stream->sock != -1 && events != 0)
+    {
+        int rc;
+
+        if (!stream->uring &&
+            UringStreamAttach(loop->uring, stream, entry) == -1)
+        {
+            LOG_ERROR("UringStreamAttach failed");
+            return -1;
+        }
+
+        /* Only a connecting client waits for just writability */
+        if (events & EV_READ)
+            rc = UringStreamStart(stream->uring);
+        else
+            rc = UringStreamPollWrite(stream->uring);
+
+        if (rc == -1)
+            return -1;
+
+        if (UringStreamEvents(stream->uring) & events)
+            MqttLoopReady(loop, entry);
+    }
+
+    return MqttLoopHeapSet(loop, entry, MqttClientNextDeadline(client));
+}
+
+#endif
+
+/* Syncs the epoll registration and timer of the client with its state. */
+static int MqttLoopUpdate(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    MqttClient *client = entry->client;
+    int fd;
+    int events;
+    struct epoll_event ev;
+
+#if defined(MQTT_USE_IO_URING)
+    if (loop->uring)
+        return MqttLoopUringUpdate(loop, entry);
+#endif
+
+    fd = MqttClientGetFd(client);
+    events = MqttClientWantedEvents(client);
+
+    /* The client closes its socket by itself, which also removes it from the
+       epoll set, see MqttLoopEntryClosed. */
+    if (fd != entry->fd)
+    {
+        entry->fd = -1;
+        entry->events = 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = MqttLoopEpollEvents(events);
+    ev.data.ptr = entry;
+
+    if (fd != -1 && events != 0)
+    {
+        if (entry->fd == -1)
+        {
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            {
+                LOG_ERROR("epoll_ctl(EPOLL_CTL_ADD) failed");
+                return -1;
+            }
+            entry->fd = fd;
+        }
+        else if (events != entry->events)
+        {
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+            {
+                LOG_ERROR("epoll_ctl(EPOLL_CTL_MOD) failed");
+                return -1;
+            }
+        }
+        entry->events = events;
+    }
+    else if (entry->fd != -1)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->fd, &ev);
+        entry->fd = -1;
+        entry->events = 0;
+    }
+
+    return MqttLoopHeapSet(loop, entry, MqttClientNextDeadline(client));
+}
+
+void MqttLoopEntryChanged(MqttLoopEntry *entry)
+{
+    if (!entry->loop || entry->dirty)
+        return;
+
+    entry->dirty = 1;
+    SIMPLEQ_INSERT_TAIL(&entry->loop->dirtyQueue, entry, dirtyQueue);
+}
+
+void MqttLoopEntryClosed(MqttLoopEntry *entry)
+{
+    entry->fd = -1;
+    entry->events = 0;
+    MqttLoopEntryChanged(entry);
+}
+
+static int MqttLoopProcessDirty(MqttLoop *loop)
+{
+    int rc = 0;
+
+    while (!SIMPLEQ_EMPTY(&loop->dirtyQueue))
+    {
+        MqttLoopEntry *entry = SIMPLEQ_FIRST(&loop->dirtyQueue);
+        SIMPLEQ_REMOVE_HEAD(&loop->dirtyQueue, dirtyQueue);
+        entry->dirty = 0;
+        if (MqttLoopUpdate(loop, entry) == -1)
+            rc = -1;
+    }
+
+    return rc;
+}
+
+MqttLoop *MqttLoopNew(void)
+{
+    MqttLoop *loop;
+
+    loop = MqttCalloc(1, sizeof(*loop));
+
+    if (!loop)
+        return NULL;
+
+    TAILQ_INIT(&loop->clients);
+    SIMPLEQ_INIT(&loop->dirtyQueue);
+
+#if defined(MQTT_USE_IO_URING)
+    SIMPLEQ_INIT(&loop->readyQueue);
+
+    loop->uring = MqttMalloc(sizeof(*loop->uring));
+
+    if (loop->uring && UringIoInit(loop->uring) == 0)
+    {
+        loop->epfd = -1;
+        return loop;
+    }
+
+    LOG_INFO("io_uring not available, using epoll");
+    MqttFree(loop->uring);
+    loop->uring = NULL;
+#endif
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->epfd == -1)
+    {
+        LOG_ERROR("epoll_create1 failed");
+        MqttFree(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void MqttLoopFree(MqttLoop *loop)
+{
+    if (!loop)
+        return;
+
+    while (!TAILQ_EMPTY(&loop->clients))
+    {
+        MqttLoopRemove(loop, TAILQ_FIRST(&loop->clients)->client);
+    }
+
+#if defined(MQTT_USE_IO_URING)
+    if (loop->uring)
+    {
+        UringIoFree(loop->uring);
+        MqttFree(loop->uring);
+    }
+#endif
+
+    if (loop->epfd != -1)
+        close(loop->epfd);
+
+    MqttFree(loop->heap);
+    MqttFree(loop);
+}
+
+int MqttLoopAdd(MqttLoop *loop, MqttClient *client)
+{
+    MqttLoopEntry *entry;
+
+    assert(loop != NULL);
+    assert(client != NULL);
+
+    entry = MqttClientLoopEntry(client);
+
+    if (entry->loop != NULL)
+    {
+        LOG_ERROR("client already belongs to a loop");
+        return -1;
+    }
+
+    entry->loop = loop;
+    entry->client = client;
+    entry->fd = -1;
+    entry->events = 0;
+    entry->deadline = -1;
+    entry->heapIndex = -1;
+    entry->dirty = 0;
+    entry->ready = 0;
+
+    TAILQ_INSERT_TAIL(&loop->clients, entry, clients);
+
+    MqttLoopEntryChanged(entry);
+
+    return 0;
+}
+
+int MqttLoopRemove(MqttLoop *loop, MqttClient *client)
+{
+    MqttLoopEntry *entry;
+
+    assert(loop != NULL);
+    assert(client != NULL);
+
+    entry = MqttClientLoopEntry(client);
+
+    if (entry->loop != loop)
+    {
+        LOG_ERROR("client does not belong to this loop");
+        return -1;
+    }
+
+    if (entry->dirty)
+    {
+        SIMPLEQ_REMOVE(&loop->dirtyQueue, entry, MqttLoopEntry, dirtyQueue);
+        entry->dirty = 0;
+    }
+
+#if defined(MQTT_USE_IO_URING)
+    if (entry->ready)
+    {
+        SIMPLEQ_REMOVE(&loop->readyQueue, entry, MqttLoopEntry, readyQueue);
+        entry->ready = 0;
+    }
+
+    /* The in-flight I/O of the connection belongs to the ring of the loop,
+       the connection can't continue without it. */
+    if (MqttClientSocketStream(client)->uring)
+    {
+        /* The buffers of the stream belong to the client */
+        const MqttAllocator *previous =
+            MqttAllocatorEnter(MqttClientAllocator(client));
+        StreamClose(&MqttClientSocketStream(client)->base);
+        MqttAllocatorLeave(previous);
+    }
+#endif
+
+    if (loop->epfd != -1 && entry->fd != -1 &&
+        entry->fd == MqttClientGetFd(client))
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->fd, &ev);
+    }
+
+    entry->fd = -1;
+    entry->events = 0;
+
+    MqttLoopHeapRemove(loop, entry);
+
+    TAILQ_REMOVE(&loop->clients, entry, clients);
+
+    entry->loop = NULL;
+
+    return 0;
+}
+
+/* Returns timeout shortened to the nearest deadline of the timer heap. */
+static int MqttLoopTimeout(MqttLoop *loop, int timeout)
+{
+    if (loop->heapSize > 0)
+    {
+        int64_t wait = loop->heap[0]->deadline - MqttGetCurrentTime();
+
+        if (wait < 0)
+            wait = 0;
+
+        if (timeout < 0 || wait < timeout)
+            timeout = (int) wait;
+    }
+
+    return timeout;
+}
+
+/* Runs expired retry and keepalive timers. The client is updated (which
+   reschedules it) before the next wait. */
+static int MqttLoopRunTimers(MqttLoop *loop)
+{
+    int64_t now = MqttGetCurrentTime();
+    int count = 0;
+
+    while (loop->heapSize > 0 && loop->heap[0]->deadline <= now)
+    {
+        MqttLoopEntry *entry = loop->heap[0];
+        MqttLoopHeapRemove(loop, entry);
+        entry->deadline = -1;
+        MqttClientHandleEvents(entry->client, 0);
+        MqttLoopEntryChanged(entry);
+        ++count;
+    }
+
+    return count;
+}
+
+#if defined(MQTT_USE_IO_URING)
+
+static int MqttLoopUringRun(MqttLoop *loop, int timeout)
+{
+    Uring *ring = &loop->uring->ring;
+    struct io_uring_cqe *cqe;
+    int count = 0;
+
+    if (MqttLoopProcessDirty(loop) == -1)
+        return -1;
+
+    UringIoRearm(loop->uring);
+
+    if (!SIMPLEQ_EMPTY(&loop->readyQueue))
+        timeout = 0;
+    else
+        timeout = MqttLoopTimeout(loop, timeout);
+
+    LOG_DEBUG("waiting timeout:%d", timeout);
+
+    /* Everything queued since the last wait (receives, sends, polls) is
+       submitted with the same system call that waits for completions */
+    if (UringSubmit(ring, timeout != 0 ? 1 : 0, timeout) == -1)
+        return -1;
+
+    while ((cqe = UringPeekCqe(ring)) != NULL)
+    {
+        UringStream *us = UringIoComplete(loop->uring, cqe);
+
+        UringCqeSeen(ring);
+
+        if (us)
+            MqttLoopReady(loop, (MqttLoopEntry *) us->userData);
+    }
+
+    while (!SIMPLEQ_EMPTY(&loop->readyQueue))
+    {
+        MqttLoopEntry *entry = SIMPLEQ_FIRST(&loop->readyQueue);
+        SocketStream *stream = MqttClientSocketStream(entry->client);
+        int ev = 0;
+
+        SIMPLEQ_REMOVE_HEAD(&loop->readyQueue, readyQueue);
+        entry->ready = 0;
+
+        if (stream->uring)
+            ev = UringStreamEvents(stream->uring) & entry->events;
+
+        if (ev == 0)
+            continue;
+
+        MqttClientHandleEvents(entry->client, ev);
+        MqttLoopEntryChanged(entry);
+        ++count;
+    }
+
+    return count + MqttLoopRunTimers(loop);
+}
+
+#endif
+
+int MqttLoopRun(MqttLoop *loop, int timeout)
+{
+    struct epoll_event events[MQTT_LOOP_MAX_EVENTS];
+    int count = 0;
+    int nfds;
+    int i;
+
+    assert(loop != NULL);
+
+#if defined(MQTT_USE_IO_URING)
+    if (loop->uring)
+        return MqttLoopUringRun(loop, timeout);
+#endif
+
+    if (MqttLoopProcessDirty(loop) == -1)
+        return -1;
+
+    timeout = MqttLoopTimeout(loop, timeout);
+
+    LOG_DEBUG("waiting timeout:%d", timeout);
+
+    nfds = epoll_wait(loop->epfd, events, MQTT_LOOP_MAX_EVENTS, timeout);
+
+    if (nfds == -1)
+    {
+        if (SocketErrno == EINTR)
+            return 0;
+        LOG_ERROR("epoll_wait failed");
+        return -1;
+    }
+
+    for (i = 0; i < nfds; ++i)
+    {
+        MqttLoopEntry *entry = (MqttLoopEntry *) events[i].data.ptr;
+        int ev = 0;
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ev |= EV_READ;
+
+        if (events[i].events & (EPOLLOUT | EPOLLERR))
+            ev |= EV_WRITE;
+
+        /* Only report what the client asked for */
+        ev &= entry->events;
+
+        MqttClientHandleEvents(entry->client, ev);
+        MqttLoopEntryChanged(entry);
+        ++count;
+    }
+
+    return count + MqttLoopRunTimers(loop);
+}
+
+#else
+
+MqttLoop *MqttLoopNew(void)
+{
+    LOG_ERROR("MqttLoop is not supported on this platform");
+    return NULL;
+}
+
+void MqttLoopFree(MqttLoop *loop)
+{
+    (void) loop;
+}
+
+int MqttLoopAdd(MqttLoop *loop, MqttClient *client)
+{
+    (void) loop;
+    (void) client;
+    return -1;
+}
+
+int MqttLoopRemove(MqttLoop *loop, MqttClient *client)
+{
+    (void) loop;
+    (void) client;
+    return -1;
+}
+
+int MqttLoopRun(MqttLoop *loop, int timeout)
+{
+    (void) loop;
+    (void) timeout;
+    return -1;
+}
+
+void MqttLoopEntryChanged(MqttLoopEntry *entry)
+{
+    (void) entry;
+}
+
+void MqttLoopEntryClosed(MqttLoopEntry *entry)
+{
+    (void) entry;
+}
+
+#endif
+
+/**********************************************************************/
+/*                              client.c                              */
+/**********************************************************************/
+
+#include "mqtt.h"
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#if (LOG_LEVEL == LOG_LEVEL_DEBUG) && !defined(PRId64)
+#error define PRId64 for your platform
+#endif
+
+/* Default budget of MqttClientSetRecvBudget, 0 means no limit */
+#if !defined(MQTT_RECV_BUDGET_PACKETS)
+#define MQTT_RECV_BUDGET_PACKETS 256
+#endif
+
+#if !defined(MQTT_RECV_BUDGET_US)
+#define MQTT_RECV_BUDGET_US 0
+#endif
+
+/* Default number of freed packets and messages a client keeps for reuse */
+#if !defined(MQTT_POOL_SIZE)
+#define MQTT_POOL_SIZE 256
+#endif
+
+/* Largest piece of a streamed message, see MqttClientSetOnMessageStream and
+   MqttClientPublishStream. A received one is read into a buffer on the
+   stack, a published one is produced into a buffer of the client. */
+#if !defined(MQTT_MESSAGE_CHUNK_SIZE)
+#define MQTT_MESSAGE_CHUNK_SIZE (16*1024)
+#endif
+
+/* Default of MqttClientSetMaxPacketSize, 0 meaning no limit */
+#if !defined(MQTT_MAX_PACKET_SIZE)
+#define MQTT_MAX_PACKET_SIZE 0
+#endif
+
+/* Defaults of MqttClientSetRecvBufferPolicy: how many bytes of the receive
+   buffer are kept between packets and after how many milliseconds without
+   packets it is freed, 0 meaning never */
+#if !defined(MQTT_RECV_BUFFER_KEEP)
+#define MQTT_RECV_BUFFER_KEEP 4096
+#endif
+
+#if !defined(MQTT_RECV_BUFFER_IDLE_MS)
+#define MQTT_RECV_BUFFER_IDLE_MS 30000
+#endif
+
+/* Defaults of MqttClientSetCoalescing: how many microseconds and bytes of
+   packets are held before sending them, a delay of 0 disabling it and a
+   size of 0 meaning no limit */
+#if !defined(MQTT_COALESCE_DELAY_US)
+#define MQTT_COALESCE_DELAY_US 0
+#endif
+
+#if !defined(MQTT_COALESCE_MAX_BYTES)
+#define MQTT_COALESCE_MAX_BYTES 0
+#endif
+
+/* Defaults of MqttClientSetQos0Limit, 0 meaning no limit */
+#if !defined(MQTT_QOS0_MAX_COUNT)
+#define MQTT_QOS0_MAX_COUNT 0
+#endif
+
+#if !defined(MQTT_QOS0_MAX_BYTES)
+#define MQTT_QOS0_MAX_BYTES 0
+#endif
+
+/* Default of MqttClientSetZeroCopyThreshold, 0 disables MSG_ZEROCOPY */
+#if !defined(MQTT_ZEROCOPY_THRESHOLD)
+#define MQTT_ZEROCOPY_THRESHOLD 0
+#endif
+
+/*
+    sendQueue is ordered by these lanes, control packets (acknowledgements,
+    PINGREQ, SUBSCRIBE etc.) first and then PUBLISH packets by priority and
+    QoS. DISCONNECT goes last since nothing is sent after it. Only the
+    packet that is being written stays in front of the others, packets go
+    ahead of each other only at packet boundaries.
+*/
+enum
+{
+    MqttSendLaneControl,
+    MqttSendLaneHigh,
+    MqttSendLaneQos2,
+    MqttSendLaneQos1,
+    MqttSendLaneQos0,
+    MqttSendLaneLow,
+    MqttSendLaneDisconnect,
+    MqttSendLaneCount
+};
+
+typedef enum MqttClientState MqttClientState;
+
+enum MqttClientState
+{
+    MqttClientStateDisconnected,
+    MqttClientStateConnecting,
+    MqttClientStateConnected,
+};
+
+/* A user payload whose release waits for the kernel to finish sending it */
+typedef struct MqttPendingRelease MqttPendingRelease;
+
+struct MqttPendingRelease
+{
+    const void *data;
+    MqttClientReleaseCallback release;
+    void *context;
+    /* zero copy send id after which the data is no longer used */
+    uint32_t zeroCopyId;
+    SIMPLEQ_ENTRY(MqttPendingRelease) chain;
+};
+
+struct MqttClient
+{
+    SocketStream stream;
+    /* client id, NULL if we want to have server generated id */
+    bstring clientId;
+    /* set to 1 if we want to have a clean session */
+    int cleanSession;
+    /* remote host and port */
+    bstring host;
+    short port;
+    /* keepalive interval in seconds */
+    int keepAlive;
+    /* user specified data, not used by us */
+    void *userData;
+    /* callback called after connection is made */
+    MqttClientOnConnectCallback onConnect;
+    /* callback called after subscribe is done */
+    MqttClientOnSubscribeCallback onSubscribe;
+    /* callback called after subscribe is done */
+    MqttClientOnUnsubscribeCallback onUnsubscribe;
+    /* callback called when a message is received */
+    MqttClientOnMessageCallback onMessage;
+    /* same with the length of the topic, used instead of onMessage if set */
+    MqttClientOnMessageWithTopicLengthCallback onMessageWithTopicLength;
+    /* callback called after publish is done and acknowledged */
+    MqttClientOnPublishCallback onPublish;
+    /* callbacks for messages of at least streamThreshold bytes, passed on
+       as they arrive */
+    MqttClientOnMessageBeginCallback onMessageBegin;
+    MqttClientOnMessageDataCallback onMessageData;
+    MqttClientOnMessageEndCallback onMessageEnd;
+    size_t streamThreshold;
+    /* while a PUBLISH is streamed, the size of its variable header (2 until
+       the length of the topic is known), 0 otherwise */
+    size_t streamHeaderSize;
+    /* 1 if the streamed PUBLISH is passed on and acknowledged, 0 if it is
+       skipped */
+    int streamDeliver;
+    /* received packets with a longer body are rejected, 0 meaning no limit,
+       see MqttClientSetMaxPacketSize */
+    size_t maxPacketSize;
+    /* 1 if a rejected PUBLISH is read past and acknowledged instead of
+       closing the connection */
+    int discardTooLarge;
+    /* 1 while reading past a rejected PUBLISH (streamed without passing it
+       on) */
+    int recvDiscard;
+    uint64_t packetsTooLarge;
+    MqttClientOnErrorCallback onError;
+    int stopped;
+    /* packets waiting to be sent over network */
+    SIMPLEQ_HEAD(, MqttPacket) sendQueue;
+    /* the last packet of each lane in sendQueue, not counting the head if
+       it has been partly written, see MqttClientQueuePacket */
+    MqttPacket *sendLaneTails[MqttSendLaneCount];
+    /* freed packets and messages kept for reuse, at most poolLimit of
+       each */
+    SIMPLEQ_HEAD(, MqttPacket) freePackets;
+    int freePacketCount;
+    MqttMessageList freeMessages;
+    int freeMessageCount;
+    int poolLimit;
+    /* sent messages that are not done yet */
+    MqttMessageList outMessages;
+    /* outMessages by packet id */
+    MqttMessageIndex outIndex;
+    /* outMessages that are still queued, in the order they were published */
+    MqttMessageList queuedMessages;
+    int outQueued;
+    /* received messages that are not done yet  */
+    MqttMessageList inMessages;
+    /* inMessages by packet id */
+    MqttMessageIndex inIndex;
+    /* in and out messages waiting for an acknowledgement, ordered by the
+       time they were sent and so by their retry deadline */
+    MqttMessageList retryMessages;
+    /* current time, read once when the client is entered from the event
+       loop instead of for every packet and message */
+    int64_t now;
+    int sessionPresent;
+    /* when was the last packet sent */
+    int64_t lastPacketSentTime;
+    /* next packet id */
+    uint16_t packetId;
+    /* timeout after which to retry sending messages */
+    int retryTimeout;
+    /* maximum number of inflight messages (not packets!) */
+    int maxInflight;
+    /* maximum number of queued messages (not packets!) */
+    int maxQueued;
+    /* 1 if PINGREQ is sent and we are waiting for PINGRESP, 0 otherwise */
+    int pingSent;
+    /* when was the PINGREQ queued */
+    int64_t pingSentTime;
+    bstring willTopic;
+    bstring willMessage;
+    int willQos;
+    int willRetain;
+    /* 1 if client should ignore incoming PUBLISH messages, 0 handle them */
+    int paused;
+    bstring userName;
+    bstring password;
+    /* The packet we are receiving */
+    MqttPacket inPacket;
+    /* maximum number of packets and microseconds to spend receiving per
+       call, 0 for no limit */
+    int recvBudgetPackets;
+    int recvBudgetUs;
+    /* 1 if receiving stopped because the budget ran out, not because the
+       socket would block */
+    int recvPending;
+    MqttClientState state;
+    /* bookkeeping for MqttLoop */
+    MqttLoopEntry loopEntry;
+    /* user payloads at least this big are sent with MSG_ZEROCOPY, 0 for
+       never */
+    size_t zeroCopyThreshold;
+    /* released user payloads still used by zero copy sends, in the order
+       they were released */
+    SIMPLEQ_HEAD(, MqttPendingRelease) pendingReleases;
+    /* the produced payload being sent, produceBuffer[producePos] to
+       produceBuffer[produceLen] is still unwritten, see
+       MqttClientPublishStream */
+    unsigned char *produceBuffer;
+    size_t producePos;
+    size_t produceLen;
+    /* buffer for the payloads of received packets, reused from packet to
+       packet, see MqttClientSetRecvBufferPolicy */
+    bstring recvBuffer;
+    size_t recvBufferKeep;
+    int recvBufferIdleMs;
+    /* most bytes recvBuffer has had allocated */
+    size_t recvBufferPeak;
+    int64_t lastPacketReceivedTime;
+    /* packets are held in sendQueue for at most coalesceDelayUs
+       microseconds or until coalesceMaxBytes bytes are held, see
+       MqttClientSetCoalescing */
+    int coalesceDelayUs;
+    size_t coalesceMaxBytes;
+    /* when the first held packet was queued (0 if none) and how many bytes
+       have been queued since */
+    int64_t coalesceStartUs;
+    size_t coalesceHeldBytes;
+    /* 1 if a packet that isn't held was queued */
+    int coalesceUrgent;
+    uint64_t coalesceFlushes;
+    uint64_t coalesceDelayTotalUs;
+    uint64_t coalesceDelayMaxUs;
+    /* limits of the QoS 0 packets in sendQueue, 0 meaning no limit, and
+       what to do when they are reached, see MqttClientSetQos0Limit */
+    size_t qos0MaxCount;
+    size_t qos0MaxBytes;
+    int qos0Policy;
+    size_t qos0Queued;
+    size_t qos0QueuedBytes;
+    uint64_t qos0Dropped;
+    uint64_t qos0DroppedBytes;
+    /* allocator of the client (allocatorStorage) or NULL for the global
+       allocator */
+    const MqttAllocator *allocator;
+    MqttAllocator allocatorStorage;
+};
+
+static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet);
+static int MqttClientQos0Fits(MqttClient *client, size_t count, size_t size);
+static int MqttClientQueueQos0(MqttClient *client, MqttPacket *packet);
+static void MqttClientUnqueuePacket(MqttClient *client, MqttPacket *prev,
+                                    MqttPacket *packet);
+static int MqttClientQueueSimplePacket(MqttClient *client, int type);
+static int MqttClientSendPacket(MqttClient *client);
+static int MqttClientRecvPacket(MqttClient *client);
+static uint16_t MqttClientNextPacketId(MqttClient *client);
+static void MqttClientProcessMessageQueue(MqttClient *client);
+static void MqttClientClearQueues(MqttClient *client);
+
+/*
+    Packets and messages come from per client pools of freed ones. Together
+    with the inline storage of small packets, a warmed up client sends and
+    acknowledges messages without allocating its bookkeeping structs. The
+    pools are not shared so they need no locking.
+*/
+
+static MqttPacket *MqttClientPacketNew(MqttClient *client, int type,
+                                       uint16_t id)
+{
+    MqttPacket *packet = SIMPLEQ_FIRST(&client->freePackets);
+
+    if (!packet)
+        return MqttPacketWithIdNew(type, id);
+
+    SIMPLEQ_REMOVE_HEAD(&client->freePackets, sendQueue);
+    --client->freePacketCount;
+
+    /* Packets in the pool have been reset already */
+    packet->type = type;
+    packet->id = id;
+
+    return packet;
+}
+
+/* Frees the packet or keeps it in the pool. */
+static void MqttClientPacketFree(MqttClient *client, MqttPacket *packet)
+{
+    if (client->freePacketCount >= client->poolLimit)
+    {
+        MqttPacketFree(packet);
+        return;
+    }
+
+    MqttPacketReset(packet);
+    SIMPLEQ_INSERT_HEAD(&client->freePackets, packet, sendQueue);
+    ++client->freePacketCount;
+}
+
+/*
+    Asks the producer of msg for the next at most size bytes of its payload.
+    Returns the number of bytes or -1 on failure.
+*/
+static int64_t MqttClientProduce(MqttClient *client, MqttMessage *msg,
+                                 void *buf, size_t size, int rewind)
+{
+    int64_t n;
+
+    if (size > MQTT_MESSAGE_CHUNK_SIZE)
+        size = MQTT_MESSAGE_CHUNK_SIZE;
+
+    n = msg->producer(client, buf, size, rewind, msg->releaseContext);
+
+    if (n <= 0 || n > (int64_t) size)
+    {
+        LOG_ERROR("failed to produce the payload");
+        return -1;
+    }
+
+    return n;
+}
+
+/*
+    Produces what is left to write of a packet whose writing has started
+    into memory so that the producer is no longer needed. Returns -1 on
+    failure.
+*/
+static int MqttClientProduceRemainder(MqttClient *client, MqttPacket *packet)
+{
+    size_t unwritten = 0;
+    size_t buffered = 0;
+    size_t left = packet->streamSize;
+    size_t size;
+    unsigned char *data;
+    int64_t n;
+
+    if (packet->state == MqttPacketStateWriteData)
+    {
+        unwritten = packet->remainingLength;
+    }
+    else
+    {
+        /* Only the head of the queue is in MqttPacketStateWritePayload */
+        buffered = client->produceLen - client->producePos;
+        left = packet->remainingLength - buffered;
+    }
+
+    size = unwritten + buffered + left;
+
+    if (!(data = MqttMalloc(size)))
+        return -1;
+
+    memcpy(data, packet->data + packet->size - unwritten, unwritten);
+    memcpy(data + unwritten, client->produceBuffer + client->producePos,
+           buffered);
+
+    while (left > 0)
+    {
+        n = MqttClientProduce(client, packet->message, data + size - left,
+                              left, left == packet->streamSize);
+        if (n == -1)
+        {
+            MqttFree(data);
+            return -1;
+        }
+        left -= (size_t) n;
+    }
+
+    client->producePos = client->produceLen = 0;
+
+    MqttPacketSetRemainder(packet, data, size);
+
+    return 0;
+}
+
+/*
+    Gives a borrowed payload back to the user, see MqttClientPublishZeroCopy
+    and MqttClientPublishStream, or closes the file of the payload, see
+    MqttClientPublishFile. Packets still waiting to be sent get a copy of it,
+    except resends of a produced payload that haven't started, which are
+    dropped. If the kernel may still be sending it without a copy, release
+    is delayed until it is done.
+*/
+static void MqttClientReleasePayload(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet;
+    MqttPacket *prev = NULL;
+    MqttPacket *next;
+    MqttPendingRelease *pending;
+    int rv;
+
+    if (!msg->userPayload && !msg->file && !msg->producer)
+        return;
+
+    if (msg->queuedPackets > 0)
+    {
+        SIMPLEQ_FOREACH_SAFE(packet, &client->sendQueue, sendQueue, next)
+        {
+            if (packet->message != msg)
+            {
+                prev = packet;
+                continue;
+            }
+
+            if (packet->produced && !MqttPacketWriteStarted(packet))
+            {
+                MqttClientUnqueuePacket(client, prev, packet);
+                --msg->queuedPackets;
+                MqttClientPacketFree(client, packet);
+                continue;
+            }
+
+            if (packet->produced)
+                rv = MqttClientProduceRemainder(client, packet);
+            else
+                rv = MqttPacketCopyExternal(packet);
+
+            if (rv == -1)
+            {
+                /* The packet can't be sent anymore */
+                LOG_ERROR("failed to copy payload of a queued packet");
+                client->stopped = 1;
+            }
+
+            prev = packet;
+        }
+    }
+
+    if (msg->file)
+    {
+        MqttFileClose(msg->fd);
+        msg->file = 0;
+        msg->fd = 0;
+        msg->fileOffset = 0;
+        msg->fileSize = 0;
+        return;
+    }
+
+    if (msg->release && msg->zeroCopyPending &&
+        client->stream.sock != -1 &&
+        !SocketStreamZeroCopyDone(&client->stream, msg->zeroCopyId))
+    {
+        pending = MqttMalloc(sizeof(*pending));
+
+        if (pending)
+        {
+            pending->data = msg->userPayload;
+            pending->release = msg->release;
+            pending->context = msg->releaseContext;
+            pending->zeroCopyId = msg->zeroCopyId;
+            SIMPLEQ_INSERT_TAIL(&client->pendingReleases, pending, chain);
+        }
+        else
+        {
+            LOG_WARNING("releasing payload before the kernel is done");
+            msg->release(client, msg->userPayload, msg->releaseContext);
+        }
+    }
+    else if (msg->release)
+    {
+        msg->release(client, msg->userPayload, msg->releaseContext);
+    }
+
+    msg->userPayload = NULL;
+    msg->userPayloadSize = 0;
+    msg->producer = NULL;
+    msg->producedSize = 0;
+    msg->release = NULL;
+    msg->releaseContext = NULL;
+    msg->zeroCopyPending = 0;
+}
+
+/*
+    Calls the delayed releases whose zero copy sends have completed, or all
+    of them if force is 1 (the socket is closed).
+*/
+static void MqttClientFlushReleases(MqttClient *client, int force)
+{
+    MqttPendingRelease *pending;
+
+    if (!force && SocketStreamReapZeroCopy(&client->stream) == -1)
+    {
+        LOG_WARNING("failed to read zero copy completions");
+    }
+
+    while ((pending = SIMPLEQ_FIRST(&client->pendingReleases)) != NULL &&
+           (force || SocketStreamZeroCopyDone(&client->stream,
+                                              pending->zeroCopyId)))
+    {
+        SIMPLEQ_REMOVE_HEAD(&client->pendingReleases, chain);
+        pending->release(client, pending->data, pending->context);
+        MqttFree(pending);
+    }
+}
+
+/*
+    Makes inPacket.payload the receive buffer of the client, empty if the
+    packet didn't have it yet, with room for size bytes and a terminator.
+    The buffer only grows here. Returns -1 on failure.
+*/
+static int MqttClientRecvBufferReserve(MqttClient *client, size_t size)
+{
+    bstring buf = client->inPacket.payload;
+
+    if (!buf)
+    {
+        if (!client->recvBuffer && !(client->recvBuffer = bfromcstr("")))
+            return -1;
+        buf = client->recvBuffer;
+        buf->slen = 0;
+        buf->data[0] = '\0';
+        client->inPacket.payload = buf;
+    }
+
+    if (size >= INT_MAX || balloc(buf, (int) size + 1) != BSTR_OK)
+        return -1;
+
+    if ((size_t) buf->mlen > client->recvBufferPeak)
+        client->recvBufferPeak = (size_t) buf->mlen;
+
+    return 0;
+}
+
+/*
+    Takes the receive buffer back from the packet that was received. A
+    buffer that grew beyond recvBufferKeep bytes for a large packet shrinks
+    back.
+*/
+static void MqttClientRecvBufferDone(MqttClient *client)
+{
+    bstring buf = client->recvBuffer;
+
+    client->inPacket.payload = NULL;
+
+    if (!buf || (size_t) buf->mlen <= client->recvBufferKeep)
+        return;
+
+    buf->slen = 0;
+
+    if (client->recvBufferKeep == 0 ||
+        ballocmin(buf, (int) client->recvBufferKeep) != BSTR_OK)
+    {
+        bdestroy(buf);
+        client->recvBuffer = NULL;
+    }
+}
+
+/*
+    Forgets the packet being received, telling the application if it was
+    streaming a message.
+*/
+static void MqttClientAbortRecv(MqttClient *client)
+{
+    if (client->streamHeaderSize > 0 && client->streamDeliver &&
+        !client->recvDiscard && client->onMessageEnd)
+    {
+        client->onMessageEnd(client, 0);
+    }
+
+    client->streamHeaderSize = 0;
+    client->streamDeliver = 0;
+    client->recvDiscard = 0;
+
+    MqttClientRecvBufferDone(client);
+    client->inPacket.state = MqttPacketStateReadType;
+}
+
+/* Closes the connection and drops what depended on it. */
+static void MqttClientClose(MqttClient *client)
+{
+    StreamClose(&client->stream.base);
+    MqttLoopEntryClosed(&client->loopEntry);
+    MqttClientFlushReleases(client, 1);
+    MqttClientAbortRecv(client);
+}
+
+static MqttMessage *MqttClientMessageNew(MqttClient *client)
+{
+    MqttMessage *msg = TAILQ_FIRST(&client->freeMessages);
+
+    if (!msg)
+        return MqttCalloc(1, sizeof(*msg));
+
+    TAILQ_REMOVE(&client->freeMessages, msg, chain);
+    --client->freeMessageCount;
+
+    return msg;
+}
+
+/* Frees the message or keeps it in the pool. */
+static void MqttClientMessageFree(MqttClient *client, MqttMessage *msg)
+{
+    MqttClientReleasePayload(client, msg);
+
+    if (client->freeMessageCount >= client->poolLimit)
+    {
+        MqttMessageFree(msg);
+        return;
+    }
+
+    MqttMessageReset(msg);
+    TAILQ_INSERT_HEAD(&client->freeMessages, msg, chain);
+    ++client->freeMessageCount;
+}
+
+/* Frees pooled packets and messages until there are at most max of each. */
+static void MqttClientTrimPools(MqttClient *client, int max)
+{
+    while (client->freePacketCount > max)
+    {
+        MqttPacket *packet = SIMPLEQ_FIRST(&client->freePackets);
+        SIMPLEQ_REMOVE_HEAD(&client->freePackets, sendQueue);
+        --client->freePacketCount;
+        MqttPacketFree(packet);
+    }
+
+    while (client->freeMessageCount > max)
+    {
+        MqttMessage *msg = TAILQ_FIRST(&client->freeMessages);
+        TAILQ_REMOVE(&client->freeMessages, msg, chain);
+        --client->freeMessageCount;
+        MqttMessageFree(msg);
+    }
+}
+
+static MQTT_INLINE int MqttClientInflightMessageCount(MqttClient *client)
+{
+    return (int) (client->inIndex.count + client->outIndex.count) -
+        client->outQueued;
+}
+
+static MQTT_INLINE int MqttClientOutMessagesLen(MqttClient *client)
+{
+    return (int) client->outIndex.count;
+}
+
+/* Stops the retry timer of the message if it is running. */
+static void MqttClientDisarmRetry(MqttClient *client, MqttMessage *msg)
+{
+    if (msg->retryArmed)
+    {
+        TAILQ_REMOVE(&client->retryMessages, msg, retry);
+        msg->retryArmed = 0;
+    }
+}
+
+/*
+    (Re)starts the retry timer of the message from time. All messages share
+    the same retry timeout so keeping the list ordered by the send time keeps
+    it ordered by the deadline too. Time never goes backwards so the message
+    nearly always goes to the tail.
+*/
+static void MqttClientArmRetry(MqttClient *client, MqttMessage *msg,
+                               int64_t time)
+{
+    MqttMessage *prev;
+
+    MqttClientDisarmRetry(client, msg);
+
+    msg->timestamp = time;
+    msg->retryArmed = 1;
+
+    prev = TAILQ_LAST(&client->retryMessages, MqttMessageList);
+
+    while (prev && prev->timestamp > time)
+        prev = TAILQ_PREV(prev, MqttMessageList, retry);
+
+    if (prev)
+        TAILQ_INSERT_AFTER(&client->retryMessages, prev, msg, retry);
+    else
+        TAILQ_INSERT_HEAD(&client->retryMessages, msg, retry);
+}
+
+/*
+    Drops the PUBLISH packets of a message that haven't started to be sent.
+    A QoS 2 resend must not be sent after the PUBREL, which is queued in an
+    earlier lane, or the receiver would take it for a new message.
+*/
+static void MqttClientUnqueueResends(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet;
+    MqttPacket *prev = NULL;
+    MqttPacket *next;
+
+    if (msg->queuedPackets == 0)
+        return;
+
+    SIMPLEQ_FOREACH_SAFE(packet, &client->sendQueue, sendQueue, next)
+    {
+        if (packet->message == msg &&
+            packet->type == MqttPacketTypePublish &&
+            !MqttPacketWriteStarted(packet))
+        {
+            MqttClientUnqueuePacket(client, prev, packet);
+            --msg->queuedPackets;
+            MqttClientPacketFree(client, packet);
+            continue;
+        }
+
+        prev = packet;
+    }
+}
+
+/*
+    Detaches a message that is about to be freed from the packets that are
+    still waiting to be sent, for example a resent PUBLISH whose original
+    was acknowledged in the meantime.
+*/
+static void MqttClientForgetMessage(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet;
+
+    MqttClientDisarmRetry(client, msg);
+
+    MqttClientReleasePayload(client, msg);
+
+    if (msg->queuedPackets == 0)
+        return;
+
+    SIMPLEQ_FOREACH(packet, &client->sendQueue, sendQueue)
+    {
+        if (packet->message == msg)
+            packet->message = NULL;
+    }
+
+    msg->queuedPackets = 0;
+}
+
+/*
+    The following keep the message lists, their indexes and the counters
+    above in sync. Messages must be added and removed only with these.
+*/
+
+static int MqttClientAddOutMessage(MqttClient *client, MqttMessage *msg)
+{
+    if (MqttMessageIndexInsert(&client->outIndex, msg) == -1)
+        return -1;
+    TAILQ_INSERT_TAIL(&client->outMessages, msg, chain);
+    if (msg->state == MqttMessageStateQueued)
+    {
+        TAILQ_INSERT_TAIL(&client->queuedMessages, msg, queue);
+        ++client->outQueued;
+    }
+    return 0;
+}
+
+static void MqttClientRemoveOutMessage(MqttClient *client, MqttMessage *msg)
+{
+    TAILQ_REMOVE(&client->outMessages, msg, chain);
+    MqttMessageIndexRemove(&client->outIndex, msg->id);
+    if (msg->state == MqttMessageStateQueued)
+    {
+        TAILQ_REMOVE(&client->queuedMessages, msg, queue);
+        --client->outQueued;
+    }
+    MqttClientForgetMessage(client, msg);
+}
+
+static int MqttClientAddInMessage(MqttClient *client, MqttMessage *msg)
+{
+    if (MqttMessageIndexInsert(&client->inIndex, msg) == -1)
+        return -1;
+    TAILQ_INSERT_TAIL(&client->inMessages, msg, chain);
+    return 0;
+}
+
+static void MqttClientRemoveInMessage(MqttClient *client, MqttMessage *msg)
+{
+    TAILQ_REMOVE(&client->inMessages, msg, chain);
+    MqttMessageIndexRemove(&client->inIndex, msg->id);
+    MqttClientForgetMessage(client, msg);
+}
+
+MqttClient *MqttClientNew(const char *clientId)
+{
+    return MqttClientNewWithAllocator(clientId, NULL);
+}
+
+MqttClient *MqttClientNewWithAllocator(const char *clientId,
+                                       const MqttAllocator *allocator)
+{
+    const MqttAllocator *previous;
+    MqttClient *client;
+
+    previous = MqttAllocatorEnter(allocator);
+
+    client = MqttCalloc(1, sizeof(*client));
+
+    if (!client)
+    {
+        MqttAllocatorLeave(previous);
+        return NULL;
+    }
+
+    if (allocator)
+    {
+        client->allocatorStorage = *allocator;
+        client->allocator = &client->allocatorStorage;
+    }
+
+    client->clientId = bfromcstr(clientId);
+
+    client->stream.sock = -1;
+
+    client->retryTimeout = 20;
+
+    client->maxQueued = 0;
+    client->maxInflight = 20;
+
+    client->recvBudgetPackets = MQTT_RECV_BUDGET_PACKETS;
+    client->recvBudgetUs = MQTT_RECV_BUDGET_US;
+
+    client->state = MqttClientStateDisconnected;
+
+    TAILQ_INIT(&client->outMessages);
+    TAILQ_INIT(&client->inMessages);
+    TAILQ_INIT(&client->queuedMessages);
+    TAILQ_INIT(&client->retryMessages);
+    SIMPLEQ_INIT(&client->sendQueue);
+    SIMPLEQ_INIT(&client->freePackets);
+    TAILQ_INIT(&client->freeMessages);
+    SIMPLEQ_INIT(&client->pendingReleases);
+
+    client->poolLimit = MQTT_POOL_SIZE;
+
+    client->zeroCopyThreshold = MQTT_ZEROCOPY_THRESHOLD;
+
+    client->coalesceDelayUs = MQTT_COALESCE_DELAY_US;
+    client->coalesceMaxBytes = MQTT_COALESCE_MAX_BYTES;
+
+    client->qos0MaxCount = MQTT_QOS0_MAX_COUNT;
+    client->qos0MaxBytes = MQTT_QOS0_MAX_BYTES;
+    client->qos0Policy = MqttQueuePolicyDropOldest;
+
+    client->maxPacketSize = MQTT_MAX_PACKET_SIZE;
+
+    client->recvBufferKeep = MQTT_RECV_BUFFER_KEEP;
+    client->recvBufferIdleMs = MQTT_RECV_BUFFER_IDLE_MS;
+
+    MqttAllocatorLeave(previous);
+
+    return client;
+}
+
+void MqttClientFree(MqttClient *client)
+{
+    MqttAllocator allocator;
+    const MqttAllocator *previous;
+
+    if (client->loopEntry.loop)
+    {
+        MqttLoopRemove(client->loopEntry.loop, client);
+    }
+
+    /* The client itself is freed with its allocator too */
+    if (client->allocator)
+    {
+        allocator = *client->allocator;
+        previous = MqttAllocatorEnter(&allocator);
+    }
+    else
+    {
+        previous = MqttAllocatorEnter(NULL);
+    }
+
+    MqttClientClearQueues(client);
+
+    MqttMessageIndexFree(&client->outIndex);
+    MqttMessageIndexFree(&client->inIndex);
+
+    MqttClientTrimPools(client, 0);
+
+    bdestroy(client->clientId);
+    bdestroy(client->willTopic);
+    bdestroy(client->willMessage);
+    bdestroy(client->host);
+    bdestroy(client->userName);
+    bdestroy(client->password);
+
+    if (client->stream.sock != -1)
+    {
+        MqttClientClose(client);
+    }
+
+    MqttClientFlushReleases(client, 1);
+    MqttClientAbortRecv(client);
+
+    MqttFree(client->produceBuffer);
+    bdestroy(client->recvBuffer);
+
+    MqttFree(client);
+
+    MqttAllocatorLeave(previous);
+}
+
+void MqttClientSetUserData(MqttClient *client, void *userData)
+{
+    assert(client != NULL);
+    client->userData = userData;
+}
+
+void *MqttClientGetUserData(MqttClient *client)
+{
+    assert(client != NULL);
+    return client->userData;
+}
+
+void MqttClientSetOnConnect(MqttClient *client, MqttClientOnConnectCallback cb)
+{
+    assert(client != NULL);
+    client->onConnect = cb;
+}
+
+void MqttClientSetOnSubscribe(MqttClient *client,
+                              MqttClientOnSubscribeCallback cb)
+{
+    assert(client != NULL);
+    client->onSubscribe = cb;
+}
+
+void MqttClientSetOnUnsubscribe(MqttClient *client,
+                                MqttClientOnUnsubscribeCallback cb)
+{
+    assert(client != NULL);
+    client->onUnsubscribe = cb;
+}
+
+void MqttClientSetOnMessage(MqttClient *client,
+                            MqttClientOnMessageCallback cb)
+{
+    assert(client != NULL);
+    client->onMessage = cb;
+}
+
+void MqttClientSetOnMessageWithTopicLength(MqttClient *client,
+    MqttClientOnMessageWithTopicLengthCallback cb)
+{
+    assert(client != NULL);
+    client->onMessageWithTopicLength = cb;
+}
+
+void MqttClientSetOnPublish(MqttClient *client,
+                            MqttClientOnPublishCallback cb)
+{
+    assert(client != NULL);
+    client->onPublish = cb;
+}
+
+void MqttClientSetOnError(MqttClient *client, MqttClientOnErrorCallback cb)
+{
+    assert(client != NULL);
+    client->onError = cb;
+}
+
+void MqttClientSetOnMessageStream(MqttClient *client, size_t threshold,
+                                  MqttClientOnMessageBeginCallback begin,
+                                  MqttClientOnMessageDataCallback data,
+                                  MqttClientOnMessageEndCallback end)
+{
+    assert(client != NULL);
+    client->streamThreshold = threshold;
+    client->onMessageBegin = begin;
+    client->onMessageData = data;
+    client->onMessageEnd = end;
+}
+
+static const struct tagbstring MqttProtocolId = bsStatic("MQTT");
+static const char MqttProtocolLevel  = 0x04;
+
+static unsigned char MqttClientConnectFlags(MqttClient *client)
+{
+    unsigned char connectFlags = 0;
+
+    if (client->cleanSession)
+    {
+        connectFlags |= 0x02;
+    }
+
+    if (client->willTopic)
+    {
+        connectFlags |= 0x04;
+        connectFlags |= (client->willQos & 3) << 3;
+        connectFlags |= (client->willRetain & 1) << 5;
+    }
+
+    if (client->userName)
+    {
+        connectFlags |= 0x80;
+        if (client->password)
+        {
+            connectFlags |= 0x40;
+        }
+    }
+
+    return connectFlags;
+}
+
+static int MqttClientConnectImpl(MqttClient *client, const char *host,
+                                 short port, int keepAlive,
+                                 int cleanSession)
+{
+    int sock;
+    MqttPacket *packet;
+    size_t bodyLength;
+    unsigned char *p;
+
+    assert(client != NULL);
+    assert(host != NULL);
+
+    if (client->state != MqttClientStateDisconnected)
+    {
+        LOG_ERROR("client must be disconnected to connect");
+        return -1;
+    }
+
+    if (client->host)
+        bassigncstr(client->host, host);
+    else
+        client->host = bfromcstr(host);
+    client->port = port;
+    client->keepAlive = keepAlive;
+    client->cleanSession = cleanSession;
+
+    /* In case we are reconnecting */
+    client->stopped = 0;
+    client->pingSent = 0;
+    client->recvPending = 0;
+    MqttClientAbortRecv(client);
+    MqttClientClearQueues(client);
+
+    if (keepAlive < 0)
+    {
+        LOG_ERROR("invalid keepAlive: %d", keepAlive);
+        return -1;
+    }
+
+    LOG_DEBUG("connecting");
+
+    if ((sock = SocketConnect(host, port, 1)) == -1)
+    {
+        if (SocketErrno != SOCKET_EINPROGRESS)
+        {
+            LOG_ERROR("SocketConnect failed!");
+            return -1;
+        }
+    }
+
+    if (SocketStreamOpen(&client->stream, sock) == -1)
+    {
+        SocketDisconnect(sock);
+        return -1;
+    }
+
+    if (client->zeroCopyThreshold > 0 &&
+        SocketStreamEnableZeroCopy(&client->stream) == -1)
+    {
+        LOG_WARNING("MSG_ZEROCOPY not available, copying instead");
+    }
+
+    packet = MqttClientPacketNew(client, MqttPacketTypeConnect, 0);
+
+    if (!packet)
+        return -1;
+
+    bodyLength = MqttStringSize(blength(&MqttProtocolId)) + 1 + 1 + 2 +
+                 MqttStringSize(blength(client->clientId));
+
+    if (client->willTopic)
+    {
+        bodyLength += MqttStringSize(blength(client->willTopic)) +
+                      MqttStringSize(blength(client->willMessage));
+    }
+
+    if (client->userName)
+    {
+        bodyLength += MqttStringSize(blength(client->userName));
+        if (client->password)
+        {
+            bodyLength += MqttStringSize(blength(client->password));
+        }
+    }
+
+    if (!(p = MqttPacketAllocate(packet, bodyLength)))
+    {
+        MqttClientPacketFree(client, packet);
+        return -1;
+    }
+
+    p = MqttEncodeString(p, bdata(&MqttProtocolId), blength(&MqttProtocolId));
+    p = MqttEncodeByte(p, MqttProtocolLevel);
+    p = MqttEncodeByte(p, MqttClientConnectFlags(client));
+    p = MqttEncodeUint16Be(p, client->keepAlive);
+    p = MqttEncodeString(p, bdata(client->clientId), blength(client->clientId));
+
+    if (client->willTopic)
+    {
+        p = MqttEncodeString(p, bdata(client->willTopic),
+                             blength(client->willTopic));
+        p = MqttEncodeString(p, bdata(client->willMessage),
+                             blength(client->willMessage));
+    }
+
+    if (client->userName)
+    {
+        p = MqttEncodeString(p, bdata(client->userName),
+                             blength(client->userName));
+        if (client->password)
+        {
+            p = MqttEncodeString(p, bdata(client->password),
+                                 blength(client->password));
+        }
+    }
+
+    MqttClientQueuePacket(client, packet);
+
+    client->state = MqttClientStateConnecting;
+
+    return 0;
+}
+
+int MqttClientConnect(MqttClient *client, const char *host, short port,
+                      int keepAlive, int cleanSession)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientConnectImpl(client, host, port, keepAlive, cleanSession);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientDisconnect(MqttClient *client)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    LOG_DEBUG("disconnecting");
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientQueueSimplePacket(client, MqttPacketTypeDisconnect);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientIsConnected(MqttClient *client)
+{
+    return client->stream.sock != -1 &&
+           client->state == MqttClientStateConnected;
+}
+
+int MqttClientGetFd(MqttClient *client)
+{
+    assert(client != NULL);
+    return client->stream.sock;
+}
+
+/*
+    Returns 1 if the packets in sendQueue are held back to be sent together
+    with the ones queued after them, see MqttClientSetCoalescing. Only
+    PUBLISH packets are held, anything else is sent right away along with
+    them.
+*/
+static int MqttClientHoldSendQueue(MqttClient *client)
+{
+    MqttPacket *head = SIMPLEQ_FIRST(&client->sendQueue);
+
+    if (client->coalesceDelayUs <= 0 || client->coalesceStartUs == 0 ||
+        client->coalesceUrgent || !head || MqttPacketWriteStarted(head))
+    {
+        return 0;
+    }
+
+    if (client->coalesceMaxBytes > 0 &&
+        client->coalesceHeldBytes >= client->coalesceMaxBytes)
+    {
+        return 0;
+    }
+
+    return MqttGetCurrentTimeUs() - client->coalesceStartUs <
+        client->coalesceDelayUs;
+}
+
+static int MqttClientWantedEventsImpl(MqttClient *client)
+{
+    int events = 0;
+
+    assert(client != NULL);
+
+    if (client->stream.sock == -1)
+    {
+        return 0;
+    }
+
+    client->now = MqttGetCurrentTime();
+
+    if (client->state == MqttClientStateConnected)
+    {
+        events = EV_READ;
+
+        /* Handle outMessages and inMessages, moving queued messages to sendQueue
+           if there are less than maxInflight number of messages in flight */
+        MqttClientProcessMessageQueue(client);
+
+        if (SIMPLEQ_EMPTY(&client->sendQueue))
+        {
+            int64_t elapsed;
+
+            LOG_DEBUG("nothing to write");
+
+            // If there's nothing to write at this point and we haven't sent
+            // any packets in keepalive seconds, we should send a ping.
+
+            elapsed = client->now - client->lastPacketSentTime;
+            if (client->keepAlive > 0 && !client->pingSent &&
+                elapsed >= client->keepAlive*1000)
+            {
+                MqttClientQueueSimplePacket(client, MqttPacketTypePingReq);
+                client->pingSent = 1;
+                client->pingSentTime = client->now;
+                events |= EV_WRITE;
+            }
+        }
+        else if (!MqttClientHoldSendQueue(client))
+        {
+            events |= EV_WRITE;
+        }
+    }
+    else if (client->state == MqttClientStateConnecting)
+    {
+        events = EV_WRITE;
+    }
+
+    return events;
+}
+
+int MqttClientWantedEvents(MqttClient *client)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientWantedEventsImpl(client);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static MQTT_INLINE int64_t MqttDeadlineMin(int64_t a, int64_t b)
+{
+    if (a == -1)
+        return b;
+    if (b == -1)
+        return a;
+    return a < b ? a : b;
+}
+
+int64_t MqttClientNextDeadline(MqttClient *client)
+{
+    int64_t deadline = -1;
+    MqttMessage *msg;
+
+    assert(client != NULL);
+
+    if (client->stream.sock == -1 ||
+        client->state != MqttClientStateConnected)
+    {
+        return -1;
+    }
+
+    /* Received data is waiting to be handled right away */
+    if (client->recvPending)
+    {
+        return client->now;
+    }
+    if (client->keepAlive > 0)
+    {
+        if (client->pingSent)
+        {
+            deadline = client->pingSentTime + client->keepAlive*1000;
+        }
+        else if (SIMPLEQ_EMPTY(&client->sendQueue))
+        {
+            deadline = client->lastPacketSentTime + client->keepAlive*1000;
+        }
+    }
+
+    /* The first message to retry is always at the head */
+    if ((msg = TAILQ_FIRST(&client->retryMessages)) != NULL)
+    {
+        deadline = MqttDeadlineMin(deadline,
+                                   msg->timestamp + client->retryTimeout*1000);
+    }
+
+    /* Held packets are sent once the millisecond the delay ends in is
+       over */
+    if (client->coalesceStartUs != 0 && !SIMPLEQ_EMPTY(&client->sendQueue))
+    {
+        deadline = MqttDeadlineMin(deadline,
+            (client->coalesceStartUs + client->coalesceDelayUs + 999) / 1000);
+    }
+
+    return deadline;
+}
+
+int MqttClientNextTimeoutMs(MqttClient *client)
+{
+    int64_t deadline = MqttClientNextDeadline(client);
+    int64_t timeout;
+
+    if (deadline == -1)
+        return -1;
+
+    timeout = deadline - MqttGetCurrentTime();
+
+    if (timeout < 0)
+        return 0;
+
+    return timeout < INT_MAX ? (int) timeout : INT_MAX;
+}
+
+static int MqttClientHandleEventsImpl(MqttClient *client, int events)
+{
+    assert(client != NULL);
+
+    if (client->stream.sock == -1)
+    {
+        LOG_ERROR("invalid socket");
+        return -1;
+    }
+
+    client->now = MqttGetCurrentTime();
+
+    /* Held packets whose delay is over are sent without waiting for the
+       socket to be reported writable, which it most likely is */
+    if (client->state == MqttClientStateConnected &&
+        client->coalesceStartUs != 0 && !SIMPLEQ_EMPTY(&client->sendQueue) &&
+        !MqttClientHoldSendQueue(client))
+    {
+        events |= EV_WRITE;
+    }
+
+    if (events & EV_WRITE)
+    {
+        LOG_DEBUG("socket writable");
+
+        if (client->state == MqttClientStateConnecting)
+        {
+            int sockError;
+            SocketGetError(client->stream.sock, &sockError);
+            LOG_DEBUG("sockError: %d", sockError);
+            if (sockError == 0)
+            {
+                LOG_DEBUG("connected!");
+                client->state = MqttClientStateConnected;
+                return 0;
+            }
+        }
+
+        if (MqttClientSendPacket(client) == -1)
+        {
+            LOG_ERROR("MqttClientSendPacket failed");
+            client->stopped = 1;
+        }
+    }
+
+    if ((events & EV_READ) || client->recvPending)
+    {
+        LOG_DEBUG("socket readable");
+
+        if (MqttClientRecvPacket(client) == -1)
+        {
+            LOG_ERROR("MqttClientRecvPacket failed");
+            client->stopped = 1;
+        }
+
+        /* Send the acknowledgements for what we just received in the same
+           pass instead of waiting for the next writable event. */
+        if (!client->stopped && !SIMPLEQ_EMPTY(&client->sendQueue) &&
+            MqttClientSendPacket(client) == -1)
+        {
+            LOG_ERROR("MqttClientSendPacket failed");
+            client->stopped = 1;
+        }
+    }
+
+    if (client->pingSent &&
+        client->now - client->pingSentTime >= client->keepAlive*1000)
+    {
+        LOG_ERROR("no PINGRESP received in time");
+        client->pingSent = 0;
+        client->stopped = 1;
+    }
+
+    /* Completions of zero copy sends are read as soon as they may be
+       there, not only once a release waits for them, as poll() and epoll
+       report the socket until they are */
+    if (client->stream.zeroCopySent != client->stream.zeroCopyDone ||
+        !SIMPLEQ_EMPTY(&client->pendingReleases))
+    {
+        MqttClientFlushReleases(client, 0);
+    }
+
+    /* Checked whenever there are events to handle instead of with a
+       deadline of its own so that idle clients don't wake up for it. The
+       keepalive pings bound the delay. */
+    if (client->recvBuffer && !client->inPacket.payload &&
+        client->recvBufferIdleMs > 0 &&
+        client->now - client->lastPacketReceivedTime >=
+        client->recvBufferIdleMs)
+    {
+        bdestroy(client->recvBuffer);
+        client->recvBuffer = NULL;
+    }
+
+    if (client->stopped)
+    {
+        MqttClientClose(client);
+    }
+
+    return 0;
+}
+
+int MqttClientHandleEvents(MqttClient *client, int events)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientHandleEventsImpl(client, events);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientRunOnce(MqttClient *client, int timeout)
+{
+    int rv;
+    int events;
+    int64_t deadline;
+
+    assert(client != NULL);
+
+    if (client->stream.sock == -1)
+    {
+        LOG_ERROR("invalid socket");
+        return -1;
+    }
+
+    events = MqttClientWantedEvents(client);
+
+    if (events == 0)
+    {
+        LOG_ERROR("not connected");
+        return -1;
+    }
+
+    LOG_DEBUG("selecting");
+
+    /* Wait no longer than until the nearest retry or keepalive deadline.
+       This is also 0 if the previous call left received data unhandled. */
+    deadline = MqttClientNextDeadline(client);
+
+    if (deadline != -1)
+    {
+        int64_t untilDeadline = deadline - client->now;
+
+        if (untilDeadline < 0)
+            untilDeadline = 0;
+
+        if (timeout < 0 || untilDeadline < timeout)
+            timeout = untilDeadline < INT_MAX ? (int) untilDeadline : INT_MAX;
+    }
+    else if (timeout < 0)
+    {
+        timeout = 30 * 1000;
+    }
+
+    rv = SocketSelect(client->stream.sock, &events, timeout);
+
+    if (rv == -1)
+    {
+        LOG_ERROR("select failed");
+        return -1;
+    }
+    else if (rv == 0)
+    {
+        LOG_DEBUG("select timeout");
+    }
+
+    return MqttClientHandleEvents(client, events);
+}
+
+int MqttClientRun(MqttClient *client)
+{
+    assert(client != NULL);
+
+    while (!client->stopped)
+    {
+        if (MqttClientRunOnce(client, -1) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int MqttClientSubscribe(MqttClient *client, const char *topicFilter,
+                        int qos)
+{
+    return MqttClientSubscribeMany(client, &topicFilter, &qos, 1);
+}
+
+static int MqttClientSubscribeManyImpl(MqttClient *client,
+                                       const char **topicFilters,
+                                       int *qos, size_t count)
+{
+    MqttPacket *packet = NULL;
+    size_t i;
+    size_t bodyLength = 2;
+    unsigned char *p;
+
+    assert(client != NULL);
+    assert(topicFilters != NULL);
+    assert(*topicFilters != NULL);
+    assert(qos != NULL);
+    assert(count > 0);
+
+    packet = MqttClientPacketNew(client, MqttPacketTypeSubscribe,
+                                 MqttClientNextPacketId(client));
+
+    if (!packet)
+        return -1;
+
+    packet->flags = 0x2;
+
+    for (i = 0; i < count; ++i)
+    {
+        bodyLength += MqttStringSize(strlen(topicFilters[i])) + 1;
+    }
+
+    if (!(p = MqttPacketAllocate(packet, bodyLength)))
+    {
+        MqttClientPacketFree(client, packet);
+        return -1;
+    }
+
+    p = MqttEncodeUint16Be(p, packet->id);
+
+    LOG_DEBUG("SUBSCRIBE id:%d", (int) packet->id);
+
+    for (i = 0; i < count; ++i)
+    {
+        p = MqttEncodeString(p, topicFilters[i], strlen(topicFilters[i]));
+        p = MqttEncodeByte(p, qos[i] & 3);
+    }
+
+    MqttClientQueuePacket(client, packet);
+
+    return packet->id;
+}
+
+int MqttClientSubscribeMany(MqttClient *client, const char **topicFilters,
+                            int *qos, size_t count)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientSubscribeManyImpl(client, topicFilters, qos, count);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static int MqttClientUnsubscribeImpl(MqttClient *client,
+                                     const char *topicFilter)
+{
+    MqttPacket *packet = NULL;
+    size_t length;
+    unsigned char *p;
+
+    assert(client != NULL);
+    assert(topicFilter != NULL);
+
+    packet = MqttClientPacketNew(client, MqttPacketTypeUnsubscribe,
+                                 MqttClientNextPacketId(client));
+
+    if (!packet)
+        return -1;
+
+    packet->flags = 0x02;
+
+    length = strlen(topicFilter);
+
+    if (!(p = MqttPacketAllocate(packet, 2 + MqttStringSize(length))))
+    {
+        MqttClientPacketFree(client, packet);
+        return -1;
+    }
+
+    p = MqttEncodeUint16Be(p, packet->id);
+    p = MqttEncodeString(p, topicFilter, length);
+
+    MqttClientQueuePacket(client, packet);
+
+    return packet->id;
+}
+
+int MqttClientUnsubscribe(MqttClient *client, const char *topicFilter)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientUnsubscribeImpl(client, topicFilter);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static MqttPacket *PublishToPacket(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet = NULL;
+    size_t bodyLength;
+    unsigned char *p;
+
+    packet = MqttClientPacketNew(client, MqttPacketTypePublish,
+                                 msg->qos > 0 ? msg->id : 0);
+
+    if (!packet)
+        return NULL;
+
+    packet->message = msg;
+    packet->flags = (msg->qos & 3) << 1;
+    packet->flags |= msg->retain & 1;
+    packet->priority = msg->priority;
+
+    /* Only the first byte of a resend changes, the packet writes it apart
+       from the shared buffer, see MqttPacketPrepareWrite */
+    if (msg->dup)
+        packet->flags |= 0x08;
+
+    if (msg->encoded)
+    {
+        MqttPacketUseShared(packet, msg->encoded, msg->encodedOffset,
+                            msg->encodedSize);
+        return packet;
+    }
+
+    /* The whole packet is encoded into one exactly sized buffer, except
+       for a borrowed payload which is sent from where it is. The message
+       keeps that buffer if it may be sent again. */
+    bodyLength = MqttStringSize(blength(msg->topic)) +
+                 (msg->qos > 0 ? 2 : 0);
+
+    if (msg->producer)
+    {
+        p = MqttPacketAllocateProduced(packet,
+                                       bodyLength + msg->producedSize,
+                                       msg->producedSize);
+    }
+    else if (msg->file)
+    {
+        p = MqttPacketAllocateFile(packet, bodyLength + msg->fileSize,
+                                   msg->fd, msg->fileOffset, msg->fileSize);
+    }
+    else if (msg->userPayload)
+    {
+        p = MqttPacketAllocateExternal(packet,
+                                       bodyLength + msg->userPayloadSize,
+                                       msg->userPayload,
+                                       msg->userPayloadSize);
+    }
+    else if (msg->qos > 0)
+    {
+        p = MqttPacketAllocateShared(packet,
+                                     bodyLength + blength(msg->payload));
+    }
+    else
+    {
+        p = MqttPacketAllocate(packet, bodyLength + blength(msg->payload));
+    }
+
+    if (!p)
+    {
+        MqttClientPacketFree(client, packet);
+        return NULL;
+    }
+
+    p = MqttEncodeString(p, bdata(msg->topic), blength(msg->topic));
+
+    if (msg->qos > 0)
+    {
+        p = MqttEncodeUint16Be(p, msg->id);
+    }
+
+    if (!msg->userPayload && !msg->file && !msg->producer)
+    {
+        p = MqttEncodeBytes(p, bdata(msg->payload), blength(msg->payload));
+    }
+
+    if (packet->shared)
+    {
+        msg->encoded = MqttPacketBufferRef(packet->shared);
+        msg->encodedOffset = 0;
+        msg->encodedSize = packet->size;
+    }
+
+    return packet;
+}
+
+static int MqttClientPublishImpl(MqttClient *client, int qos,
+                                 int retain, const char *topic,
+                                 const void *data, size_t size,
+                                 int priority)
+{
+    MqttMessage *message;
+
+    /* first check if the queue is already full */
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
+    {
+        return -1;
+    }
+
+    if (qos == 0)
+    {
+        /* Copy payload and topic directly from user buffers as we don't need
+           to keep the message data around after this function. The message
+           itself only lives for the encoding too. */
+        MqttMessage tmp;
+        MqttPacket *packet;
+        struct tagbstring bttopic, btpayload;
+
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.retain = retain;
+        tmp.priority = priority;
+
+        btfromcstr(bttopic, topic);
+        tmp.topic = &bttopic;
+
+        btfromblk(btpayload, data, size);
+        tmp.payload = &btpayload;
+
+        packet = PublishToPacket(client, &tmp);
+
+        if (!packet)
+            return -1;
+
+        packet->message = NULL;
+
+        if (MqttClientQueueQos0(client, packet) == -1)
+        {
+            MqttClientPacketFree(client, packet);
+            return -1;
+        }
+
+        return 0;
+    }
+    else
+    {
+        MqttPacket *packet;
+        struct tagbstring bttopic, btpayload;
+
+        message = MqttClientMessageNew(client);
+        if (!message)
+        {
+            return -1;
+        }
+
+        message->state = MqttMessageStateQueued;
+        message->qos = qos;
+        message->retain = retain;
+        message->priority = priority;
+        message->dup = 0;
+        message->id = MqttClientNextPacketId(client);
+
+        /* The message keeps the packet encoded from the user buffers
+           instead of copies of them, and sends it as is every time. */
+        btfromcstr(bttopic, topic);
+        message->topic = &bttopic;
+
+        btfromblk(btpayload, data, size);
+        message->payload = &btpayload;
+
+        packet = PublishToPacket(client, message);
+
+        message->topic = NULL;
+        message->payload = NULL;
+
+        if (!packet)
+        {
+            MqttClientMessageFree(client, message);
+            return -1;
+        }
+
+        packet->message = NULL;
+        MqttClientPacketFree(client, packet);
+
+        if (MqttClientAddOutMessage(client, message) == -1)
+        {
+            MqttClientMessageFree(client, message);
+            return -1;
+        }
+
+        MqttLoopEntryChanged(&client->loopEntry);
+
+        return message->id;
+    }
+}
+
+int MqttClientPublish(MqttClient *client, int qos, int retain,
+                      const char *topic, const void *data, size_t size)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishImpl(client, qos, retain, topic, data, size,
+                               MqttPriorityNormal);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientPublishWithPriority(MqttClient *client, int qos, int retain,
+                                  const char *topic, const void *data,
+                                  size_t size, int priority)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishImpl(client, qos, retain, topic, data, size,
+                               priority);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+/*
+    Publishes a message whose payload lives outside of it. A QoS 0 message is
+    not tracked, its packet frees it once sent. On failure the message is
+    freed without calling release. Returns like MqttClientPublish.
+*/
+static int MqttClientPublishMessage(MqttClient *client, MqttMessage *message)
 {
-    MqttClient *client;
+    MqttPacket *packet;
 
-    client = calloc(1, sizeof(*client));
+    if (!message->topic)
+        goto error;
 
-    if (!client)
+    if (message->qos == 0)
     {
-        return NULL;
-    }
+        if (!(packet = PublishToPacket(client, message)))
+            goto error;
 
-    client->clientId = bfromcstr(clientId);
+        if (MqttClientQueueQos0(client, packet) == -1)
+        {
+            packet->message = NULL;
+            MqttClientPacketFree(client, packet);
+            goto error;
+        }
 
-    client->stream.sock = -1;
+        return 0;
+    }
 
-    client->retryTimeout = 20;
+    message->state = MqttMessageStateQueued;
+    message->id = MqttClientNextPacketId(client);
 
-    client->maxQueued = 0;
-    client->maxInflight = 20;
+    if (MqttClientAddOutMessage(client, message) == -1)
+        goto error;
 
-    client->state = MqttClientStateDisconnected;
+    MqttLoopEntryChanged(&client->loopEntry);
 
-    TAILQ_INIT(&client->outMessages);
-    TAILQ_INIT(&client->inMessages);
-    SIMPLEQ_INIT(&client->sendQueue);
+    return message->id;
 
-    return client;
+error:
+    message->release = NULL;
+    MqttClientMessageFree(client, message);
+    return -1;
 }
 
-void MqttClientFree(MqttClient *client)
+static int MqttClientPublishZeroCopyImpl(MqttClient *client, int qos,
+                                         int retain, const char *topic,
+                                         const void *data, size_t size,
+                                         MqttClientReleaseCallback release,
+                                         void *context)
 {
-    MqttClientClearQueues(client);
-
-    bdestroy(client->clientId);
-    bdestroy(client->willTopic);
-    bdestroy(client->willMessage);
-    bdestroy(client->host);
-    bdestroy(client->userName);
-    bdestroy(client->password);
+    MqttMessage *message;
 
-    if (client->stream.sock != -1)
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
     {
-        SocketDisconnect(client->stream.sock);
+        return -1;
     }
 
-    free(client);
-}
+    message = MqttClientMessageNew(client);
 
-void MqttClientSetUserData(MqttClient *client, void *userData)
-{
-    assert(client != NULL);
-    client->userData = userData;
-}
+    if (!message)
+        return -1;
 
-void *MqttClientGetUserData(MqttClient *client)
-{
-    assert(client != NULL);
-    return client->userData;
-}
+    message->qos = qos;
+    message->retain = retain;
+    message->topic = bfromcstr(topic);
+    message->userPayload = data;
+    message->userPayloadSize = size;
+    message->release = release;
+    message->releaseContext = context;
 
-void MqttClientSetOnConnect(MqttClient *client, MqttClientOnConnectCallback cb)
-{
-    assert(client != NULL);
-    client->onConnect = cb;
+    return MqttClientPublishMessage(client, message);
 }
 
-void MqttClientSetOnSubscribe(MqttClient *client,
-                              MqttClientOnSubscribeCallback cb)
+int MqttClientPublishZeroCopy(MqttClient *client, int qos, int retain,
+                              const char *topic, const void *data,
+                              size_t size, MqttClientReleaseCallback release,
+                              void *context)
 {
-    assert(client != NULL);
-    client->onSubscribe = cb;
-}
+    const MqttAllocator *previous;
+    int rv;
 
-void MqttClientSetOnUnsubscribe(MqttClient *client,
-                                MqttClientOnUnsubscribeCallback cb)
-{
     assert(client != NULL);
-    client->onUnsubscribe = cb;
-}
+    assert(data != NULL || size == 0);
 
-void MqttClientSetOnMessage(MqttClient *client,
-                            MqttClientOnMessageCallback cb)
-{
-    assert(client != NULL);
-    client->onMessage = cb;
-}
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishZeroCopyImpl(client, qos, retain, topic, data,
+                                       size, release, context);
+    MqttAllocatorLeave(previous);
 
-void MqttClientSetOnPublish(MqttClient *client,
-                            MqttClientOnPublishCallback cb)
-{
-    assert(client != NULL);
-    client->onPublish = cb;
+    return rv;
 }
 
-static const struct tagbstring MqttProtocolId = bsStatic("MQTT");
-static const char MqttProtocolLevel  = 0x04;
-
-static unsigned char MqttClientConnectFlags(MqttClient *client)
+static int MqttClientPublishFileImpl(MqttClient *client, int qos,
+                                     int retain, const char *topic, int fd,
+                                     int64_t offset, size_t length)
 {
-    unsigned char connectFlags = 0;
+    MqttMessage *message;
 
-    if (client->cleanSession)
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
     {
-        connectFlags |= 0x02;
+        return -1;
     }
 
-    if (client->willTopic)
-    {
-        connectFlags |= 0x04;
-        connectFlags |= (client->willQos & 3) << 3;
-        connectFlags |= (client->willRetain & 1) << 5;
-    }
+    message = MqttClientMessageNew(client);
 
-    if (client->userName)
+    if (!message)
+        return -1;
+
+    message->qos = qos;
+    message->retain = retain;
+
+    /* The message owns a descriptor of its own so that it can outlive fd */
+    if ((message->fd = MqttFileDup(fd)) == -1)
     {
-        connectFlags |= 0x80;
-        if (client->password)
-        {
-            connectFlags |= 0x40;
-        }
+        LOG_ERROR("failed to duplicate the file descriptor");
+        MqttClientMessageFree(client, message);
+        return -1;
     }
 
-    return connectFlags;
+    message->file = 1;
+    message->fileOffset = offset;
+    message->fileSize = length;
+    message->topic = bfromcstr(topic);
+
+    return MqttClientPublishMessage(client, message);
 }
 
-int MqttClientConnect(MqttClient *client, const char *host, short port,
-                      int keepAlive, int cleanSession)
+int MqttClientPublishFile(MqttClient *client, int qos, int retain,
+                          const char *topic, int fd, int64_t offset,
+                          size_t length)
 {
-    int sock;
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    const MqttAllocator *previous;
+    int rv;
 
     assert(client != NULL);
-    assert(host != NULL);
-
-    if (client->state != MqttClientStateDisconnected)
-    {
-        LOG_ERROR("client must be disconnected to connect");
-        return -1;
-    }
-
-    if (client->host)
-        bassigncstr(client->host, host);
-    else
-        client->host = bfromcstr(host);
-    client->port = port;
-    client->keepAlive = keepAlive;
-    client->cleanSession = cleanSession;
-
-    /* In case we are reconnecting */
-    client->stopped = 0;
-    client->pingSent = 0;
-    MqttClientClearQueues(client);
+    assert(fd != -1);
+    assert(offset >= 0);
 
-    if (keepAlive < 0)
-    {
-        LOG_ERROR("invalid keepAlive: %d", keepAlive);
-        return -1;
-    }
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishFileImpl(client, qos, retain, topic, fd, offset,
+                                   length);
+    MqttAllocatorLeave(previous);
 
-    LOG_DEBUG("connecting");
+    return rv;
+}
 
-    if ((sock = SocketConnect(host, port, 1)) == -1)
-    {
-        if (SocketErrno != SOCKET_EINPROGRESS)
-        {
-            LOG_ERROR("SocketConnect failed!");
-            return -1;
-        }
-    }
+static int MqttClientPublishStreamImpl(MqttClient *client, int qos,
+                                      int retain, const char *topic,
+                                      size_t size,
+                                      MqttClientProducerCallback read,
+                                      MqttClientReleaseCallback release,
+                                      void *context)
+{
+    MqttMessage *message;
 
-    if (SocketStreamOpen(&client->stream, sock) == -1)
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
     {
         return -1;
     }
 
-    packet = MqttPacketNew(MqttPacketTypeConnect);
+    message = MqttClientMessageNew(client);
 
-    if (!packet)
+    if (!message)
         return -1;
 
-    StringStreamInit(&ss);
-
-    StreamWriteMqttString(&MqttProtocolId, pss);
-    StreamWriteByte(MqttProtocolLevel, pss);
-    StreamWriteByte(MqttClientConnectFlags(client), pss);
-    StreamWriteUint16Be(client->keepAlive, pss);
-    StreamWriteMqttString(client->clientId, pss);
-
-    if (client->willTopic)
-    {
-        StreamWriteMqttString(client->willTopic, pss);
-        StreamWriteMqttString(client->willMessage, pss);
-    }
+    message->qos = qos;
+    message->retain = retain;
+    message->topic = bfromcstr(topic);
+    message->producer = read;
+    message->producedSize = size;
+    message->release = release;
+    message->releaseContext = context;
 
-    if (client->userName)
-    {
-        StreamWriteMqttString(client->userName, pss);
-        if(client->password)
-        {
-            StreamWriteMqttString(client->password, pss);
-        }
-    }
+    return MqttClientPublishMessage(client, message);
+}
 
-    packet->payload = ss.buffer;
+int MqttClientPublishStream(MqttClient *client, int qos, int retain,
+                            const char *topic, size_t size,
+                            MqttClientProducerCallback read,
+                            MqttClientReleaseCallback release,
+                            void *context)
+{
+    const MqttAllocator *previous;
+    int rv;
 
-    MqttClientQueuePacket(client, packet);
+    assert(client != NULL);
+    assert(read != NULL);
 
-    client->state = MqttClientStateConnecting;
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishStreamImpl(client, qos, retain, topic, size, read,
+                                     release, context);
+    MqttAllocatorLeave(previous);
 
-    return 0;
+    return rv;
 }
 
-int MqttClientDisconnect(MqttClient *client)
+int MqttClientPublishCString(MqttClient *client, int qos, int retain,
+                             const char *topic, const char *msg)
 {
-    LOG_DEBUG("disconnecting");
-    return MqttClientQueueSimplePacket(client, MqttPacketTypeDisconnect);
+    return MqttClientPublish(client, qos, retain, topic, msg, strlen(msg));
 }
 
-int MqttClientIsConnected(MqttClient *client)
+/* Returns the size of the body of the PUBLISH of spec. */
+static MQTT_INLINE size_t MqttPublishSpecBodyLength(const MqttPublishSpec *spec)
 {
-    return client->stream.sock != -1 &&
-           client->state == MqttClientStateConnected;
+    return MqttStringSize(strlen(spec->topic)) + (spec->qos > 0 ? 2 : 0) +
+        spec->size;
 }
 
-int MqttClientRunOnce(MqttClient *client, int timeout)
+static int MqttClientPublishManyImpl(MqttClient *client,
+                                     const MqttPublishSpec *specs,
+                                     size_t count, int *ids)
 {
-    int rv;
-    int events = 0;
-
-    assert(client != NULL);
-
-    if (client->stream.sock == -1)
-    {
-        LOG_ERROR("invalid socket");
-        return -1;
-    }
+    MqttPacketBuffer *buffer;
+    size_t tracked = 0;
+    size_t total = 0;
+    size_t qos0Count = 0;
+    size_t qos0Bytes = 0;
+    size_t bodyLength;
+    size_t size;
+    size_t i;
+    unsigned char *p;
 
-    if (client->state == MqttClientStateConnected)
+    for (i = 0; i < count; ++i)
     {
-        events = EV_READ;
+        assert(specs[i].topic != NULL);
+        assert(specs[i].data != NULL || specs[i].size == 0);
 
-        /* Handle outMessages and inMessages, moving queued messages to sendQueue
-           if there are less than maxInflight number of messages in flight */
-        MqttClientProcessMessageQueue(client);
+        bodyLength = MqttPublishSpecBodyLength(&specs[i]);
 
-        if (SIMPLEQ_EMPTY(&client->sendQueue))
+        if (specs[i].qos < 0 || specs[i].qos > 2 ||
+            strlen(specs[i].topic) > 0xFFFF ||
+            bodyLength > MQTT_MAX_REMAINING_LENGTH)
         {
-            int64_t elapsed;
-
-            LOG_DEBUG("nothing to write");
+            LOG_ERROR("invalid message %lu", (unsigned long) i);
+            return -1;
+        }
 
-            // If there's nothing to write at this point and we haven't sent
-            // any packets in keepalive seconds, we should send a ping.
+        size = MqttPacketHeaderSize(bodyLength) + bodyLength;
 
-            elapsed = MqttGetCurrentTime() - client->lastPacketSentTime;
-            if (client->keepAlive > 0 && elapsed >= client->keepAlive*1000)
-            {
-                MqttClientQueueSimplePacket(client, MqttPacketTypePingReq);
-                client->pingSent = 1;
-                events |= EV_WRITE;
-            }
+        if (specs[i].qos > 0)
+        {
+            ++tracked;
         }
         else
         {
-            events |= EV_WRITE;
+            ++qos0Count;
+            qos0Bytes += size;
         }
+
+        total += size;
     }
-    else if (client->state == MqttClientStateConnecting)
+
+    /* All or nothing, so that the caller doesn't have to find out which
+       messages were left out */
+    if (tracked > 0 && client->maxQueued > 0 &&
+        (size_t) MqttClientOutMessagesLen(client) + tracked >
+        (size_t) client->maxQueued)
     {
-        events = EV_WRITE;
+        return -1;
     }
-    else
+
+    if (qos0Count > 0 && client->qos0Policy == MqttQueuePolicyBlock &&
+        !MqttClientQos0Fits(client, qos0Count, qos0Bytes))
     {
-        LOG_ERROR("not connected");
         return -1;
     }
 
-    LOG_DEBUG("selecting");
+    if (count == 0)
+        return 0;
 
-    if (timeout < 0)
+    if (!(buffer = MqttPacketBufferNew(total)))
+        return -1;
+
+    p = buffer->data;
+
+    for (i = 0; i < count; ++i)
     {
-        timeout = client->keepAlive * 1000;
-        if (timeout == 0)
+        const MqttPublishSpec *spec = &specs[i];
+        int flags = ((spec->qos & 3) << 1) | (spec->retain & 1);
+        unsigned char *start = p;
+        MqttMessage *message = NULL;
+        MqttPacket *packet = NULL;
+        uint16_t id = 0;
+
+        if (spec->qos > 0)
         {
-            timeout = 30 * 1000;
+            if (!(message = MqttClientMessageNew(client)))
+                break;
+            id = MqttClientNextPacketId(client);
+        }
+        else if (!(packet = MqttClientPacketNew(client, MqttPacketTypePublish,
+                                                0)))
+        {
+            break;
         }
-    }
-    else if (timeout > (client->keepAlive * 1000) && client->keepAlive > 0)
-    {
-        timeout = client->keepAlive * 1000;
-    }
 
-    rv = SocketSelect(client->stream.sock, &events, timeout);
+        bodyLength = MqttPublishSpecBodyLength(spec);
 
-    if (rv == -1)
-    {
-        LOG_ERROR("select failed");
-        return -1;
-    }
-    else if (rv)
-    {
-        LOG_DEBUG("select rv=%d", rv);
+        p = MqttEncodeFixedHeader(p, MqttPacketTypePublish, flags,
+                                  bodyLength);
+        p = MqttEncodeString(p, spec->topic, strlen(spec->topic));
 
-        if (events & EV_WRITE)
-        {
-            LOG_DEBUG("socket writable");
+        if (spec->qos > 0)
+            p = MqttEncodeUint16Be(p, id);
 
-            if (client->state == MqttClientStateConnecting)
-            {
-                int sockError;
-                SocketGetError(client->stream.sock, &sockError);
-                LOG_DEBUG("sockError: %d", sockError);
-                if (sockError == 0)
-                {
-                    LOG_DEBUG("connected!");
-                    client->state = MqttClientStateConnected;
-                    return 0;
-                }
-            }
+        p = MqttEncodeBytes(p, spec->data, spec->size);
 
-            if (MqttClientSendPacket(client) == -1)
+        if (packet)
+        {
+            /* A QoS 0 message is sent right away like in MqttClientPublish */
+            packet->flags = flags;
+            packet->priority = spec->priority;
+            MqttPacketUseShared(packet, buffer, start - buffer->data,
+                                p - start);
+            if (MqttClientQueueQos0(client, packet) == -1)
             {
-                LOG_ERROR("MqttClientSendPacket failed");
-                client->stopped = 1;
+                MqttClientPacketFree(client, packet);
+                break;
             }
         }
-
-        if (events & EV_READ)
+        else
         {
-            LOG_DEBUG("socket readable");
-
-            if (MqttClientRecvPacket(client) == -1)
+            message->state = MqttMessageStateQueued;
+            message->qos = spec->qos;
+            message->retain = spec->retain;
+            message->priority = spec->priority;
+            message->id = id;
+            message->encoded = MqttPacketBufferRef(buffer);
+            message->encodedOffset = start - buffer->data;
+            message->encodedSize = p - start;
+
+            if (MqttClientAddOutMessage(client, message) == -1)
             {
-                LOG_ERROR("MqttClientRecvPacket failed");
-                client->stopped = 1;
+                MqttClientMessageFree(client, message);
+                break;
             }
         }
-    }
-    else
-    {
-        LOG_DEBUG("select timeout");
 
-        if (client->pingSent)
-        {
-            LOG_ERROR("no PINGRESP received in time");
-            client->pingSent = 0;
-            client->stopped = 1;
-        }
+        if (ids)
+            ids[i] = id;
     }
 
-    if (client->stopped)
+    /* The messages and packets hold the references from now on */
+    MqttPacketBufferUnref(buffer);
+
+    if (tracked > 0)
+        MqttLoopEntryChanged(&client->loopEntry);
+
+    if (i < count)
     {
-        SocketDisconnect(client->stream.sock);
-        client->stream.sock = -1;
+        LOG_ERROR("published %lu of %lu messages", (unsigned long) i,
+                  (unsigned long) count);
     }
 
-    return 0;
+    return i > 0 ? (int) i : -1;
 }
 
-int MqttClientRun(MqttClient *client)
+int MqttClientPublishMany(MqttClient *client, const MqttPublishSpec *specs,
+                          size_t count, int *ids)
 {
+    const MqttAllocator *previous;
+    int rv;
+
     assert(client != NULL);
+    assert(specs != NULL || count == 0);
 
-    while (!client->stopped)
-    {
-        if (MqttClientRunOnce(client, -1) == -1)
-            return -1;
-    }
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishManyImpl(client, specs, count, ids);
+    MqttAllocatorLeave(previous);
 
-    return 0;
+    return rv;
 }
 
-int MqttClientSubscribe(MqttClient *client, const char *topicFilter,
-                        int qos)
+void MqttClientSetZeroCopyThreshold(MqttClient *client, size_t size)
 {
-    return MqttClientSubscribeMany(client, &topicFilter, &qos, 1);
+    assert(client != NULL);
+    client->zeroCopyThreshold = size;
 }
 
-int MqttClientSubscribeMany(MqttClient *client, const char **topicFilters,
-                            int *qos, size_t count)
+void MqttClientSetPublishRetryTimeout(MqttClient *client, int timeout)
 {
-    MqttPacket *packet = NULL;
-    size_t i;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    assert(client != NULL);
+    client->retryTimeout = timeout;
+}
 
+void MqttClientSetMaxMessagesInflight(MqttClient *client, int max)
+{
     assert(client != NULL);
-    assert(topicFilters != NULL);
-    assert(*topicFilters != NULL);
-    assert(qos != NULL);
-    assert(count > 0);
+    client->maxInflight = max;
+}
 
-    packet = MqttPacketWithIdNew(MqttPacketTypeSubscribe,
-                                 MqttClientNextPacketId(client));
+void MqttClientSetMaxQueuedMessages(MqttClient *client, int max)
+{
+    assert(client != NULL);
+    client->maxQueued = max;
+}
 
-    if (!packet)
-        return -1;
+void MqttClientSetRecvBudget(MqttClient *client, int maxPackets,
+                             int maxTimeUs)
+{
+    assert(client != NULL);
+    client->recvBudgetPackets = maxPackets > 0 ? maxPackets : 0;
+    client->recvBudgetUs = maxTimeUs > 0 ? maxTimeUs : 0;
+}
 
-    packet->flags = 0x2;
+void MqttClientSetPoolLimit(MqttClient *client, int max)
+{
+    const MqttAllocator *previous;
+    assert(client != NULL);
+    client->poolLimit = max > 0 ? max : 0;
+    previous = MqttAllocatorEnter(client->allocator);
+    MqttClientTrimPools(client, client->poolLimit);
+    MqttAllocatorLeave(previous);
+}
 
-    StringStreamInit(&ss);
+void MqttClientSetMaxPacketSize(MqttClient *client, size_t max, int discard)
+{
+    assert(client != NULL);
+    client->maxPacketSize = max;
+    client->discardTooLarge = discard;
+}
 
-    StreamWriteUint16Be(packet->id, pss);
+void MqttClientSetRecvBufferPolicy(MqttClient *client, size_t keep,
+                                   int idleMs)
+{
+    assert(client != NULL);
+    client->recvBufferKeep = keep;
+    client->recvBufferIdleMs = idleMs;
+}
 
-    LOG_DEBUG("SUBSCRIBE id:%d", (int) packet->id);
+void MqttClientSetCoalescing(MqttClient *client, int delayUs,
+                             size_t maxBytes)
+{
+    assert(client != NULL);
+    client->coalesceDelayUs = delayUs > 0 ? delayUs : 0;
+    client->coalesceMaxBytes = maxBytes;
+    MqttLoopEntryChanged(&client->loopEntry);
+}
 
-    for (i = 0; i < count; ++i)
-    {
-        struct tagbstring filter;
-        btfromcstr(filter, topicFilters[i]);
-        StreamWriteMqttString(&filter, pss);
-        StreamWriteByte(qos[i] & 3, pss);
-    }
+void MqttClientSetQos0Limit(MqttClient *client, size_t maxCount,
+                            size_t maxBytes, int policy)
+{
+    assert(client != NULL);
+    client->qos0MaxCount = maxCount;
+    client->qos0MaxBytes = maxBytes;
+    client->qos0Policy = policy;
+}
 
-    packet->payload = ss.buffer;
+void MqttClientGetStats(MqttClient *client, MqttClientStats *stats)
+{
+    assert(client != NULL);
+    assert(stats != NULL);
 
-    MqttClientQueuePacket(client, packet);
+    memset(stats, 0, sizeof(*stats));
 
-    return packet->id;
+    stats->recvBufferSize = client->recvBuffer ?
+        (size_t) client->recvBuffer->mlen : 0;
+    stats->recvBufferPeak = client->recvBufferPeak;
+    stats->packetsTooLarge = client->packetsTooLarge;
+    stats->coalesceFlushes = client->coalesceFlushes;
+    stats->coalesceDelayTotalUs = client->coalesceDelayTotalUs;
+    stats->coalesceDelayMaxUs = client->coalesceDelayMaxUs;
+    stats->qos0Queued = client->qos0Queued;
+    stats->qos0QueuedBytes = client->qos0QueuedBytes;
+    stats->qos0Dropped = client->qos0Dropped;
+    stats->qos0DroppedBytes = client->qos0DroppedBytes;
 }
 
-int MqttClientUnsubscribe(MqttClient *client, const char *topicFilter)
+void MqttClientShrinkPools(MqttClient *client)
 {
-    MqttPacket *packet = NULL;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-    struct tagbstring filter;
-
+    const MqttAllocator *previous;
     assert(client != NULL);
-    assert(topicFilter != NULL);
+    previous = MqttAllocatorEnter(client->allocator);
+    MqttClientTrimPools(client, 0);
+    MqttAllocatorLeave(previous);
+}
 
-    packet = MqttPacketWithIdNew(MqttPacketTypeUnsubscribe,
-                                 MqttClientNextPacketId(client));
+static int MqttClientSetWillImpl(MqttClient *client,
+                                 const char *topic,
+                                 const void *msg, size_t size,
+                                 int qos, int retain)
+{
+    assert(client != NULL);
 
-    if (!packet)
+    if (client->stream.sock != -1)
+    {
+        LOG_ERROR("MqttClientSetWill must be called before MqttClientConnect");
         return -1;
+    }
 
-    packet->flags = 0x02;
-
-    StringStreamInit(&ss);
-
-    StreamWriteUint16Be(packet->id, pss);
+    client->willTopic = bfromcstr(topic);
+    client->willMessage = blk2bstr(msg, size);
+    client->willQos = qos;
+    client->willRetain = retain;
 
-    btfromcstr(filter, topicFilter);
+    return 0;
+}
 
-    StreamWriteMqttString(&filter, pss);
+int MqttClientSetWill(MqttClient *client, const char *topic, const void *msg,
+                      size_t size, int qos, int retain)
+{
+    const MqttAllocator *previous;
+    int rv;
 
-    packet->payload = ss.buffer;
+    assert(client != NULL);
 
-    MqttClientQueuePacket(client, packet);
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientSetWillImpl(client, topic, msg, size, qos, retain);
+    MqttAllocatorLeave(previous);
 
-    return packet->id;
+    return rv;
 }
 
-static MQTT_INLINE int MqttClientOutMessagesLen(MqttClient *client)
+static int MqttClientSetAuthImpl(MqttClient *client, const char *userName,
+                                 const char *password)
 {
-    MqttMessage *msg;
-    int count = 0;
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
+    assert(client != NULL);
+
+    if (client->state == MqttClientStateConnecting)
     {
-        ++count;
+        LOG_ERROR("MqttClientSetAuth must be called before MqttClientConnect");
+        return -1;
     }
-    return count;
-}
-
-static MqttPacket *PublishToPacket(MqttMessage *msg)
-{
-    MqttPacket *packet = NULL;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
 
-    if (msg->qos > 0)
+    if (userName)
     {
-        packet = MqttPacketWithIdNew(MqttPacketTypePublish,
-                                     msg->id);
+        if (client->userName)
+            bassigncstr(client->userName, userName);
+        else
+            client->userName = bfromcstr(userName);
+
+        if (password)
+        {
+            if (client->password)
+                bassigncstr(client->password, password);
+            else
+                client->password = bfromcstr(password);
+        }
+        else
+        {
+            bdestroy(client->password);
+            client->password = NULL;
+        }
     }
     else
     {
-        packet = MqttPacketNew(MqttPacketTypePublish);
+        bdestroy(client->userName);
+        client->userName = NULL;
+
+        bdestroy(client->password);
+        client->password = NULL;
     }
 
-    if (!packet)
-        return NULL;
+    return 0;
+}
 
-    packet->message = msg;
+int MqttClientSetAuth(MqttClient *client, const char *userName,
+                      const char *password)
+{
+    const MqttAllocator *previous;
+    int rv;
 
-    StringStreamInit(&ss);
+    assert(client != NULL);
 
-    StreamWriteMqttString(msg->topic, pss);
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientSetAuthImpl(client, userName, password);
+    MqttAllocatorLeave(previous);
 
-    if (msg->qos > 0)
-    {
-        StreamWriteUint16Be(msg->id, pss);
-    }
+    return rv;
+}
 
-    StreamWrite(bdata(msg->payload), blength(msg->payload), pss);
+/* Returns the lane of sendQueue the packet goes to. */
+static int MqttClientSendLane(const MqttPacket *packet)
+{
+    if (packet->type == MqttPacketTypeDisconnect)
+        return MqttSendLaneDisconnect;
 
-    packet->payload = ss.buffer;
-    packet->flags = (msg->qos & 3) << 1;
-    packet->flags |= msg->retain & 1;
+    if (packet->type != MqttPacketTypePublish)
+        return MqttSendLaneControl;
 
-    return packet;
-}
+    if (packet->priority > MqttPriorityNormal)
+        return MqttSendLaneHigh;
 
-int MqttClientPublish(MqttClient *client, int qos, int retain,
-                      const char *topic, const void *data, size_t size)
-{
-    MqttMessage *message;
+    if (packet->priority < MqttPriorityNormal)
+        return MqttSendLaneLow;
 
-    /* first check if the queue is already full */
-    if (qos > 0 && client->maxQueued > 0 &&
-        MqttClientOutMessagesLen(client) >= client->maxQueued)
+    switch ((packet->flags >> 1) & 3)
     {
-        return -1;
+        case 2: return MqttSendLaneQos2;
+        case 1: return MqttSendLaneQos1;
+        default: return MqttSendLaneQos0;
     }
+}
 
-    message = calloc(1, sizeof(*message));
-    if (!message)
+static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet)
+{
+    MqttPacket *head = SIMPLEQ_FIRST(&client->sendQueue);
+    MqttPacket *after = NULL;
+    int lane;
+
+    assert(client != NULL);
+    LOG_DEBUG("queuing packet %s", MqttPacketName(packet->type));
+    if (packet->message)
+        ++packet->message->queuedPackets;
+    MqttPacketPrepareWrite(packet);
+    if (client->coalesceDelayUs > 0)
     {
-        return -1;
+        if (client->coalesceStartUs == 0)
+            client->coalesceStartUs = MqttGetCurrentTimeUs();
+        client->coalesceHeldBytes += packet->remainingLength +
+            packet->streamSize;
+        if (packet->type != MqttPacketTypePublish)
+            client->coalesceUrgent = 1;
     }
 
-    message->state = MqttMessageStateQueued;
-    message->qos = qos;
-    message->retain = retain;
-    message->dup = 0;
-    message->timestamp = MqttGetCurrentTime();
-
-    if (qos == 0)
+    /* A partly written head has to be finished first, whatever its lane */
+    if (head && MqttPacketWriteStarted(head) &&
+        client->sendLaneTails[head->lane] == head)
     {
-        /* Copy payload and topic directly from user buffers as we don't need
-           to keep the message data around after this function. */
-        MqttPacket *packet;
-        struct tagbstring bttopic, btpayload;
-
-        btfromcstr(bttopic, topic);
-        message->topic = &bttopic;
-
-        btfromblk(btpayload, data, size);
-        message->payload = &btpayload;
-
-        packet = PublishToPacket(message);
+        client->sendLaneTails[head->lane] = NULL;
+    }
 
-        message->topic = NULL;
-        message->payload = NULL;
+    /* The packet goes after the last one of its lane or of the closest
+       lane before it */
+    packet->lane = MqttClientSendLane(packet);
 
-        MqttClientQueuePacket(client, packet);
+    for (lane = packet->lane; lane >= 0 && !after; --lane)
+        after = client->sendLaneTails[lane];
 
-        MqttMessageFree(message);
+    if (!after && head && MqttPacketWriteStarted(head))
+        after = head;
 
-        return 0;
-    }
+    if (after)
+        SIMPLEQ_INSERT_AFTER(&client->sendQueue, after, packet, sendQueue);
     else
-    {
-        /* Duplicate the user buffers as we need the data to be available
-           longer. */
-        message->topic = bfromcstr(topic);
-        message->payload = blk2bstr(data, size);
-
-        message->id = MqttClientNextPacketId(client);
+        SIMPLEQ_INSERT_HEAD(&client->sendQueue, packet, sendQueue);
 
-        TAILQ_INSERT_TAIL(&client->outMessages, message, chain);
+    client->sendLaneTails[packet->lane] = packet;
 
-        return message->id;
-    }
+    MqttLoopEntryChanged(&client->loopEntry);
 }
 
-int MqttClientPublishCString(MqttClient *client, int qos, int retain,
-                             const char *topic, const char *msg)
+/* Removes the packet, which follows prev or is the head if prev is NULL,
+   from sendQueue. */
+static void MqttClientUnqueuePacket(MqttClient *client, MqttPacket *prev,
+                                    MqttPacket *packet)
 {
-    return MqttClientPublish(client, qos, retain, topic, msg, strlen(msg));
-}
+    if (packet->queuedSize > 0)
+    {
+        --client->qos0Queued;
+        client->qos0QueuedBytes -= packet->queuedSize;
+        packet->queuedSize = 0;
+    }
 
-void MqttClientSetPublishRetryTimeout(MqttClient *client, int timeout)
-{
-    assert(client != NULL);
-    client->retryTimeout = timeout;
-}
+    if (client->sendLaneTails[packet->lane] == packet)
+    {
+        client->sendLaneTails[packet->lane] =
+            prev && prev->lane == packet->lane ? prev : NULL;
+    }
 
-void MqttClientSetMaxMessagesInflight(MqttClient *client, int max)
-{
-    assert(client != NULL);
-    client->maxInflight = max;
+    if (prev)
+        SIMPLEQ_REMOVE_AFTER(&client->sendQueue, prev, sendQueue);
+    else
+        SIMPLEQ_REMOVE_HEAD(&client->sendQueue, sendQueue);
 }
 
-void MqttClientSetMaxQueuedMessages(MqttClient *client, int max)
+/* Returns 1 if count more QoS 0 packets of size bytes in total fit in the
+   limits. */
+static int MqttClientQos0Fits(MqttClient *client, size_t count, size_t size)
 {
-    assert(client != NULL);
-    client->maxQueued = max;
+    return (client->qos0MaxCount == 0 ||
+            client->qos0Queued + count <= client->qos0MaxCount) &&
+           (client->qos0MaxBytes == 0 ||
+            client->qos0QueuedBytes + size <= client->qos0MaxBytes);
 }
 
-int MqttClientSetWill(MqttClient *client, const char *topic, const void *msg,
-                      size_t size, int qos, int retain)
+/* Returns 1 if a QoS 0 packet of size bytes would fit in the limits once
+   the queued QoS 0 packets that can be dropped were. */
+static int MqttClientQos0FitsAlone(MqttClient *client, size_t size)
 {
-    assert(client != NULL);
-
-    if (client->stream.sock != -1)
-    {
-        LOG_ERROR("MqttClientSetWill must be called before MqttClientConnect");
-        return -1;
-    }
+    MqttPacket *head = SIMPLEQ_FIRST(&client->sendQueue);
+    size_t count = 1;
 
-    client->willTopic = bfromcstr(topic);
-    client->willMessage = blk2bstr(msg, size);
-    client->willQos = qos;
-    client->willRetain = retain;
+    /* Only the head can have started to be sent */
+    if (head && head->queuedSize > 0 && MqttPacketWriteStarted(head))
+    {
+        ++count;
+        size += head->queuedSize;
+    }
 
-    return 0;
+    return (client->qos0MaxCount == 0 || count <= client->qos0MaxCount) &&
+           (client->qos0MaxBytes == 0 || size <= client->qos0MaxBytes);
 }
 
-int MqttClientSetAuth(MqttClient *client, const char *userName,
-                      const char *password)
+/* Counts and frees a QoS 0 packet that is not sent, see
+   MqttClientSetQos0Limit. */
+static void MqttClientDropQos0(MqttClient *client, MqttPacket *packet,
+                               size_t size)
 {
-    assert(client != NULL);
+    ++client->qos0Dropped;
+    client->qos0DroppedBytes += size;
 
-    if (client->state == MqttClientStateConnecting)
+    /* The message of a QoS 0 packet belongs to it and gives a borrowed
+       payload back */
+    if (packet->message)
     {
-        LOG_ERROR("MqttClientSetAuth must be called before MqttClientConnect");
-        return -1;
+        MqttClientMessageFree(client, packet->message);
+        packet->message = NULL;
     }
 
-    if (userName)
+    MqttClientPacketFree(client, packet);
+}
+
+/*
+    Drops the oldest QoS 0 packets of a lane of sendQueue that haven't
+    started to be sent until a packet of size bytes fits in the limits.
+*/
+static void MqttClientDropOldestQos0(MqttClient *client, int lane,
+                                     size_t size)
+{
+    MqttPacket *prev = NULL;
+    MqttPacket *queued;
+    MqttPacket *next;
+    int before;
+
+    /* The lane follows the last packet of the lanes before it */
+    for (before = lane - 1; before >= 0 && !prev; --before)
+        prev = client->sendLaneTails[before];
+
+    queued = prev ? SIMPLEQ_NEXT(prev, sendQueue) :
+        SIMPLEQ_FIRST(&client->sendQueue);
+
+    while (queued && !MqttClientQos0Fits(client, 1, size))
     {
-        if (client->userName)
-            bassigncstr(client->userName, userName);
-        else
-            client->userName = bfromcstr(userName);
+        next = SIMPLEQ_NEXT(queued, sendQueue);
 
-        if (password)
+        if (queued->lane == lane && queued->queuedSize > 0 &&
+            !MqttPacketWriteStarted(queued))
         {
-            if (client->password)
-                bassigncstr(client->password, password);
-            else
-                client->password = bfromcstr(password);
+            size_t queuedSize = queued->queuedSize;
+            MqttClientUnqueuePacket(client, prev, queued);
+            if (queued->message)
+                --queued->message->queuedPackets;
+            MqttClientDropQos0(client, queued, queuedSize);
+        }
+        else if (queued->lane > lane && !MqttPacketWriteStarted(queued))
+        {
+            /* Past the lane, only a packet being written at the head is
+               out of order */
+            break;
         }
         else
         {
-            bdestroy(client->password);
-            client->password = NULL;
+            prev = queued;
         }
+
+        queued = next;
     }
-    else
+}
+
+/*
+    Queues a QoS 0 PUBLISH within the limits of MqttClientSetQos0Limit or
+    drops it or older ones. Returns -1, leaving the packet to the caller, if
+    it doesn't fit and the policy is MqttQueuePolicyBlock.
+*/
+static int MqttClientQueueQos0(MqttClient *client, MqttPacket *packet)
+{
+    size_t size = packet->size + packet->externalSize + packet->streamSize;
+    uint64_t dropped = client->qos0Dropped;
+
+    if (!MqttClientQos0Fits(client, 1, size))
     {
-        bdestroy(client->userName);
-        client->userName = NULL;
+        if (client->qos0Policy == MqttQueuePolicyBlock)
+            return -1;
 
-        bdestroy(client->password);
-        client->password = NULL;
+        /* Nothing is dropped for a packet that can't fit anyway */
+        if (client->qos0Policy == MqttQueuePolicyDropOldest &&
+            MqttClientQos0FitsAlone(client, size))
+        {
+            /* The lanes QoS 0 packets can be in, lowest priority first */
+            static const int lanes[] = {
+                MqttSendLaneLow, MqttSendLaneQos0, MqttSendLaneHigh
+            };
+            size_t i;
+
+            for (i = 0; i < sizeof(lanes) / sizeof(lanes[0]) &&
+                 !MqttClientQos0Fits(client, 1, size); ++i)
+            {
+                MqttClientDropOldestQos0(client, lanes[i], size);
+            }
+        }
+
+        if (!MqttClientQos0Fits(client, 1, size))
+        {
+            MqttClientDropQos0(client, packet, size);
+            packet = NULL;
+        }
+
+        LOG_DEBUG("dropped %lu QoS 0 messages",
+                  (unsigned long) (client->qos0Dropped - dropped));
     }
 
-    return 0;
-}
+    if (packet)
+    {
+        MqttClientQueuePacket(client, packet);
+        packet->queuedSize = size;
+        ++client->qos0Queued;
+        client->qos0QueuedBytes += size;
+    }
 
-static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet)
-{
-    assert(client != NULL);
-    LOG_DEBUG("queuing packet %s", MqttPacketName(packet->type));
-    packet->state = MqttPacketStateWriteType;
-    SIMPLEQ_INSERT_TAIL(&client->sendQueue, packet, sendQueue);
+    /* Called last, the callback may publish again */
+    if (client->qos0Dropped != dropped && client->onError)
+        client->onError(client, MqttErrorQos0Dropped);
+
+    return 0;
 }
 
 static int MqttClientQueueSimplePacket(MqttClient *client, int type)
 {
-    MqttPacket *packet = MqttPacketNew(type);
+    MqttPacket *packet = MqttClientPacketNew(client, type, 0);
     if (!packet)
         return -1;
+    MqttPacketAllocate(packet, 0);
     MqttClientQueuePacket(client, packet);
     return 0;
 }
 
+static void MqttClientPacketSent(MqttClient *client, MqttPacket *packet)
+{
+    client->lastPacketSentTime = client->now;
+
+    if (packet->type == MqttPacketTypeDisconnect)
+    {
+        client->stopped = 1;
+        client->state = MqttClientStateDisconnected;
+    }
+
+    LOG_DEBUG("sent %s", MqttPacketName(packet->type));
+
+    if (packet->type == MqttPacketTypePublish && packet->message &&
+        packet->message->state == MqttMessageStatePublish)
+    {
+        MqttMessage *msg = packet->message;
+
+        if (msg->qos == 1)
+        {
+            msg->state = MqttMessageStateWaitPubAck;
+        }
+        else if (msg->qos == 2)
+        {
+            msg->state = MqttMessageStateWaitPubRec;
+        }
+    }
+
+    /* Everything sent with a message is acknowledged so start the retry
+       timer of the message. A QoS 0 message (from
+       MqttClientPublishZeroCopy) is done once sent. */
+    if (packet->message)
+    {
+        --packet->message->queuedPackets;
+        if (packet->message->qos == 0)
+            MqttClientMessageFree(client, packet->message);
+        else
+            MqttClientArmRetry(client, packet->message,
+                               client->lastPacketSentTime);
+    }
+
+    MqttClientUnqueuePacket(client, NULL, packet);
+
+    MqttClientPacketFree(client, packet);
+}
+
 static int MqttClientSendPacket(MqttClient *client)
 {
     MqttPacket *packet;
 
-    packet = SIMPLEQ_FIRST(&client->sendQueue);
-
-    if (!packet)
+    if (SIMPLEQ_EMPTY(&client->sendQueue))
     {
         LOG_WARNING("MqttClientSendPacket called with no queued packets");
         return 0;
     }
 
-    while (packet != NULL)
-    {
-        switch (packet->state)
-        {
-            case MqttPacketStateWriteType:
-            {
-                unsigned char typeAndFlags = ((packet->type & 0x0F) << 4) |
-                                             (packet->flags & 0x0F);
+    if (MqttClientHoldSendQueue(client))
+        return 0;
 
-                if (StreamWriteByte(typeAndFlags, &client->stream.base) == -1)
-                {
-                    if (SocketWouldBlock(SocketErrno))
-                        return 0;
-                    return -1;
-                }
+    /* Everything queued so far goes out now, the next packet starts a new
+       delay */
+    if (client->coalesceStartUs != 0)
+    {
+        uint64_t delay = (uint64_t) (MqttGetCurrentTimeUs() -
+                                     client->coalesceStartUs);
+        ++client->coalesceFlushes;
+        client->coalesceDelayTotalUs += delay;
+        if (delay > client->coalesceDelayMaxUs)
+            client->coalesceDelayMaxUs = delay;
+        client->coalesceStartUs = 0;
+        client->coalesceHeldBytes = 0;
+        client->coalesceUrgent = 0;
+    }
 
-                packet->state = MqttPacketStateWriteRemainingLength;
-                packet->remainingLength = blength(packet->payload);
+    /* Nothing is sent after DISCONNECT or a fatal error */
+    while (!client->stopped && !SIMPLEQ_EMPTY(&client->sendQueue))
+    {
+        StreamIoVec iov[STREAM_IOV_MAX];
+        int iovcnt = 0;
+        MqttPacket *zeroCopy = NULL;
+        MqttPacket *payload = NULL;
+        uint32_t zeroCopyId = client->stream.zeroCopySent;
+        int64_t total = 0;
+        int64_t nwritten;
+        size_t left;
+        int i, n;
+
+        /* Gather the unwritten parts of as many queued packets as fit */
+        SIMPLEQ_FOREACH(packet, &client->sendQueue, sendQueue)
+        {
+            if (iovcnt == STREAM_IOV_MAX)
+                break;
 
+            /* A payload from a file or a producer is sent on its own once
+               the rest of its packet has been written */
+            if (packet->state == MqttPacketStateWritePayload)
+            {
+                if (iovcnt == 0)
+                    payload = packet;
                 break;
             }
 
-            case MqttPacketStateWriteRemainingLength:
+            if (client->stream.zeroCopy && client->zeroCopyThreshold > 0 &&
+                packet->externalSize >= client->zeroCopyThreshold)
             {
-                if (StreamWriteRemainingLength(&packet->remainingLength,
-                                               &client->stream.base) == -1)
+                /* MSG_ZEROCOPY covers every buffer of the send but only the
+                   borrowed payload stays unchanged until the kernel is done,
+                   so it goes alone and the rest is copied as usual. */
+                if (packet->remainingLength > packet->externalSize)
                 {
-                    if (SocketWouldBlock(SocketErrno))
-                        return 0;
-                    return -1;
+                    iovcnt += MqttPacketWriteIov(packet, iov + iovcnt, 1);
+                }
+                else if (iovcnt == 0)
+                {
+                    iovcnt = MqttPacketWriteIov(packet, iov, 1);
+                    zeroCopy = packet;
                 }
-
-                packet->state = MqttPacketStateWritePayload;
-                packet->remainingLength = blength(packet->payload);
-
                 break;
             }
 
-            case MqttPacketStateWritePayload:
-            {
-                if (packet->payload)
-                {
-                    int64_t offset = blength(packet->payload) - packet->remainingLength;
-                    int64_t nwritten = 0;
-                    int towrite = 16*1024;
-
-                    if (packet->remainingLength < 16*1024)
-                        towrite = packet->remainingLength;
+            n = MqttPacketWriteIov(packet, iov + iovcnt,
+                                   STREAM_IOV_MAX - iovcnt);
 
-                    nwritten = StreamWrite(bdataofs(packet->payload, offset),
-                                           towrite,
-                                           &client->stream.base);
+            /* Packets encoded back to back (see MqttClientPublishMany) go
+               out as one buffer */
+            if (n > 0 && iovcnt > 0 &&
+                (const unsigned char *) iov[iovcnt - 1].data +
+                iov[iovcnt - 1].size == iov[iovcnt].data)
+            {
+                iov[iovcnt - 1].size += iov[iovcnt].size;
+                for (i = 1; i < n; ++i)
+                    iov[iovcnt + i - 1] = iov[iovcnt + i];
+                --n;
+            }
 
-                    if (nwritten == -1)
-                    {
-                        if (SocketWouldBlock(SocketErrno))
-                        {
-                            return 0;
-                        }
-                        return -1;
-                    }
+            iovcnt += n;
 
-                    packet->remainingLength -= nwritten;
+            if (packet->streamSize > 0)
+                break;
+        }
 
-                    LOG_DEBUG("nwritten:%d", (int) nwritten);
-                }
+        for (i = 0; i < iovcnt; ++i)
+        {
+            total += iov[i].size;
+        }
 
-                if (packet->remainingLength == 0)
+        if (payload && payload->produced)
+        {
+            if (client->producePos == client->produceLen)
+            {
+                if (!client->produceBuffer &&
+                    !(client->produceBuffer =
+                      MqttMalloc(MQTT_MESSAGE_CHUNK_SIZE)))
                 {
-                    LOG_DEBUG("packet payload sent");
-                    packet->state = MqttPacketStateWriteComplete;
+                    return -1;
                 }
 
-                break;
-            }
+                nwritten = MqttClientProduce(client, payload->message,
+                    client->produceBuffer, payload->remainingLength,
+                    payload->remainingLength == payload->streamSize);
 
-            case MqttPacketStateWriteComplete:
-            {
-                client->lastPacketSentTime = MqttGetCurrentTime();
+                if (nwritten == -1)
+                    return -1;
 
-                if (packet->type == MqttPacketTypeDisconnect)
-                {
-                    client->stopped = 1;
-                    client->state = MqttClientStateDisconnected;
-                }
+                client->producePos = 0;
+                client->produceLen = (size_t) nwritten;
+            }
 
-                LOG_DEBUG("sent %s", MqttPacketName(packet->type));
+            iov[0].data = client->produceBuffer + client->producePos;
+            iov[0].size = client->produceLen - client->producePos;
+            iovcnt = 1;
+            total = (int64_t) iov[0].size;
 
-                if (packet->type == MqttPacketTypePublish && packet->message)
-                {
-                    MqttMessage *msg = packet->message;
+            nwritten = StreamWritev(iov, iovcnt, &client->stream.base);
 
-                    if (msg->qos == 1)
-                    {
-                        msg->state = MqttMessageStateWaitPubAck;
-                    }
-                    else if (msg->qos == 2)
-                    {
-                        msg->state = MqttMessageStateWaitPubRec;
-                    }
-                }
+            if (nwritten > 0)
+                client->producePos += (size_t) nwritten;
+        }
+        else if (payload)
+        {
+            total = (int64_t) payload->remainingLength;
+            nwritten = SocketStreamSendFile(&client->stream, payload->fd,
+                                            MqttPacketFilePosition(payload),
+                                            payload->remainingLength);
+            if (nwritten == 0)
+            {
+                LOG_ERROR("file ended before the payload was sent");
+                return -1;
+            }
+        }
+        else if (zeroCopy)
+            nwritten = SocketStreamWritevZeroCopy(&client->stream, iov,
+                                                  iovcnt);
+        else
+            nwritten = StreamWritev(iov, iovcnt, &client->stream.base);
 
-                if (packet->message)
-                {
-                    packet->message->timestamp = client->lastPacketSentTime;
-                }
+        /* The kernel may now use the payload until the send completes */
+        if (zeroCopy && client->stream.zeroCopySent != zeroCopyId &&
+            zeroCopy->message)
+        {
+            zeroCopy->message->zeroCopyPending = 1;
+            zeroCopy->message->zeroCopyId = zeroCopyId;
+        }
 
-                SIMPLEQ_REMOVE_HEAD(&client->sendQueue, sendQueue);
+        if (nwritten == -1)
+        {
+            if (SocketWouldBlock(SocketErrno))
+                return 0;
+            return -1;
+        }
+
+        LOG_DEBUG("nwritten:%d", (int) nwritten);
 
-                MqttPacketFree(packet);
+        /* Consume the written bytes packet by packet. A packet that was only
+           partially written stays at the head of the queue and continues from
+           where it left off. */
+        left = (size_t) nwritten;
 
-                packet = SIMPLEQ_FIRST(&client->sendQueue);
+        while ((packet = SIMPLEQ_FIRST(&client->sendQueue)) != NULL)
+        {
+            left -= MqttPacketWriteAdvance(packet, left);
 
+            if (packet->state != MqttPacketStateWriteComplete)
                 break;
-            }
+
+            MqttClientPacketSent(client, packet);
+        }
+
+        if (nwritten < total)
+        {
+            /* Short write, the socket buffer is full */
+            return 0;
         }
     }
 
@@ -6449,7 +12000,7 @@ static int MqttClientHandleSubAck(MqttClient *client)
         return -1;
     }
 
-    qos = malloc(count * sizeof(int));
+    qos = MqttMalloc(count * sizeof(int));
 
     for (i = 0; i < count; ++i)
     {
@@ -6463,115 +12014,148 @@ static int MqttClientHandleSubAck(MqttClient *client)
         client->onSubscribe(client, id, qos, count);
     }
 
-    free(qos);
+    MqttFree(qos);
 
     return 0;
 }
 
-static int MqttClientSendPubAck(MqttClient *client, uint16_t id)
+/* Queues a PUBACK, PUBREC, PUBREL or PUBCOMP. */
+static int MqttClientQueueAckPacket(MqttClient *client, int type, int flags,
+                                    uint16_t id, MqttMessage *msg)
 {
     MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    unsigned char *p;
 
-    packet = MqttPacketWithIdNew(MqttPacketTypePubAck, id);
+    packet = MqttClientPacketNew(client, type, id);
 
     if (!packet)
         return -1;
 
-    StringStreamInit(&ss);
+    packet->flags = flags;
 
-    StreamWriteUint16Be(id, pss);
+    /* Fits in the inline storage of the packet, can't fail */
+    p = MqttPacketAllocate(packet, 2);
 
-    packet->payload = ss.buffer;
+    MqttEncodeUint16Be(p, id);
+
+    packet->message = msg;
 
     MqttClientQueuePacket(client, packet);
 
     return 0;
 }
 
-static int MqttClientSendPubRec(MqttClient *client, MqttMessage *msg)
+static int MqttClientSendPubAck(MqttClient *client, uint16_t id)
 {
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-
-    packet = MqttPacketWithIdNew(MqttPacketTypePubRec, msg->id);
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubAck, 0, id,
+                                    NULL);
+}
 
-    if (!packet)
-        return -1;
+static int MqttClientSendPubRec(MqttClient *client, MqttMessage *msg)
+{
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubRec, 0, msg->id,
+                                    msg);
+}
 
-    StringStreamInit(&ss);
+static int MqttClientSendPubRel(MqttClient *client, MqttMessage *msg)
+{
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubRel, 0x2,
+                                    msg->id, msg);
+}
 
-    StreamWriteUint16Be(msg->id, pss);
+static int MqttClientSendPubComp(MqttClient *client, uint16_t id)
+{
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubComp, 0, id,
+                                    NULL);
+}
 
-    packet->payload = ss.buffer;
-    packet->message = msg;
+/*
+    Resends PUBREC if a QoS 2 message with the id has been received before,
+    in which case the message must not be delivered again. Returns 1 if so.
+*/
+static int MqttClientIsDuplicatePublish(MqttClient *client, uint16_t id)
+{
+    MqttMessage *msg = MqttMessageIndexFind(&client->inIndex, id);
 
-    MqttClientQueuePacket(client, packet);
+    if (msg && msg->state == MqttMessageStateWaitPubRel)
+    {
+        LOG_DEBUG("resending PUBREC id:%u", msg->id);
+        MqttClientSendPubRec(client, msg);
+        return 1;
+    }
 
     return 0;
 }
 
-static int MqttClientSendPubRel(MqttClient *client, MqttMessage *msg)
+/* Acknowledges a delivered PUBLISH. */
+static int MqttClientAckPublish(MqttClient *client, int qos, uint16_t id)
 {
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-
-    packet = MqttPacketWithIdNew(MqttPacketTypePubRel, msg->id);
-
-    if (!packet)
-        return -1;
+    MqttMessage *msg;
 
-    packet->flags = 0x2;
+    if (qos == 1)
+    {
+        return MqttClientSendPubAck(client, id);
+    }
+    else if (qos == 2)
+    {
+        msg = MqttClientMessageNew(client);
 
-    StringStreamInit(&ss);
+        if (!msg)
+            return -1;
 
-    StreamWriteUint16Be(msg->id, pss);
+        msg->state = MqttMessageStateWaitPubRel;
+        msg->id = id;
+        msg->qos = qos;
 
-    packet->payload = ss.buffer;
-    packet->message = msg;
+        if (MqttClientAddInMessage(client, msg) == -1)
+        {
+            MqttClientMessageFree(client, msg);
+            return -1;
+        }
 
-    MqttClientQueuePacket(client, packet);
+        return MqttClientSendPubRec(client, msg);
+    }
 
     return 0;
 }
 
-static int MqttClientSendPubComp(MqttClient *client, uint16_t id)
+/* Finishes a streamed PUBLISH, see MqttClientRecvPublishHeader. */
+static int MqttClientEndPublishStream(MqttClient *client)
 {
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    int deliver = client->streamDeliver;
+    int discard = client->recvDiscard;
 
-    packet = MqttPacketWithIdNew(MqttPacketTypePubComp, id);
+    client->streamHeaderSize = 0;
+    client->streamDeliver = 0;
+    client->recvDiscard = 0;
 
-    if (!packet)
-        return -1;
-
-    StringStreamInit(&ss);
-
-    StreamWriteUint16Be(id, pss);
-
-    packet->payload = ss.buffer;
+    if (!deliver)
+        return 0;
 
-    MqttClientQueuePacket(client, packet);
+    /* A discarded message is acknowledged so that it isn't sent again */
+    if (client->onMessageEnd && !discard)
+        client->onMessageEnd(client, 1);
 
-    return 0;
+    return MqttClientAckPublish(client, (client->inPacket.flags >> 1) & 3,
+                                client->inPacket.id);
 }
 
 static int MqttClientHandlePublish(MqttClient *client)
 {
-    MqttMessage *msg;
-    uint16_t id;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    uint16_t id = 0;
     MqttPacket *packet;
     int qos;
     int retain;
-    bstring topic;
+    unsigned char *p;
+    size_t length;
+    size_t topicLength;
+    size_t headerSize;
+    char *topic;
     void *payload;
-    int payloadSize;
+    size_t payloadSize;
+
+    if (client->streamHeaderSize > 0)
+        return MqttClientEndPublishStream(client);
 
     /* We are paused - do nothing */
     if (client->paused)
@@ -6582,73 +12166,66 @@ static int MqttClientHandlePublish(MqttClient *client)
     qos = (packet->flags >> 1) & 3;
     retain = packet->flags & 1;
 
-    StringStreamInitFromBstring(&ss, packet->payload);
+    /* The topic, packet id and payload are used where they are in the
+       received packet */
+    p = (unsigned char *) bdata(packet->payload);
+    length = (size_t) blength(packet->payload);
 
-    StreamReadMqttString(&topic, pss);
-
-    if (qos > 0)
+    if (length < 2)
     {
-        StreamReadUint16Be(&id, pss);
+        LOG_ERROR("invalid PUBLISH packet");
+        return -1;
     }
 
-    payload = bdataofs(ss.buffer, ss.pos);
-    payloadSize = blength(ss.buffer) - ss.pos;
+    topicLength = (size_t) ((p[0] << 8) | p[1]);
+    headerSize = 2 + topicLength + (qos > 0 ? 2 : 0);
 
-    if (qos == 2)
+    if (headerSize > length)
     {
-        /* Check if we have sent a PUBREC previously with the same id. If we
-           have, we have to resend the PUBREC. We must not call the onMessage
-           callback again. */
+        LOG_ERROR("invalid PUBLISH packet");
+        return -1;
+    }
 
-        TAILQ_FOREACH(msg, &client->inMessages, chain)
-        {
-            if (msg->id == id &&
-                msg->state == MqttMessageStateWaitPubRel)
-            {
-                break;
-            }
-        }
+    if (qos > 0)
+    {
+        id = (uint16_t) ((p[2 + topicLength] << 8) | p[2 + topicLength + 1]);
+    }
 
-        if (msg)
-        {
-            LOG_DEBUG("resending PUBREC id:%u", msg->id);
-            MqttClientSendPubRec(client, msg);
-            bdestroy(topic);
-            return 0;
-        }
+    payload = p + headerSize;
+    payloadSize = length - headerSize;
+
+    /* Check if we have sent a PUBREC previously with the same id. If we
+       have, we have to resend the PUBREC. We must not call the onMessage
+       callback again. */
+    if (qos == 2 && MqttClientIsDuplicatePublish(client, id))
+    {
+        return 0;
     }
 
-    if (client->onMessage)
+    /* Moving the topic over the length, which has been read, leaves room
+       for terminating it without touching the packet id or the payload */
+    topic = (char *) p + 1;
+    memmove(topic, p + 2, topicLength);
+    topic[topicLength] = '\0';
+
+    if (client->onMessageWithTopicLength)
+    {
+        LOG_DEBUG("calling onMessage");
+        client->onMessageWithTopicLength(client, topic, topicLength, payload,
+                                         payloadSize, qos, retain);
+    }
+    else if (client->onMessage)
     {
         LOG_DEBUG("calling onMessage");
         client->onMessage(client,
-            bdata(topic),
+            topic,
             payload,
             payloadSize,
             qos,
             retain);
     }
 
-    bdestroy(topic);
-
-    if (qos == 1)
-    {
-        MqttClientSendPubAck(client, id);
-    }
-    else if (qos == 2)
-    {
-        msg = calloc(1, sizeof(*msg));
-
-        msg->state = MqttMessageStateWaitPubRel;
-        msg->id = id;
-        msg->qos = qos;
-
-        TAILQ_INSERT_TAIL(&client->inMessages, msg, chain);
-
-        MqttClientSendPubRec(client, msg);
-    }
-
-    return 0;
+    return MqttClientAckPublish(client, qos, id);
 }
 
 static int MqttClientHandlePubAck(MqttClient *client)
@@ -6664,29 +12241,25 @@ static int MqttClientHandlePubAck(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        if (msg->id == id &&
-            msg->state == MqttMessageStateWaitPubAck)
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->outIndex, id);
 
-    if (!msg)
+    /* The original may be acknowledged while the message is being sent
+       again, and the resend after that */
+    if (!msg || (msg->state != MqttMessageStateWaitPubAck &&
+                 (msg->state != MqttMessageStatePublish || msg->qos != 1)))
     {
-        LOG_ERROR("no message found with id %d", (int) id);
-        return -1;
+        LOG_WARNING("no message found with id %d", (int) id);
+        return 0;
     }
 
-    TAILQ_REMOVE(&client->outMessages, msg, chain);
+    MqttClientRemoveOutMessage(client, msg);
 
     if (client->onPublish)
     {
         client->onPublish(client, msg->id);
     }
 
-    MqttMessageFree(msg);
+    MqttClientMessageFree(client, msg);
 
     return 0;
 }
@@ -6704,19 +12277,13 @@ static int MqttClientHandlePubRec(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        /* Also check if we are waiting for PUBCOMP, if we have sent PUBREL but
-           they haven't received it.  */
-        if (msg->id == id &&
-            (msg->state == MqttMessageStateWaitPubRec ||
-             msg->state == MqttMessageStateWaitPubComp))
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->outIndex, id);
 
-    if (!msg)
+    /* Also check if we are waiting for PUBCOMP, if we have sent PUBREL but
+       they haven't received it, or sending the PUBLISH again.  */
+    if (!msg || (msg->state != MqttMessageStateWaitPubRec &&
+                 msg->state != MqttMessageStateWaitPubComp &&
+                 (msg->state != MqttMessageStatePublish || msg->qos != 2)))
     {
         LOG_ERROR("no message found with id %d", (int) id);
         return -1;
@@ -6724,9 +12291,16 @@ static int MqttClientHandlePubRec(MqttClient *client)
 
     msg->state = MqttMessageStateWaitPubComp;
 
+    MqttClientUnqueueResends(client, msg);
+
+    MqttClientReleasePayload(client, msg);
+
     bdestroy(msg->payload);
     msg->payload = NULL;
 
+    MqttPacketBufferUnref(msg->encoded);
+    msg->encoded = NULL;
+
     bdestroy(msg->topic);
     msg->topic = NULL;
 
@@ -6749,23 +12323,16 @@ static int MqttClientHandlePubRel(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->inMessages, chain)
-    {
-        if (msg->id == id &&
-            msg->state == MqttMessageStateWaitPubRel)
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->inIndex, id);
 
-    if (!msg)
+    if (!msg || msg->state != MqttMessageStateWaitPubRel)
     {
         LOG_ERROR("no message found with id %d", (int) id);
         return -1;
     }
 
-    TAILQ_REMOVE(&client->inMessages, msg, chain);
-    MqttMessageFree(msg);
+    MqttClientRemoveInMessage(client, msg);
+    MqttClientMessageFree(client, msg);
 
     if (MqttClientSendPubComp(client, id) == -1)
         return -1;
@@ -6786,23 +12353,17 @@ static int MqttClientHandlePubComp(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        if (msg->id == id && msg->state == MqttMessageStateWaitPubComp)
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->outIndex, id);
 
-    if (!msg)
+    if (!msg || msg->state != MqttMessageStateWaitPubComp)
     {
         LOG_WARNING("no message found with id %d", (int) id);
         return 0;
     }
 
-    TAILQ_REMOVE(&client->outMessages, msg, chain);
+    MqttClientRemoveOutMessage(client, msg);
 
-    MqttMessageFree(msg);
+    MqttClientMessageFree(client, msg);
 
     if (client->onPublish)
     {
@@ -6881,16 +12442,203 @@ static int MqttClientHandlePacket(MqttClient *client)
             break;
     }
 
-    bdestroy(client->inPacket.payload);
-    client->inPacket.payload = NULL;
+    client->lastPacketReceivedTime = client->now;
+
+    MqttClientRecvBufferDone(client);
 
     client->inPacket.state = MqttPacketStateReadType;
 
     return rc;
 }
 
+/* Returns 1 if the receive budget starting at start is used up. */
+static int MqttClientRecvBudgetUsed(MqttClient *client, int packets,
+                                    int64_t start)
+{
+    if (client->recvBudgetPackets > 0 && packets >= client->recvBudgetPackets)
+        return 1;
+
+    if (client->recvBudgetUs > 0 &&
+        MqttGetCurrentTimeUs() - start >= client->recvBudgetUs)
+        return 1;
+
+    return 0;
+}
+
+/*
+    Reads the topic and packet id of a streamed PUBLISH into the payload of
+    inPacket and calls onMessageBegin. Returns 1 if it made progress, 0 if
+    the socket would block or -1 on error.
+*/
+static int MqttClientRecvPublishHeader(MqttClient *client)
+{
+    MqttPacket *packet = &client->inPacket;
+    int qos = (packet->flags >> 1) & 3;
+    size_t want = client->streamHeaderSize;
+    size_t have;
+    uint16_t topicLength;
+    int64_t nread;
+    unsigned char *p;
+
+    if (!packet->payload && MqttClientRecvBufferReserve(client, want) == -1)
+        return -1;
+
+    have = blength(packet->payload);
+
+    if (want - have > packet->remainingLength)
+    {
+        LOG_ERROR("invalid PUBLISH header");
+        return -1;
+    }
+
+    nread = StreamRead(bdataofs(packet->payload, have), want - have,
+                       &client->stream.base);
+
+    if (nread == -1)
+    {
+        if (SocketWouldBlock(SocketErrno))
+            return 0;
+        LOG_ERROR("failed reading packet payload");
+        return -1;
+    }
+    else if (nread == 0)
+    {
+        LOG_ERROR("socket disconnected");
+        return -1;
+    }
+
+    packet->remainingLength -= nread;
+    packet->payload->slen += nread;
+
+    if (have + nread < want)
+        return 1;
+
+    p = packet->payload->data;
+
+    if (want == 2)
+    {
+        /* The length of the topic tells how much more there is */
+        topicLength = (uint16_t) ((p[0] << 8) | p[1]);
+        client->streamHeaderSize = 2 + topicLength + (qos > 0 ? 2 : 0);
+        if (MqttClientRecvBufferReserve(client,
+                                        client->streamHeaderSize) == -1)
+            return -1;
+        return 1;
+    }
+
+    topicLength = (uint16_t) want - 2 - (qos > 0 ? 2 : 0);
+
+    if (qos > 0)
+        packet->id = (uint16_t) ((p[2 + topicLength] << 8) |
+                                 p[2 + topicLength + 1]);
+
+    /* The packet id has been read, the topic can be terminated over it */
+    p[2 + topicLength] = '\0';
+
+    client->streamDeliver = !client->paused &&
+        !(qos == 2 && MqttClientIsDuplicatePublish(client, packet->id));
+
+    if (client->streamDeliver && !client->recvDiscard)
+    {
+        client->onMessageBegin(client, (const char *) p + 2, topicLength,
+                               packet->remainingLength, qos,
+                               packet->flags & 1);
+    }
+
+    MqttClientRecvBufferDone(client);
+
+    packet->state = MqttPacketStateReadPublishPayload;
+
+    return 1;
+}
+
+/*
+    Rejects the packet being received for being larger than maxPacketSize
+    before anything is allocated for it. A PUBLISH is read past like a
+    streamed one, without passing it on, if discardTooLarge is 1. Returns 1
+    if receiving continues, -1 if the connection must be closed.
+*/
+static int MqttClientRejectPacket(MqttClient *client)
+{
+    MqttPacket *packet = &client->inPacket;
+
+    ++client->packetsTooLarge;
+
+    LOG_ERROR("%s of %lu bytes is larger than the limit of %lu bytes",
+              MqttPacketName(packet->type),
+              (unsigned long) packet->remainingLength,
+              (unsigned long) client->maxPacketSize);
+
+    if (client->onError)
+        client->onError(client, MqttErrorPacketTooLarge);
+
+    if (!client->discardTooLarge || packet->type != MqttPacketTypePublish)
+        return -1;
+
+    client->recvDiscard = 1;
+    client->streamHeaderSize = 2;
+    packet->state = MqttPacketStateReadPublishHeader;
+
+    return 1;
+}
+
+/*
+    Passes on the next piece of the payload of a streamed PUBLISH. Returns
+    like MqttClientRecvPublishHeader.
+*/
+static int MqttClientRecvPublishPayload(MqttClient *client)
+{
+    unsigned char chunk[MQTT_MESSAGE_CHUNK_SIZE];
+    MqttPacket *packet = &client->inPacket;
+    size_t toread = sizeof(chunk);
+    int64_t nread;
+
+    if (packet->remainingLength < toread)
+        toread = packet->remainingLength;
+
+    if (toread > 0)
+    {
+        nread = StreamRead(chunk, toread, &client->stream.base);
+
+        if (nread == -1)
+        {
+            if (SocketWouldBlock(SocketErrno))
+                return 0;
+            LOG_ERROR("failed reading packet payload");
+            return -1;
+        }
+        else if (nread == 0)
+        {
+            LOG_ERROR("socket disconnected");
+            return -1;
+        }
+
+        packet->remainingLength -= nread;
+
+        if (client->streamDeliver && !client->recvDiscard &&
+            client->onMessageData)
+        {
+            client->onMessageData(client, chunk, (size_t) nread);
+        }
+    }
+
+    if (packet->remainingLength == 0)
+        packet->state = MqttPacketStateReadComplete;
+
+    return 1;
+}
+
+/*
+    Receives and handles packets until the socket would block or the receive
+    budget is used up.
+*/
 static int MqttClientRecvPacket(MqttClient *client)
 {
+    int64_t start = client->recvBudgetUs > 0 ? MqttGetCurrentTimeUs() : 0;
+    int packets = 0;
+
+    client->recvPending = 0;
+
     while (1)
     {
         switch (client->inPacket.state)
@@ -6898,14 +12646,22 @@ static int MqttClientRecvPacket(MqttClient *client)
             case MqttPacketStateReadType:
             {
                 unsigned char typeAndFlags;
+                int64_t nread;
+
+                nread = StreamReadByte(&typeAndFlags, &client->stream.base);
 
-                if (StreamReadByte(&typeAndFlags, &client->stream.base) == -1)
+                if (nread == -1)
                 {
                     if (SocketWouldBlock(SocketErrno))
                         return 0;
                     LOG_ERROR("failed reading packet type");
                     return -1;
                 }
+                else if (nread == 0)
+                {
+                    LOG_ERROR("socket disconnected");
+                    return -1;
+                }
 
                 client->inPacket.type = typeAndFlags >> 4;
                 client->inPacket.flags = typeAndFlags & 0x0F;
@@ -6940,8 +12696,41 @@ static int MqttClientRecvPacket(MqttClient *client)
                 LOG_DEBUG("remainingLength:%lu",
                           client->inPacket.remainingLength);
 
-                client->inPacket.state = MqttPacketStateReadPayload;
+                if (client->maxPacketSize > 0 &&
+                    client->inPacket.remainingLength > client->maxPacketSize)
+                {
+                    int rc = MqttClientRejectPacket(client);
+                    if (rc <= 0)
+                        return rc;
+                }
+                else if (client->inPacket.type == MqttPacketTypePublish &&
+                    client->onMessageBegin &&
+                    client->inPacket.remainingLength >= client->streamThreshold)
+                {
+                    client->inPacket.state = MqttPacketStateReadPublishHeader;
+                    client->streamHeaderSize = 2;
+                }
+                else
+                {
+                    client->inPacket.state = MqttPacketStateReadPayload;
+                }
+
+                break;
+            }
+
+            case MqttPacketStateReadPublishHeader:
+            {
+                int rc = MqttClientRecvPublishHeader(client);
+                if (rc <= 0)
+                    return rc;
+                break;
+            }
 
+            case MqttPacketStateReadPublishPayload:
+            {
+                int rc = MqttClientRecvPublishPayload(client);
+                if (rc <= 0)
+                    return rc;
                 break;
             }
 
@@ -6951,14 +12740,12 @@ static int MqttClientRecvPacket(MqttClient *client)
                 {
                     int64_t nread, offset, toread;
 
-                    if (client->inPacket.payload == NULL)
+                    if (client->inPacket.payload == NULL &&
+                        MqttClientRecvBufferReserve(client,
+                            client->inPacket.remainingLength) == -1)
                     {
-                        unsigned char *data;
-                        client->inPacket.payload = bfromcstr("");
-                        ballocmin(client->inPacket.payload,
-                                  client->inPacket.remainingLength+1);
-                        data = client->inPacket.payload->data;
-                        data[client->inPacket.remainingLength] = '\0';
+                        LOG_ERROR("out of memory");
+                        return -1;
                     }
 
                     offset = blength(client->inPacket.payload);
@@ -6978,15 +12765,11 @@ static int MqttClientRecvPacket(MqttClient *client)
                         if (SocketWouldBlock(SocketErrno))
                             return 0;
                         LOG_ERROR("failed reading packet payload");
-                        bdestroy(client->inPacket.payload);
-                        client->inPacket.payload = NULL;
                         return -1;
                     }
                     else if (nread == 0)
                     {
                         LOG_ERROR("socket disconnected");
-                        bdestroy(client->inPacket.payload);
-                        client->inPacket.payload = NULL;
                         return -1;
                     }
 
@@ -6998,6 +12781,12 @@ static int MqttClientRecvPacket(MqttClient *client)
 
                 if (client->inPacket.remainingLength == 0)
                 {
+                    /* The reused buffer isn't terminated already */
+                    if (client->inPacket.payload)
+                    {
+                        bstring payload = client->inPacket.payload;
+                        payload->data[payload->slen] = '\0';
+                    }
                     client->inPacket.state = MqttPacketStateReadComplete;
                 }
                 break;
@@ -7005,9 +12794,25 @@ static int MqttClientRecvPacket(MqttClient *client)
 
             case MqttPacketStateReadComplete:
             {
-                int type = client->inPacket.type;
-                LOG_DEBUG("received %s", MqttPacketName(type));
-                return MqttClientHandlePacket(client);
+                int rc;
+
+                LOG_DEBUG("received %s", MqttPacketName(client->inPacket.type));
+
+                rc = MqttClientHandlePacket(client);
+
+                if (rc == -1 || client->stopped)
+                    return rc;
+
+                /* Keep going until the socket would block so that a burst
+                   is not handled one wait at a time, but give the other
+                   clients a turn once the budget is used up. */
+                if (MqttClientRecvBudgetUsed(client, ++packets, start))
+                {
+                    client->recvPending = 1;
+                    return 0;
+                }
+
+                break;
             }
         }
     }
@@ -7019,103 +12824,111 @@ static uint16_t MqttClientNextPacketId(MqttClient *client)
 {
     uint16_t id;
     assert(client != NULL);
-    id = ++client->packetId;
-    if (id == 0)
+    /* Skip ids that are still used by unfinished messages after the ids
+       have wrapped around */
+    do
+    {
         id = ++client->packetId;
+        if (id == 0)
+            id = ++client->packetId;
+    }
+    while (MqttMessageIndexFind(&client->outIndex, id) != NULL);
     return id;
 }
 
-static int64_t MqttMessageTimeSinceSent(MqttMessage *msg)
-{
-    int64_t now = MqttGetCurrentTime();
-    return now - msg->timestamp;
-}
-
-static int MqttMessageShouldResend(MqttClient *client, MqttMessage *msg)
+/*
+    Resends what hasn't been acknowledged in time. Only the expired messages
+    at the head of the retry list are visited.
+*/
+static void MqttClientProcessRetries(MqttClient *client)
 {
-    if (msg->timestamp > 0 &&
-        MqttMessageTimeSinceSent(msg) >= client->retryTimeout*1000)
-    {
-        return 1;
-    }
-
-    return 0;
-}
+    int64_t retry = client->retryTimeout*1000;
+    MqttMessage *msg, *last;
+    MqttPacket *packet;
 
-static void MqttClientProcessInMessages(MqttClient *client)
-{
-    MqttMessage *msg, *next;
+    /* Don't visit the messages rearmed below again even if the timeout
+       is zero */
+    last = TAILQ_LAST(&client->retryMessages, MqttMessageList);
 
-    TAILQ_FOREACH_SAFE(msg, &client->inMessages, chain, next)
+    while ((msg = TAILQ_FIRST(&client->retryMessages)) != NULL &&
+           msg->timestamp + retry <= client->now)
     {
+        MqttClientDisarmRetry(client, msg);
+
         switch (msg->state)
         {
-            case MqttMessageStateWaitPubRel:
-                if (MqttMessageShouldResend(client, msg))
+            case MqttMessageStateWaitPubAck:
+            case MqttMessageStateWaitPubRec:
+            {
+                msg->dup = 1;
+
+                if ((packet = PublishToPacket(client, msg)) != NULL)
+                {
+                    /* The timer restarts when the packet has been sent */
+                    msg->state = MqttMessageStatePublish;
+                    MqttClientQueuePacket(client, packet);
+                }
+                else
                 {
-                    MqttClientSendPubRec(client, msg);
+                    MqttClientArmRetry(client, msg, client->now);
                 }
                 break;
+            }
+
+            case MqttMessageStateWaitPubComp:
+            {
+                /* Restart the timer now so that the PUBREL isn't queued
+                   again before it has been sent */
+                MqttClientArmRetry(client, msg, client->now);
+                MqttClientSendPubRel(client, msg);
+                break;
+            }
+
+            case MqttMessageStateWaitPubRel:
+            {
+                MqttClientArmRetry(client, msg, client->now);
+                MqttClientSendPubRec(client, msg);
+                break;
+            }
 
             default:
                 break;
         }
+
+        if (msg == last)
+            break;
     }
 }
 
-static void MqttClientProcessOutMessages(MqttClient *client)
+/* Moves queued messages to sendQueue while the inflight window allows. */
+static void MqttClientProcessQueuedMessages(MqttClient *client)
 {
-    MqttMessage *msg, *next;
+    MqttMessage *msg;
     MqttPacket *packet;
     int inflight = MqttClientInflightMessageCount(client);
 
-    TAILQ_FOREACH_SAFE(msg, &client->outMessages, chain, next)
+    while (inflight < client->maxInflight &&
+           (msg = TAILQ_FIRST(&client->queuedMessages)) != NULL)
     {
-        switch (msg->state)
+        packet = PublishToPacket(client, msg);
+        if (!packet)
         {
-            case MqttMessageStateQueued:
-            {
-                if (inflight >= client->maxInflight)
-                {
-                    continue;
-                }
-                /* State change from MqttMessageStatePublish happens after
-                   the packet has been sent (in MqttClientSendPacket). */
-                msg->state = MqttMessageStatePublish;
-                packet = PublishToPacket(msg);
-                MqttClientQueuePacket(client, packet);
-                ++inflight;
-                break;
-            }
-
-            case MqttMessageStateWaitPubAck:
-            case MqttMessageStateWaitPubRec:
-            {
-                if (MqttMessageShouldResend(client, msg))
-                {
-                    msg->state = MqttMessageStatePublish;
-                    packet = PublishToPacket(msg);
-                    MqttClientQueuePacket(client, packet);
-                }
-                break;
-            }
-
-            case MqttMessageStateWaitPubComp:
-            {
-                if (MqttMessageShouldResend(client, msg))
-                {
-                    MqttClientSendPubRel(client, msg);
-                }
-                break;
-            }
+            break;
         }
+        /* State change from MqttMessageStatePublish happens after
+           the packet has been sent (in MqttClientSendPacket). */
+        TAILQ_REMOVE(&client->queuedMessages, msg, queue);
+        --client->outQueued;
+        msg->state = MqttMessageStatePublish;
+        MqttClientQueuePacket(client, packet);
+        ++inflight;
     }
 }
 
 static void MqttClientProcessMessageQueue(MqttClient *client)
 {
-    MqttClientProcessInMessages(client);
-    MqttClientProcessOutMessages(client);
+    MqttClientProcessRetries(client);
+    MqttClientProcessQueuedMessages(client);
 }
 
 static void MqttClientClearQueues(MqttClient *client)
@@ -7123,23 +12936,33 @@ static void MqttClientClearQueues(MqttClient *client)
     while (!SIMPLEQ_EMPTY(&client->sendQueue))
     {
         MqttPacket *packet = SIMPLEQ_FIRST(&client->sendQueue);
-        SIMPLEQ_REMOVE_HEAD(&client->sendQueue, sendQueue);
-        MqttPacketFree(packet);
+        MqttClientUnqueuePacket(client, NULL, packet);
+        /* QoS 0 messages belong to their packets */
+        if (packet->message && packet->message->qos == 0)
+            MqttClientMessageFree(client, packet->message);
+        MqttClientPacketFree(client, packet);
     }
 
     while (!TAILQ_EMPTY(&client->outMessages))
     {
         MqttMessage *msg = TAILQ_FIRST(&client->outMessages);
         TAILQ_REMOVE(&client->outMessages, msg, chain);
-        MqttMessageFree(msg);
+        MqttClientMessageFree(client, msg);
     }
 
     while (!TAILQ_EMPTY(&client->inMessages))
     {
         MqttMessage *msg = TAILQ_FIRST(&client->inMessages);
         TAILQ_REMOVE(&client->inMessages, msg, chain);
-        MqttMessageFree(msg);
+        MqttClientMessageFree(client, msg);
     }
+
+    MqttMessageIndexClear(&client->outIndex);
+    MqttMessageIndexClear(&client->inIndex);
+    client->outQueued = 0;
+    client->producePos = client->produceLen = 0;
+    TAILQ_INIT(&client->queuedMessages);
+    TAILQ_INIT(&client->retryMessages);
 }
 
 void MqttClientPause(MqttClient *client)
@@ -7153,3 +12976,21 @@ void MqttClientResume(MqttClient *client)
     assert(client != NULL);
     client->paused = 0;
 }
+
+MqttLoopEntry *MqttClientLoopEntry(MqttClient *client)
+{
+    assert(client != NULL);
+    return &client->loopEntry;
+}
+
+SocketStream *MqttClientSocketStream(MqttClient *client)
+{
+    assert(client != NULL);
+    return &client->stream;
+}
+
+const MqttAllocator *MqttClientAllocator(MqttClient *client)
+{
+    assert(client != NULL);
+    return client->allocator;
+}
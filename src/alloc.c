@@ -0,0 +1,95 @@
+#include "alloc.h"
+
+#include <string.h>
+#include <stdint.h>
+
+static MqttAllocator MqttGlobalAllocator;
+static int MqttGlobalAllocatorSet = 0;
+
+static MQTT_THREAD_LOCAL const MqttAllocator *MqttCurrentAllocator = NULL;
+
+static MQTT_INLINE const MqttAllocator *MqttAllocatorGet(void)
+{
+    if (MqttCurrentAllocator)
+        return MqttCurrentAllocator;
+    if (MqttGlobalAllocatorSet)
+        return &MqttGlobalAllocator;
+    return NULL;
+}
+
+void MqttSetAllocator(const MqttAllocator *allocator)
+{
+    if (allocator)
+    {
+        MqttGlobalAllocator = *allocator;
+        MqttGlobalAllocatorSet = 1;
+    }
+    else
+    {
+        MqttGlobalAllocatorSet = 0;
+    }
+}
+
+void *MqttMalloc(size_t size)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+
+    if (allocator)
+        return allocator->alloc(allocator->userData, size);
+
+    return malloc(size);
+}
+
+void *MqttCalloc(size_t count, size_t size)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+    void *ptr;
+
+    if (!allocator)
+        return calloc(count, size);
+
+    if (size > 0 && count > SIZE_MAX / size)
+        return NULL;
+
+    ptr = allocator->alloc(allocator->userData, count * size);
+
+    if (ptr)
+        memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+void *MqttRealloc(void *ptr, size_t size)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+
+    if (allocator)
+        return allocator->realloc(allocator->userData, ptr, size);
+
+    return realloc(ptr, size);
+}
+
+void MqttFree(void *ptr)
+{
+    const MqttAllocator *allocator = MqttAllocatorGet();
+
+    if (!ptr)
+        return;
+
+    if (allocator)
+        allocator->free(allocator->userData, ptr);
+    else
+        free(ptr);
+}
+
+const MqttAllocator *MqttAllocatorEnter(const MqttAllocator *allocator)
+{
+    const MqttAllocator *previous = MqttCurrentAllocator;
+    MqttCurrentAllocator = allocator;
+    return previous;
+}
+
+void MqttAllocatorLeave(const MqttAllocator *previous)
+{
+    MqttCurrentAllocator = previous;
+}
@@ -0,0 +1,33 @@
+#ifndef MQTT_ALLOC_H
+#define MQTT_ALLOC_H
+
+#include "config.h"
+#include "mqtt.h"
+
+#include <stdlib.h>
+
+/*
+    All the memory of the library comes from these. They use the allocator
+    of the calling thread set with MqttAllocatorEnter, or the global one set
+    with MqttSetAllocator, or the C library.
+*/
+
+void *MqttMalloc(size_t size);
+
+void *MqttCalloc(size_t count, size_t size);
+
+void *MqttRealloc(void *ptr, size_t size);
+
+void MqttFree(void *ptr);
+
+/*
+    Makes allocator (NULL for the global one) the allocator of the calling
+    thread and returns the previous one to pass to MqttAllocatorLeave. The
+    public functions of a client wrap their work in these so that everything
+    allocated for the client, strings included, comes from its allocator.
+*/
+const MqttAllocator *MqttAllocatorEnter(const MqttAllocator *allocator);
+
+void MqttAllocatorLeave(const MqttAllocator *previous);
+
+#endif
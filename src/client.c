@@ -10,6 +10,8 @@
 #include "stringstream.h"
 #include "stream_mqtt.h"
 #include "message.h"
+#include "loop.h"
+#include "alloc.h"
 
 #include "queue.h"
 
@@ -21,11 +23,93 @@
 #include <assert.h>
 #include <time.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #if (LOG_LEVEL == LOG_LEVEL_DEBUG) && !defined(PRId64)
 #error define PRId64 for your platform
 #endif
 
+/* Default budget of MqttClientSetRecvBudget, 0 means no limit */
+#if !defined(MQTT_RECV_BUDGET_PACKETS)
+#define MQTT_RECV_BUDGET_PACKETS 256
+#endif
+
+#if !defined(MQTT_RECV_BUDGET_US)
+#define MQTT_RECV_BUDGET_US 0
+#endif
+
+/* Default number of freed packets and messages a client keeps for reuse */
+#if !defined(MQTT_POOL_SIZE)
+#define MQTT_POOL_SIZE 256
+#endif
+
+/* Largest piece of a streamed message, see MqttClientSetOnMessageStream and
+   MqttClientPublishStream. A received one is read into a buffer on the
+   stack, a published one is produced into a buffer of the client. */
+#if !defined(MQTT_MESSAGE_CHUNK_SIZE)
+#define MQTT_MESSAGE_CHUNK_SIZE (16*1024)
+#endif
+
+/* Default of MqttClientSetMaxPacketSize, 0 meaning no limit */
+#if !defined(MQTT_MAX_PACKET_SIZE)
+#define MQTT_MAX_PACKET_SIZE 0
+#endif
+
+/* Defaults of MqttClientSetRecvBufferPolicy: how many bytes of the receive
+   buffer are kept between packets and after how many milliseconds without
+   packets it is freed, 0 meaning never */
+#if !defined(MQTT_RECV_BUFFER_KEEP)
+#define MQTT_RECV_BUFFER_KEEP 4096
+#endif
+
+#if !defined(MQTT_RECV_BUFFER_IDLE_MS)
+#define MQTT_RECV_BUFFER_IDLE_MS 30000
+#endif
+
+/* Defaults of MqttClientSetCoalescing: how many microseconds and bytes of
+   packets are held before sending them, a delay of 0 disabling it and a
+   size of 0 meaning no limit */
+#if !defined(MQTT_COALESCE_DELAY_US)
+#define MQTT_COALESCE_DELAY_US 0
+#endif
+
+#if !defined(MQTT_COALESCE_MAX_BYTES)
+#define MQTT_COALESCE_MAX_BYTES 0
+#endif
+
+/* Defaults of MqttClientSetQos0Limit, 0 meaning no limit */
+#if !defined(MQTT_QOS0_MAX_COUNT)
+#define MQTT_QOS0_MAX_COUNT 0
+#endif
+
+#if !defined(MQTT_QOS0_MAX_BYTES)
+#define MQTT_QOS0_MAX_BYTES 0
+#endif
+
+/* Default of MqttClientSetZeroCopyThreshold, 0 disables MSG_ZEROCOPY */
+#if !defined(MQTT_ZEROCOPY_THRESHOLD)
+#define MQTT_ZEROCOPY_THRESHOLD 0
+#endif
+
+/*
+    sendQueue is ordered by these lanes, control packets (acknowledgements,
+    PINGREQ, SUBSCRIBE etc.) first and then PUBLISH packets by priority and
+    QoS. DISCONNECT goes last since nothing is sent after it. Only the
+    packet that is being written stays in front of the others, packets go
+    ahead of each other only at packet boundaries.
+*/
+enum
+{
+    MqttSendLaneControl,
+    MqttSendLaneHigh,
+    MqttSendLaneQos2,
+    MqttSendLaneQos1,
+    MqttSendLaneQos0,
+    MqttSendLaneLow,
+    MqttSendLaneDisconnect,
+    MqttSendLaneCount
+};
+
 typedef enum MqttClientState MqttClientState;
 
 enum MqttClientState
@@ -35,6 +119,19 @@ enum MqttClientState
     MqttClientStateConnected,
 };
 
+/* A user payload whose release waits for the kernel to finish sending it */
+typedef struct MqttPendingRelease MqttPendingRelease;
+
+struct MqttPendingRelease
+{
+    const void *data;
+    MqttClientReleaseCallback release;
+    void *context;
+    /* zero copy send id after which the data is no longer used */
+    uint32_t zeroCopyId;
+    SIMPLEQ_ENTRY(MqttPendingRelease) chain;
+};
+
 struct MqttClient
 {
     SocketStream stream;
@@ -57,15 +154,63 @@ struct MqttClient
     MqttClientOnUnsubscribeCallback onUnsubscribe;
     /* callback called when a message is received */
     MqttClientOnMessageCallback onMessage;
+    /* same with the length of the topic, used instead of onMessage if set */
+    MqttClientOnMessageWithTopicLengthCallback onMessageWithTopicLength;
     /* callback called after publish is done and acknowledged */
     MqttClientOnPublishCallback onPublish;
+    /* callbacks for messages of at least streamThreshold bytes, passed on
+       as they arrive */
+    MqttClientOnMessageBeginCallback onMessageBegin;
+    MqttClientOnMessageDataCallback onMessageData;
+    MqttClientOnMessageEndCallback onMessageEnd;
+    size_t streamThreshold;
+    /* while a PUBLISH is streamed, the size of its variable header (2 until
+       the length of the topic is known), 0 otherwise */
+    size_t streamHeaderSize;
+    /* 1 if the streamed PUBLISH is passed on and acknowledged, 0 if it is
+       skipped */
+    int streamDeliver;
+    /* received packets with a longer body are rejected, 0 meaning no limit,
+       see MqttClientSetMaxPacketSize */
+    size_t maxPacketSize;
+    /* 1 if a rejected PUBLISH is read past and acknowledged instead of
+       closing the connection */
+    int discardTooLarge;
+    /* 1 while reading past a rejected PUBLISH (streamed without passing it
+       on) */
+    int recvDiscard;
+    uint64_t packetsTooLarge;
+    MqttClientOnErrorCallback onError;
     int stopped;
     /* packets waiting to be sent over network */
     SIMPLEQ_HEAD(, MqttPacket) sendQueue;
+    /* the last packet of each lane in sendQueue, not counting the head if
+       it has been partly written, see MqttClientQueuePacket */
+    MqttPacket *sendLaneTails[MqttSendLaneCount];
+    /* freed packets and messages kept for reuse, at most poolLimit of
+       each */
+    SIMPLEQ_HEAD(, MqttPacket) freePackets;
+    int freePacketCount;
+    MqttMessageList freeMessages;
+    int freeMessageCount;
+    int poolLimit;
     /* sent messages that are not done yet */
     MqttMessageList outMessages;
+    /* outMessages by packet id */
+    MqttMessageIndex outIndex;
+    /* outMessages that are still queued, in the order they were published */
+    MqttMessageList queuedMessages;
+    int outQueued;
     /* received messages that are not done yet  */
     MqttMessageList inMessages;
+    /* inMessages by packet id */
+    MqttMessageIndex inIndex;
+    /* in and out messages waiting for an acknowledgement, ordered by the
+       time they were sent and so by their retry deadline */
+    MqttMessageList retryMessages;
+    /* current time, read once when the client is entered from the event
+       loop instead of for every packet and message */
+    int64_t now;
     int sessionPresent;
     /* when was the last packet sent */
     int64_t lastPacketSentTime;
@@ -79,6 +224,8 @@ struct MqttClient
     int maxQueued;
     /* 1 if PINGREQ is sent and we are waiting for PINGRESP, 0 otherwise */
     int pingSent;
+    /* when was the PINGREQ queued */
+    int64_t pingSentTime;
     bstring willTopic;
     bstring willMessage;
     int willQos;
@@ -89,10 +236,70 @@ struct MqttClient
     bstring password;
     /* The packet we are receiving */
     MqttPacket inPacket;
+    /* maximum number of packets and microseconds to spend receiving per
+       call, 0 for no limit */
+    int recvBudgetPackets;
+    int recvBudgetUs;
+    /* 1 if receiving stopped because the budget ran out, not because the
+       socket would block */
+    int recvPending;
     MqttClientState state;
+    /* bookkeeping for MqttLoop */
+    MqttLoopEntry loopEntry;
+    /* user payloads at least this big are sent with MSG_ZEROCOPY, 0 for
+       never */
+    size_t zeroCopyThreshold;
+    /* released user payloads still used by zero copy sends, in the order
+       they were released */
+    SIMPLEQ_HEAD(, MqttPendingRelease) pendingReleases;
+    /* the produced payload being sent, produceBuffer[producePos] to
+       produceBuffer[produceLen] is still unwritten, see
+       MqttClientPublishStream */
+    unsigned char *produceBuffer;
+    size_t producePos;
+    size_t produceLen;
+    /* buffer for the payloads of received packets, reused from packet to
+       packet, see MqttClientSetRecvBufferPolicy */
+    bstring recvBuffer;
+    size_t recvBufferKeep;
+    int recvBufferIdleMs;
+    /* most bytes recvBuffer has had allocated */
+    size_t recvBufferPeak;
+    int64_t lastPacketReceivedTime;
+    /* packets are held in sendQueue for at most coalesceDelayUs
+       microseconds or until coalesceMaxBytes bytes are held, see
+       MqttClientSetCoalescing */
+    int coalesceDelayUs;
+    size_t coalesceMaxBytes;
+    /* when the first held packet was queued (0 if none) and how many bytes
+       have been queued since */
+    int64_t coalesceStartUs;
+    size_t coalesceHeldBytes;
+    /* 1 if a packet that isn't held was queued */
+    int coalesceUrgent;
+    uint64_t coalesceFlushes;
+    uint64_t coalesceDelayTotalUs;
+    uint64_t coalesceDelayMaxUs;
+    /* limits of the QoS 0 packets in sendQueue, 0 meaning no limit, and
+       what to do when they are reached, see MqttClientSetQos0Limit */
+    size_t qos0MaxCount;
+    size_t qos0MaxBytes;
+    int qos0Policy;
+    size_t qos0Queued;
+    size_t qos0QueuedBytes;
+    uint64_t qos0Dropped;
+    uint64_t qos0DroppedBytes;
+    /* allocator of the client (allocatorStorage) or NULL for the global
+       allocator */
+    const MqttAllocator *allocator;
+    MqttAllocator allocatorStorage;
 };
 
 static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet);
+static int MqttClientQos0Fits(MqttClient *client, size_t count, size_t size);
+static int MqttClientQueueQos0(MqttClient *client, MqttPacket *packet);
+static void MqttClientUnqueuePacket(MqttClient *client, MqttPacket *prev,
+                                    MqttPacket *packet);
 static int MqttClientQueueSimplePacket(MqttClient *client, int type);
 static int MqttClientSendPacket(MqttClient *client);
 static int MqttClientRecvPacket(MqttClient *client);
@@ -100,830 +307,2663 @@ static uint16_t MqttClientNextPacketId(MqttClient *client);
 static void MqttClientProcessMessageQueue(MqttClient *client);
 static void MqttClientClearQueues(MqttClient *client);
 
-static MQTT_INLINE int MqttClientInflightMessageCount(MqttClient *client)
+/*
+    Packets and messages come from per client pools of freed ones. Together
+    with the inline storage of small packets, a warmed up client sends and
+    acknowledges messages without allocating its bookkeeping structs. The
+    pools are not shared so they need no locking.
+*/
+
+static MqttPacket *MqttClientPacketNew(MqttClient *client, int type,
+                                       uint16_t id)
 {
-    MqttMessage *msg;
-    int queued = 0;
-    int inMessagesCount = 0;
-    int outMessagesCount = 0;
+    MqttPacket *packet = SIMPLEQ_FIRST(&client->freePackets);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        if (msg->state == MqttMessageStateQueued)
-        {
-            ++queued;
-        }
+    if (!packet)
+        return MqttPacketWithIdNew(type, id);
 
-        ++outMessagesCount;
-    }
+    SIMPLEQ_REMOVE_HEAD(&client->freePackets, sendQueue);
+    --client->freePacketCount;
 
-    TAILQ_FOREACH(msg, &client->inMessages, chain)
-    {
-        ++inMessagesCount;
-    }
+    /* Packets in the pool have been reset already */
+    packet->type = type;
+    packet->id = id;
 
-    return inMessagesCount + outMessagesCount - queued;
+    return packet;
 }
 
-MqttClient *MqttClientNew(const char *clientId)
+/* Frees the packet or keeps it in the pool. */
+static void MqttClientPacketFree(MqttClient *client, MqttPacket *packet)
 {
-    MqttClient *client;
-
-    client = calloc(1, sizeof(*client));
-
-    if (!client)
+    if (client->freePacketCount >= client->poolLimit)
     {
-        return NULL;
+        MqttPacketFree(packet);
+        return;
     }
 
-    client->clientId = bfromcstr(clientId);
-
-    client->stream.sock = -1;
+    MqttPacketReset(packet);
+    SIMPLEQ_INSERT_HEAD(&client->freePackets, packet, sendQueue);
+    ++client->freePacketCount;
+}
 
-    client->retryTimeout = 20;
+/*
+    Asks the producer of msg for the next at most size bytes of its payload.
+    Returns the number of bytes or -1 on failure.
+*/
+static int64_t MqttClientProduce(MqttClient *client, MqttMessage *msg,
+                                 void *buf, size_t size, int rewind)
+{
+    int64_t n;
 
-    client->maxQueued = 0;
-    client->maxInflight = 20;
+    if (size > MQTT_MESSAGE_CHUNK_SIZE)
+        size = MQTT_MESSAGE_CHUNK_SIZE;
 
-    client->state = MqttClientStateDisconnected;
+    n = msg->producer(client, buf, size, rewind, msg->releaseContext);
 
-    TAILQ_INIT(&client->outMessages);
-    TAILQ_INIT(&client->inMessages);
-    SIMPLEQ_INIT(&client->sendQueue);
+    if (n <= 0 || n > (int64_t) size)
+    {
+        LOG_ERROR("failed to produce the payload");
+        return -1;
+    }
 
-    return client;
+    return n;
 }
 
-void MqttClientFree(MqttClient *client)
+/*
+    Produces what is left to write of a packet whose writing has started
+    into memory so that the producer is no longer needed. Returns -1 on
+    failure.
+*/
+static int MqttClientProduceRemainder(MqttClient *client, MqttPacket *packet)
 {
-    MqttClientClearQueues(client);
-
-    bdestroy(client->clientId);
-    bdestroy(client->willTopic);
-    bdestroy(client->willMessage);
-    bdestroy(client->host);
-    bdestroy(client->userName);
-    bdestroy(client->password);
+    size_t unwritten = 0;
+    size_t buffered = 0;
+    size_t left = packet->streamSize;
+    size_t size;
+    unsigned char *data;
+    int64_t n;
 
-    if (client->stream.sock != -1)
+    if (packet->state == MqttPacketStateWriteData)
+    {
+        unwritten = packet->remainingLength;
+    }
+    else
     {
-        SocketDisconnect(client->stream.sock);
+        /* Only the head of the queue is in MqttPacketStateWritePayload */
+        buffered = client->produceLen - client->producePos;
+        left = packet->remainingLength - buffered;
     }
 
-    free(client);
-}
+    size = unwritten + buffered + left;
 
-void MqttClientSetUserData(MqttClient *client, void *userData)
-{
-    assert(client != NULL);
-    client->userData = userData;
-}
+    if (!(data = MqttMalloc(size)))
+        return -1;
 
-void *MqttClientGetUserData(MqttClient *client)
-{
-    assert(client != NULL);
-    return client->userData;
-}
+    memcpy(data, packet->data + packet->size - unwritten, unwritten);
+    memcpy(data + unwritten, client->produceBuffer + client->producePos,
+           buffered);
 
-void MqttClientSetOnConnect(MqttClient *client, MqttClientOnConnectCallback cb)
-{
-    assert(client != NULL);
-    client->onConnect = cb;
-}
+    while (left > 0)
+    {
+        n = MqttClientProduce(client, packet->message, data + size - left,
+                              left, left == packet->streamSize);
+        if (n == -1)
+        {
+            MqttFree(data);
+            return -1;
+        }
+        left -= (size_t) n;
+    }
 
-void MqttClientSetOnSubscribe(MqttClient *client,
-                              MqttClientOnSubscribeCallback cb)
-{
-    assert(client != NULL);
-    client->onSubscribe = cb;
-}
+    client->producePos = client->produceLen = 0;
 
-void MqttClientSetOnUnsubscribe(MqttClient *client,
-                                MqttClientOnUnsubscribeCallback cb)
-{
-    assert(client != NULL);
-    client->onUnsubscribe = cb;
-}
+    MqttPacketSetRemainder(packet, data, size);
 
-void MqttClientSetOnMessage(MqttClient *client,
-                            MqttClientOnMessageCallback cb)
-{
-    assert(client != NULL);
-    client->onMessage = cb;
+    return 0;
 }
 
-void MqttClientSetOnPublish(MqttClient *client,
-                            MqttClientOnPublishCallback cb)
+/*
+    Gives a borrowed payload back to the user, see MqttClientPublishZeroCopy
+    and MqttClientPublishStream, or closes the file of the payload, see
+    MqttClientPublishFile. Packets still waiting to be sent get a copy of it,
+    except resends of a produced payload that haven't started, which are
+    dropped. If the kernel may still be sending it without a copy, release
+    is delayed until it is done.
+*/
+static void MqttClientReleasePayload(MqttClient *client, MqttMessage *msg)
 {
-    assert(client != NULL);
-    client->onPublish = cb;
-}
-
-static const struct tagbstring MqttProtocolId = bsStatic("MQTT");
-static const char MqttProtocolLevel  = 0x04;
+    MqttPacket *packet;
+    MqttPacket *prev = NULL;
+    MqttPacket *next;
+    MqttPendingRelease *pending;
+    int rv;
 
-static unsigned char MqttClientConnectFlags(MqttClient *client)
-{
-    unsigned char connectFlags = 0;
+    if (!msg->userPayload && !msg->file && !msg->producer)
+        return;
 
-    if (client->cleanSession)
+    if (msg->queuedPackets > 0)
     {
-        connectFlags |= 0x02;
+        SIMPLEQ_FOREACH_SAFE(packet, &client->sendQueue, sendQueue, next)
+        {
+            if (packet->message != msg)
+            {
+                prev = packet;
+                continue;
+            }
+
+            if (packet->produced && !MqttPacketWriteStarted(packet))
+            {
+                MqttClientUnqueuePacket(client, prev, packet);
+                --msg->queuedPackets;
+                MqttClientPacketFree(client, packet);
+                continue;
+            }
+
+            if (packet->produced)
+                rv = MqttClientProduceRemainder(client, packet);
+            else
+                rv = MqttPacketCopyExternal(packet);
+
+            if (rv == -1)
+            {
+                /* The packet can't be sent anymore */
+                LOG_ERROR("failed to copy payload of a queued packet");
+                client->stopped = 1;
+            }
+
+            prev = packet;
+        }
     }
 
-    if (client->willTopic)
+    if (msg->file)
     {
-        connectFlags |= 0x04;
-        connectFlags |= (client->willQos & 3) << 3;
-        connectFlags |= (client->willRetain & 1) << 5;
+        MqttFileClose(msg->fd);
+        msg->file = 0;
+        msg->fd = 0;
+        msg->fileOffset = 0;
+        msg->fileSize = 0;
+        return;
     }
 
-    if (client->userName)
+    if (msg->release && msg->zeroCopyPending &&
+        client->stream.sock != -1 &&
+        !SocketStreamZeroCopyDone(&client->stream, msg->zeroCopyId))
     {
-        connectFlags |= 0x80;
-        if (client->password)
+        pending = MqttMalloc(sizeof(*pending));
+
+        if (pending)
         {
-            connectFlags |= 0x40;
+            pending->data = msg->userPayload;
+            pending->release = msg->release;
+            pending->context = msg->releaseContext;
+            pending->zeroCopyId = msg->zeroCopyId;
+            SIMPLEQ_INSERT_TAIL(&client->pendingReleases, pending, chain);
         }
+        else
+        {
+            LOG_WARNING("releasing payload before the kernel is done");
+            msg->release(client, msg->userPayload, msg->releaseContext);
+        }
+    }
+    else if (msg->release)
+    {
+        msg->release(client, msg->userPayload, msg->releaseContext);
     }
 
-    return connectFlags;
+    msg->userPayload = NULL;
+    msg->userPayloadSize = 0;
+    msg->producer = NULL;
+    msg->producedSize = 0;
+    msg->release = NULL;
+    msg->releaseContext = NULL;
+    msg->zeroCopyPending = 0;
 }
 
-int MqttClientConnect(MqttClient *client, const char *host, short port,
-                      int keepAlive, int cleanSession)
+/*
+    Calls the delayed releases whose zero copy sends have completed, or all
+    of them if force is 1 (the socket is closed).
+*/
+static void MqttClientFlushReleases(MqttClient *client, int force)
 {
-    int sock;
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    MqttPendingRelease *pending;
 
-    assert(client != NULL);
-    assert(host != NULL);
-
-    if (client->state != MqttClientStateDisconnected)
+    if (!force && SocketStreamReapZeroCopy(&client->stream) == -1)
     {
-        LOG_ERROR("client must be disconnected to connect");
-        return -1;
+        LOG_WARNING("failed to read zero copy completions");
     }
 
-    if (client->host)
-        bassigncstr(client->host, host);
-    else
-        client->host = bfromcstr(host);
-    client->port = port;
-    client->keepAlive = keepAlive;
-    client->cleanSession = cleanSession;
-
-    /* In case we are reconnecting */
-    client->stopped = 0;
-    client->pingSent = 0;
-    MqttClientClearQueues(client);
-
-    if (keepAlive < 0)
+    while ((pending = SIMPLEQ_FIRST(&client->pendingReleases)) != NULL &&
+           (force || SocketStreamZeroCopyDone(&client->stream,
+                                              pending->zeroCopyId)))
     {
-        LOG_ERROR("invalid keepAlive: %d", keepAlive);
-        return -1;
+        SIMPLEQ_REMOVE_HEAD(&client->pendingReleases, chain);
+        pending->release(client, pending->data, pending->context);
+        MqttFree(pending);
     }
+}
 
-    LOG_DEBUG("connecting");
+/*
+    Makes inPacket.payload the receive buffer of the client, empty if the
+    packet didn't have it yet, with room for size bytes and a terminator.
+    The buffer only grows here. Returns -1 on failure.
+*/
+static int MqttClientRecvBufferReserve(MqttClient *client, size_t size)
+{
+    bstring buf = client->inPacket.payload;
 
-    if ((sock = SocketConnect(host, port, 1)) == -1)
+    if (!buf)
     {
-        if (SocketErrno != SOCKET_EINPROGRESS)
-        {
-            LOG_ERROR("SocketConnect failed!");
+        if (!client->recvBuffer && !(client->recvBuffer = bfromcstr("")))
             return -1;
-        }
+        buf = client->recvBuffer;
+        buf->slen = 0;
+        buf->data[0] = '\0';
+        client->inPacket.payload = buf;
     }
 
-    if (SocketStreamOpen(&client->stream, sock) == -1)
-    {
+    if (size >= INT_MAX || balloc(buf, (int) size + 1) != BSTR_OK)
         return -1;
-    }
 
-    packet = MqttPacketNew(MqttPacketTypeConnect);
+    if ((size_t) buf->mlen > client->recvBufferPeak)
+        client->recvBufferPeak = (size_t) buf->mlen;
 
-    if (!packet)
-        return -1;
+    return 0;
+}
 
-    StringStreamInit(&ss);
+/*
+    Takes the receive buffer back from the packet that was received. A
+    buffer that grew beyond recvBufferKeep bytes for a large packet shrinks
+    back.
+*/
+static void MqttClientRecvBufferDone(MqttClient *client)
+{
+    bstring buf = client->recvBuffer;
 
-    StreamWriteMqttString(&MqttProtocolId, pss);
-    StreamWriteByte(MqttProtocolLevel, pss);
-    StreamWriteByte(MqttClientConnectFlags(client), pss);
-    StreamWriteUint16Be(client->keepAlive, pss);
-    StreamWriteMqttString(client->clientId, pss);
+    client->inPacket.payload = NULL;
 
-    if (client->willTopic)
+    if (!buf || (size_t) buf->mlen <= client->recvBufferKeep)
+        return;
+
+    buf->slen = 0;
+
+    if (client->recvBufferKeep == 0 ||
+        ballocmin(buf, (int) client->recvBufferKeep) != BSTR_OK)
     {
-        StreamWriteMqttString(client->willTopic, pss);
-        StreamWriteMqttString(client->willMessage, pss);
+        bdestroy(buf);
+        client->recvBuffer = NULL;
     }
+}
 
-    if (client->userName)
+/*
+    Forgets the packet being received, telling the application if it was
+    streaming a message.
+*/
+static void MqttClientAbortRecv(MqttClient *client)
+{
+    if (client->streamHeaderSize > 0 && client->streamDeliver &&
+        !client->recvDiscard && client->onMessageEnd)
     {
-        StreamWriteMqttString(client->userName, pss);
-        if(client->password)
-        {
-            StreamWriteMqttString(client->password, pss);
-        }
+        client->onMessageEnd(client, 0);
     }
 
-    packet->payload = ss.buffer;
-
-    MqttClientQueuePacket(client, packet);
-
-    client->state = MqttClientStateConnecting;
+    client->streamHeaderSize = 0;
+    client->streamDeliver = 0;
+    client->recvDiscard = 0;
 
-    return 0;
+    MqttClientRecvBufferDone(client);
+    client->inPacket.state = MqttPacketStateReadType;
 }
 
-int MqttClientDisconnect(MqttClient *client)
+/* Closes the connection and drops what depended on it. */
+static void MqttClientClose(MqttClient *client)
 {
-    LOG_DEBUG("disconnecting");
-    return MqttClientQueueSimplePacket(client, MqttPacketTypeDisconnect);
+    StreamClose(&client->stream.base);
+    MqttLoopEntryClosed(&client->loopEntry);
+    MqttClientFlushReleases(client, 1);
+    MqttClientAbortRecv(client);
 }
 
-int MqttClientIsConnected(MqttClient *client)
+static MqttMessage *MqttClientMessageNew(MqttClient *client)
 {
-    return client->stream.sock != -1 &&
-           client->state == MqttClientStateConnected;
+    MqttMessage *msg = TAILQ_FIRST(&client->freeMessages);
+
+    if (!msg)
+        return MqttCalloc(1, sizeof(*msg));
+
+    TAILQ_REMOVE(&client->freeMessages, msg, chain);
+    --client->freeMessageCount;
+
+    return msg;
 }
 
-int MqttClientRunOnce(MqttClient *client, int timeout)
+/* Frees the message or keeps it in the pool. */
+static void MqttClientMessageFree(MqttClient *client, MqttMessage *msg)
 {
-    int rv;
-    int events = 0;
+    MqttClientReleasePayload(client, msg);
 
-    assert(client != NULL);
+    if (client->freeMessageCount >= client->poolLimit)
+    {
+        MqttMessageFree(msg);
+        return;
+    }
 
-    if (client->stream.sock == -1)
+    MqttMessageReset(msg);
+    TAILQ_INSERT_HEAD(&client->freeMessages, msg, chain);
+    ++client->freeMessageCount;
+}
+
+/* Frees pooled packets and messages until there are at most max of each. */
+static void MqttClientTrimPools(MqttClient *client, int max)
+{
+    while (client->freePacketCount > max)
     {
-        LOG_ERROR("invalid socket");
-        return -1;
+        MqttPacket *packet = SIMPLEQ_FIRST(&client->freePackets);
+        SIMPLEQ_REMOVE_HEAD(&client->freePackets, sendQueue);
+        --client->freePacketCount;
+        MqttPacketFree(packet);
     }
 
-    if (client->state == MqttClientStateConnected)
+    while (client->freeMessageCount > max)
     {
-        events = EV_READ;
+        MqttMessage *msg = TAILQ_FIRST(&client->freeMessages);
+        TAILQ_REMOVE(&client->freeMessages, msg, chain);
+        --client->freeMessageCount;
+        MqttMessageFree(msg);
+    }
+}
 
-        /* Handle outMessages and inMessages, moving queued messages to sendQueue
-           if there are less than maxInflight number of messages in flight */
-        MqttClientProcessMessageQueue(client);
+static MQTT_INLINE int MqttClientInflightMessageCount(MqttClient *client)
+{
+    return (int) (client->inIndex.count + client->outIndex.count) -
+        client->outQueued;
+}
 
-        if (SIMPLEQ_EMPTY(&client->sendQueue))
+static MQTT_INLINE int MqttClientOutMessagesLen(MqttClient *client)
+{
+    return (int) client->outIndex.count;
+}
+
+/* Stops the retry timer of the message if it is running. */
+static void MqttClientDisarmRetry(MqttClient *client, MqttMessage *msg)
+{
+    if (msg->retryArmed)
+    {
+        TAILQ_REMOVE(&client->retryMessages, msg, retry);
+        msg->retryArmed = 0;
+    }
+}
+
+/*
+    (Re)starts the retry timer of the message from time. All messages share
+    the same retry timeout so keeping the list ordered by the send time keeps
+    it ordered by the deadline too. Time never goes backwards so the message
+    nearly always goes to the tail.
+*/
+static void MqttClientArmRetry(MqttClient *client, MqttMessage *msg,
+                               int64_t time)
+{
+    MqttMessage *prev;
+
+    MqttClientDisarmRetry(client, msg);
+
+    msg->timestamp = time;
+    msg->retryArmed = 1;
+
+    prev = TAILQ_LAST(&client->retryMessages, MqttMessageList);
+
+    while (prev && prev->timestamp > time)
+        prev = TAILQ_PREV(prev, MqttMessageList, retry);
+
+    if (prev)
+        TAILQ_INSERT_AFTER(&client->retryMessages, prev, msg, retry);
+    else
+        TAILQ_INSERT_HEAD(&client->retryMessages, msg, retry);
+}
+
+/*
+    Drops the PUBLISH packets of a message that haven't started to be sent.
+    A QoS 2 resend must not be sent after the PUBREL, which is queued in an
+    earlier lane, or the receiver would take it for a new message.
+*/
+static void MqttClientUnqueueResends(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet;
+    MqttPacket *prev = NULL;
+    MqttPacket *next;
+
+    if (msg->queuedPackets == 0)
+        return;
+
+    SIMPLEQ_FOREACH_SAFE(packet, &client->sendQueue, sendQueue, next)
+    {
+        if (packet->message == msg &&
+            packet->type == MqttPacketTypePublish &&
+            !MqttPacketWriteStarted(packet))
+        {
+            MqttClientUnqueuePacket(client, prev, packet);
+            --msg->queuedPackets;
+            MqttClientPacketFree(client, packet);
+            continue;
+        }
+
+        prev = packet;
+    }
+}
+
+/*
+    Detaches a message that is about to be freed from the packets that are
+    still waiting to be sent, for example a resent PUBLISH whose original
+    was acknowledged in the meantime.
+*/
+static void MqttClientForgetMessage(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet;
+
+    MqttClientDisarmRetry(client, msg);
+
+    MqttClientReleasePayload(client, msg);
+
+    if (msg->queuedPackets == 0)
+        return;
+
+    SIMPLEQ_FOREACH(packet, &client->sendQueue, sendQueue)
+    {
+        if (packet->message == msg)
+            packet->message = NULL;
+    }
+
+    msg->queuedPackets = 0;
+}
+
+/*
+    The following keep the message lists, their indexes and the counters
+    above in sync. Messages must be added and removed only with these.
+*/
+
+static int MqttClientAddOutMessage(MqttClient *client, MqttMessage *msg)
+{
+    if (MqttMessageIndexInsert(&client->outIndex, msg) == -1)
+        return -1;
+    TAILQ_INSERT_TAIL(&client->outMessages, msg, chain);
+    if (msg->state == MqttMessageStateQueued)
+    {
+        TAILQ_INSERT_TAIL(&client->queuedMessages, msg, queue);
+        ++client->outQueued;
+    }
+    return 0;
+}
+
+static void MqttClientRemoveOutMessage(MqttClient *client, MqttMessage *msg)
+{
+    TAILQ_REMOVE(&client->outMessages, msg, chain);
+    MqttMessageIndexRemove(&client->outIndex, msg->id);
+    if (msg->state == MqttMessageStateQueued)
+    {
+        TAILQ_REMOVE(&client->queuedMessages, msg, queue);
+        --client->outQueued;
+    }
+    MqttClientForgetMessage(client, msg);
+}
+
+static int MqttClientAddInMessage(MqttClient *client, MqttMessage *msg)
+{
+    if (MqttMessageIndexInsert(&client->inIndex, msg) == -1)
+        return -1;
+    TAILQ_INSERT_TAIL(&client->inMessages, msg, chain);
+    return 0;
+}
+
+static void MqttClientRemoveInMessage(MqttClient *client, MqttMessage *msg)
+{
+    TAILQ_REMOVE(&client->inMessages, msg, chain);
+    MqttMessageIndexRemove(&client->inIndex, msg->id);
+    MqttClientForgetMessage(client, msg);
+}
+
+MqttClient *MqttClientNew(const char *clientId)
+{
+    return MqttClientNewWithAllocator(clientId, NULL);
+}
+
+MqttClient *MqttClientNewWithAllocator(const char *clientId,
+                                       const MqttAllocator *allocator)
+{
+    const MqttAllocator *previous;
+    MqttClient *client;
+
+    previous = MqttAllocatorEnter(allocator);
+
+    client = MqttCalloc(1, sizeof(*client));
+
+    if (!client)
+    {
+        MqttAllocatorLeave(previous);
+        return NULL;
+    }
+
+    if (allocator)
+    {
+        client->allocatorStorage = *allocator;
+        client->allocator = &client->allocatorStorage;
+    }
+
+    client->clientId = bfromcstr(clientId);
+
+    client->stream.sock = -1;
+
+    client->retryTimeout = 20;
+
+    client->maxQueued = 0;
+    client->maxInflight = 20;
+
+    client->recvBudgetPackets = MQTT_RECV_BUDGET_PACKETS;
+    client->recvBudgetUs = MQTT_RECV_BUDGET_US;
+
+    client->state = MqttClientStateDisconnected;
+
+    TAILQ_INIT(&client->outMessages);
+    TAILQ_INIT(&client->inMessages);
+    TAILQ_INIT(&client->queuedMessages);
+    TAILQ_INIT(&client->retryMessages);
+    SIMPLEQ_INIT(&client->sendQueue);
+    SIMPLEQ_INIT(&client->freePackets);
+    TAILQ_INIT(&client->freeMessages);
+    SIMPLEQ_INIT(&client->pendingReleases);
+
+    client->poolLimit = MQTT_POOL_SIZE;
+
+    client->zeroCopyThreshold = MQTT_ZEROCOPY_THRESHOLD;
+
+    client->coalesceDelayUs = MQTT_COALESCE_DELAY_US;
+    client->coalesceMaxBytes = MQTT_COALESCE_MAX_BYTES;
+
+    client->qos0MaxCount = MQTT_QOS0_MAX_COUNT;
+    client->qos0MaxBytes = MQTT_QOS0_MAX_BYTES;
+    client->qos0Policy = MqttQueuePolicyDropOldest;
+
+    client->maxPacketSize = MQTT_MAX_PACKET_SIZE;
+
+    client->recvBufferKeep = MQTT_RECV_BUFFER_KEEP;
+    client->recvBufferIdleMs = MQTT_RECV_BUFFER_IDLE_MS;
+
+    MqttAllocatorLeave(previous);
+
+    return client;
+}
+
+void MqttClientFree(MqttClient *client)
+{
+    MqttAllocator allocator;
+    const MqttAllocator *previous;
+
+    if (client->loopEntry.loop)
+    {
+        MqttLoopRemove(client->loopEntry.loop, client);
+    }
+
+    /* The client itself is freed with its allocator too */
+    if (client->allocator)
+    {
+        allocator = *client->allocator;
+        previous = MqttAllocatorEnter(&allocator);
+    }
+    else
+    {
+        previous = MqttAllocatorEnter(NULL);
+    }
+
+    MqttClientClearQueues(client);
+
+    MqttMessageIndexFree(&client->outIndex);
+    MqttMessageIndexFree(&client->inIndex);
+
+    MqttClientTrimPools(client, 0);
+
+    bdestroy(client->clientId);
+    bdestroy(client->willTopic);
+    bdestroy(client->willMessage);
+    bdestroy(client->host);
+    bdestroy(client->userName);
+    bdestroy(client->password);
+
+    if (client->stream.sock != -1)
+    {
+        MqttClientClose(client);
+    }
+
+    MqttClientFlushReleases(client, 1);
+    MqttClientAbortRecv(client);
+
+    MqttFree(client->produceBuffer);
+    bdestroy(client->recvBuffer);
+
+    MqttFree(client);
+
+    MqttAllocatorLeave(previous);
+}
+
+void MqttClientSetUserData(MqttClient *client, void *userData)
+{
+    assert(client != NULL);
+    client->userData = userData;
+}
+
+void *MqttClientGetUserData(MqttClient *client)
+{
+    assert(client != NULL);
+    return client->userData;
+}
+
+void MqttClientSetOnConnect(MqttClient *client, MqttClientOnConnectCallback cb)
+{
+    assert(client != NULL);
+    client->onConnect = cb;
+}
+
+void MqttClientSetOnSubscribe(MqttClient *client,
+                              MqttClientOnSubscribeCallback cb)
+{
+    assert(client != NULL);
+    client->onSubscribe = cb;
+}
+
+void MqttClientSetOnUnsubscribe(MqttClient *client,
+                                MqttClientOnUnsubscribeCallback cb)
+{
+    assert(client != NULL);
+    client->onUnsubscribe = cb;
+}
+
+void MqttClientSetOnMessage(MqttClient *client,
+                            MqttClientOnMessageCallback cb)
+{
+    assert(client != NULL);
+    client->onMessage = cb;
+}
+
+void MqttClientSetOnMessageWithTopicLength(MqttClient *client,
+    MqttClientOnMessageWithTopicLengthCallback cb)
+{
+    assert(client != NULL);
+    client->onMessageWithTopicLength = cb;
+}
+
+void MqttClientSetOnPublish(MqttClient *client,
+                            MqttClientOnPublishCallback cb)
+{
+    assert(client != NULL);
+    client->onPublish = cb;
+}
+
+void MqttClientSetOnError(MqttClient *client, MqttClientOnErrorCallback cb)
+{
+    assert(client != NULL);
+    client->onError = cb;
+}
+
+void MqttClientSetOnMessageStream(MqttClient *client, size_t threshold,
+                                  MqttClientOnMessageBeginCallback begin,
+                                  MqttClientOnMessageDataCallback data,
+                                  MqttClientOnMessageEndCallback end)
+{
+    assert(client != NULL);
+    client->streamThreshold = threshold;
+    client->onMessageBegin = begin;
+    client->onMessageData = data;
+    client->onMessageEnd = end;
+}
+
+static const struct tagbstring MqttProtocolId = bsStatic("MQTT");
+static const char MqttProtocolLevel  = 0x04;
+
+static unsigned char MqttClientConnectFlags(MqttClient *client)
+{
+    unsigned char connectFlags = 0;
+
+    if (client->cleanSession)
+    {
+        connectFlags |= 0x02;
+    }
+
+    if (client->willTopic)
+    {
+        connectFlags |= 0x04;
+        connectFlags |= (client->willQos & 3) << 3;
+        connectFlags |= (client->willRetain & 1) << 5;
+    }
+
+    if (client->userName)
+    {
+        connectFlags |= 0x80;
+        if (client->password)
+        {
+            connectFlags |= 0x40;
+        }
+    }
+
+    return connectFlags;
+}
+
+static int MqttClientConnectImpl(MqttClient *client, const char *host,
+                                 short port, int keepAlive,
+                                 int cleanSession)
+{
+    int sock;
+    MqttPacket *packet;
+    size_t bodyLength;
+    unsigned char *p;
+
+    assert(client != NULL);
+    assert(host != NULL);
+
+    if (client->state != MqttClientStateDisconnected)
+    {
+        LOG_ERROR("client must be disconnected to connect");
+        return -1;
+    }
+
+    if (client->host)
+        bassigncstr(client->host, host);
+    else
+        client->host = bfromcstr(host);
+    client->port = port;
+    client->keepAlive = keepAlive;
+    client->cleanSession = cleanSession;
+
+    /* In case we are reconnecting */
+    client->stopped = 0;
+    client->pingSent = 0;
+    client->recvPending = 0;
+    MqttClientAbortRecv(client);
+    MqttClientClearQueues(client);
+
+    if (keepAlive < 0)
+    {
+        LOG_ERROR("invalid keepAlive: %d", keepAlive);
+        return -1;
+    }
+
+    LOG_DEBUG("connecting");
+
+    if ((sock = SocketConnect(host, port, 1)) == -1)
+    {
+        if (SocketErrno != SOCKET_EINPROGRESS)
+        {
+            LOG_ERROR("SocketConnect failed!");
+            return -1;
+        }
+    }
+
+    if (SocketStreamOpen(&client->stream, sock) == -1)
+    {
+        SocketDisconnect(sock);
+        return -1;
+    }
+
+    if (client->zeroCopyThreshold > 0 &&
+        SocketStreamEnableZeroCopy(&client->stream) == -1)
+    {
+        LOG_WARNING("MSG_ZEROCOPY not available, copying instead");
+    }
+
+    packet = MqttClientPacketNew(client, MqttPacketTypeConnect, 0);
+
+    if (!packet)
+        return -1;
+
+    bodyLength = MqttStringSize(blength(&MqttProtocolId)) + 1 + 1 + 2 +
+                 MqttStringSize(blength(client->clientId));
+
+    if (client->willTopic)
+    {
+        bodyLength += MqttStringSize(blength(client->willTopic)) +
+                      MqttStringSize(blength(client->willMessage));
+    }
+
+    if (client->userName)
+    {
+        bodyLength += MqttStringSize(blength(client->userName));
+        if (client->password)
+        {
+            bodyLength += MqttStringSize(blength(client->password));
+        }
+    }
+
+    if (!(p = MqttPacketAllocate(packet, bodyLength)))
+    {
+        MqttClientPacketFree(client, packet);
+        return -1;
+    }
+
+    p = MqttEncodeString(p, bdata(&MqttProtocolId), blength(&MqttProtocolId));
+    p = MqttEncodeByte(p, MqttProtocolLevel);
+    p = MqttEncodeByte(p, MqttClientConnectFlags(client));
+    p = MqttEncodeUint16Be(p, client->keepAlive);
+    p = MqttEncodeString(p, bdata(client->clientId), blength(client->clientId));
+
+    if (client->willTopic)
+    {
+        p = MqttEncodeString(p, bdata(client->willTopic),
+                             blength(client->willTopic));
+        p = MqttEncodeString(p, bdata(client->willMessage),
+                             blength(client->willMessage));
+    }
+
+    if (client->userName)
+    {
+        p = MqttEncodeString(p, bdata(client->userName),
+                             blength(client->userName));
+        if (client->password)
+        {
+            p = MqttEncodeString(p, bdata(client->password),
+                                 blength(client->password));
+        }
+    }
+
+    MqttClientQueuePacket(client, packet);
+
+    client->state = MqttClientStateConnecting;
+
+    return 0;
+}
+
+int MqttClientConnect(MqttClient *client, const char *host, short port,
+                      int keepAlive, int cleanSession)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientConnectImpl(client, host, port, keepAlive, cleanSession);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientDisconnect(MqttClient *client)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    LOG_DEBUG("disconnecting");
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientQueueSimplePacket(client, MqttPacketTypeDisconnect);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientIsConnected(MqttClient *client)
+{
+    return client->stream.sock != -1 &&
+           client->state == MqttClientStateConnected;
+}
+
+int MqttClientGetFd(MqttClient *client)
+{
+    assert(client != NULL);
+    return client->stream.sock;
+}
+
+/*
+    Returns 1 if the packets in sendQueue are held back to be sent together
+    with the ones queued after them, see MqttClientSetCoalescing. Only
+    PUBLISH packets are held, anything else is sent right away along with
+    them.
+*/
+static int MqttClientHoldSendQueue(MqttClient *client)
+{
+    MqttPacket *head = SIMPLEQ_FIRST(&client->sendQueue);
+
+    if (client->coalesceDelayUs <= 0 || client->coalesceStartUs == 0 ||
+        client->coalesceUrgent || !head || MqttPacketWriteStarted(head))
+    {
+        return 0;
+    }
+
+    if (client->coalesceMaxBytes > 0 &&
+        client->coalesceHeldBytes >= client->coalesceMaxBytes)
+    {
+        return 0;
+    }
+
+    return MqttGetCurrentTimeUs() - client->coalesceStartUs <
+        client->coalesceDelayUs;
+}
+
+static int MqttClientWantedEventsImpl(MqttClient *client)
+{
+    int events = 0;
+
+    assert(client != NULL);
+
+    if (client->stream.sock == -1)
+    {
+        return 0;
+    }
+
+    client->now = MqttGetCurrentTime();
+
+    if (client->state == MqttClientStateConnected)
+    {
+        events = EV_READ;
+
+        /* Handle outMessages and inMessages, moving queued messages to sendQueue
+           if there are less than maxInflight number of messages in flight */
+        MqttClientProcessMessageQueue(client);
+
+        if (SIMPLEQ_EMPTY(&client->sendQueue))
+        {
+            int64_t elapsed;
+
+            LOG_DEBUG("nothing to write");
+
+            // If there's nothing to write at this point and we haven't sent
+            // any packets in keepalive seconds, we should send a ping.
+
+            elapsed = client->now - client->lastPacketSentTime;
+            if (client->keepAlive > 0 && !client->pingSent &&
+                elapsed >= client->keepAlive*1000)
+            {
+                MqttClientQueueSimplePacket(client, MqttPacketTypePingReq);
+                client->pingSent = 1;
+                client->pingSentTime = client->now;
+                events |= EV_WRITE;
+            }
+        }
+        else if (!MqttClientHoldSendQueue(client))
+        {
+            events |= EV_WRITE;
+        }
+    }
+    else if (client->state == MqttClientStateConnecting)
+    {
+        events = EV_WRITE;
+    }
+
+    return events;
+}
+
+int MqttClientWantedEvents(MqttClient *client)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientWantedEventsImpl(client);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static MQTT_INLINE int64_t MqttDeadlineMin(int64_t a, int64_t b)
+{
+    if (a == -1)
+        return b;
+    if (b == -1)
+        return a;
+    return a < b ? a : b;
+}
+
+int64_t MqttClientNextDeadline(MqttClient *client)
+{
+    int64_t deadline = -1;
+    MqttMessage *msg;
+
+    assert(client != NULL);
+
+    if (client->stream.sock == -1 ||
+        client->state != MqttClientStateConnected)
+    {
+        return -1;
+    }
+
+    /* Received data is waiting to be handled right away */
+    if (client->recvPending)
+    {
+        return client->now;
+    }
+    if (client->keepAlive > 0)
+    {
+        if (client->pingSent)
+        {
+            deadline = client->pingSentTime + client->keepAlive*1000;
+        }
+        else if (SIMPLEQ_EMPTY(&client->sendQueue))
+        {
+            deadline = client->lastPacketSentTime + client->keepAlive*1000;
+        }
+    }
+
+    /* The first message to retry is always at the head */
+    if ((msg = TAILQ_FIRST(&client->retryMessages)) != NULL)
+    {
+        deadline = MqttDeadlineMin(deadline,
+                                   msg->timestamp + client->retryTimeout*1000);
+    }
+
+    /* Held packets are sent once the millisecond the delay ends in is
+       over */
+    if (client->coalesceStartUs != 0 && !SIMPLEQ_EMPTY(&client->sendQueue))
+    {
+        deadline = MqttDeadlineMin(deadline,
+            (client->coalesceStartUs + client->coalesceDelayUs + 999) / 1000);
+    }
+
+    return deadline;
+}
+
+int MqttClientNextTimeoutMs(MqttClient *client)
+{
+    int64_t deadline = MqttClientNextDeadline(client);
+    int64_t timeout;
+
+    if (deadline == -1)
+        return -1;
+
+    timeout = deadline - MqttGetCurrentTime();
+
+    if (timeout < 0)
+        return 0;
+
+    return timeout < INT_MAX ? (int) timeout : INT_MAX;
+}
+
+static int MqttClientHandleEventsImpl(MqttClient *client, int events)
+{
+    assert(client != NULL);
+
+    if (client->stream.sock == -1)
+    {
+        LOG_ERROR("invalid socket");
+        return -1;
+    }
+
+    client->now = MqttGetCurrentTime();
+
+    /* Held packets whose delay is over are sent without waiting for the
+       socket to be reported writable, which it most likely is */
+    if (client->state == MqttClientStateConnected &&
+        client->coalesceStartUs != 0 && !SIMPLEQ_EMPTY(&client->sendQueue) &&
+        !MqttClientHoldSendQueue(client))
+    {
+        events |= EV_WRITE;
+    }
+
+    if (events & EV_WRITE)
+    {
+        LOG_DEBUG("socket writable");
+
+        if (client->state == MqttClientStateConnecting)
+        {
+            int sockError;
+            SocketGetError(client->stream.sock, &sockError);
+            LOG_DEBUG("sockError: %d", sockError);
+            if (sockError == 0)
+            {
+                LOG_DEBUG("connected!");
+                client->state = MqttClientStateConnected;
+                return 0;
+            }
+        }
+
+        if (MqttClientSendPacket(client) == -1)
+        {
+            LOG_ERROR("MqttClientSendPacket failed");
+            client->stopped = 1;
+        }
+    }
+
+    if ((events & EV_READ) || client->recvPending)
+    {
+        LOG_DEBUG("socket readable");
+
+        if (MqttClientRecvPacket(client) == -1)
+        {
+            LOG_ERROR("MqttClientRecvPacket failed");
+            client->stopped = 1;
+        }
+
+        /* Send the acknowledgements for what we just received in the same
+           pass instead of waiting for the next writable event. */
+        if (!client->stopped && !SIMPLEQ_EMPTY(&client->sendQueue) &&
+            MqttClientSendPacket(client) == -1)
+        {
+            LOG_ERROR("MqttClientSendPacket failed");
+            client->stopped = 1;
+        }
+    }
+
+    if (client->pingSent &&
+        client->now - client->pingSentTime >= client->keepAlive*1000)
+    {
+        LOG_ERROR("no PINGRESP received in time");
+        client->pingSent = 0;
+        client->stopped = 1;
+    }
+
+    /* Completions of zero copy sends are read as soon as they may be
+       there, not only once a release waits for them, as poll() and epoll
+       report the socket until they are */
+    if (client->stream.zeroCopySent != client->stream.zeroCopyDone ||
+        !SIMPLEQ_EMPTY(&client->pendingReleases))
+    {
+        MqttClientFlushReleases(client, 0);
+    }
+
+    /* Checked whenever there are events to handle instead of with a
+       deadline of its own so that idle clients don't wake up for it. The
+       keepalive pings bound the delay. */
+    if (client->recvBuffer && !client->inPacket.payload &&
+        client->recvBufferIdleMs > 0 &&
+        client->now - client->lastPacketReceivedTime >=
+        client->recvBufferIdleMs)
+    {
+        bdestroy(client->recvBuffer);
+        client->recvBuffer = NULL;
+    }
+
+    if (client->stopped)
+    {
+        MqttClientClose(client);
+    }
+
+    return 0;
+}
+
+int MqttClientHandleEvents(MqttClient *client, int events)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientHandleEventsImpl(client, events);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientRunOnce(MqttClient *client, int timeout)
+{
+    int rv;
+    int events;
+    int64_t deadline;
+
+    assert(client != NULL);
+
+    if (client->stream.sock == -1)
+    {
+        LOG_ERROR("invalid socket");
+        return -1;
+    }
+
+    events = MqttClientWantedEvents(client);
+
+    if (events == 0)
+    {
+        LOG_ERROR("not connected");
+        return -1;
+    }
+
+    LOG_DEBUG("selecting");
+
+    /* Wait no longer than until the nearest retry or keepalive deadline.
+       This is also 0 if the previous call left received data unhandled. */
+    deadline = MqttClientNextDeadline(client);
+
+    if (deadline != -1)
+    {
+        int64_t untilDeadline = deadline - client->now;
+
+        if (untilDeadline < 0)
+            untilDeadline = 0;
+
+        if (timeout < 0 || untilDeadline < timeout)
+            timeout = untilDeadline < INT_MAX ? (int) untilDeadline : INT_MAX;
+    }
+    else if (timeout < 0)
+    {
+        timeout = 30 * 1000;
+    }
+
+    rv = SocketSelect(client->stream.sock, &events, timeout);
+
+    if (rv == -1)
+    {
+        LOG_ERROR("select failed");
+        return -1;
+    }
+    else if (rv == 0)
+    {
+        LOG_DEBUG("select timeout");
+    }
+
+    return MqttClientHandleEvents(client, events);
+}
+
+int MqttClientRun(MqttClient *client)
+{
+    assert(client != NULL);
+
+    while (!client->stopped)
+    {
+        if (MqttClientRunOnce(client, -1) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int MqttClientSubscribe(MqttClient *client, const char *topicFilter,
+                        int qos)
+{
+    return MqttClientSubscribeMany(client, &topicFilter, &qos, 1);
+}
+
+static int MqttClientSubscribeManyImpl(MqttClient *client,
+                                       const char **topicFilters,
+                                       int *qos, size_t count)
+{
+    MqttPacket *packet = NULL;
+    size_t i;
+    size_t bodyLength = 2;
+    unsigned char *p;
+
+    assert(client != NULL);
+    assert(topicFilters != NULL);
+    assert(*topicFilters != NULL);
+    assert(qos != NULL);
+    assert(count > 0);
+
+    packet = MqttClientPacketNew(client, MqttPacketTypeSubscribe,
+                                 MqttClientNextPacketId(client));
+
+    if (!packet)
+        return -1;
+
+    packet->flags = 0x2;
+
+    for (i = 0; i < count; ++i)
+    {
+        bodyLength += MqttStringSize(strlen(topicFilters[i])) + 1;
+    }
+
+    if (!(p = MqttPacketAllocate(packet, bodyLength)))
+    {
+        MqttClientPacketFree(client, packet);
+        return -1;
+    }
+
+    p = MqttEncodeUint16Be(p, packet->id);
+
+    LOG_DEBUG("SUBSCRIBE id:%d", (int) packet->id);
+
+    for (i = 0; i < count; ++i)
+    {
+        p = MqttEncodeString(p, topicFilters[i], strlen(topicFilters[i]));
+        p = MqttEncodeByte(p, qos[i] & 3);
+    }
+
+    MqttClientQueuePacket(client, packet);
+
+    return packet->id;
+}
+
+int MqttClientSubscribeMany(MqttClient *client, const char **topicFilters,
+                            int *qos, size_t count)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientSubscribeManyImpl(client, topicFilters, qos, count);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static int MqttClientUnsubscribeImpl(MqttClient *client,
+                                     const char *topicFilter)
+{
+    MqttPacket *packet = NULL;
+    size_t length;
+    unsigned char *p;
+
+    assert(client != NULL);
+    assert(topicFilter != NULL);
+
+    packet = MqttClientPacketNew(client, MqttPacketTypeUnsubscribe,
+                                 MqttClientNextPacketId(client));
+
+    if (!packet)
+        return -1;
+
+    packet->flags = 0x02;
+
+    length = strlen(topicFilter);
+
+    if (!(p = MqttPacketAllocate(packet, 2 + MqttStringSize(length))))
+    {
+        MqttClientPacketFree(client, packet);
+        return -1;
+    }
+
+    p = MqttEncodeUint16Be(p, packet->id);
+    p = MqttEncodeString(p, topicFilter, length);
+
+    MqttClientQueuePacket(client, packet);
+
+    return packet->id;
+}
+
+int MqttClientUnsubscribe(MqttClient *client, const char *topicFilter)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientUnsubscribeImpl(client, topicFilter);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static MqttPacket *PublishToPacket(MqttClient *client, MqttMessage *msg)
+{
+    MqttPacket *packet = NULL;
+    size_t bodyLength;
+    unsigned char *p;
+
+    packet = MqttClientPacketNew(client, MqttPacketTypePublish,
+                                 msg->qos > 0 ? msg->id : 0);
+
+    if (!packet)
+        return NULL;
+
+    packet->message = msg;
+    packet->flags = (msg->qos & 3) << 1;
+    packet->flags |= msg->retain & 1;
+    packet->priority = msg->priority;
+
+    /* Only the first byte of a resend changes, the packet writes it apart
+       from the shared buffer, see MqttPacketPrepareWrite */
+    if (msg->dup)
+        packet->flags |= 0x08;
+
+    if (msg->encoded)
+    {
+        MqttPacketUseShared(packet, msg->encoded, msg->encodedOffset,
+                            msg->encodedSize);
+        return packet;
+    }
+
+    /* The whole packet is encoded into one exactly sized buffer, except
+       for a borrowed payload which is sent from where it is. The message
+       keeps that buffer if it may be sent again. */
+    bodyLength = MqttStringSize(blength(msg->topic)) +
+                 (msg->qos > 0 ? 2 : 0);
+
+    if (msg->producer)
+    {
+        p = MqttPacketAllocateProduced(packet,
+                                       bodyLength + msg->producedSize,
+                                       msg->producedSize);
+    }
+    else if (msg->file)
+    {
+        p = MqttPacketAllocateFile(packet, bodyLength + msg->fileSize,
+                                   msg->fd, msg->fileOffset, msg->fileSize);
+    }
+    else if (msg->userPayload)
+    {
+        p = MqttPacketAllocateExternal(packet,
+                                       bodyLength + msg->userPayloadSize,
+                                       msg->userPayload,
+                                       msg->userPayloadSize);
+    }
+    else if (msg->qos > 0)
+    {
+        p = MqttPacketAllocateShared(packet,
+                                     bodyLength + blength(msg->payload));
+    }
+    else
+    {
+        p = MqttPacketAllocate(packet, bodyLength + blength(msg->payload));
+    }
+
+    if (!p)
+    {
+        MqttClientPacketFree(client, packet);
+        return NULL;
+    }
+
+    p = MqttEncodeString(p, bdata(msg->topic), blength(msg->topic));
+
+    if (msg->qos > 0)
+    {
+        p = MqttEncodeUint16Be(p, msg->id);
+    }
+
+    if (!msg->userPayload && !msg->file && !msg->producer)
+    {
+        p = MqttEncodeBytes(p, bdata(msg->payload), blength(msg->payload));
+    }
+
+    if (packet->shared)
+    {
+        msg->encoded = MqttPacketBufferRef(packet->shared);
+        msg->encodedOffset = 0;
+        msg->encodedSize = packet->size;
+    }
+
+    return packet;
+}
+
+static int MqttClientPublishImpl(MqttClient *client, int qos,
+                                 int retain, const char *topic,
+                                 const void *data, size_t size,
+                                 int priority)
+{
+    MqttMessage *message;
+
+    /* first check if the queue is already full */
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
+    {
+        return -1;
+    }
+
+    if (qos == 0)
+    {
+        /* Copy payload and topic directly from user buffers as we don't need
+           to keep the message data around after this function. The message
+           itself only lives for the encoding too. */
+        MqttMessage tmp;
+        MqttPacket *packet;
+        struct tagbstring bttopic, btpayload;
+
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.retain = retain;
+        tmp.priority = priority;
+
+        btfromcstr(bttopic, topic);
+        tmp.topic = &bttopic;
+
+        btfromblk(btpayload, data, size);
+        tmp.payload = &btpayload;
+
+        packet = PublishToPacket(client, &tmp);
+
+        if (!packet)
+            return -1;
+
+        packet->message = NULL;
+
+        if (MqttClientQueueQos0(client, packet) == -1)
         {
-            int64_t elapsed;
+            MqttClientPacketFree(client, packet);
+            return -1;
+        }
 
-            LOG_DEBUG("nothing to write");
+        return 0;
+    }
+    else
+    {
+        MqttPacket *packet;
+        struct tagbstring bttopic, btpayload;
 
-            // If there's nothing to write at this point and we haven't sent
-            // any packets in keepalive seconds, we should send a ping.
+        message = MqttClientMessageNew(client);
+        if (!message)
+        {
+            return -1;
+        }
 
-            elapsed = MqttGetCurrentTime() - client->lastPacketSentTime;
-            if (client->keepAlive > 0 && elapsed >= client->keepAlive*1000)
-            {
-                MqttClientQueueSimplePacket(client, MqttPacketTypePingReq);
-                client->pingSent = 1;
-                events |= EV_WRITE;
-            }
+        message->state = MqttMessageStateQueued;
+        message->qos = qos;
+        message->retain = retain;
+        message->priority = priority;
+        message->dup = 0;
+        message->id = MqttClientNextPacketId(client);
+
+        /* The message keeps the packet encoded from the user buffers
+           instead of copies of them, and sends it as is every time. */
+        btfromcstr(bttopic, topic);
+        message->topic = &bttopic;
+
+        btfromblk(btpayload, data, size);
+        message->payload = &btpayload;
+
+        packet = PublishToPacket(client, message);
+
+        message->topic = NULL;
+        message->payload = NULL;
+
+        if (!packet)
+        {
+            MqttClientMessageFree(client, message);
+            return -1;
         }
-        else
+
+        packet->message = NULL;
+        MqttClientPacketFree(client, packet);
+
+        if (MqttClientAddOutMessage(client, message) == -1)
         {
-            events |= EV_WRITE;
+            MqttClientMessageFree(client, message);
+            return -1;
         }
+
+        MqttLoopEntryChanged(&client->loopEntry);
+
+        return message->id;
     }
-    else if (client->state == MqttClientStateConnecting)
+}
+
+int MqttClientPublish(MqttClient *client, int qos, int retain,
+                      const char *topic, const void *data, size_t size)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishImpl(client, qos, retain, topic, data, size,
+                               MqttPriorityNormal);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientPublishWithPriority(MqttClient *client, int qos, int retain,
+                                  const char *topic, const void *data,
+                                  size_t size, int priority)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishImpl(client, qos, retain, topic, data, size,
+                               priority);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+/*
+    Publishes a message whose payload lives outside of it. A QoS 0 message is
+    not tracked, its packet frees it once sent. On failure the message is
+    freed without calling release. Returns like MqttClientPublish.
+*/
+static int MqttClientPublishMessage(MqttClient *client, MqttMessage *message)
+{
+    MqttPacket *packet;
+
+    if (!message->topic)
+        goto error;
+
+    if (message->qos == 0)
     {
-        events = EV_WRITE;
+        if (!(packet = PublishToPacket(client, message)))
+            goto error;
+
+        if (MqttClientQueueQos0(client, packet) == -1)
+        {
+            packet->message = NULL;
+            MqttClientPacketFree(client, packet);
+            goto error;
+        }
+
+        return 0;
     }
-    else
+
+    message->state = MqttMessageStateQueued;
+    message->id = MqttClientNextPacketId(client);
+
+    if (MqttClientAddOutMessage(client, message) == -1)
+        goto error;
+
+    MqttLoopEntryChanged(&client->loopEntry);
+
+    return message->id;
+
+error:
+    message->release = NULL;
+    MqttClientMessageFree(client, message);
+    return -1;
+}
+
+static int MqttClientPublishZeroCopyImpl(MqttClient *client, int qos,
+                                         int retain, const char *topic,
+                                         const void *data, size_t size,
+                                         MqttClientReleaseCallback release,
+                                         void *context)
+{
+    MqttMessage *message;
+
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
     {
-        LOG_ERROR("not connected");
         return -1;
     }
 
-    LOG_DEBUG("selecting");
+    message = MqttClientMessageNew(client);
 
-    if (timeout < 0)
+    if (!message)
+        return -1;
+
+    message->qos = qos;
+    message->retain = retain;
+    message->topic = bfromcstr(topic);
+    message->userPayload = data;
+    message->userPayloadSize = size;
+    message->release = release;
+    message->releaseContext = context;
+
+    return MqttClientPublishMessage(client, message);
+}
+
+int MqttClientPublishZeroCopy(MqttClient *client, int qos, int retain,
+                              const char *topic, const void *data,
+                              size_t size, MqttClientReleaseCallback release,
+                              void *context)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+    assert(data != NULL || size == 0);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishZeroCopyImpl(client, qos, retain, topic, data,
+                                       size, release, context);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static int MqttClientPublishFileImpl(MqttClient *client, int qos,
+                                     int retain, const char *topic, int fd,
+                                     int64_t offset, size_t length)
+{
+    MqttMessage *message;
+
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
+    {
+        return -1;
+    }
+
+    message = MqttClientMessageNew(client);
+
+    if (!message)
+        return -1;
+
+    message->qos = qos;
+    message->retain = retain;
+
+    /* The message owns a descriptor of its own so that it can outlive fd */
+    if ((message->fd = MqttFileDup(fd)) == -1)
+    {
+        LOG_ERROR("failed to duplicate the file descriptor");
+        MqttClientMessageFree(client, message);
+        return -1;
+    }
+
+    message->file = 1;
+    message->fileOffset = offset;
+    message->fileSize = length;
+    message->topic = bfromcstr(topic);
+
+    return MqttClientPublishMessage(client, message);
+}
+
+int MqttClientPublishFile(MqttClient *client, int qos, int retain,
+                          const char *topic, int fd, int64_t offset,
+                          size_t length)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+    assert(fd != -1);
+    assert(offset >= 0);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishFileImpl(client, qos, retain, topic, fd, offset,
+                                   length);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+static int MqttClientPublishStreamImpl(MqttClient *client, int qos,
+                                      int retain, const char *topic,
+                                      size_t size,
+                                      MqttClientProducerCallback read,
+                                      MqttClientReleaseCallback release,
+                                      void *context)
+{
+    MqttMessage *message;
+
+    if (qos > 0 && client->maxQueued > 0 &&
+        MqttClientOutMessagesLen(client) >= client->maxQueued)
+    {
+        return -1;
+    }
+
+    message = MqttClientMessageNew(client);
+
+    if (!message)
+        return -1;
+
+    message->qos = qos;
+    message->retain = retain;
+    message->topic = bfromcstr(topic);
+    message->producer = read;
+    message->producedSize = size;
+    message->release = release;
+    message->releaseContext = context;
+
+    return MqttClientPublishMessage(client, message);
+}
+
+int MqttClientPublishStream(MqttClient *client, int qos, int retain,
+                            const char *topic, size_t size,
+                            MqttClientProducerCallback read,
+                            MqttClientReleaseCallback release,
+                            void *context)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
+    assert(read != NULL);
+
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishStreamImpl(client, qos, retain, topic, size, read,
+                                     release, context);
+    MqttAllocatorLeave(previous);
+
+    return rv;
+}
+
+int MqttClientPublishCString(MqttClient *client, int qos, int retain,
+                             const char *topic, const char *msg)
+{
+    return MqttClientPublish(client, qos, retain, topic, msg, strlen(msg));
+}
+
+/* Returns the size of the body of the PUBLISH of spec. */
+static MQTT_INLINE size_t MqttPublishSpecBodyLength(const MqttPublishSpec *spec)
+{
+    return MqttStringSize(strlen(spec->topic)) + (spec->qos > 0 ? 2 : 0) +
+        spec->size;
+}
+
+static int MqttClientPublishManyImpl(MqttClient *client,
+                                     const MqttPublishSpec *specs,
+                                     size_t count, int *ids)
+{
+    MqttPacketBuffer *buffer;
+    size_t tracked = 0;
+    size_t total = 0;
+    size_t qos0Count = 0;
+    size_t qos0Bytes = 0;
+    size_t bodyLength;
+    size_t size;
+    size_t i;
+    unsigned char *p;
+
+    for (i = 0; i < count; ++i)
     {
-        timeout = client->keepAlive * 1000;
-        if (timeout == 0)
+        assert(specs[i].topic != NULL);
+        assert(specs[i].data != NULL || specs[i].size == 0);
+
+        bodyLength = MqttPublishSpecBodyLength(&specs[i]);
+
+        if (specs[i].qos < 0 || specs[i].qos > 2 ||
+            strlen(specs[i].topic) > 0xFFFF ||
+            bodyLength > MQTT_MAX_REMAINING_LENGTH)
+        {
+            LOG_ERROR("invalid message %lu", (unsigned long) i);
+            return -1;
+        }
+
+        size = MqttPacketHeaderSize(bodyLength) + bodyLength;
+
+        if (specs[i].qos > 0)
+        {
+            ++tracked;
+        }
+        else
         {
-            timeout = 30 * 1000;
+            ++qos0Count;
+            qos0Bytes += size;
         }
+
+        total += size;
     }
-    else if (timeout > (client->keepAlive * 1000) && client->keepAlive > 0)
+
+    /* All or nothing, so that the caller doesn't have to find out which
+       messages were left out */
+    if (tracked > 0 && client->maxQueued > 0 &&
+        (size_t) MqttClientOutMessagesLen(client) + tracked >
+        (size_t) client->maxQueued)
     {
-        timeout = client->keepAlive * 1000;
+        return -1;
     }
 
-    rv = SocketSelect(client->stream.sock, &events, timeout);
-
-    if (rv == -1)
+    if (qos0Count > 0 && client->qos0Policy == MqttQueuePolicyBlock &&
+        !MqttClientQos0Fits(client, qos0Count, qos0Bytes))
     {
-        LOG_ERROR("select failed");
         return -1;
     }
-    else if (rv)
+
+    if (count == 0)
+        return 0;
+
+    if (!(buffer = MqttPacketBufferNew(total)))
+        return -1;
+
+    p = buffer->data;
+
+    for (i = 0; i < count; ++i)
     {
-        LOG_DEBUG("select rv=%d", rv);
+        const MqttPublishSpec *spec = &specs[i];
+        int flags = ((spec->qos & 3) << 1) | (spec->retain & 1);
+        unsigned char *start = p;
+        MqttMessage *message = NULL;
+        MqttPacket *packet = NULL;
+        uint16_t id = 0;
 
-        if (events & EV_WRITE)
+        if (spec->qos > 0)
         {
-            LOG_DEBUG("socket writable");
+            if (!(message = MqttClientMessageNew(client)))
+                break;
+            id = MqttClientNextPacketId(client);
+        }
+        else if (!(packet = MqttClientPacketNew(client, MqttPacketTypePublish,
+                                                0)))
+        {
+            break;
+        }
 
-            if (client->state == MqttClientStateConnecting)
-            {
-                int sockError;
-                SocketGetError(client->stream.sock, &sockError);
-                LOG_DEBUG("sockError: %d", sockError);
-                if (sockError == 0)
-                {
-                    LOG_DEBUG("connected!");
-                    client->state = MqttClientStateConnected;
-                    return 0;
-                }
-            }
+        bodyLength = MqttPublishSpecBodyLength(spec);
+
+        p = MqttEncodeFixedHeader(p, MqttPacketTypePublish, flags,
+                                  bodyLength);
+        p = MqttEncodeString(p, spec->topic, strlen(spec->topic));
+
+        if (spec->qos > 0)
+            p = MqttEncodeUint16Be(p, id);
 
-            if (MqttClientSendPacket(client) == -1)
+        p = MqttEncodeBytes(p, spec->data, spec->size);
+
+        if (packet)
+        {
+            /* A QoS 0 message is sent right away like in MqttClientPublish */
+            packet->flags = flags;
+            packet->priority = spec->priority;
+            MqttPacketUseShared(packet, buffer, start - buffer->data,
+                                p - start);
+            if (MqttClientQueueQos0(client, packet) == -1)
             {
-                LOG_ERROR("MqttClientSendPacket failed");
-                client->stopped = 1;
+                MqttClientPacketFree(client, packet);
+                break;
             }
         }
-
-        if (events & EV_READ)
+        else
         {
-            LOG_DEBUG("socket readable");
-
-            if (MqttClientRecvPacket(client) == -1)
+            message->state = MqttMessageStateQueued;
+            message->qos = spec->qos;
+            message->retain = spec->retain;
+            message->priority = spec->priority;
+            message->id = id;
+            message->encoded = MqttPacketBufferRef(buffer);
+            message->encodedOffset = start - buffer->data;
+            message->encodedSize = p - start;
+
+            if (MqttClientAddOutMessage(client, message) == -1)
             {
-                LOG_ERROR("MqttClientRecvPacket failed");
-                client->stopped = 1;
+                MqttClientMessageFree(client, message);
+                break;
             }
         }
-    }
-    else
-    {
-        LOG_DEBUG("select timeout");
 
-        if (client->pingSent)
-        {
-            LOG_ERROR("no PINGRESP received in time");
-            client->pingSent = 0;
-            client->stopped = 1;
-        }
+        if (ids)
+            ids[i] = id;
     }
 
-    if (client->stopped)
+    /* The messages and packets hold the references from now on */
+    MqttPacketBufferUnref(buffer);
+
+    if (tracked > 0)
+        MqttLoopEntryChanged(&client->loopEntry);
+
+    if (i < count)
     {
-        SocketDisconnect(client->stream.sock);
-        client->stream.sock = -1;
+        LOG_ERROR("published %lu of %lu messages", (unsigned long) i,
+                  (unsigned long) count);
     }
 
-    return 0;
+    return i > 0 ? (int) i : -1;
 }
 
-int MqttClientRun(MqttClient *client)
+int MqttClientPublishMany(MqttClient *client, const MqttPublishSpec *specs,
+                          size_t count, int *ids)
 {
+    const MqttAllocator *previous;
+    int rv;
+
     assert(client != NULL);
+    assert(specs != NULL || count == 0);
 
-    while (!client->stopped)
-    {
-        if (MqttClientRunOnce(client, -1) == -1)
-            return -1;
-    }
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientPublishManyImpl(client, specs, count, ids);
+    MqttAllocatorLeave(previous);
 
-    return 0;
+    return rv;
 }
 
-int MqttClientSubscribe(MqttClient *client, const char *topicFilter,
-                        int qos)
+void MqttClientSetZeroCopyThreshold(MqttClient *client, size_t size)
 {
-    return MqttClientSubscribeMany(client, &topicFilter, &qos, 1);
+    assert(client != NULL);
+    client->zeroCopyThreshold = size;
 }
 
-int MqttClientSubscribeMany(MqttClient *client, const char **topicFilters,
-                            int *qos, size_t count)
+void MqttClientSetPublishRetryTimeout(MqttClient *client, int timeout)
 {
-    MqttPacket *packet = NULL;
-    size_t i;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-
     assert(client != NULL);
-    assert(topicFilters != NULL);
-    assert(*topicFilters != NULL);
-    assert(qos != NULL);
-    assert(count > 0);
-
-    packet = MqttPacketWithIdNew(MqttPacketTypeSubscribe,
-                                 MqttClientNextPacketId(client));
-
-    if (!packet)
-        return -1;
+    client->retryTimeout = timeout;
+}
 
-    packet->flags = 0x2;
+void MqttClientSetMaxMessagesInflight(MqttClient *client, int max)
+{
+    assert(client != NULL);
+    client->maxInflight = max;
+}
 
-    StringStreamInit(&ss);
+void MqttClientSetMaxQueuedMessages(MqttClient *client, int max)
+{
+    assert(client != NULL);
+    client->maxQueued = max;
+}
 
-    StreamWriteUint16Be(packet->id, pss);
+void MqttClientSetRecvBudget(MqttClient *client, int maxPackets,
+                             int maxTimeUs)
+{
+    assert(client != NULL);
+    client->recvBudgetPackets = maxPackets > 0 ? maxPackets : 0;
+    client->recvBudgetUs = maxTimeUs > 0 ? maxTimeUs : 0;
+}
 
-    LOG_DEBUG("SUBSCRIBE id:%d", (int) packet->id);
+void MqttClientSetPoolLimit(MqttClient *client, int max)
+{
+    const MqttAllocator *previous;
+    assert(client != NULL);
+    client->poolLimit = max > 0 ? max : 0;
+    previous = MqttAllocatorEnter(client->allocator);
+    MqttClientTrimPools(client, client->poolLimit);
+    MqttAllocatorLeave(previous);
+}
 
-    for (i = 0; i < count; ++i)
-    {
-        struct tagbstring filter;
-        btfromcstr(filter, topicFilters[i]);
-        StreamWriteMqttString(&filter, pss);
-        StreamWriteByte(qos[i] & 3, pss);
-    }
+void MqttClientSetMaxPacketSize(MqttClient *client, size_t max, int discard)
+{
+    assert(client != NULL);
+    client->maxPacketSize = max;
+    client->discardTooLarge = discard;
+}
 
-    packet->payload = ss.buffer;
+void MqttClientSetRecvBufferPolicy(MqttClient *client, size_t keep,
+                                   int idleMs)
+{
+    assert(client != NULL);
+    client->recvBufferKeep = keep;
+    client->recvBufferIdleMs = idleMs;
+}
 
-    MqttClientQueuePacket(client, packet);
+void MqttClientSetCoalescing(MqttClient *client, int delayUs,
+                             size_t maxBytes)
+{
+    assert(client != NULL);
+    client->coalesceDelayUs = delayUs > 0 ? delayUs : 0;
+    client->coalesceMaxBytes = maxBytes;
+    MqttLoopEntryChanged(&client->loopEntry);
+}
 
-    return packet->id;
+void MqttClientSetQos0Limit(MqttClient *client, size_t maxCount,
+                            size_t maxBytes, int policy)
+{
+    assert(client != NULL);
+    client->qos0MaxCount = maxCount;
+    client->qos0MaxBytes = maxBytes;
+    client->qos0Policy = policy;
 }
 
-int MqttClientUnsubscribe(MqttClient *client, const char *topicFilter)
+void MqttClientGetStats(MqttClient *client, MqttClientStats *stats)
 {
-    MqttPacket *packet = NULL;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-    struct tagbstring filter;
+    assert(client != NULL);
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(*stats));
+
+    stats->recvBufferSize = client->recvBuffer ?
+        (size_t) client->recvBuffer->mlen : 0;
+    stats->recvBufferPeak = client->recvBufferPeak;
+    stats->packetsTooLarge = client->packetsTooLarge;
+    stats->coalesceFlushes = client->coalesceFlushes;
+    stats->coalesceDelayTotalUs = client->coalesceDelayTotalUs;
+    stats->coalesceDelayMaxUs = client->coalesceDelayMaxUs;
+    stats->qos0Queued = client->qos0Queued;
+    stats->qos0QueuedBytes = client->qos0QueuedBytes;
+    stats->qos0Dropped = client->qos0Dropped;
+    stats->qos0DroppedBytes = client->qos0DroppedBytes;
+}
 
+void MqttClientShrinkPools(MqttClient *client)
+{
+    const MqttAllocator *previous;
     assert(client != NULL);
-    assert(topicFilter != NULL);
+    previous = MqttAllocatorEnter(client->allocator);
+    MqttClientTrimPools(client, 0);
+    MqttAllocatorLeave(previous);
+}
 
-    packet = MqttPacketWithIdNew(MqttPacketTypeUnsubscribe,
-                                 MqttClientNextPacketId(client));
+static int MqttClientSetWillImpl(MqttClient *client,
+                                 const char *topic,
+                                 const void *msg, size_t size,
+                                 int qos, int retain)
+{
+    assert(client != NULL);
 
-    if (!packet)
+    if (client->stream.sock != -1)
+    {
+        LOG_ERROR("MqttClientSetWill must be called before MqttClientConnect");
         return -1;
+    }
 
-    packet->flags = 0x02;
-
-    StringStreamInit(&ss);
-
-    StreamWriteUint16Be(packet->id, pss);
+    client->willTopic = bfromcstr(topic);
+    client->willMessage = blk2bstr(msg, size);
+    client->willQos = qos;
+    client->willRetain = retain;
 
-    btfromcstr(filter, topicFilter);
+    return 0;
+}
 
-    StreamWriteMqttString(&filter, pss);
+int MqttClientSetWill(MqttClient *client, const char *topic, const void *msg,
+                      size_t size, int qos, int retain)
+{
+    const MqttAllocator *previous;
+    int rv;
 
-    packet->payload = ss.buffer;
+    assert(client != NULL);
 
-    MqttClientQueuePacket(client, packet);
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientSetWillImpl(client, topic, msg, size, qos, retain);
+    MqttAllocatorLeave(previous);
 
-    return packet->id;
+    return rv;
 }
 
-static MQTT_INLINE int MqttClientOutMessagesLen(MqttClient *client)
+static int MqttClientSetAuthImpl(MqttClient *client, const char *userName,
+                                 const char *password)
 {
-    MqttMessage *msg;
-    int count = 0;
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
+    assert(client != NULL);
+
+    if (client->state == MqttClientStateConnecting)
     {
-        ++count;
+        LOG_ERROR("MqttClientSetAuth must be called before MqttClientConnect");
+        return -1;
     }
-    return count;
-}
-
-static MqttPacket *PublishToPacket(MqttMessage *msg)
-{
-    MqttPacket *packet = NULL;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
 
-    if (msg->qos > 0)
+    if (userName)
     {
-        packet = MqttPacketWithIdNew(MqttPacketTypePublish,
-                                     msg->id);
+        if (client->userName)
+            bassigncstr(client->userName, userName);
+        else
+            client->userName = bfromcstr(userName);
+
+        if (password)
+        {
+            if (client->password)
+                bassigncstr(client->password, password);
+            else
+                client->password = bfromcstr(password);
+        }
+        else
+        {
+            bdestroy(client->password);
+            client->password = NULL;
+        }
     }
     else
     {
-        packet = MqttPacketNew(MqttPacketTypePublish);
+        bdestroy(client->userName);
+        client->userName = NULL;
+
+        bdestroy(client->password);
+        client->password = NULL;
     }
 
-    if (!packet)
-        return NULL;
+    return 0;
+}
 
-    packet->message = msg;
+int MqttClientSetAuth(MqttClient *client, const char *userName,
+                      const char *password)
+{
+    const MqttAllocator *previous;
+    int rv;
+
+    assert(client != NULL);
 
-    StringStreamInit(&ss);
+    previous = MqttAllocatorEnter(client->allocator);
+    rv = MqttClientSetAuthImpl(client, userName, password);
+    MqttAllocatorLeave(previous);
 
-    StreamWriteMqttString(msg->topic, pss);
+    return rv;
+}
 
-    if (msg->qos > 0)
-    {
-        StreamWriteUint16Be(msg->id, pss);
-    }
+/* Returns the lane of sendQueue the packet goes to. */
+static int MqttClientSendLane(const MqttPacket *packet)
+{
+    if (packet->type == MqttPacketTypeDisconnect)
+        return MqttSendLaneDisconnect;
 
-    StreamWrite(bdata(msg->payload), blength(msg->payload), pss);
+    if (packet->type != MqttPacketTypePublish)
+        return MqttSendLaneControl;
 
-    packet->payload = ss.buffer;
-    packet->flags = (msg->qos & 3) << 1;
-    packet->flags |= msg->retain & 1;
+    if (packet->priority > MqttPriorityNormal)
+        return MqttSendLaneHigh;
 
-    return packet;
+    if (packet->priority < MqttPriorityNormal)
+        return MqttSendLaneLow;
+
+    switch ((packet->flags >> 1) & 3)
+    {
+        case 2: return MqttSendLaneQos2;
+        case 1: return MqttSendLaneQos1;
+        default: return MqttSendLaneQos0;
+    }
 }
 
-int MqttClientPublish(MqttClient *client, int qos, int retain,
-                      const char *topic, const void *data, size_t size)
+static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet)
 {
-    MqttMessage *message;
+    MqttPacket *head = SIMPLEQ_FIRST(&client->sendQueue);
+    MqttPacket *after = NULL;
+    int lane;
 
-    /* first check if the queue is already full */
-    if (qos > 0 && client->maxQueued > 0 &&
-        MqttClientOutMessagesLen(client) >= client->maxQueued)
+    assert(client != NULL);
+    LOG_DEBUG("queuing packet %s", MqttPacketName(packet->type));
+    if (packet->message)
+        ++packet->message->queuedPackets;
+    MqttPacketPrepareWrite(packet);
+    if (client->coalesceDelayUs > 0)
     {
-        return -1;
+        if (client->coalesceStartUs == 0)
+            client->coalesceStartUs = MqttGetCurrentTimeUs();
+        client->coalesceHeldBytes += packet->remainingLength +
+            packet->streamSize;
+        if (packet->type != MqttPacketTypePublish)
+            client->coalesceUrgent = 1;
     }
 
-    message = calloc(1, sizeof(*message));
-    if (!message)
+    /* A partly written head has to be finished first, whatever its lane */
+    if (head && MqttPacketWriteStarted(head) &&
+        client->sendLaneTails[head->lane] == head)
     {
-        return -1;
+        client->sendLaneTails[head->lane] = NULL;
     }
 
-    message->state = MqttMessageStateQueued;
-    message->qos = qos;
-    message->retain = retain;
-    message->dup = 0;
-    message->timestamp = MqttGetCurrentTime();
-
-    if (qos == 0)
-    {
-        /* Copy payload and topic directly from user buffers as we don't need
-           to keep the message data around after this function. */
-        MqttPacket *packet;
-        struct tagbstring bttopic, btpayload;
-
-        btfromcstr(bttopic, topic);
-        message->topic = &bttopic;
-
-        btfromblk(btpayload, data, size);
-        message->payload = &btpayload;
-
-        packet = PublishToPacket(message);
+    /* The packet goes after the last one of its lane or of the closest
+       lane before it */
+    packet->lane = MqttClientSendLane(packet);
 
-        message->topic = NULL;
-        message->payload = NULL;
-
-        MqttClientQueuePacket(client, packet);
+    for (lane = packet->lane; lane >= 0 && !after; --lane)
+        after = client->sendLaneTails[lane];
 
-        MqttMessageFree(message);
+    if (!after && head && MqttPacketWriteStarted(head))
+        after = head;
 
-        return 0;
-    }
+    if (after)
+        SIMPLEQ_INSERT_AFTER(&client->sendQueue, after, packet, sendQueue);
     else
-    {
-        /* Duplicate the user buffers as we need the data to be available
-           longer. */
-        message->topic = bfromcstr(topic);
-        message->payload = blk2bstr(data, size);
-
-        message->id = MqttClientNextPacketId(client);
-
-        TAILQ_INSERT_TAIL(&client->outMessages, message, chain);
-
-        return message->id;
-    }
-}
-
-int MqttClientPublishCString(MqttClient *client, int qos, int retain,
-                             const char *topic, const char *msg)
-{
-    return MqttClientPublish(client, qos, retain, topic, msg, strlen(msg));
-}
+        SIMPLEQ_INSERT_HEAD(&client->sendQueue, packet, sendQueue);
 
-void MqttClientSetPublishRetryTimeout(MqttClient *client, int timeout)
-{
-    assert(client != NULL);
-    client->retryTimeout = timeout;
+    client->sendLaneTails[packet->lane] = packet;
+
+    MqttLoopEntryChanged(&client->loopEntry);
 }
 
-void MqttClientSetMaxMessagesInflight(MqttClient *client, int max)
+/* Removes the packet, which follows prev or is the head if prev is NULL,
+   from sendQueue. */
+static void MqttClientUnqueuePacket(MqttClient *client, MqttPacket *prev,
+                                    MqttPacket *packet)
 {
-    assert(client != NULL);
-    client->maxInflight = max;
+    if (packet->queuedSize > 0)
+    {
+        --client->qos0Queued;
+        client->qos0QueuedBytes -= packet->queuedSize;
+        packet->queuedSize = 0;
+    }
+
+    if (client->sendLaneTails[packet->lane] == packet)
+    {
+        client->sendLaneTails[packet->lane] =
+            prev && prev->lane == packet->lane ? prev : NULL;
+    }
+
+    if (prev)
+        SIMPLEQ_REMOVE_AFTER(&client->sendQueue, prev, sendQueue);
+    else
+        SIMPLEQ_REMOVE_HEAD(&client->sendQueue, sendQueue);
 }
 
-void MqttClientSetMaxQueuedMessages(MqttClient *client, int max)
+/* Returns 1 if count more QoS 0 packets of size bytes in total fit in the
+   limits. */
+static int MqttClientQos0Fits(MqttClient *client, size_t count, size_t size)
 {
-    assert(client != NULL);
-    client->maxQueued = max;
+    return (client->qos0MaxCount == 0 ||
+            client->qos0Queued + count <= client->qos0MaxCount) &&
+           (client->qos0MaxBytes == 0 ||
+            client->qos0QueuedBytes + size <= client->qos0MaxBytes);
 }
 
-int MqttClientSetWill(MqttClient *client, const char *topic, const void *msg,
-                      size_t size, int qos, int retain)
+/* Returns 1 if a QoS 0 packet of size bytes would fit in the limits once
+   the queued QoS 0 packets that can be dropped were. */
+static int MqttClientQos0FitsAlone(MqttClient *client, size_t size)
 {
-    assert(client != NULL);
+    MqttPacket *head = SIMPLEQ_FIRST(&client->sendQueue);
+    size_t count = 1;
 
-    if (client->stream.sock != -1)
+    /* Only the head can have started to be sent */
+    if (head && head->queuedSize > 0 && MqttPacketWriteStarted(head))
     {
-        LOG_ERROR("MqttClientSetWill must be called before MqttClientConnect");
-        return -1;
+        ++count;
+        size += head->queuedSize;
     }
 
-    client->willTopic = bfromcstr(topic);
-    client->willMessage = blk2bstr(msg, size);
-    client->willQos = qos;
-    client->willRetain = retain;
-
-    return 0;
+    return (client->qos0MaxCount == 0 || count <= client->qos0MaxCount) &&
+           (client->qos0MaxBytes == 0 || size <= client->qos0MaxBytes);
 }
 
-int MqttClientSetAuth(MqttClient *client, const char *userName,
-                      const char *password)
+/* Counts and frees a QoS 0 packet that is not sent, see
+   MqttClientSetQos0Limit. */
+static void MqttClientDropQos0(MqttClient *client, MqttPacket *packet,
+                               size_t size)
 {
-    assert(client != NULL);
+    ++client->qos0Dropped;
+    client->qos0DroppedBytes += size;
 
-    if (client->state == MqttClientStateConnecting)
+    /* The message of a QoS 0 packet belongs to it and gives a borrowed
+       payload back */
+    if (packet->message)
     {
-        LOG_ERROR("MqttClientSetAuth must be called before MqttClientConnect");
-        return -1;
+        MqttClientMessageFree(client, packet->message);
+        packet->message = NULL;
     }
 
-    if (userName)
+    MqttClientPacketFree(client, packet);
+}
+
+/*
+    Drops the oldest QoS 0 packets of a lane of sendQueue that haven't
+    started to be sent until a packet of size bytes fits in the limits.
+*/
+static void MqttClientDropOldestQos0(MqttClient *client, int lane,
+                                     size_t size)
+{
+    MqttPacket *prev = NULL;
+    MqttPacket *queued;
+    MqttPacket *next;
+    int before;
+
+    /* The lane follows the last packet of the lanes before it */
+    for (before = lane - 1; before >= 0 && !prev; --before)
+        prev = client->sendLaneTails[before];
+
+    queued = prev ? SIMPLEQ_NEXT(prev, sendQueue) :
+        SIMPLEQ_FIRST(&client->sendQueue);
+
+    while (queued && !MqttClientQos0Fits(client, 1, size))
     {
-        if (client->userName)
-            bassigncstr(client->userName, userName);
-        else
-            client->userName = bfromcstr(userName);
+        next = SIMPLEQ_NEXT(queued, sendQueue);
 
-        if (password)
+        if (queued->lane == lane && queued->queuedSize > 0 &&
+            !MqttPacketWriteStarted(queued))
         {
-            if (client->password)
-                bassigncstr(client->password, password);
-            else
-                client->password = bfromcstr(password);
+            size_t queuedSize = queued->queuedSize;
+            MqttClientUnqueuePacket(client, prev, queued);
+            if (queued->message)
+                --queued->message->queuedPackets;
+            MqttClientDropQos0(client, queued, queuedSize);
+        }
+        else if (queued->lane > lane && !MqttPacketWriteStarted(queued))
+        {
+            /* Past the lane, only a packet being written at the head is
+               out of order */
+            break;
         }
         else
         {
-            bdestroy(client->password);
-            client->password = NULL;
+            prev = queued;
         }
+
+        queued = next;
     }
-    else
+}
+
+/*
+    Queues a QoS 0 PUBLISH within the limits of MqttClientSetQos0Limit or
+    drops it or older ones. Returns -1, leaving the packet to the caller, if
+    it doesn't fit and the policy is MqttQueuePolicyBlock.
+*/
+static int MqttClientQueueQos0(MqttClient *client, MqttPacket *packet)
+{
+    size_t size = packet->size + packet->externalSize + packet->streamSize;
+    uint64_t dropped = client->qos0Dropped;
+
+    if (!MqttClientQos0Fits(client, 1, size))
     {
-        bdestroy(client->userName);
-        client->userName = NULL;
+        if (client->qos0Policy == MqttQueuePolicyBlock)
+            return -1;
 
-        bdestroy(client->password);
-        client->password = NULL;
+        /* Nothing is dropped for a packet that can't fit anyway */
+        if (client->qos0Policy == MqttQueuePolicyDropOldest &&
+            MqttClientQos0FitsAlone(client, size))
+        {
+            /* The lanes QoS 0 packets can be in, lowest priority first */
+            static const int lanes[] = {
+                MqttSendLaneLow, MqttSendLaneQos0, MqttSendLaneHigh
+            };
+            size_t i;
+
+            for (i = 0; i < sizeof(lanes) / sizeof(lanes[0]) &&
+                 !MqttClientQos0Fits(client, 1, size); ++i)
+            {
+                MqttClientDropOldestQos0(client, lanes[i], size);
+            }
+        }
+
+        if (!MqttClientQos0Fits(client, 1, size))
+        {
+            MqttClientDropQos0(client, packet, size);
+            packet = NULL;
+        }
+
+        LOG_DEBUG("dropped %lu QoS 0 messages",
+                  (unsigned long) (client->qos0Dropped - dropped));
     }
 
-    return 0;
-}
+    if (packet)
+    {
+        MqttClientQueuePacket(client, packet);
+        packet->queuedSize = size;
+        ++client->qos0Queued;
+        client->qos0QueuedBytes += size;
+    }
 
-static void MqttClientQueuePacket(MqttClient *client, MqttPacket *packet)
-{
-    assert(client != NULL);
-    LOG_DEBUG("queuing packet %s", MqttPacketName(packet->type));
-    packet->state = MqttPacketStateWriteType;
-    SIMPLEQ_INSERT_TAIL(&client->sendQueue, packet, sendQueue);
+    /* Called last, the callback may publish again */
+    if (client->qos0Dropped != dropped && client->onError)
+        client->onError(client, MqttErrorQos0Dropped);
+
+    return 0;
 }
 
 static int MqttClientQueueSimplePacket(MqttClient *client, int type)
 {
-    MqttPacket *packet = MqttPacketNew(type);
+    MqttPacket *packet = MqttClientPacketNew(client, type, 0);
     if (!packet)
         return -1;
+    MqttPacketAllocate(packet, 0);
     MqttClientQueuePacket(client, packet);
     return 0;
 }
 
+static void MqttClientPacketSent(MqttClient *client, MqttPacket *packet)
+{
+    client->lastPacketSentTime = client->now;
+
+    if (packet->type == MqttPacketTypeDisconnect)
+    {
+        client->stopped = 1;
+        client->state = MqttClientStateDisconnected;
+    }
+
+    LOG_DEBUG("sent %s", MqttPacketName(packet->type));
+
+    if (packet->type == MqttPacketTypePublish && packet->message &&
+        packet->message->state == MqttMessageStatePublish)
+    {
+        MqttMessage *msg = packet->message;
+
+        if (msg->qos == 1)
+        {
+            msg->state = MqttMessageStateWaitPubAck;
+        }
+        else if (msg->qos == 2)
+        {
+            msg->state = MqttMessageStateWaitPubRec;
+        }
+    }
+
+    /* Everything sent with a message is acknowledged so start the retry
+       timer of the message. A QoS 0 message (from
+       MqttClientPublishZeroCopy) is done once sent. */
+    if (packet->message)
+    {
+        --packet->message->queuedPackets;
+        if (packet->message->qos == 0)
+            MqttClientMessageFree(client, packet->message);
+        else
+            MqttClientArmRetry(client, packet->message,
+                               client->lastPacketSentTime);
+    }
+
+    MqttClientUnqueuePacket(client, NULL, packet);
+
+    MqttClientPacketFree(client, packet);
+}
+
 static int MqttClientSendPacket(MqttClient *client)
 {
     MqttPacket *packet;
 
-    packet = SIMPLEQ_FIRST(&client->sendQueue);
-
-    if (!packet)
+    if (SIMPLEQ_EMPTY(&client->sendQueue))
     {
         LOG_WARNING("MqttClientSendPacket called with no queued packets");
         return 0;
     }
 
-    while (packet != NULL)
-    {
-        switch (packet->state)
-        {
-            case MqttPacketStateWriteType:
-            {
-                unsigned char typeAndFlags = ((packet->type & 0x0F) << 4) |
-                                             (packet->flags & 0x0F);
-
-                if (StreamWriteByte(typeAndFlags, &client->stream.base) == -1)
-                {
-                    if (SocketWouldBlock(SocketErrno))
-                        return 0;
-                    return -1;
-                }
+    if (MqttClientHoldSendQueue(client))
+        return 0;
 
-                packet->state = MqttPacketStateWriteRemainingLength;
-                packet->remainingLength = blength(packet->payload);
+    /* Everything queued so far goes out now, the next packet starts a new
+       delay */
+    if (client->coalesceStartUs != 0)
+    {
+        uint64_t delay = (uint64_t) (MqttGetCurrentTimeUs() -
+                                     client->coalesceStartUs);
+        ++client->coalesceFlushes;
+        client->coalesceDelayTotalUs += delay;
+        if (delay > client->coalesceDelayMaxUs)
+            client->coalesceDelayMaxUs = delay;
+        client->coalesceStartUs = 0;
+        client->coalesceHeldBytes = 0;
+        client->coalesceUrgent = 0;
+    }
+
+    /* Nothing is sent after DISCONNECT or a fatal error */
+    while (!client->stopped && !SIMPLEQ_EMPTY(&client->sendQueue))
+    {
+        StreamIoVec iov[STREAM_IOV_MAX];
+        int iovcnt = 0;
+        MqttPacket *zeroCopy = NULL;
+        MqttPacket *payload = NULL;
+        uint32_t zeroCopyId = client->stream.zeroCopySent;
+        int64_t total = 0;
+        int64_t nwritten;
+        size_t left;
+        int i, n;
+
+        /* Gather the unwritten parts of as many queued packets as fit */
+        SIMPLEQ_FOREACH(packet, &client->sendQueue, sendQueue)
+        {
+            if (iovcnt == STREAM_IOV_MAX)
+                break;
 
+            /* A payload from a file or a producer is sent on its own once
+               the rest of its packet has been written */
+            if (packet->state == MqttPacketStateWritePayload)
+            {
+                if (iovcnt == 0)
+                    payload = packet;
                 break;
             }
 
-            case MqttPacketStateWriteRemainingLength:
+            if (client->stream.zeroCopy && client->zeroCopyThreshold > 0 &&
+                packet->externalSize >= client->zeroCopyThreshold)
             {
-                if (StreamWriteRemainingLength(&packet->remainingLength,
-                                               &client->stream.base) == -1)
+                /* MSG_ZEROCOPY covers every buffer of the send but only the
+                   borrowed payload stays unchanged until the kernel is done,
+                   so it goes alone and the rest is copied as usual. */
+                if (packet->remainingLength > packet->externalSize)
                 {
-                    if (SocketWouldBlock(SocketErrno))
-                        return 0;
-                    return -1;
+                    iovcnt += MqttPacketWriteIov(packet, iov + iovcnt, 1);
+                }
+                else if (iovcnt == 0)
+                {
+                    iovcnt = MqttPacketWriteIov(packet, iov, 1);
+                    zeroCopy = packet;
                 }
-
-                packet->state = MqttPacketStateWritePayload;
-                packet->remainingLength = blength(packet->payload);
-
                 break;
             }
 
-            case MqttPacketStateWritePayload:
-            {
-                if (packet->payload)
-                {
-                    int64_t offset = blength(packet->payload) - packet->remainingLength;
-                    int64_t nwritten = 0;
-                    int towrite = 16*1024;
+            n = MqttPacketWriteIov(packet, iov + iovcnt,
+                                   STREAM_IOV_MAX - iovcnt);
 
-                    if (packet->remainingLength < 16*1024)
-                        towrite = packet->remainingLength;
-
-                    nwritten = StreamWrite(bdataofs(packet->payload, offset),
-                                           towrite,
-                                           &client->stream.base);
+            /* Packets encoded back to back (see MqttClientPublishMany) go
+               out as one buffer */
+            if (n > 0 && iovcnt > 0 &&
+                (const unsigned char *) iov[iovcnt - 1].data +
+                iov[iovcnt - 1].size == iov[iovcnt].data)
+            {
+                iov[iovcnt - 1].size += iov[iovcnt].size;
+                for (i = 1; i < n; ++i)
+                    iov[iovcnt + i - 1] = iov[iovcnt + i];
+                --n;
+            }
 
-                    if (nwritten == -1)
-                    {
-                        if (SocketWouldBlock(SocketErrno))
-                        {
-                            return 0;
-                        }
-                        return -1;
-                    }
+            iovcnt += n;
 
-                    packet->remainingLength -= nwritten;
+            if (packet->streamSize > 0)
+                break;
+        }
 
-                    LOG_DEBUG("nwritten:%d", (int) nwritten);
-                }
+        for (i = 0; i < iovcnt; ++i)
+        {
+            total += iov[i].size;
+        }
 
-                if (packet->remainingLength == 0)
+        if (payload && payload->produced)
+        {
+            if (client->producePos == client->produceLen)
+            {
+                if (!client->produceBuffer &&
+                    !(client->produceBuffer =
+                      MqttMalloc(MQTT_MESSAGE_CHUNK_SIZE)))
                 {
-                    LOG_DEBUG("packet payload sent");
-                    packet->state = MqttPacketStateWriteComplete;
+                    return -1;
                 }
 
-                break;
-            }
+                nwritten = MqttClientProduce(client, payload->message,
+                    client->produceBuffer, payload->remainingLength,
+                    payload->remainingLength == payload->streamSize);
 
-            case MqttPacketStateWriteComplete:
-            {
-                client->lastPacketSentTime = MqttGetCurrentTime();
+                if (nwritten == -1)
+                    return -1;
 
-                if (packet->type == MqttPacketTypeDisconnect)
-                {
-                    client->stopped = 1;
-                    client->state = MqttClientStateDisconnected;
-                }
+                client->producePos = 0;
+                client->produceLen = (size_t) nwritten;
+            }
 
-                LOG_DEBUG("sent %s", MqttPacketName(packet->type));
+            iov[0].data = client->produceBuffer + client->producePos;
+            iov[0].size = client->produceLen - client->producePos;
+            iovcnt = 1;
+            total = (int64_t) iov[0].size;
 
-                if (packet->type == MqttPacketTypePublish && packet->message)
-                {
-                    MqttMessage *msg = packet->message;
+            nwritten = StreamWritev(iov, iovcnt, &client->stream.base);
 
-                    if (msg->qos == 1)
-                    {
-                        msg->state = MqttMessageStateWaitPubAck;
-                    }
-                    else if (msg->qos == 2)
-                    {
-                        msg->state = MqttMessageStateWaitPubRec;
-                    }
-                }
+            if (nwritten > 0)
+                client->producePos += (size_t) nwritten;
+        }
+        else if (payload)
+        {
+            total = (int64_t) payload->remainingLength;
+            nwritten = SocketStreamSendFile(&client->stream, payload->fd,
+                                            MqttPacketFilePosition(payload),
+                                            payload->remainingLength);
+            if (nwritten == 0)
+            {
+                LOG_ERROR("file ended before the payload was sent");
+                return -1;
+            }
+        }
+        else if (zeroCopy)
+            nwritten = SocketStreamWritevZeroCopy(&client->stream, iov,
+                                                  iovcnt);
+        else
+            nwritten = StreamWritev(iov, iovcnt, &client->stream.base);
 
-                if (packet->message)
-                {
-                    packet->message->timestamp = client->lastPacketSentTime;
-                }
+        /* The kernel may now use the payload until the send completes */
+        if (zeroCopy && client->stream.zeroCopySent != zeroCopyId &&
+            zeroCopy->message)
+        {
+            zeroCopy->message->zeroCopyPending = 1;
+            zeroCopy->message->zeroCopyId = zeroCopyId;
+        }
+
+        if (nwritten == -1)
+        {
+            if (SocketWouldBlock(SocketErrno))
+                return 0;
+            return -1;
+        }
 
-                SIMPLEQ_REMOVE_HEAD(&client->sendQueue, sendQueue);
+        LOG_DEBUG("nwritten:%d", (int) nwritten);
 
-                MqttPacketFree(packet);
+        /* Consume the written bytes packet by packet. A packet that was only
+           partially written stays at the head of the queue and continues from
+           where it left off. */
+        left = (size_t) nwritten;
 
-                packet = SIMPLEQ_FIRST(&client->sendQueue);
+        while ((packet = SIMPLEQ_FIRST(&client->sendQueue)) != NULL)
+        {
+            left -= MqttPacketWriteAdvance(packet, left);
 
+            if (packet->state != MqttPacketStateWriteComplete)
                 break;
-            }
+
+            MqttClientPacketSent(client, packet);
+        }
+
+        if (nwritten < total)
+        {
+            /* Short write, the socket buffer is full */
+            return 0;
         }
     }
 
@@ -988,7 +3028,7 @@ static int MqttClientHandleSubAck(MqttClient *client)
         return -1;
     }
 
-    qos = malloc(count * sizeof(int));
+    qos = MqttMalloc(count * sizeof(int));
 
     for (i = 0; i < count; ++i)
     {
@@ -1002,115 +3042,148 @@ static int MqttClientHandleSubAck(MqttClient *client)
         client->onSubscribe(client, id, qos, count);
     }
 
-    free(qos);
+    MqttFree(qos);
 
     return 0;
 }
 
-static int MqttClientSendPubAck(MqttClient *client, uint16_t id)
+/* Queues a PUBACK, PUBREC, PUBREL or PUBCOMP. */
+static int MqttClientQueueAckPacket(MqttClient *client, int type, int flags,
+                                    uint16_t id, MqttMessage *msg)
 {
     MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    unsigned char *p;
 
-    packet = MqttPacketWithIdNew(MqttPacketTypePubAck, id);
+    packet = MqttClientPacketNew(client, type, id);
 
     if (!packet)
         return -1;
 
-    StringStreamInit(&ss);
+    packet->flags = flags;
+
+    /* Fits in the inline storage of the packet, can't fail */
+    p = MqttPacketAllocate(packet, 2);
 
-    StreamWriteUint16Be(id, pss);
+    MqttEncodeUint16Be(p, id);
 
-    packet->payload = ss.buffer;
+    packet->message = msg;
 
     MqttClientQueuePacket(client, packet);
 
     return 0;
 }
 
-static int MqttClientSendPubRec(MqttClient *client, MqttMessage *msg)
+static int MqttClientSendPubAck(MqttClient *client, uint16_t id)
 {
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-
-    packet = MqttPacketWithIdNew(MqttPacketTypePubRec, msg->id);
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubAck, 0, id,
+                                    NULL);
+}
 
-    if (!packet)
-        return -1;
+static int MqttClientSendPubRec(MqttClient *client, MqttMessage *msg)
+{
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubRec, 0, msg->id,
+                                    msg);
+}
 
-    StringStreamInit(&ss);
+static int MqttClientSendPubRel(MqttClient *client, MqttMessage *msg)
+{
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubRel, 0x2,
+                                    msg->id, msg);
+}
 
-    StreamWriteUint16Be(msg->id, pss);
+static int MqttClientSendPubComp(MqttClient *client, uint16_t id)
+{
+    return MqttClientQueueAckPacket(client, MqttPacketTypePubComp, 0, id,
+                                    NULL);
+}
 
-    packet->payload = ss.buffer;
-    packet->message = msg;
+/*
+    Resends PUBREC if a QoS 2 message with the id has been received before,
+    in which case the message must not be delivered again. Returns 1 if so.
+*/
+static int MqttClientIsDuplicatePublish(MqttClient *client, uint16_t id)
+{
+    MqttMessage *msg = MqttMessageIndexFind(&client->inIndex, id);
 
-    MqttClientQueuePacket(client, packet);
+    if (msg && msg->state == MqttMessageStateWaitPubRel)
+    {
+        LOG_DEBUG("resending PUBREC id:%u", msg->id);
+        MqttClientSendPubRec(client, msg);
+        return 1;
+    }
 
     return 0;
 }
 
-static int MqttClientSendPubRel(MqttClient *client, MqttMessage *msg)
+/* Acknowledges a delivered PUBLISH. */
+static int MqttClientAckPublish(MqttClient *client, int qos, uint16_t id)
 {
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-
-    packet = MqttPacketWithIdNew(MqttPacketTypePubRel, msg->id);
-
-    if (!packet)
-        return -1;
+    MqttMessage *msg;
 
-    packet->flags = 0x2;
+    if (qos == 1)
+    {
+        return MqttClientSendPubAck(client, id);
+    }
+    else if (qos == 2)
+    {
+        msg = MqttClientMessageNew(client);
 
-    StringStreamInit(&ss);
+        if (!msg)
+            return -1;
 
-    StreamWriteUint16Be(msg->id, pss);
+        msg->state = MqttMessageStateWaitPubRel;
+        msg->id = id;
+        msg->qos = qos;
 
-    packet->payload = ss.buffer;
-    packet->message = msg;
+        if (MqttClientAddInMessage(client, msg) == -1)
+        {
+            MqttClientMessageFree(client, msg);
+            return -1;
+        }
 
-    MqttClientQueuePacket(client, packet);
+        return MqttClientSendPubRec(client, msg);
+    }
 
     return 0;
 }
 
-static int MqttClientSendPubComp(MqttClient *client, uint16_t id)
+/* Finishes a streamed PUBLISH, see MqttClientRecvPublishHeader. */
+static int MqttClientEndPublishStream(MqttClient *client)
 {
-    MqttPacket *packet;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
-
-    packet = MqttPacketWithIdNew(MqttPacketTypePubComp, id);
+    int deliver = client->streamDeliver;
+    int discard = client->recvDiscard;
 
-    if (!packet)
-        return -1;
-
-    StringStreamInit(&ss);
-
-    StreamWriteUint16Be(id, pss);
+    client->streamHeaderSize = 0;
+    client->streamDeliver = 0;
+    client->recvDiscard = 0;
 
-    packet->payload = ss.buffer;
+    if (!deliver)
+        return 0;
 
-    MqttClientQueuePacket(client, packet);
+    /* A discarded message is acknowledged so that it isn't sent again */
+    if (client->onMessageEnd && !discard)
+        client->onMessageEnd(client, 1);
 
-    return 0;
+    return MqttClientAckPublish(client, (client->inPacket.flags >> 1) & 3,
+                                client->inPacket.id);
 }
 
 static int MqttClientHandlePublish(MqttClient *client)
 {
-    MqttMessage *msg;
-    uint16_t id;
-    StringStream ss;
-    Stream *pss = (Stream *) &ss;
+    uint16_t id = 0;
     MqttPacket *packet;
     int qos;
     int retain;
-    bstring topic;
+    unsigned char *p;
+    size_t length;
+    size_t topicLength;
+    size_t headerSize;
+    char *topic;
     void *payload;
-    int payloadSize;
+    size_t payloadSize;
+
+    if (client->streamHeaderSize > 0)
+        return MqttClientEndPublishStream(client);
 
     /* We are paused - do nothing */
     if (client->paused)
@@ -1121,73 +3194,66 @@ static int MqttClientHandlePublish(MqttClient *client)
     qos = (packet->flags >> 1) & 3;
     retain = packet->flags & 1;
 
-    StringStreamInitFromBstring(&ss, packet->payload);
+    /* The topic, packet id and payload are used where they are in the
+       received packet */
+    p = (unsigned char *) bdata(packet->payload);
+    length = (size_t) blength(packet->payload);
+
+    if (length < 2)
+    {
+        LOG_ERROR("invalid PUBLISH packet");
+        return -1;
+    }
+
+    topicLength = (size_t) ((p[0] << 8) | p[1]);
+    headerSize = 2 + topicLength + (qos > 0 ? 2 : 0);
 
-    StreamReadMqttString(&topic, pss);
+    if (headerSize > length)
+    {
+        LOG_ERROR("invalid PUBLISH packet");
+        return -1;
+    }
 
     if (qos > 0)
     {
-        StreamReadUint16Be(&id, pss);
+        id = (uint16_t) ((p[2 + topicLength] << 8) | p[2 + topicLength + 1]);
     }
 
-    payload = bdataofs(ss.buffer, ss.pos);
-    payloadSize = blength(ss.buffer) - ss.pos;
+    payload = p + headerSize;
+    payloadSize = length - headerSize;
 
-    if (qos == 2)
+    /* Check if we have sent a PUBREC previously with the same id. If we
+       have, we have to resend the PUBREC. We must not call the onMessage
+       callback again. */
+    if (qos == 2 && MqttClientIsDuplicatePublish(client, id))
     {
-        /* Check if we have sent a PUBREC previously with the same id. If we
-           have, we have to resend the PUBREC. We must not call the onMessage
-           callback again. */
+        return 0;
+    }
 
-        TAILQ_FOREACH(msg, &client->inMessages, chain)
-        {
-            if (msg->id == id &&
-                msg->state == MqttMessageStateWaitPubRel)
-            {
-                break;
-            }
-        }
+    /* Moving the topic over the length, which has been read, leaves room
+       for terminating it without touching the packet id or the payload */
+    topic = (char *) p + 1;
+    memmove(topic, p + 2, topicLength);
+    topic[topicLength] = '\0';
 
-        if (msg)
-        {
-            LOG_DEBUG("resending PUBREC id:%u", msg->id);
-            MqttClientSendPubRec(client, msg);
-            bdestroy(topic);
-            return 0;
-        }
+    if (client->onMessageWithTopicLength)
+    {
+        LOG_DEBUG("calling onMessage");
+        client->onMessageWithTopicLength(client, topic, topicLength, payload,
+                                         payloadSize, qos, retain);
     }
-
-    if (client->onMessage)
+    else if (client->onMessage)
     {
         LOG_DEBUG("calling onMessage");
         client->onMessage(client,
-            bdata(topic),
+            topic,
             payload,
             payloadSize,
             qos,
             retain);
     }
 
-    bdestroy(topic);
-
-    if (qos == 1)
-    {
-        MqttClientSendPubAck(client, id);
-    }
-    else if (qos == 2)
-    {
-        msg = calloc(1, sizeof(*msg));
-
-        msg->state = MqttMessageStateWaitPubRel;
-        msg->id = id;
-        msg->qos = qos;
-
-        TAILQ_INSERT_TAIL(&client->inMessages, msg, chain);
-
-        MqttClientSendPubRec(client, msg);
-    }
-
-    return 0;
+    return MqttClientAckPublish(client, qos, id);
 }
 
 static int MqttClientHandlePubAck(MqttClient *client)
@@ -1203,29 +3269,25 @@ static int MqttClientHandlePubAck(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        if (msg->id == id &&
-            msg->state == MqttMessageStateWaitPubAck)
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->outIndex, id);
 
-    if (!msg)
+    /* The original may be acknowledged while the message is being sent
+       again, and the resend after that */
+    if (!msg || (msg->state != MqttMessageStateWaitPubAck &&
+                 (msg->state != MqttMessageStatePublish || msg->qos != 1)))
     {
-        LOG_ERROR("no message found with id %d", (int) id);
-        return -1;
+        LOG_WARNING("no message found with id %d", (int) id);
+        return 0;
     }
 
-    TAILQ_REMOVE(&client->outMessages, msg, chain);
+    MqttClientRemoveOutMessage(client, msg);
 
     if (client->onPublish)
     {
         client->onPublish(client, msg->id);
     }
 
-    MqttMessageFree(msg);
+    MqttClientMessageFree(client, msg);
 
     return 0;
 }
@@ -1243,19 +3305,13 @@ static int MqttClientHandlePubRec(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        /* Also check if we are waiting for PUBCOMP, if we have sent PUBREL but
-           they haven't received it.  */
-        if (msg->id == id &&
-            (msg->state == MqttMessageStateWaitPubRec ||
-             msg->state == MqttMessageStateWaitPubComp))
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->outIndex, id);
 
-    if (!msg)
+    /* Also check if we are waiting for PUBCOMP, if we have sent PUBREL but
+       they haven't received it, or sending the PUBLISH again.  */
+    if (!msg || (msg->state != MqttMessageStateWaitPubRec &&
+                 msg->state != MqttMessageStateWaitPubComp &&
+                 (msg->state != MqttMessageStatePublish || msg->qos != 2)))
     {
         LOG_ERROR("no message found with id %d", (int) id);
         return -1;
@@ -1263,9 +3319,16 @@ static int MqttClientHandlePubRec(MqttClient *client)
 
     msg->state = MqttMessageStateWaitPubComp;
 
+    MqttClientUnqueueResends(client, msg);
+
+    MqttClientReleasePayload(client, msg);
+
     bdestroy(msg->payload);
     msg->payload = NULL;
 
+    MqttPacketBufferUnref(msg->encoded);
+    msg->encoded = NULL;
+
     bdestroy(msg->topic);
     msg->topic = NULL;
 
@@ -1288,23 +3351,16 @@ static int MqttClientHandlePubRel(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->inMessages, chain)
-    {
-        if (msg->id == id &&
-            msg->state == MqttMessageStateWaitPubRel)
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->inIndex, id);
 
-    if (!msg)
+    if (!msg || msg->state != MqttMessageStateWaitPubRel)
     {
         LOG_ERROR("no message found with id %d", (int) id);
         return -1;
     }
 
-    TAILQ_REMOVE(&client->inMessages, msg, chain);
-    MqttMessageFree(msg);
+    MqttClientRemoveInMessage(client, msg);
+    MqttClientMessageFree(client, msg);
 
     if (MqttClientSendPubComp(client, id) == -1)
         return -1;
@@ -1325,23 +3381,17 @@ static int MqttClientHandlePubComp(MqttClient *client)
 
     StreamReadUint16Be(&id, pss);
 
-    TAILQ_FOREACH(msg, &client->outMessages, chain)
-    {
-        if (msg->id == id && msg->state == MqttMessageStateWaitPubComp)
-        {
-            break;
-        }
-    }
+    msg = MqttMessageIndexFind(&client->outIndex, id);
 
-    if (!msg)
+    if (!msg || msg->state != MqttMessageStateWaitPubComp)
     {
         LOG_WARNING("no message found with id %d", (int) id);
         return 0;
     }
 
-    TAILQ_REMOVE(&client->outMessages, msg, chain);
+    MqttClientRemoveOutMessage(client, msg);
 
-    MqttMessageFree(msg);
+    MqttClientMessageFree(client, msg);
 
     if (client->onPublish)
     {
@@ -1420,16 +3470,203 @@ static int MqttClientHandlePacket(MqttClient *client)
             break;
     }
 
-    bdestroy(client->inPacket.payload);
-    client->inPacket.payload = NULL;
+    client->lastPacketReceivedTime = client->now;
+
+    MqttClientRecvBufferDone(client);
 
     client->inPacket.state = MqttPacketStateReadType;
 
     return rc;
 }
 
+/* Returns 1 if the receive budget starting at start is used up. */
+static int MqttClientRecvBudgetUsed(MqttClient *client, int packets,
+                                    int64_t start)
+{
+    if (client->recvBudgetPackets > 0 && packets >= client->recvBudgetPackets)
+        return 1;
+
+    if (client->recvBudgetUs > 0 &&
+        MqttGetCurrentTimeUs() - start >= client->recvBudgetUs)
+        return 1;
+
+    return 0;
+}
+
+/*
+    Reads the topic and packet id of a streamed PUBLISH into the payload of
+    inPacket and calls onMessageBegin. Returns 1 if it made progress, 0 if
+    the socket would block or -1 on error.
+*/
+static int MqttClientRecvPublishHeader(MqttClient *client)
+{
+    MqttPacket *packet = &client->inPacket;
+    int qos = (packet->flags >> 1) & 3;
+    size_t want = client->streamHeaderSize;
+    size_t have;
+    uint16_t topicLength;
+    int64_t nread;
+    unsigned char *p;
+
+    if (!packet->payload && MqttClientRecvBufferReserve(client, want) == -1)
+        return -1;
+
+    have = blength(packet->payload);
+
+    if (want - have > packet->remainingLength)
+    {
+        LOG_ERROR("invalid PUBLISH header");
+        return -1;
+    }
+
+    nread = StreamRead(bdataofs(packet->payload, have), want - have,
+                       &client->stream.base);
+
+    if (nread == -1)
+    {
+        if (SocketWouldBlock(SocketErrno))
+            return 0;
+        LOG_ERROR("failed reading packet payload");
+        return -1;
+    }
+    else if (nread == 0)
+    {
+        LOG_ERROR("socket disconnected");
+        return -1;
+    }
+
+    packet->remainingLength -= nread;
+    packet->payload->slen += nread;
+
+    if (have + nread < want)
+        return 1;
+
+    p = packet->payload->data;
+
+    if (want == 2)
+    {
+        /* The length of the topic tells how much more there is */
+        topicLength = (uint16_t) ((p[0] << 8) | p[1]);
+        client->streamHeaderSize = 2 + topicLength + (qos > 0 ? 2 : 0);
+        if (MqttClientRecvBufferReserve(client,
+                                        client->streamHeaderSize) == -1)
+            return -1;
+        return 1;
+    }
+
+    topicLength = (uint16_t) want - 2 - (qos > 0 ? 2 : 0);
+
+    if (qos > 0)
+        packet->id = (uint16_t) ((p[2 + topicLength] << 8) |
+                                 p[2 + topicLength + 1]);
+
+    /* The packet id has been read, the topic can be terminated over it */
+    p[2 + topicLength] = '\0';
+
+    client->streamDeliver = !client->paused &&
+        !(qos == 2 && MqttClientIsDuplicatePublish(client, packet->id));
+
+    if (client->streamDeliver && !client->recvDiscard)
+    {
+        client->onMessageBegin(client, (const char *) p + 2, topicLength,
+                               packet->remainingLength, qos,
+                               packet->flags & 1);
+    }
+
+    MqttClientRecvBufferDone(client);
+
+    packet->state = MqttPacketStateReadPublishPayload;
+
+    return 1;
+}
+
+/*
+    Rejects the packet being received for being larger than maxPacketSize
+    before anything is allocated for it. A PUBLISH is read past like a
+    streamed one, without passing it on, if discardTooLarge is 1. Returns 1
+    if receiving continues, -1 if the connection must be closed.
+*/
+static int MqttClientRejectPacket(MqttClient *client)
+{
+    MqttPacket *packet = &client->inPacket;
+
+    ++client->packetsTooLarge;
+
+    LOG_ERROR("%s of %lu bytes is larger than the limit of %lu bytes",
+              MqttPacketName(packet->type),
+              (unsigned long) packet->remainingLength,
+              (unsigned long) client->maxPacketSize);
+
+    if (client->onError)
+        client->onError(client, MqttErrorPacketTooLarge);
+
+    if (!client->discardTooLarge || packet->type != MqttPacketTypePublish)
+        return -1;
+
+    client->recvDiscard = 1;
+    client->streamHeaderSize = 2;
+    packet->state = MqttPacketStateReadPublishHeader;
+
+    return 1;
+}
+
+/*
+    Passes on the next piece of the payload of a streamed PUBLISH. Returns
+    like MqttClientRecvPublishHeader.
+*/
+static int MqttClientRecvPublishPayload(MqttClient *client)
+{
+    unsigned char chunk[MQTT_MESSAGE_CHUNK_SIZE];
+    MqttPacket *packet = &client->inPacket;
+    size_t toread = sizeof(chunk);
+    int64_t nread;
+
+    if (packet->remainingLength < toread)
+        toread = packet->remainingLength;
+
+    if (toread > 0)
+    {
+        nread = StreamRead(chunk, toread, &client->stream.base);
+
+        if (nread == -1)
+        {
+            if (SocketWouldBlock(SocketErrno))
+                return 0;
+            LOG_ERROR("failed reading packet payload");
+            return -1;
+        }
+        else if (nread == 0)
+        {
+            LOG_ERROR("socket disconnected");
+            return -1;
+        }
+
+        packet->remainingLength -= nread;
+
+        if (client->streamDeliver && !client->recvDiscard &&
+            client->onMessageData)
+        {
+            client->onMessageData(client, chunk, (size_t) nread);
+        }
+    }
+
+    if (packet->remainingLength == 0)
+        packet->state = MqttPacketStateReadComplete;
+
+    return 1;
+}
+
+/*
+    Receives and handles packets until the socket would block or the receive
+    budget is used up.
+*/
 static int MqttClientRecvPacket(MqttClient *client)
 {
+    int64_t start = client->recvBudgetUs > 0 ? MqttGetCurrentTimeUs() : 0;
+    int packets = 0;
+
+    client->recvPending = 0;
+
     while (1)
     {
         switch (client->inPacket.state)
@@ -1437,14 +3674,22 @@ static int MqttClientRecvPacket(MqttClient *client)
             case MqttPacketStateReadType:
             {
                 unsigned char typeAndFlags;
+                int64_t nread;
+
+                nread = StreamReadByte(&typeAndFlags, &client->stream.base);
 
-                if (StreamReadByte(&typeAndFlags, &client->stream.base) == -1)
+                if (nread == -1)
                 {
                     if (SocketWouldBlock(SocketErrno))
                         return 0;
                     LOG_ERROR("failed reading packet type");
                     return -1;
                 }
+                else if (nread == 0)
+                {
+                    LOG_ERROR("socket disconnected");
+                    return -1;
+                }
 
                 client->inPacket.type = typeAndFlags >> 4;
                 client->inPacket.flags = typeAndFlags & 0x0F;
@@ -1479,8 +3724,41 @@ static int MqttClientRecvPacket(MqttClient *client)
                 LOG_DEBUG("remainingLength:%lu",
                           client->inPacket.remainingLength);
 
-                client->inPacket.state = MqttPacketStateReadPayload;
+                if (client->maxPacketSize > 0 &&
+                    client->inPacket.remainingLength > client->maxPacketSize)
+                {
+                    int rc = MqttClientRejectPacket(client);
+                    if (rc <= 0)
+                        return rc;
+                }
+                else if (client->inPacket.type == MqttPacketTypePublish &&
+                    client->onMessageBegin &&
+                    client->inPacket.remainingLength >= client->streamThreshold)
+                {
+                    client->inPacket.state = MqttPacketStateReadPublishHeader;
+                    client->streamHeaderSize = 2;
+                }
+                else
+                {
+                    client->inPacket.state = MqttPacketStateReadPayload;
+                }
+
+                break;
+            }
+
+            case MqttPacketStateReadPublishHeader:
+            {
+                int rc = MqttClientRecvPublishHeader(client);
+                if (rc <= 0)
+                    return rc;
+                break;
+            }
 
+            case MqttPacketStateReadPublishPayload:
+            {
+                int rc = MqttClientRecvPublishPayload(client);
+                if (rc <= 0)
+                    return rc;
                 break;
             }
 
@@ -1490,14 +3768,12 @@ static int MqttClientRecvPacket(MqttClient *client)
                 {
                     int64_t nread, offset, toread;
 
-                    if (client->inPacket.payload == NULL)
+                    if (client->inPacket.payload == NULL &&
+                        MqttClientRecvBufferReserve(client,
+                            client->inPacket.remainingLength) == -1)
                     {
-                        unsigned char *data;
-                        client->inPacket.payload = bfromcstr("");
-                        ballocmin(client->inPacket.payload,
-                                  client->inPacket.remainingLength+1);
-                        data = client->inPacket.payload->data;
-                        data[client->inPacket.remainingLength] = '\0';
+                        LOG_ERROR("out of memory");
+                        return -1;
                     }
 
                     offset = blength(client->inPacket.payload);
@@ -1517,15 +3793,11 @@ static int MqttClientRecvPacket(MqttClient *client)
                         if (SocketWouldBlock(SocketErrno))
                             return 0;
                         LOG_ERROR("failed reading packet payload");
-                        bdestroy(client->inPacket.payload);
-                        client->inPacket.payload = NULL;
                         return -1;
                     }
                     else if (nread == 0)
                     {
                         LOG_ERROR("socket disconnected");
-                        bdestroy(client->inPacket.payload);
-                        client->inPacket.payload = NULL;
                         return -1;
                     }
 
@@ -1537,6 +3809,12 @@ static int MqttClientRecvPacket(MqttClient *client)
 
                 if (client->inPacket.remainingLength == 0)
                 {
+                    /* The reused buffer isn't terminated already */
+                    if (client->inPacket.payload)
+                    {
+                        bstring payload = client->inPacket.payload;
+                        payload->data[payload->slen] = '\0';
+                    }
                     client->inPacket.state = MqttPacketStateReadComplete;
                 }
                 break;
@@ -1544,9 +3822,25 @@ static int MqttClientRecvPacket(MqttClient *client)
 
             case MqttPacketStateReadComplete:
             {
-                int type = client->inPacket.type;
-                LOG_DEBUG("received %s", MqttPacketName(type));
-                return MqttClientHandlePacket(client);
+                int rc;
+
+                LOG_DEBUG("received %s", MqttPacketName(client->inPacket.type));
+
+                rc = MqttClientHandlePacket(client);
+
+                if (rc == -1 || client->stopped)
+                    return rc;
+
+                /* Keep going until the socket would block so that a burst
+                   is not handled one wait at a time, but give the other
+                   clients a turn once the budget is used up. */
+                if (MqttClientRecvBudgetUsed(client, ++packets, start))
+                {
+                    client->recvPending = 1;
+                    return 0;
+                }
+
+                break;
             }
         }
     }
@@ -1558,103 +3852,111 @@ static uint16_t MqttClientNextPacketId(MqttClient *client)
 {
     uint16_t id;
     assert(client != NULL);
-    id = ++client->packetId;
-    if (id == 0)
+    /* Skip ids that are still used by unfinished messages after the ids
+       have wrapped around */
+    do
+    {
         id = ++client->packetId;
+        if (id == 0)
+            id = ++client->packetId;
+    }
+    while (MqttMessageIndexFind(&client->outIndex, id) != NULL);
     return id;
 }
 
-static int64_t MqttMessageTimeSinceSent(MqttMessage *msg)
-{
-    int64_t now = MqttGetCurrentTime();
-    return now - msg->timestamp;
-}
-
-static int MqttMessageShouldResend(MqttClient *client, MqttMessage *msg)
+/*
+    Resends what hasn't been acknowledged in time. Only the expired messages
+    at the head of the retry list are visited.
+*/
+static void MqttClientProcessRetries(MqttClient *client)
 {
-    if (msg->timestamp > 0 &&
-        MqttMessageTimeSinceSent(msg) >= client->retryTimeout*1000)
-    {
-        return 1;
-    }
-
-    return 0;
-}
+    int64_t retry = client->retryTimeout*1000;
+    MqttMessage *msg, *last;
+    MqttPacket *packet;
 
-static void MqttClientProcessInMessages(MqttClient *client)
-{
-    MqttMessage *msg, *next;
+    /* Don't visit the messages rearmed below again even if the timeout
+       is zero */
+    last = TAILQ_LAST(&client->retryMessages, MqttMessageList);
 
-    TAILQ_FOREACH_SAFE(msg, &client->inMessages, chain, next)
+    while ((msg = TAILQ_FIRST(&client->retryMessages)) != NULL &&
+           msg->timestamp + retry <= client->now)
     {
+        MqttClientDisarmRetry(client, msg);
+
         switch (msg->state)
         {
-            case MqttMessageStateWaitPubRel:
-                if (MqttMessageShouldResend(client, msg))
+            case MqttMessageStateWaitPubAck:
+            case MqttMessageStateWaitPubRec:
+            {
+                msg->dup = 1;
+
+                if ((packet = PublishToPacket(client, msg)) != NULL)
+                {
+                    /* The timer restarts when the packet has been sent */
+                    msg->state = MqttMessageStatePublish;
+                    MqttClientQueuePacket(client, packet);
+                }
+                else
                 {
-                    MqttClientSendPubRec(client, msg);
+                    MqttClientArmRetry(client, msg, client->now);
                 }
                 break;
+            }
+
+            case MqttMessageStateWaitPubComp:
+            {
+                /* Restart the timer now so that the PUBREL isn't queued
+                   again before it has been sent */
+                MqttClientArmRetry(client, msg, client->now);
+                MqttClientSendPubRel(client, msg);
+                break;
+            }
+
+            case MqttMessageStateWaitPubRel:
+            {
+                MqttClientArmRetry(client, msg, client->now);
+                MqttClientSendPubRec(client, msg);
+                break;
+            }
 
             default:
                 break;
         }
+
+        if (msg == last)
+            break;
     }
 }
 
-static void MqttClientProcessOutMessages(MqttClient *client)
+/* Moves queued messages to sendQueue while the inflight window allows. */
+static void MqttClientProcessQueuedMessages(MqttClient *client)
 {
-    MqttMessage *msg, *next;
+    MqttMessage *msg;
     MqttPacket *packet;
     int inflight = MqttClientInflightMessageCount(client);
 
-    TAILQ_FOREACH_SAFE(msg, &client->outMessages, chain, next)
+    while (inflight < client->maxInflight &&
+           (msg = TAILQ_FIRST(&client->queuedMessages)) != NULL)
     {
-        switch (msg->state)
+        packet = PublishToPacket(client, msg);
+        if (!packet)
         {
-            case MqttMessageStateQueued:
-            {
-                if (inflight >= client->maxInflight)
-                {
-                    continue;
-                }
-                /* State change from MqttMessageStatePublish happens after
-                   the packet has been sent (in MqttClientSendPacket). */
-                msg->state = MqttMessageStatePublish;
-                packet = PublishToPacket(msg);
-                MqttClientQueuePacket(client, packet);
-                ++inflight;
-                break;
-            }
-
-            case MqttMessageStateWaitPubAck:
-            case MqttMessageStateWaitPubRec:
-            {
-                if (MqttMessageShouldResend(client, msg))
-                {
-                    msg->state = MqttMessageStatePublish;
-                    packet = PublishToPacket(msg);
-                    MqttClientQueuePacket(client, packet);
-                }
-                break;
-            }
-
-            case MqttMessageStateWaitPubComp:
-            {
-                if (MqttMessageShouldResend(client, msg))
-                {
-                    MqttClientSendPubRel(client, msg);
-                }
-                break;
-            }
+            break;
         }
+        /* State change from MqttMessageStatePublish happens after
+           the packet has been sent (in MqttClientSendPacket). */
+        TAILQ_REMOVE(&client->queuedMessages, msg, queue);
+        --client->outQueued;
+        msg->state = MqttMessageStatePublish;
+        MqttClientQueuePacket(client, packet);
+        ++inflight;
     }
 }
 
 static void MqttClientProcessMessageQueue(MqttClient *client)
 {
-    MqttClientProcessInMessages(client);
-    MqttClientProcessOutMessages(client);
+    MqttClientProcessRetries(client);
+    MqttClientProcessQueuedMessages(client);
 }
 
 static void MqttClientClearQueues(MqttClient *client)
@@ -1662,23 +3964,33 @@ static void MqttClientClearQueues(MqttClient *client)
     while (!SIMPLEQ_EMPTY(&client->sendQueue))
     {
         MqttPacket *packet = SIMPLEQ_FIRST(&client->sendQueue);
-        SIMPLEQ_REMOVE_HEAD(&client->sendQueue, sendQueue);
-        MqttPacketFree(packet);
+        MqttClientUnqueuePacket(client, NULL, packet);
+        /* QoS 0 messages belong to their packets */
+        if (packet->message && packet->message->qos == 0)
+            MqttClientMessageFree(client, packet->message);
+        MqttClientPacketFree(client, packet);
     }
 
     while (!TAILQ_EMPTY(&client->outMessages))
     {
         MqttMessage *msg = TAILQ_FIRST(&client->outMessages);
         TAILQ_REMOVE(&client->outMessages, msg, chain);
-        MqttMessageFree(msg);
+        MqttClientMessageFree(client, msg);
     }
 
     while (!TAILQ_EMPTY(&client->inMessages))
     {
         MqttMessage *msg = TAILQ_FIRST(&client->inMessages);
         TAILQ_REMOVE(&client->inMessages, msg, chain);
-        MqttMessageFree(msg);
+        MqttClientMessageFree(client, msg);
     }
+
+    MqttMessageIndexClear(&client->outIndex);
+    MqttMessageIndexClear(&client->inIndex);
+    client->outQueued = 0;
+    client->producePos = client->produceLen = 0;
+    TAILQ_INIT(&client->queuedMessages);
+    TAILQ_INIT(&client->retryMessages);
 }
 
 void MqttClientPause(MqttClient *client)
@@ -1692,3 +4004,21 @@ void MqttClientResume(MqttClient *client)
     assert(client != NULL);
     client->paused = 0;
 }
+
+MqttLoopEntry *MqttClientLoopEntry(MqttClient *client)
+{
+    assert(client != NULL);
+    return &client->loopEntry;
+}
+
+SocketStream *MqttClientSocketStream(MqttClient *client)
+{
+    assert(client != NULL);
+    return &client->stream;
+}
+
+const MqttAllocator *MqttClientAllocator(MqttClient *client)
+{
+    assert(client != NULL);
+    return client->allocator;
+}
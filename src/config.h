@@ -7,10 +7,24 @@
 #define MQTT_INLINE inline
 #endif
 
+/* Storage for a variable of which every thread has its own copy */
+#if defined(_MSC_VER)
+#define MQTT_THREAD_LOCAL __declspec(thread)
+#elif __STDC_VERSION__ >= 201112L
+#define MQTT_THREAD_LOCAL _Thread_local
+#else
+#define MQTT_THREAD_LOCAL __thread
+#endif
+
 #if __STDC_VERSION__ >= 199901L
 #define _XOPEN_SOURCE 600
 #else
 #define _XOPEN_SOURCE 500
 #endif
 
+/* The io_uring backend uses syscall() and Linux specific mmap() flags */
+#if defined(MQTT_USE_IO_URING) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #endif
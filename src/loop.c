@@ -0,0 +1,653 @@
+#include "loop.h"
+#include "private.h"
+#include "socket.h"
+#include "misc.h"
+#include "log.h"
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+
+#if defined(MQTT_USE_IO_URING)
+#include "uringstream.h"
+#endif
+
+/* Maximum number of ready sockets taken from epoll_wait at a time */
+#define MQTT_LOOP_MAX_EVENTS 256
+
+struct MqttLoop
+{
+    /* -1 when io_uring is used */
+    int epfd;
+#if defined(MQTT_USE_IO_URING)
+    /* NULL if io_uring is not available, epoll is used instead */
+    UringIo *uring;
+    /* clients with completed I/O to handle */
+    SIMPLEQ_HEAD(, MqttLoopEntry) readyQueue;
+#endif
+    /* all clients added to the loop */
+    TAILQ_HEAD(, MqttLoopEntry) clients;
+    /* clients whose events or deadline must be updated before waiting */
+    SIMPLEQ_HEAD(, MqttLoopEntry) dirtyQueue;
+    /* binary min-heap of clients ordered by deadline */
+    MqttLoopEntry **heap;
+    int heapSize;
+    int heapCapacity;
+};
+
+static void MqttLoopHeapSwap(MqttLoop *loop, int a, int b)
+{
+    MqttLoopEntry *tmp = loop->heap[a];
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = tmp;
+    loop->heap[a]->heapIndex = a;
+    loop->heap[b]->heapIndex = b;
+}
+
+static void MqttLoopHeapUp(MqttLoop *loop, int index)
+{
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (loop->heap[parent]->deadline <= loop->heap[index]->deadline)
+            break;
+        MqttLoopHeapSwap(loop, parent, index);
+        index = parent;
+    }
+}
+
+static void MqttLoopHeapDown(MqttLoop *loop, int index)
+{
+    while (1)
+    {
+        int left = index * 2 + 1;
+        int right = left + 1;
+        int smallest = index;
+
+        if (left < loop->heapSize &&
+            loop->heap[left]->deadline < loop->heap[smallest]->deadline)
+            smallest = left;
+
+        if (right < loop->heapSize &&
+            loop->heap[right]->deadline < loop->heap[smallest]->deadline)
+            smallest = right;
+
+        if (smallest == index)
+            break;
+
+        MqttLoopHeapSwap(loop, index, smallest);
+        index = smallest;
+    }
+}
+
+static void MqttLoopHeapRemove(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    int index = entry->heapIndex;
+
+    if (index == -1)
+        return;
+
+    entry->heapIndex = -1;
+
+    if (index == --loop->heapSize)
+        return;
+
+    loop->heap[index] = loop->heap[loop->heapSize];
+    loop->heap[index]->heapIndex = index;
+
+    MqttLoopHeapUp(loop, index);
+    MqttLoopHeapDown(loop, loop->heap[index]->heapIndex);
+}
+
+static int MqttLoopHeapSet(MqttLoop *loop, MqttLoopEntry *entry,
+                           int64_t deadline)
+{
+    if (deadline == -1)
+    {
+        MqttLoopHeapRemove(loop, entry);
+        entry->deadline = -1;
+        return 0;
+    }
+
+    if (entry->heapIndex == -1)
+    {
+        if (loop->heapSize == loop->heapCapacity)
+        {
+            int capacity = loop->heapCapacity ? loop->heapCapacity * 2 : 64;
+            MqttLoopEntry **heap = MqttRealloc(loop->heap,
+                                               capacity * sizeof(*heap));
+            if (!heap)
+                return -1;
+            loop->heap = heap;
+            loop->heapCapacity = capacity;
+        }
+
+        entry->deadline = deadline;
+        entry->heapIndex = loop->heapSize++;
+        loop->heap[entry->heapIndex] = entry;
+        MqttLoopHeapUp(loop, entry->heapIndex);
+    }
+    else
+    {
+        entry->deadline = deadline;
+        MqttLoopHeapUp(loop, entry->heapIndex);
+        MqttLoopHeapDown(loop, entry->heapIndex);
+    }
+
+    return 0;
+}
+
+static int MqttLoopEpollEvents(int events)
+{
+    int epollEvents = 0;
+
+    if (events & EV_READ)
+        epollEvents |= EPOLLIN;
+
+    if (events & EV_WRITE)
+        epollEvents |= EPOLLOUT;
+
+    return epollEvents;
+}
+
+#if defined(MQTT_USE_IO_URING)
+
+static void MqttLoopReady(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    if (entry->ready)
+        return;
+
+    entry->ready = 1;
+    SIMPLEQ_INSERT_TAIL(&loop->readyQueue, entry, readyQueue);
+}
+
+/*
+    With io_uring the socket is attached to the ring when first seen. A
+    connecting client polls for writability, a connected one keeps a receive
+    armed. Clients that can already make progress are queued right away.
+*/
+static int MqttLoopUringUpdate(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    MqttClient *client = entry->client;
+    SocketStream *stream = MqttClientSocketStream(client);
+    int events = MqttClientWantedEvents(client);
+
+    entry->fd = stream->sock;
+    entry->events = events;
+
+    if (stream->sock != -1 && events != 0)
+    {
+        int rc;
+
+        if (!stream->uring &&
+            UringStreamAttach(loop->uring, stream, entry) == -1)
+        {
+            LOG_ERROR("UringStreamAttach failed");
+            return -1;
+        }
+
+        /* Only a connecting client waits for just writability */
+        if (events & EV_READ)
+            rc = UringStreamStart(stream->uring);
+        else
+            rc = UringStreamPollWrite(stream->uring);
+
+        if (rc == -1)
+            return -1;
+
+        if (UringStreamEvents(stream->uring) & events)
+            MqttLoopReady(loop, entry);
+    }
+
+    return MqttLoopHeapSet(loop, entry, MqttClientNextDeadline(client));
+}
+
+#endif
+
+/* Syncs the epoll registration and timer of the client with its state. */
+static int MqttLoopUpdate(MqttLoop *loop, MqttLoopEntry *entry)
+{
+    MqttClient *client = entry->client;
+    int fd;
+    int events;
+    struct epoll_event ev;
+
+#if defined(MQTT_USE_IO_URING)
+    if (loop->uring)
+        return MqttLoopUringUpdate(loop, entry);
+#endif
+
+    fd = MqttClientGetFd(client);
+    events = MqttClientWantedEvents(client);
+
+    /* The client closes its socket by itself, which also removes it from the
+       epoll set, see MqttLoopEntryClosed. */
+    if (fd != entry->fd)
+    {
+        entry->fd = -1;
+        entry->events = 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = MqttLoopEpollEvents(events);
+    ev.data.ptr = entry;
+
+    if (fd != -1 && events != 0)
+    {
+        if (entry->fd == -1)
+        {
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            {
+                LOG_ERROR("epoll_ctl(EPOLL_CTL_ADD) failed");
+                return -1;
+            }
+            entry->fd = fd;
+        }
+        else if (events != entry->events)
+        {
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+            {
+                LOG_ERROR("epoll_ctl(EPOLL_CTL_MOD) failed");
+                return -1;
+            }
+        }
+        entry->events = events;
+    }
+    else if (entry->fd != -1)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->fd, &ev);
+        entry->fd = -1;
+        entry->events = 0;
+    }
+
+    return MqttLoopHeapSet(loop, entry, MqttClientNextDeadline(client));
+}
+
+void MqttLoopEntryChanged(MqttLoopEntry *entry)
+{
+    if (!entry->loop || entry->dirty)
+        return;
+
+    entry->dirty = 1;
+    SIMPLEQ_INSERT_TAIL(&entry->loop->dirtyQueue, entry, dirtyQueue);
+}
+
+void MqttLoopEntryClosed(MqttLoopEntry *entry)
+{
+    entry->fd = -1;
+    entry->events = 0;
+    MqttLoopEntryChanged(entry);
+}
+
+static int MqttLoopProcessDirty(MqttLoop *loop)
+{
+    int rc = 0;
+
+    while (!SIMPLEQ_EMPTY(&loop->dirtyQueue))
+    {
+        MqttLoopEntry *entry = SIMPLEQ_FIRST(&loop->dirtyQueue);
+        SIMPLEQ_REMOVE_HEAD(&loop->dirtyQueue, dirtyQueue);
+        entry->dirty = 0;
+        if (MqttLoopUpdate(loop, entry) == -1)
+            rc = -1;
+    }
+
+    return rc;
+}
+
+MqttLoop *MqttLoopNew(void)
+{
+    MqttLoop *loop;
+
+    loop = MqttCalloc(1, sizeof(*loop));
+
+    if (!loop)
+        return NULL;
+
+    TAILQ_INIT(&loop->clients);
+    SIMPLEQ_INIT(&loop->dirtyQueue);
+
+#if defined(MQTT_USE_IO_URING)
+    SIMPLEQ_INIT(&loop->readyQueue);
+
+    loop->uring = MqttMalloc(sizeof(*loop->uring));
+
+    if (loop->uring && UringIoInit(loop->uring) == 0)
+    {
+        loop->epfd = -1;
+        return loop;
+    }
+
+    LOG_INFO("io_uring not available, using epoll");
+    MqttFree(loop->uring);
+    loop->uring = NULL;
+#endif
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->epfd == -1)
+    {
+        LOG_ERROR("epoll_create1 failed");
+        MqttFree(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void MqttLoopFree(MqttLoop *loop)
+{
+    if (!loop)
+        return;
+
+    while (!TAILQ_EMPTY(&loop->clients))
+    {
+        MqttLoopRemove(loop, TAILQ_FIRST(&loop->clients)->client);
+    }
+
+#if defined(MQTT_USE_IO_URING)
+    if (loop->uring)
+    {
+        UringIoFree(loop->uring);
+        MqttFree(loop->uring);
+    }
+#endif
+
+    if (loop->epfd != -1)
+        close(loop->epfd);
+
+    MqttFree(loop->heap);
+    MqttFree(loop);
+}
+
+int MqttLoopAdd(MqttLoop *loop, MqttClient *client)
+{
+    MqttLoopEntry *entry;
+
+    assert(loop != NULL);
+    assert(client != NULL);
+
+    entry = MqttClientLoopEntry(client);
+
+    if (entry->loop != NULL)
+    {
+        LOG_ERROR("client already belongs to a loop");
+        return -1;
+    }
+
+    entry->loop = loop;
+    entry->client = client;
+    entry->fd = -1;
+    entry->events = 0;
+    entry->deadline = -1;
+    entry->heapIndex = -1;
+    entry->dirty = 0;
+    entry->ready = 0;
+
+    TAILQ_INSERT_TAIL(&loop->clients, entry, clients);
+
+    MqttLoopEntryChanged(entry);
+
+    return 0;
+}
+
+int MqttLoopRemove(MqttLoop *loop, MqttClient *client)
+{
+    MqttLoopEntry *entry;
+
+    assert(loop != NULL);
+    assert(client != NULL);
+
+    entry = MqttClientLoopEntry(client);
+
+    if (entry->loop != loop)
+    {
+        LOG_ERROR("client does not belong to this loop");
+        return -1;
+    }
+
+    if (entry->dirty)
+    {
+        SIMPLEQ_REMOVE(&loop->dirtyQueue, entry, MqttLoopEntry, dirtyQueue);
+        entry->dirty = 0;
+    }
+
+#if defined(MQTT_USE_IO_URING)
+    if (entry->ready)
+    {
+        SIMPLEQ_REMOVE(&loop->readyQueue, entry, MqttLoopEntry, readyQueue);
+        entry->ready = 0;
+    }
+
+    /* The in-flight I/O of the connection belongs to the ring of the loop,
+       the connection can't continue without it. */
+    if (MqttClientSocketStream(client)->uring)
+    {
+        /* The buffers of the stream belong to the client */
+        const MqttAllocator *previous =
+            MqttAllocatorEnter(MqttClientAllocator(client));
+        StreamClose(&MqttClientSocketStream(client)->base);
+        MqttAllocatorLeave(previous);
+    }
+#endif
+
+    if (loop->epfd != -1 && entry->fd != -1 &&
+        entry->fd == MqttClientGetFd(client))
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->fd, &ev);
+    }
+
+    entry->fd = -1;
+    entry->events = 0;
+
+    MqttLoopHeapRemove(loop, entry);
+
+    TAILQ_REMOVE(&loop->clients, entry, clients);
+
+    entry->loop = NULL;
+
+    return 0;
+}
+
+/* Returns timeout shortened to the nearest deadline of the timer heap. */
+static int MqttLoopTimeout(MqttLoop *loop, int timeout)
+{
+    if (loop->heapSize > 0)
+    {
+        int64_t wait = loop->heap[0]->deadline - MqttGetCurrentTime();
+
+        if (wait < 0)
+            wait = 0;
+
+        if (timeout < 0 || wait < timeout)
+            timeout = (int) wait;
+    }
+
+    return timeout;
+}
+
+/* Runs expired retry and keepalive timers. The client is updated (which
+   reschedules it) before the next wait. */
+static int MqttLoopRunTimers(MqttLoop *loop)
+{
+    int64_t now = MqttGetCurrentTime();
+    int count = 0;
+
+    while (loop->heapSize > 0 && loop->heap[0]->deadline <= now)
+    {
+        MqttLoopEntry *entry = loop->heap[0];
+        MqttLoopHeapRemove(loop, entry);
+        entry->deadline = -1;
+        MqttClientHandleEvents(entry->client, 0);
+        MqttLoopEntryChanged(entry);
+        ++count;
+    }
+
+    return count;
+}
+
+#if defined(MQTT_USE_IO_URING)
+
+static int MqttLoopUringRun(MqttLoop *loop, int timeout)
+{
+    Uring *ring = &loop->uring->ring;
+    struct io_uring_cqe *cqe;
+    int count = 0;
+
+    if (MqttLoopProcessDirty(loop) == -1)
+        return -1;
+
+    UringIoRearm(loop->uring);
+
+    if (!SIMPLEQ_EMPTY(&loop->readyQueue))
+        timeout = 0;
+    else
+        timeout = MqttLoopTimeout(loop, timeout);
+
+    LOG_DEBUG("waiting timeout:%d", timeout);
+
+    /* Everything queued since the last wait (receives, sends, polls) is
+       submitted with the same system call that waits for completions */
+    if (UringSubmit(ring, timeout != 0 ? 1 : 0, timeout) == -1)
+        return -1;
+
+    while ((cqe = UringPeekCqe(ring)) != NULL)
+    {
+        UringStream *us = UringIoComplete(loop->uring, cqe);
+
+        UringCqeSeen(ring);
+
+        if (us)
+            MqttLoopReady(loop, (MqttLoopEntry *) us->userData);
+    }
+
+    while (!SIMPLEQ_EMPTY(&loop->readyQueue))
+    {
+        MqttLoopEntry *entry = SIMPLEQ_FIRST(&loop->readyQueue);
+        SocketStream *stream = MqttClientSocketStream(entry->client);
+        int ev = 0;
+
+        SIMPLEQ_REMOVE_HEAD(&loop->readyQueue, readyQueue);
+        entry->ready = 0;
+
+        if (stream->uring)
+            ev = UringStreamEvents(stream->uring) & entry->events;
+
+        if (ev == 0)
+            continue;
+
+        MqttClientHandleEvents(entry->client, ev);
+        MqttLoopEntryChanged(entry);
+        ++count;
+    }
+
+    return count + MqttLoopRunTimers(loop);
+}
+
+#endif
+
+int MqttLoopRun(MqttLoop *loop, int timeout)
+{
+    struct epoll_event events[MQTT_LOOP_MAX_EVENTS];
+    int count = 0;
+    int nfds;
+    int i;
+
+    assert(loop != NULL);
+
+#if defined(MQTT_USE_IO_URING)
+    if (loop->uring)
+        return MqttLoopUringRun(loop, timeout);
+#endif
+
+    if (MqttLoopProcessDirty(loop) == -1)
+        return -1;
+
+    timeout = MqttLoopTimeout(loop, timeout);
+
+    LOG_DEBUG("waiting timeout:%d", timeout);
+
+    nfds = epoll_wait(loop->epfd, events, MQTT_LOOP_MAX_EVENTS, timeout);
+
+    if (nfds == -1)
+    {
+        if (SocketErrno == EINTR)
+            return 0;
+        LOG_ERROR("epoll_wait failed");
+        return -1;
+    }
+
+    for (i = 0; i < nfds; ++i)
+    {
+        MqttLoopEntry *entry = (MqttLoopEntry *) events[i].data.ptr;
+        int ev = 0;
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ev |= EV_READ;
+
+        if (events[i].events & (EPOLLOUT | EPOLLERR))
+            ev |= EV_WRITE;
+
+        /* Only report what the client asked for */
+        ev &= entry->events;
+
+        MqttClientHandleEvents(entry->client, ev);
+        MqttLoopEntryChanged(entry);
+        ++count;
+    }
+
+    return count + MqttLoopRunTimers(loop);
+}
+
+#else
+
+MqttLoop *MqttLoopNew(void)
+{
+    LOG_ERROR("MqttLoop is not supported on this platform");
+    return NULL;
+}
+
+void MqttLoopFree(MqttLoop *loop)
+{
+    (void) loop;
+}
+
+int MqttLoopAdd(MqttLoop *loop, MqttClient *client)
+{
+    (void) loop;
+    (void) client;
+    return -1;
+}
+
+int MqttLoopRemove(MqttLoop *loop, MqttClient *client)
+{
+    (void) loop;
+    (void) client;
+    return -1;
+}
+
+int MqttLoopRun(MqttLoop *loop, int timeout)
+{
+    (void) loop;
+    (void) timeout;
+    return -1;
+}
+
+void MqttLoopEntryChanged(MqttLoopEntry *entry)
+{
+    (void) entry;
+}
+
+void MqttLoopEntryClosed(MqttLoopEntry *entry)
+{
+    (void) entry;
+}
+
+#endif
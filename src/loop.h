@@ -0,0 +1,61 @@
+#ifndef MQTT_LOOP_H
+#define MQTT_LOOP_H
+
+#include "config.h"
+#include "mqtt.h"
+#include "queue.h"
+#include "socketstream.h"
+
+#include <stdint.h>
+
+typedef struct MqttLoopEntry MqttLoopEntry;
+
+/*
+    Per client bookkeeping of a MqttLoop. Embedded in MqttClient so that adding
+    a client to a loop doesn't allocate.
+*/
+struct MqttLoopEntry
+{
+    /* the loop the client belongs to, NULL if none */
+    MqttLoop *loop;
+    MqttClient *client;
+    /* socket registered with the loop, -1 if none */
+    int fd;
+    /* events the client waits for */
+    int events;
+    /* next retry or keepalive deadline in milliseconds, -1 if none */
+    int64_t deadline;
+    /* position in the timer heap, -1 if not in the heap */
+    int heapIndex;
+    /* 1 if the client must be re-examined before the loop waits again */
+    int dirty;
+    /* 1 if the client has completed I/O to handle (io_uring only) */
+    int ready;
+    TAILQ_ENTRY(MqttLoopEntry) clients;
+    SIMPLEQ_ENTRY(MqttLoopEntry) dirtyQueue;
+    SIMPLEQ_ENTRY(MqttLoopEntry) readyQueue;
+};
+
+/* Returns the loop bookkeeping embedded in client. */
+MqttLoopEntry *MqttClientLoopEntry(MqttClient *client);
+
+/* Returns the socket stream of client. */
+SocketStream *MqttClientSocketStream(MqttClient *client);
+
+/* Returns the allocator of client or NULL if it uses the global one. */
+const MqttAllocator *MqttClientAllocator(MqttClient *client);
+
+/*
+    Tells the loop of the entry that the client's wanted events or deadline may
+    have changed. Does nothing if the client is not in a loop.
+*/
+void MqttLoopEntryChanged(MqttLoopEntry *entry);
+
+/*
+    Tells the loop of the entry that the client closed its socket, which also
+    removed it from epoll. A new socket of the client is registered again
+    even if it gets the same number.
+*/
+void MqttLoopEntryClosed(MqttLoopEntry *entry);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef MQTT_MEMDBG_H
+#define MQTT_MEMDBG_H
+
+/*
+    Bstrlib includes this when BSTRLIB_MEMORY_DEBUG is defined. It routes the
+    string allocations through the allocator of the library.
+*/
+
+#include "alloc.h"
+
+#define bstr__alloc(x) MqttMalloc(x)
+#define bstr__realloc(p, x) MqttRealloc((p), (x))
+#define bstr__free(p) MqttFree(p)
+
+#endif
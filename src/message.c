@@ -2,10 +2,172 @@
 #include "stringstream.h"
 #include "stream_mqtt.h"
 #include "packet.h"
+#include "alloc.h"
+
+#include <string.h>
+#include <assert.h>
 
 void MqttMessageFree(MqttMessage *msg)
+{
+    MqttMessageReset(msg);
+    MqttFree(msg);
+}
+
+void MqttMessageReset(MqttMessage *msg)
 {
     bdestroy(msg->topic);
     bdestroy(msg->payload);
-    free(msg);
+    MqttPacketBufferUnref(msg->encoded);
+    memset(msg, 0, sizeof(*msg));
+}
+
+/* Smallest table allocated when the first message is added */
+#define MQTT_MESSAGE_INDEX_MIN_CAPACITY 16
+
+/*
+    Packet ids are mostly allocated sequentially so the low bits of the id
+    spread them over the table well enough.
+*/
+static MQTT_INLINE size_t MqttMessageIndexSlot(const MqttMessageIndex *index,
+                                               uint16_t id)
+{
+    return id & (index->capacity - 1);
+}
+
+static int MqttMessageIndexGrow(MqttMessageIndex *index)
+{
+    MqttMessageIndex grown;
+    size_t i;
+
+    grown.capacity = index->capacity > 0 ?
+        index->capacity * 2 : MQTT_MESSAGE_INDEX_MIN_CAPACITY;
+    grown.count = 0;
+    grown.slots = MqttCalloc(grown.capacity, sizeof(*grown.slots));
+
+    if (!grown.slots)
+        return -1;
+
+    for (i = 0; i < index->capacity; ++i)
+    {
+        if (index->slots[i])
+            MqttMessageIndexInsert(&grown, index->slots[i]);
+    }
+
+    MqttFree(index->slots);
+    *index = grown;
+
+    return 0;
+}
+
+int MqttMessageIndexInsert(MqttMessageIndex *index, MqttMessage *msg)
+{
+    size_t mask, i;
+
+    assert(index != NULL);
+    assert(msg != NULL);
+
+    /* Keep the load factor at most 3/4 */
+    if ((index->count + 1) * 4 > index->capacity * 3)
+    {
+        if (MqttMessageIndexGrow(index) == -1)
+            return -1;
+    }
+
+    mask = index->capacity - 1;
+
+    for (i = MqttMessageIndexSlot(index, msg->id); index->slots[i];
+         i = (i + 1) & mask)
+    {
+        if (index->slots[i]->id == msg->id)
+        {
+            index->slots[i] = msg;
+            return 0;
+        }
+    }
+
+    index->slots[i] = msg;
+    ++index->count;
+
+    return 0;
+}
+
+static MQTT_INLINE size_t MqttMessageIndexLookup(const MqttMessageIndex *index,
+                                                 uint16_t id)
+{
+    size_t mask = index->capacity - 1;
+    size_t i;
+
+    for (i = MqttMessageIndexSlot(index, id); index->slots[i];
+         i = (i + 1) & mask)
+    {
+        if (index->slots[i]->id == id)
+            return i;
+    }
+
+    return index->capacity;
+}
+
+MqttMessage *MqttMessageIndexFind(const MqttMessageIndex *index, uint16_t id)
+{
+    size_t i;
+
+    assert(index != NULL);
+
+    if (index->count == 0)
+        return NULL;
+
+    i = MqttMessageIndexLookup(index, id);
+
+    return i < index->capacity ? index->slots[i] : NULL;
+}
+
+void MqttMessageIndexRemove(MqttMessageIndex *index, uint16_t id)
+{
+    size_t mask, i, j, home;
+
+    assert(index != NULL);
+
+    if (index->count == 0)
+        return;
+
+    if ((i = MqttMessageIndexLookup(index, id)) == index->capacity)
+        return;
+
+    mask = index->capacity - 1;
+
+    /* Shift the following entries of the probe sequence back so that no
+       tombstones are needed */
+    for (j = (i + 1) & mask; index->slots[j]; j = (j + 1) & mask)
+    {
+        home = MqttMessageIndexSlot(index, index->slots[j]->id);
+
+        /* The entry stays if its home slot is cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+
+    index->slots[i] = NULL;
+    --index->count;
+}
+
+void MqttMessageIndexClear(MqttMessageIndex *index)
+{
+    assert(index != NULL);
+
+    if (index->slots)
+        memset(index->slots, 0, index->capacity * sizeof(*index->slots));
+
+    index->count = 0;
+}
+
+void MqttMessageIndexFree(MqttMessageIndex *index)
+{
+    assert(index != NULL);
+    MqttFree(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
 }
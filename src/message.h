@@ -1,6 +1,10 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include "config.h"
+#include "mqtt.h"
+
+#include <stdlib.h>
 #include <stdint.h>
 
 #include "queue.h"
@@ -16,6 +20,8 @@ enum MqttMessageState
     MqttMessageStateWaitPubRel
 };
 
+struct MqttPacketBuffer;
+
 typedef struct MqttMessage MqttMessage;
 
 struct MqttMessage
@@ -25,11 +31,47 @@ struct MqttMessage
     int retain;
     int dup;
     int padding;
+    /* one of MqttPriority, see MqttClientPublishWithPriority */
+    int priority;
     uint16_t id;
+    /* when the message or its last acknowledgement was sent */
     int64_t timestamp;
     bstring topic;
     bstring payload;
+    /* the encoded PUBLISH (encodedSize bytes at encodedOffset), sent again
+       as is, which replaces topic and payload of a message published with
+       MqttClientPublish or MqttClientPublishMany */
+    struct MqttPacketBuffer *encoded;
+    size_t encodedOffset;
+    size_t encodedSize;
     TAILQ_ENTRY(MqttMessage) chain;
+    /* link in the queued messages of the client */
+    TAILQ_ENTRY(MqttMessage) queue;
+    /* link in the retry list of the client, valid if retryArmed is 1 */
+    TAILQ_ENTRY(MqttMessage) retry;
+    int retryArmed;
+    /* number of packets in the send queue that refer to this message */
+    int queuedPackets;
+    /* payload borrowed from the user instead of payload, given back with
+       release, see MqttClientPublishZeroCopy */
+    const void *userPayload;
+    size_t userPayloadSize;
+    MqttClientReleaseCallback release;
+    void *releaseContext;
+    /* 1 if the payload is fileSize bytes of the file fd (owned by the
+       message) from fileOffset, see MqttClientPublishFile */
+    int file;
+    int fd;
+    int64_t fileOffset;
+    size_t fileSize;
+    /* or a payload of producedSize bytes from producer, which gets
+       releaseContext, see MqttClientPublishStream */
+    MqttClientProducerCallback producer;
+    size_t producedSize;
+    /* 1 if userPayload was sent with MSG_ZEROCOPY, zeroCopyId being the id
+       of the last such send */
+    int zeroCopyPending;
+    uint32_t zeroCopyId;
 };
 
 typedef struct MqttMessageList MqttMessageList;
@@ -37,4 +79,38 @@ TAILQ_HEAD(MqttMessageList, MqttMessage);
 
 void MqttMessageFree(MqttMessage *msg);
 
+/* Frees the topic, payload and encoded packet of the message and clears it
+   for reuse. */
+void MqttMessageReset(MqttMessage *msg);
+
+/*
+    Maps packet ids to messages with an open addressing hash table so that
+    acknowledgements can be matched to messages in constant time. The table
+    doesn't own the messages.
+*/
+typedef struct MqttMessageIndex MqttMessageIndex;
+
+struct MqttMessageIndex
+{
+    MqttMessage **slots;
+    /* number of slots, zero or a power of two */
+    size_t capacity;
+    size_t count;
+};
+
+/* Adds a message, replacing one with the same id. Returns -1 on failure. */
+int MqttMessageIndexInsert(MqttMessageIndex *index, MqttMessage *msg);
+
+/* Returns the message with the id or NULL. */
+MqttMessage *MqttMessageIndexFind(const MqttMessageIndex *index, uint16_t id);
+
+/* Removes the message with the id if there is one. */
+void MqttMessageIndexRemove(MqttMessageIndex *index, uint16_t id);
+
+/* Removes all messages but keeps the table allocated. */
+void MqttMessageIndexClear(MqttMessageIndex *index);
+
+/* Frees the table. */
+void MqttMessageIndexFree(MqttMessageIndex *index);
+
 #endif
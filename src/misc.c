@@ -3,6 +3,14 @@
 #include <stdio.h>
 #include <time.h>
 
+#if defined(_WIN32)
+#include <io.h>
+#include <limits.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 #if defined(_WIN32)
 #include "win32.h"
 int64_t MqttGetCurrentTime()
@@ -19,6 +27,22 @@ int64_t MqttGetCurrentTime()
     counter.QuadPart /= frequency.QuadPart;
     return counter.QuadPart;
 }
+
+int64_t MqttGetCurrentTimeUs()
+{
+    static volatile long once = 0;
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (InterlockedCompareExchange(&once, 1, 0) == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    /* split to avoid overflowing the multiplication */
+    return (counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (counter.QuadPart % frequency.QuadPart) * 1000000 /
+           frequency.QuadPart;
+}
 #else
 int64_t MqttGetCurrentTime()
 {
@@ -29,8 +53,65 @@ int64_t MqttGetCurrentTime()
 
     return ((int64_t) t.tv_sec * 1000) + (int64_t) t.tv_nsec / 1000 / 1000;
 }
+
+int64_t MqttGetCurrentTimeUs()
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1)
+        return -1;
+
+    return ((int64_t) t.tv_sec * 1000000) + (int64_t) t.tv_nsec / 1000;
+}
 #endif
 
+int64_t MqttFileReadAt(int fd, void *buf, size_t size, int64_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+#if defined(_WIN32)
+        int rv;
+        unsigned int chunk = size - done > INT_MAX ?
+            INT_MAX : (unsigned int) (size - done);
+        if (_lseeki64(fd, offset + done, SEEK_SET) == -1)
+            return -1;
+        rv = _read(fd, (char *) buf + done, chunk);
+#else
+        ssize_t rv = pread(fd, (char *) buf + done, size - done,
+                           (off_t) (offset + done));
+        if (rv == -1 && errno == EINTR)
+            continue;
+#endif
+        if (rv == -1)
+            return -1;
+        if (rv == 0)
+            break;
+        done += (size_t) rv;
+    }
+
+    return (int64_t) done;
+}
+
+int MqttFileDup(int fd)
+{
+#if defined(_WIN32)
+    return _dup(fd);
+#else
+    return dup(fd);
+#endif
+}
+
+void MqttFileClose(int fd)
+{
+#if defined(_WIN32)
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
 /* https://gist.github.com/ccbrown/9722406 */
 void DumpHex(const void* data, size_t size) {
     char ascii[17];
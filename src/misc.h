@@ -12,6 +12,21 @@
 */
 int64_t MqttGetCurrentTime();
 
+/* Same as MqttGetCurrentTime but in microseconds. */
+int64_t MqttGetCurrentTimeUs();
+
+/*
+    Reads size bytes of the file from offset unless the file ends first,
+    without using the file position (except on Windows). Returns the number
+    of bytes read or -1 on error.
+*/
+int64_t MqttFileReadAt(int fd, void *buf, size_t size, int64_t offset);
+
+/* Returns a new descriptor for the same open file or -1. */
+int MqttFileDup(int fd);
+
+void MqttFileClose(int fd);
+
 /*
     Simple hexdump to stdout.
 */
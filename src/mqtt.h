@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef enum MqttConnectionStatus
 {
@@ -25,8 +26,96 @@ typedef enum MqttSubscriptionStatus
     MqttSubscriptionFailure = 0x80
 } MqttSubscriptionStatus;
 
+typedef enum MqttEvent
+{
+    MqttEventRead = 1,
+    MqttEventWrite = 2
+} MqttEvent;
+
+/* Errors reported to MqttClientOnErrorCallback */
+typedef enum MqttError
+{
+    /* a received packet was larger than allowed, see
+       MqttClientSetMaxPacketSize */
+    MqttErrorPacketTooLarge = 1,
+    /* QoS 0 messages were dropped to stay within MqttClientSetQos0Limit */
+    MqttErrorQos0Dropped = 2
+} MqttError;
+
+/* What to do with a QoS 0 message that doesn't fit, see
+   MqttClientSetQos0Limit */
+typedef enum MqttQueuePolicy
+{
+    /* drops the oldest of the lowest priority first */
+    MqttQueuePolicyDropOldest,
+    MqttQueuePolicyDropNewest,
+    MqttQueuePolicyBlock
+} MqttQueuePolicy;
+
+/*
+    Priority of a published message, see MqttClientPublishWithPriority.
+    Normal messages are sent QoS 2 first, then QoS 1 and then QoS 0. High
+    ones go before them and low ones after them. Acknowledgements and other
+    control packets are always sent first, except DISCONNECT which is sent
+    after everything queued before it.
+*/
+typedef enum MqttPriority
+{
+    MqttPriorityLow = -1,
+    MqttPriorityNormal = 0,
+    MqttPriorityHigh = 1
+} MqttPriority;
+
 typedef struct MqttClient MqttClient;
 
+/*
+    Memory allocation functions for the library. userData is passed to each
+    of them as is. realloc must accept a NULL ptr like realloc() does.
+*/
+typedef struct MqttAllocator
+{
+    void *(*alloc)(void *userData, size_t size);
+    void *(*realloc)(void *userData, void *ptr, size_t size);
+    void (*free)(void *userData, void *ptr);
+    void *userData;
+} MqttAllocator;
+
+typedef struct MqttLoop MqttLoop;
+
+/* One message for MqttClientPublishMany */
+typedef struct MqttPublishSpec
+{
+    const char *topic;
+    const void *data;
+    size_t size;
+    int qos;
+    int retain;
+    /* one of MqttPriority, 0 being MqttPriorityNormal */
+    int priority;
+} MqttPublishSpec;
+
+/* Counters of a client, see MqttClientGetStats */
+typedef struct MqttClientStats
+{
+    /* bytes allocated for the receive buffer now and at most so far, see
+       MqttClientSetRecvBufferPolicy */
+    size_t recvBufferSize;
+    size_t recvBufferPeak;
+    /* received packets rejected by MqttClientSetMaxPacketSize */
+    uint64_t packetsTooLarge;
+    /* writes of packets held by MqttClientSetCoalescing and the total and
+       longest time in microseconds the first of them was held */
+    uint64_t coalesceFlushes;
+    uint64_t coalesceDelayTotalUs;
+    uint64_t coalesceDelayMaxUs;
+    /* QoS 0 messages waiting to be sent and their size, and the ones
+       dropped so far, see MqttClientSetQos0Limit */
+    size_t qos0Queued;
+    size_t qos0QueuedBytes;
+    uint64_t qos0Dropped;
+    uint64_t qos0DroppedBytes;
+} MqttClientStats;
+
 typedef void (*MqttClientOnConnectCallback)(MqttClient *client,
                                             MqttConnectionStatus status,
                                             int sessionPresent);
@@ -45,10 +134,66 @@ typedef void (*MqttClientOnMessageCallback)(MqttClient *client,
                                             int qos,
                                             int retain);
 
+/* See MqttClientSetOnMessageWithTopicLength */
+typedef void (*MqttClientOnMessageWithTopicLengthCallback)(
+    MqttClient *client, const char *topic, size_t topicLength,
+    const void *data, size_t size, int qos, int retain);
+
 typedef void (*MqttClientOnPublishCallback)(MqttClient *client, int id);
 
+typedef void (*MqttClientOnErrorCallback)(MqttClient *client, MqttError error);
+
+/* See MqttClientSetOnMessageStream */
+typedef void (*MqttClientOnMessageBeginCallback)(MqttClient *client,
+                                                 const char *topic,
+                                                 size_t topicLength,
+                                                 size_t size,
+                                                 int qos,
+                                                 int retain);
+
+typedef void (*MqttClientOnMessageDataCallback)(MqttClient *client,
+                                                const void *data,
+                                                size_t size);
+
+typedef void (*MqttClientOnMessageEndCallback)(MqttClient *client,
+                                               int complete);
+
+/* Tells that the library no longer uses data, see MqttClientPublishZeroCopy */
+typedef void (*MqttClientReleaseCallback)(MqttClient *client,
+                                          const void *data,
+                                          void *context);
+
+/*
+    Fills buf with the next at most size bytes of a payload published with
+    MqttClientPublishStream and returns how many were written, which must be
+    at least 1. rewind is 1 when the payload is (re)started from the first
+    byte, as it is for the first call and when a QoS 1 or 2 message is sent
+    again. Returning -1 closes the connection.
+*/
+typedef int64_t (*MqttClientProducerCallback)(MqttClient *client, void *buf,
+                                              size_t size, int rewind,
+                                              void *context);
+
+/*
+    Sets the allocator for all memory of the library that doesn't belong to
+    a client with an allocator of its own, strings included. NULL restores
+    malloc, realloc and free. The allocator is copied. Set it before creating
+    any clients or loops, as memory is always freed with the allocator it
+    came from.
+*/
+void MqttSetAllocator(const MqttAllocator *allocator);
+
 MqttClient *MqttClientNew(const char *clientId);
 
+/*
+    Same as MqttClientNew but all the memory of the client, from the client
+    itself to its messages, packets and strings, comes from allocator (which
+    is copied). This allows, for example, exact accounting of the memory
+    used by each connection.
+*/
+MqttClient *MqttClientNewWithAllocator(const char *clientId,
+                                       const MqttAllocator *allocator);
+
 void MqttClientFree(MqttClient *client);
 
 void MqttClientSetUserData(MqttClient *client, void *userData);
@@ -66,9 +211,35 @@ void MqttClientSetOnUnsubscribe(MqttClient *client,
 void MqttClientSetOnMessage(MqttClient *client,
                             MqttClientOnMessageCallback cb);
 
+/*
+    Same as MqttClientSetOnMessage but cb also gets the length of topic so
+    that it doesn't need strlen(). The topic and the payload point into the
+    received packet and are valid only during the call. Replaces the
+    callback of MqttClientSetOnMessage while set.
+*/
+void MqttClientSetOnMessageWithTopicLength(MqttClient *client,
+    MqttClientOnMessageWithTopicLengthCallback cb);
+
 void MqttClientSetOnPublish(MqttClient *client,
                             MqttClientOnPublishCallback cb);
 
+/* Sets a callback for errors the client recovers from or closes on. */
+void MqttClientSetOnError(MqttClient *client, MqttClientOnErrorCallback cb);
+
+/*
+    Passes received messages of at least threshold bytes on as they arrive
+    instead of buffering them whole for onMessage. begin gets the topic, its
+    length and the size of the payload, data (if not NULL) gets the payload in pieces
+    of at most MQTT_MESSAGE_CHUNK_SIZE (16 KiB) bytes and end (if not NULL)
+    is called with complete set to 1 after the last piece. If the connection
+    is lost before that, end is called with complete set to 0. The message
+    is acknowledged after end. A NULL begin turns streaming off.
+*/
+void MqttClientSetOnMessageStream(MqttClient *client, size_t threshold,
+                                  MqttClientOnMessageBeginCallback begin,
+                                  MqttClientOnMessageDataCallback data,
+                                  MqttClientOnMessageEndCallback end);
+
 int MqttClientConnect(MqttClient *client, const char *host, short port,
                       int keepAlive, int cleanSession);
 
@@ -76,10 +247,47 @@ int MqttClientDisconnect(MqttClient *client);
 
 int MqttClientIsConnected(MqttClient *client);
 
+/*
+    Waits for socket events at most timeout milliseconds (if negative, until
+    the next retry or keepalive deadline) and handles them. The wait never
+    extends past the next deadline.
+*/
 int MqttClientRunOnce(MqttClient *client, int timeout);
 
 int MqttClientRun(MqttClient *client);
 
+/*
+    The following functions let an application drive the client from its own
+    event loop instead of MqttClientRunOnce. Before each wait, ask for the
+    socket, the events to wait for and the timeout. Then pass the ready events
+    (0 on timeout) to MqttClientHandleEvents. None of these block.
+*/
+
+/* Returns the socket of the client or -1 if it is not connected. */
+int MqttClientGetFd(MqttClient *client);
+
+/*
+    Queues due publish retries and keepalive pings and returns the events
+    (MqttEventRead, MqttEventWrite) the client waits for, or 0 if it has no
+    connection.
+*/
+int MqttClientWantedEvents(MqttClient *client);
+
+/*
+    Returns the number of milliseconds until the client has retry or keepalive
+    work to do, 0 if that is overdue or received data is waiting to be handled
+    (see MqttClientSetRecvBudget) or -1 if there is none.
+*/
+int MqttClientNextTimeoutMs(MqttClient *client);
+
+/*
+    Handles the ready events (MqttEventRead, MqttEventWrite or 0 on timeout).
+    Report socket errors and hangups as MqttEventRead. Closes the socket if
+    the connection failed or the client disconnected. Returns -1 if the client
+    has no connection, 0 otherwise.
+*/
+int MqttClientHandleEvents(MqttClient *client, int events);
+
 int MqttClientSubscribe(MqttClient *client, const char *topicFilter,
                         int qos);
 
@@ -94,18 +302,200 @@ int MqttClientPublish(MqttClient *client, int qos, int retain,
 int MqttClientPublishCString(MqttClient *client, int qos, int retain,
                              const char *topic, const char *msg);
 
+/*
+    Same as MqttClientPublish but the message is sent with priority (one of
+    MqttPriority) instead of MqttPriorityNormal. Packets queued to be sent
+    are sent in the order of their priority, but a packet that has been
+    partly written is always finished first.
+*/
+int MqttClientPublishWithPriority(MqttClient *client, int qos, int retain,
+                                  const char *topic, const void *data,
+                                  size_t size, int priority);
+
+/*
+    Publishes count messages like MqttClientPublish, encoding all of them
+    back to back into one buffer so that they are sent with few writes. The
+    QoS 1 and 2 messages must fit in MqttClientSetMaxQueuedMessages together,
+    and with MqttQueuePolicyBlock the QoS 0 messages in
+    MqttClientSetQos0Limit, or none is published. The buffer is freed once
+    every message is done with. Stores the id of each message (0 for QoS 0)
+    in ids if it is not NULL. Returns the number of messages published, less
+    than count only if memory ran out, or -1.
+*/
+int MqttClientPublishMany(MqttClient *client, const MqttPublishSpec *specs,
+                          size_t count, int *ids);
+
+/*
+    Same as MqttClientPublish but the payload is sent straight from data
+    instead of a copy. data must stay valid and unchanged until release (if
+    not NULL) is called with it and context. That happens once the message
+    is no longer needed: after a QoS 0 message has been sent, after a PUBACK
+    or PUBREC has been received, or when the message is dropped because the
+    client reconnects or is freed. release is not called if this returns -1.
+*/
+int MqttClientPublishZeroCopy(MqttClient *client, int qos, int retain,
+                              const char *topic, const void *data,
+                              size_t size, MqttClientReleaseCallback release,
+                              void *context);
+
+/*
+    Publishes length bytes of the file fd from offset. The body is sent with
+    sendfile() where available instead of being read into memory, and QoS 1
+    and 2 retries read the file again. The client keeps a duplicate of fd so
+    fd can be closed right away, but that part of the file must not change
+    until the message is done. Returns like MqttClientPublish.
+*/
+int MqttClientPublishFile(MqttClient *client, int qos, int retain,
+                          const char *topic, int fd, int64_t offset,
+                          size_t length);
+
+/*
+    Publishes a payload of size bytes that read produces while the message
+    is being sent, in pieces of at most MQTT_MESSAGE_CHUNK_SIZE (16 KiB)
+    bytes, so that a payload of any size takes constant memory. read and
+    release (if not NULL) get context. release is called with NULL data once
+    read is no longer needed, like with MqttClientPublishZeroCopy. If the
+    message is acknowledged in the middle of sending it again, the rest is
+    read into memory first. Returns like MqttClientPublish.
+*/
+int MqttClientPublishStream(MqttClient *client, int qos, int retain,
+                            const char *topic, size_t size,
+                            MqttClientProducerCallback read,
+                            MqttClientReleaseCallback release,
+                            void *context);
+
+/*
+    Sends the payloads of MqttClientPublishZeroCopy of at least size bytes
+    with MSG_ZEROCOPY on Linux, so that the kernel doesn't copy them either.
+    release is then delayed until the kernel reports that it is done with the
+    data. Pinning the memory costs more than copying small payloads. Takes
+    effect when connecting. The default is MQTT_ZEROCOPY_THRESHOLD (0), 0
+    meaning never. Not used with io_uring.
+*/
+void MqttClientSetZeroCopyThreshold(MqttClient *client, size_t size);
+
 void MqttClientSetPublishRetryTimeout(MqttClient *client, int timeout);
 
 void MqttClientSetMaxMessagesInflight(MqttClient *client, int max);
 
 void MqttClientSetMaxQueuedMessages(MqttClient *client, int max);
 
+/*
+    Limits how many packets (maxPackets) and how long (maxTimeUs microseconds)
+    one call of MqttClientRunOnce or MqttClientHandleEvents spends receiving
+    before returning, 0 meaning no limit. Otherwise the client keeps handling
+    packets until the socket would block. What is left is handled on the next
+    call without waiting. The default is MQTT_RECV_BUDGET_PACKETS (256)
+    packets and MQTT_RECV_BUDGET_US (0) microseconds.
+*/
+void MqttClientSetRecvBudget(MqttClient *client, int maxPackets,
+                             int maxTimeUs);
+
+/*
+    Sets how many freed messages and packets (max of each) the client keeps
+    for reuse instead of returning them to the heap, freeing any beyond the
+    new limit. The default is MQTT_POOL_SIZE (256). 0 disables pooling.
+*/
+void MqttClientSetPoolLimit(MqttClient *client, int max);
+
+/* Frees the messages and packets the client keeps for reuse. */
+void MqttClientShrinkPools(MqttClient *client);
+
+/*
+    Rejects received packets whose body (what follows the fixed header) is
+    larger than max bytes before allocating anything for them, 0 meaning no
+    limit. Each one is counted in MqttClientStats and reported to onError
+    with MqttErrorPacketTooLarge. The connection is then closed, unless
+    discard is 1 and the packet is a PUBLISH: it is read past a piece at a
+    time and acknowledged without passing it on. The default is
+    MQTT_MAX_PACKET_SIZE (0).
+*/
+void MqttClientSetMaxPacketSize(MqttClient *client, size_t max, int discard);
+
+/*
+    Received packets are read into one buffer that is reused from packet to
+    packet and grows to fit the largest. After a packet larger than keep
+    bytes the buffer shrinks back to keep bytes, and after idleMs
+    milliseconds without packets it is freed, 0 meaning never. The idle time
+    is checked when the client handles events, it doesn't wake the client.
+    The defaults are MQTT_RECV_BUFFER_KEEP (4096) bytes and
+    MQTT_RECV_BUFFER_IDLE_MS (30000) milliseconds.
+*/
+void MqttClientSetRecvBufferPolicy(MqttClient *client, size_t keep,
+                                   int idleMs);
+
+/*
+    Holds PUBLISH packets for up to delayUs microseconds after the first of
+    them is queued, or until maxBytes bytes are held (0 meaning no limit),
+    and then sends them together with as few writes as possible. Any other
+    packet, such as an acknowledgement, is sent right away along with the
+    held ones. This trades latency for fewer and larger writes when
+    messages are published in small bursts. A delay of 0, the default
+    (MQTT_COALESCE_DELAY_US), sends packets as soon as the socket is
+    writable. The delays are reported in MqttClientStats.
+*/
+void MqttClientSetCoalescing(MqttClient *client, int delayUs,
+                             size_t maxBytes);
+
+/*
+    Limits the QoS 0 messages waiting to be sent to maxCount messages and
+    maxBytes bytes of encoded packets, 0 meaning no limit, so that a slow
+    connection doesn't make them take up memory without bound. A message
+    that doesn't fit is handled according to policy (one of
+    MqttQueuePolicy): MqttQueuePolicyDropOldest drops queued messages that
+    haven't started to be sent until it fits, those of the lowest priority
+    first and the oldest first among the same priority, or only the message
+    itself if it wouldn't fit even without them. MqttQueuePolicyDropNewest
+    drops the message itself.
+    Publishing a dropped message returns 0 as usual, the drops are counted
+    in MqttClientStats and reported to onError with MqttErrorQos0Dropped
+    once per publish. MqttQueuePolicyBlock makes the publish return -1
+    without dropping anything, the message can be published again once the
+    client has sent some. The default is MQTT_QOS0_MAX_COUNT and
+    MQTT_QOS0_MAX_BYTES (both 0) with MqttQueuePolicyDropOldest.
+*/
+void MqttClientSetQos0Limit(MqttClient *client, size_t maxCount,
+                            size_t maxBytes, int policy);
+
+/* Fills stats with the current counters of the client. */
+void MqttClientGetStats(MqttClient *client, MqttClientStats *stats);
+
 int MqttClientSetWill(MqttClient *client, const char *topic, const void *msg,
                       size_t size, int qos, int retain);
 
 int MqttClientSetAuth(MqttClient *client, const char *username,
                       const char *password);
 
+/*
+    Creates an event loop that drives many clients from one thread with epoll,
+    or with io_uring if the library was built with MQTT_IO_URING and the kernel
+    supports it. Returns NULL on failure or if the platform has no epoll.
+*/
+MqttLoop *MqttLoopNew(void);
+
+/* Removes all clients from the loop and frees it. */
+void MqttLoopFree(MqttLoop *loop);
+
+/*
+    Adds a client to the loop. The client can be connected before or after
+    it is added. A client can belong to only one loop and must not be driven
+    with MqttClientRunOnce while it is in a loop.
+*/
+int MqttLoopAdd(MqttLoop *loop, MqttClient *client);
+
+/*
+    Removes a client from the loop. With io_uring the pending I/O of the
+    client belongs to the loop so its connection is closed.
+*/
+int MqttLoopRemove(MqttLoop *loop, MqttClient *client);
+
+/*
+    Waits at most timeout milliseconds (indefinitely if negative) for socket
+    events or retry and keepalive deadlines and services all the clients
+    that are ready. Returns the number of clients serviced or -1 on error.
+*/
+int MqttLoopRun(MqttLoop *loop, int timeout);
+
 #if defined(__cplusplus)
 }
 #endif
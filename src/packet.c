@@ -1,5 +1,7 @@
 #include "packet.h"
 #include "log.h"
+#include "alloc.h"
+#include "misc.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -32,7 +34,7 @@ MqttPacket *MqttPacketNew(int type)
 {
     MqttPacket *packet = NULL;
 
-    packet = (MqttPacket *) calloc(1, sizeof(*packet));
+    packet = (MqttPacket *) MqttCalloc(1, sizeof(*packet));
     if (!packet)
         return NULL;
 
@@ -51,7 +53,375 @@ MqttPacket *MqttPacketWithIdNew(int type, uint16_t id)
 }
 
 void MqttPacketFree(MqttPacket *packet)
+{
+    MqttPacketReset(packet);
+    MqttFree(packet);
+}
+
+/* Frees data unless it is stored inside the packet or shared. */
+static void MqttPacketFreeData(MqttPacket *packet)
+{
+    if (packet->shared)
+    {
+        MqttPacketBufferUnref(packet->shared);
+        packet->shared = NULL;
+    }
+    else if (!MqttPacketIsInline(packet))
+    {
+        MqttFree(packet->data);
+    }
+}
+
+void MqttPacketReset(MqttPacket *packet)
 {
     bdestroy(packet->payload);
-    free(packet);
+    MqttPacketFreeData(packet);
+    memset(packet, 0, sizeof(*packet));
+}
+
+void MqttPacketBufferUnref(MqttPacketBuffer *buffer)
+{
+    if (buffer && --buffer->refs == 0)
+        MqttFree(buffer);
+}
+
+MqttPacketBuffer *MqttPacketBufferNew(size_t size)
+{
+    /* The buffer and its data are allocated together */
+    MqttPacketBuffer *buffer = MqttMalloc(sizeof(*buffer) + size);
+
+    if (!buffer)
+        return NULL;
+
+    buffer->refs = 1;
+    buffer->size = size;
+    buffer->data = (unsigned char *) (buffer + 1);
+
+    return buffer;
+}
+
+size_t MqttPacketHeaderSize(size_t bodyLength)
+{
+    size_t headerLength = 1;
+
+    do
+    {
+        bodyLength /= 128;
+        ++headerLength;
+    }
+    while (bodyLength > 0);
+
+    return headerLength;
+}
+
+unsigned char *MqttEncodeFixedHeader(unsigned char *p, int type, int flags,
+                                     size_t bodyLength)
+{
+    *p++ = ((type & 0x0F) << 4) | (flags & 0x0F);
+
+    do
+    {
+        unsigned char encodedByte = bodyLength % 128;
+        bodyLength /= 128;
+        if (bodyLength > 0)
+            encodedByte |= 128;
+        *p++ = encodedByte;
+    }
+    while (bodyLength > 0);
+
+    return p;
+}
+
+/* Encodes the fixed header for bodyLength but allocates only what the
+   packet writes from its own data, the last unowned bytes excluded, into a
+   new shared buffer if shared is 1. */
+static unsigned char *MqttPacketAllocateOwned(MqttPacket *packet,
+                                              size_t bodyLength,
+                                              size_t unowned, int shared)
+{
+    size_t size;
+
+    assert(packet->data == NULL);
+    assert(unowned <= bodyLength);
+
+    if (bodyLength > MQTT_MAX_REMAINING_LENGTH)
+    {
+        LOG_ERROR("packet too big: %lu bytes", (unsigned long) bodyLength);
+        return NULL;
+    }
+
+    size = MqttPacketHeaderSize(bodyLength) + bodyLength - unowned;
+
+    if (shared)
+    {
+        if ((packet->shared = MqttPacketBufferNew(size)) != NULL)
+            packet->data = packet->shared->data;
+    }
+    else if (size <= MQTT_PACKET_INLINE_SIZE)
+        packet->data = packet->inlineData;
+    else
+        packet->data = MqttMalloc(size);
+
+    if (!packet->data)
+        return NULL;
+
+    packet->size = size;
+
+    return MqttEncodeFixedHeader(packet->data, packet->type, packet->flags,
+                                 bodyLength);
+}
+
+unsigned char *MqttPacketAllocate(MqttPacket *packet, size_t bodyLength)
+{
+    return MqttPacketAllocateOwned(packet, bodyLength, 0, 0);
+}
+
+unsigned char *MqttPacketAllocateShared(MqttPacket *packet, size_t bodyLength)
+{
+    return MqttPacketAllocateOwned(packet, bodyLength, 0, 1);
+}
+
+void MqttPacketUseShared(MqttPacket *packet, MqttPacketBuffer *buffer,
+                         size_t offset, size_t size)
+{
+    assert(packet->data == NULL);
+    assert(offset + size <= buffer->size);
+    packet->shared = MqttPacketBufferRef(buffer);
+    packet->data = buffer->data + offset;
+    packet->size = size;
+}
+
+unsigned char *MqttPacketAllocateExternal(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          const void *external,
+                                          size_t externalSize)
+{
+    unsigned char *p = MqttPacketAllocateOwned(packet, bodyLength,
+                                               externalSize, 0);
+    if (p)
+    {
+        packet->external = (const unsigned char *) external;
+        packet->externalSize = externalSize;
+    }
+    return p;
+}
+
+unsigned char *MqttPacketAllocateFile(MqttPacket *packet, size_t bodyLength,
+                                      int fd, int64_t fileOffset,
+                                      size_t fileSize)
+{
+    unsigned char *p = MqttPacketAllocateOwned(packet, bodyLength, fileSize,
+                                               0);
+    if (p)
+    {
+        packet->fd = fd;
+        packet->fileOffset = fileOffset;
+        packet->streamSize = fileSize;
+    }
+    return p;
+}
+
+unsigned char *MqttPacketAllocateProduced(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          size_t streamSize)
+{
+    unsigned char *p = MqttPacketAllocateOwned(packet, bodyLength,
+                                               streamSize, 0);
+    if (p)
+    {
+        packet->produced = 1;
+        packet->streamSize = streamSize;
+    }
+    return p;
+}
+
+void MqttPacketSetRemainder(MqttPacket *packet, unsigned char *data,
+                            size_t size)
+{
+    MqttPacketFreeData(packet);
+
+    packet->data = data;
+    packet->size = size;
+    packet->external = NULL;
+    packet->externalSize = 0;
+    packet->fd = 0;
+    packet->fileOffset = 0;
+    packet->produced = 0;
+    packet->streamSize = 0;
+    packet->ownHeader = 0;
+    packet->state = MqttPacketStateWriteData;
+    packet->remainingLength = size;
+}
+
+void MqttPacketPrepareWrite(MqttPacket *packet)
+{
+    assert(packet->data != NULL);
+
+    /* Flags such as DUP may have changed since the packet was encoded */
+    packet->header = ((packet->type & 0x0F) << 4) | (packet->flags & 0x0F);
+    packet->ownHeader = packet->shared && packet->data[0] != packet->header;
+
+    if (!packet->shared)
+        packet->data[0] = packet->header;
+
+    packet->state = MqttPacketStateWriteData;
+    packet->remainingLength = packet->size + packet->externalSize;
+    packet->writeStarted = 0;
+}
+
+int MqttPacketWriteIov(MqttPacket *packet, StreamIoVec *iov, int max)
+{
+    size_t written;
+    int count = 0;
+
+    if (max <= 0 || packet->state != MqttPacketStateWriteData)
+        return 0;
+
+    written = packet->size + packet->externalSize - packet->remainingLength;
+
+    if (written == 0 && packet->ownHeader)
+    {
+        iov[count].data = &packet->header;
+        iov[count].size = 1;
+        ++count;
+        written = 1;
+    }
+
+    if (count < max && written < packet->size)
+    {
+        iov[count].data = packet->data + written;
+        iov[count].size = packet->size - written;
+        ++count;
+        written = packet->size;
+    }
+
+    if (count < max && packet->externalSize > 0)
+    {
+        written -= packet->size;
+        iov[count].data = packet->external + written;
+        iov[count].size = packet->externalSize - written;
+        ++count;
+    }
+
+    return count;
+}
+
+/* Reads the unwritten part of the file into the data of the packet. */
+static int MqttPacketCopyFile(MqttPacket *packet)
+{
+    size_t skip = 0;
+    size_t head = packet->size;
+    unsigned char *data;
+
+    /* Once the file is being written, what has been written from it and
+       the data before it aren't needed */
+    if (packet->state == MqttPacketStateWritePayload)
+    {
+        skip = packet->streamSize - packet->remainingLength;
+        head = 0;
+    }
+
+    data = MqttMalloc(head + packet->streamSize - skip);
+
+    if (!data)
+        return -1;
+
+    if (head > 0)
+        memcpy(data, packet->data, head);
+
+    if (MqttFileReadAt(packet->fd, data + head, packet->streamSize - skip,
+                       packet->fileOffset + (int64_t) skip) !=
+        (int64_t) (packet->streamSize - skip))
+    {
+        LOG_ERROR("failed to read the payload from the file");
+        MqttFree(data);
+        return -1;
+    }
+
+    MqttPacketFreeData(packet);
+
+    if (packet->state == MqttPacketStateWritePayload)
+    {
+        /* Continue from the start of what was read */
+        packet->state = MqttPacketStateWriteData;
+        packet->data = data;
+        packet->remainingLength = packet->streamSize - skip;
+        packet->size = packet->remainingLength;
+    }
+    else
+    {
+        if (packet->state == MqttPacketStateWriteData)
+            packet->remainingLength += packet->streamSize;
+        packet->data = data;
+        packet->size += packet->streamSize;
+    }
+
+    packet->fd = 0;
+    packet->fileOffset = 0;
+    packet->streamSize = 0;
+
+    return 0;
+}
+
+int MqttPacketCopyExternal(MqttPacket *packet)
+{
+    unsigned char *data;
+
+    if (packet->produced)
+        return -1;
+
+    if (packet->streamSize > 0)
+        return MqttPacketCopyFile(packet);
+
+    if (packet->externalSize == 0)
+        return 0;
+
+    data = MqttMalloc(packet->size + packet->externalSize);
+
+    if (!data)
+        return -1;
+
+    memcpy(data, packet->data, packet->size);
+    memcpy(data + packet->size, packet->external, packet->externalSize);
+
+    MqttPacketFreeData(packet);
+
+    /* The offsets don't change, remainingLength stays valid */
+    packet->data = data;
+    packet->size += packet->externalSize;
+    packet->external = NULL;
+    packet->externalSize = 0;
+
+    return 0;
+}
+
+size_t MqttPacketWriteAdvance(MqttPacket *packet, size_t size)
+{
+    if (packet->state != MqttPacketStateWriteData &&
+        packet->state != MqttPacketStateWritePayload)
+        return 0;
+
+    if (size > packet->remainingLength)
+        size = packet->remainingLength;
+
+    if (size > 0)
+        packet->writeStarted = 1;
+
+    packet->remainingLength -= size;
+
+    if (packet->remainingLength == 0)
+    {
+        if (packet->state == MqttPacketStateWriteData &&
+            packet->streamSize > 0)
+        {
+            packet->state = MqttPacketStateWritePayload;
+            packet->remainingLength = packet->streamSize;
+        }
+        else
+        {
+            packet->state = MqttPacketStateWriteComplete;
+        }
+    }
+
+    return size;
 }
@@ -2,9 +2,11 @@
 #define PACKET_H
 
 #include "config.h"
+#include "stream.h"
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #include <bstrlib/bstrlib.h>
@@ -34,16 +36,42 @@ enum MqttPacketState
     MqttPacketStateReadType,
     MqttPacketStateReadRemainingLength,
     MqttPacketStateReadPayload,
+    /* a PUBLISH passed on as it arrives, see MqttClientSetOnMessageStream */
+    MqttPacketStateReadPublishHeader,
+    MqttPacketStateReadPublishPayload,
     MqttPacketStateReadComplete,
 
-    MqttPacketStateWriteType,
-    MqttPacketStateWriteRemainingLength,
+    MqttPacketStateWriteData,
+    /* the payload is sent from a file or produced as it is sent, see
+       MqttPacketAllocateFile and MqttPacketAllocateProduced */
     MqttPacketStateWritePayload,
     MqttPacketStateWriteComplete
 };
 
+/* Largest remaining length that fits in the four encoded bytes */
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
+/* Packets whose encoding fits in this many bytes (PUBACK, PUBREC, PUBREL,
+   PUBCOMP, PINGREQ and DISCONNECT) are stored inside MqttPacket. */
+#define MQTT_PACKET_INLINE_SIZE 4
+
 struct MqttMessage;
 
+/*
+    An encoded packet that a message keeps for sending it again and shares
+    with the packets that send it, see MqttPacketAllocateShared, or several
+    packets encoded back to back, see MqttClientPublishMany. It is freed
+    when the last reference is dropped.
+*/
+typedef struct MqttPacketBuffer MqttPacketBuffer;
+
+struct MqttPacketBuffer
+{
+    int refs;
+    size_t size;
+    unsigned char *data;
+};
+
 typedef struct MqttPacket MqttPacket;
 
 struct MqttPacket
@@ -52,9 +80,42 @@ struct MqttPacket
     int flags;
     int state;
     uint16_t id;
+    /* the priority of a PUBLISH (one of MqttPriority) and the lane of
+       the send queue the packet is in */
+    int priority;
+    int lane;
+    /* bytes of a QoS 0 PUBLISH counted in the limits of the client while
+       it is queued, 0 for other packets */
+    size_t queuedSize;
+    /* when writing, the number of bytes left to write in the current state */
     size_t remainingLength;
     size_t remainingLengthMul;
-    /* TODO: maybe switch to have a StringStream here? */
+    /* 1 once any of the packet has been written */
+    int writeStarted;
+    /* the whole encoded packet when writing, see MqttPacketAllocate */
+    unsigned char *data;
+    size_t size;
+    /* storage for data of small packets */
+    unsigned char inlineData[MQTT_PACKET_INLINE_SIZE];
+    /* the buffer data belongs to if it is shared */
+    MqttPacketBuffer *shared;
+    /* the first byte of the packet, written from here instead of from
+       data if ownHeader is 1, see MqttPacketPrepareWrite */
+    unsigned char header;
+    int ownHeader;
+    /* end of the payload, written after data from memory the packet doesn't
+       own, see MqttPacketAllocateExternal */
+    const unsigned char *external;
+    size_t externalSize;
+    /* or end of the payload (streamSize bytes if more than 0) written after
+       data in MqttPacketStateWritePayload, from fd at fileOffset (see
+       MqttPacketAllocateFile) or, if produced is 1, from the producer of the
+       message (see MqttPacketAllocateProduced) */
+    int fd;
+    int64_t fileOffset;
+    int produced;
+    size_t streamSize;
+    /* the received payload when reading */
     bstring payload;
     struct MqttMessage *message;
     SIMPLEQ_ENTRY(MqttPacket) sendQueue;
@@ -68,4 +129,180 @@ MqttPacket *MqttPacketWithIdNew(int type, uint16_t id);
 
 void MqttPacketFree(MqttPacket *packet);
 
+/* Frees the data of the packet and clears it for reuse. */
+void MqttPacketReset(MqttPacket *packet);
+
+/* Returns 1 if the encoded packet is stored inside the packet. */
+static MQTT_INLINE int MqttPacketIsInline(const MqttPacket *packet)
+{
+    return packet->data == packet->inlineData;
+}
+
+/*
+    Allocates the buffer for the encoded packet with a body (variable header
+    and payload) of bodyLength bytes and encodes the fixed header into it.
+    Small packets use the storage inside the packet and don't allocate.
+    Returns where the caller must write exactly bodyLength bytes of body, or
+    NULL on failure.
+*/
+unsigned char *MqttPacketAllocate(MqttPacket *packet, size_t bodyLength);
+
+/*
+    Same as MqttPacketAllocate but the encoded packet goes to a new shared
+    buffer, see MqttPacketBufferRef.
+*/
+unsigned char *MqttPacketAllocateShared(MqttPacket *packet, size_t bodyLength);
+
+/* Returns a new buffer of size bytes with one reference or NULL. */
+MqttPacketBuffer *MqttPacketBufferNew(size_t size);
+
+/*
+    Makes the packet send the encoded packet of size bytes at offset in
+    buffer, taking a reference.
+*/
+void MqttPacketUseShared(MqttPacket *packet, MqttPacketBuffer *buffer,
+                         size_t offset, size_t size);
+
+/* Takes a reference to the buffer and returns it. */
+static MQTT_INLINE MqttPacketBuffer *MqttPacketBufferRef(
+    MqttPacketBuffer *buffer)
+{
+    ++buffer->refs;
+    return buffer;
+}
+
+/* Drops a reference to the buffer (which may be NULL). */
+void MqttPacketBufferUnref(MqttPacketBuffer *buffer);
+
+/*
+    Same as MqttPacketAllocate but the last externalSize bytes of the body are
+    written straight from external, which must stay valid until the packet
+    has been written or MqttPacketCopyExternal is called. The caller writes
+    the first bodyLength - externalSize bytes.
+*/
+unsigned char *MqttPacketAllocateExternal(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          const void *external,
+                                          size_t externalSize);
+
+/*
+    Same as MqttPacketAllocateExternal but the last fileSize bytes of the body
+    are fileSize bytes of fd from fileOffset. They are not part of what
+    MqttPacketWriteIov returns. Once the rest has been written, the packet is
+    in MqttPacketStateWritePayload until remainingLength bytes from
+    MqttPacketFilePosition have been written. fd must stay open until then.
+*/
+unsigned char *MqttPacketAllocateFile(MqttPacket *packet, size_t bodyLength,
+                                      int fd, int64_t fileOffset,
+                                      size_t fileSize);
+
+/*
+    Same as MqttPacketAllocateFile but the caller produces the last
+    streamSize bytes of the body in MqttPacketStateWritePayload.
+*/
+unsigned char *MqttPacketAllocateProduced(MqttPacket *packet,
+                                          size_t bodyLength,
+                                          size_t streamSize);
+
+/* Returns 1 if any of the packet has been written. */
+static MQTT_INLINE int MqttPacketWriteStarted(const MqttPacket *packet)
+{
+    return packet->writeStarted;
+}
+
+/*
+    Replaces what is left to write of the packet with size bytes of data
+    allocated with MqttMalloc, which the packet takes over.
+*/
+void MqttPacketSetRemainder(MqttPacket *packet, unsigned char *data,
+                            size_t size);
+
+/* Returns the offset in fd to write from in MqttPacketStateWritePayload. */
+static MQTT_INLINE int64_t MqttPacketFilePosition(const MqttPacket *packet)
+{
+    return packet->fileOffset +
+        (int64_t) (packet->streamSize - packet->remainingLength);
+}
+
+/*
+    Copies the external part of the packet, from memory or from a file, into
+    its own data so that the memory can be released or the file closed. Can
+    be called in the middle of writing the packet. Returns -1 on failure and
+    for produced packets.
+*/
+int MqttPacketCopyExternal(MqttPacket *packet);
+
+/*
+    Updates the type and flags in the encoded packet and sets the packet to
+    MqttPacketStateWriteData. A shared buffer is left as it is for the
+    other packets using it, the packet writes a first byte of its own if
+    it needs another one.
+*/
+void MqttPacketPrepareWrite(MqttPacket *packet);
+
+/*
+    Fills iov with at most max buffers holding the unwritten part of the
+    packet. Returns the number of buffers used.
+*/
+int MqttPacketWriteIov(MqttPacket *packet, StreamIoVec *iov, int max);
+
+/*
+    Marks up to size bytes of the packet written. Returns the number of bytes
+    consumed from size. The packet is in MqttPacketStateWriteComplete when
+    all of it has been written.
+*/
+size_t MqttPacketWriteAdvance(MqttPacket *packet, size_t size);
+
+/* Returns the size of the fixed header of a packet with bodyLength bytes
+   of body. */
+size_t MqttPacketHeaderSize(size_t bodyLength);
+
+/*
+    Helpers for writing the body returned by MqttPacketAllocate, or whole
+    packets into a buffer of MqttPacketBufferNew. They return the position
+    following what was written.
+*/
+
+unsigned char *MqttEncodeFixedHeader(unsigned char *p, int type, int flags,
+                                     size_t bodyLength);
+
+static MQTT_INLINE unsigned char *MqttEncodeByte(unsigned char *p,
+                                                 unsigned char value)
+{
+    *p++ = value;
+    return p;
+}
+
+static MQTT_INLINE unsigned char *MqttEncodeUint16Be(unsigned char *p,
+                                                     uint16_t value)
+{
+    *p++ = (unsigned char) (value >> 8);
+    *p++ = (unsigned char) (value & 0xFF);
+    return p;
+}
+
+static MQTT_INLINE unsigned char *MqttEncodeBytes(unsigned char *p,
+                                                  const void *data,
+                                                  size_t size)
+{
+    if (size > 0)
+        memcpy(p, data, size);
+    return p + size;
+}
+
+/* Writes a length prefixed string, see MqttStringSize. */
+static MQTT_INLINE unsigned char *MqttEncodeString(unsigned char *p,
+                                                   const void *data,
+                                                   size_t size)
+{
+    p = MqttEncodeUint16Be(p, (uint16_t) size);
+    return MqttEncodeBytes(p, data, size);
+}
+
+/* Returns the encoded size of a string of size bytes. */
+static MQTT_INLINE size_t MqttStringSize(size_t size)
+{
+    return 2 + size;
+}
+
 #endif
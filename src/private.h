@@ -3,8 +3,16 @@
 
 #include "mqtt.h"
 
+#include <stdint.h>
+
 void MqttClientPause(MqttClient *client);
 
 void MqttClientResume(MqttClient *client);
 
+/*
+    Returns the time (see MqttGetCurrentTime) of the next retry or keepalive
+    action of the client, or -1 if there is none.
+*/
+int64_t MqttClientNextDeadline(MqttClient *client);
+
 #endif
@@ -1,10 +1,29 @@
 #include "socket.h"
 #include "log.h"
+#include "misc.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 
+#if defined(SOCKET_USE_POLL) && !defined(_WIN32)
+#include <poll.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+/* Size of the buffer SocketSendFile reads the file into without sendfile */
+#if !defined(SOCKET_SENDFILE_BUFFER_SIZE)
+#define SOCKET_SENDFILE_BUFFER_SIZE (16*1024)
+#endif
+
+#if defined(SOCKET_HAVE_ZEROCOPY)
+#include <time.h>
+#include <linux/errqueue.h>
+#endif
+
 #if defined(_WIN32)
 static int InitializeWsa()
 {
@@ -108,6 +127,48 @@ int64_t SocketSend(int sock, const void *buf, size_t len, int flags)
     return send(sock, buf, len, flags);
 }
 
+int64_t SocketSendv(int sock, const SocketIoVec *iov, int count, int flags)
+{
+#if defined(_WIN32)
+    WSABUF bufs[SOCKET_IOV_MAX];
+    DWORD sent = 0;
+    int i;
+
+    assert(count <= SOCKET_IOV_MAX);
+
+    for (i = 0; i < count; ++i)
+    {
+        bufs[i].buf = (char *) iov[i].base;
+        bufs[i].len = (ULONG) iov[i].len;
+    }
+
+    if (WSASend(sock, bufs, count, &sent, flags, NULL, NULL) == SOCKET_ERROR)
+    {
+        return -1;
+    }
+
+    return sent;
+#else
+    struct iovec bufs[SOCKET_IOV_MAX];
+    struct msghdr msg;
+    int i;
+
+    assert(count <= SOCKET_IOV_MAX);
+
+    for (i = 0; i < count; ++i)
+    {
+        bufs[i].iov_base = (void *) iov[i].base;
+        bufs[i].iov_len = iov[i].len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = bufs;
+    msg.msg_iovlen = count;
+
+    return sendmsg(sock, &msg, flags);
+#endif
+}
+
 int SocketSendAll(int sock, const char *buf, size_t *len)
 {
     size_t total = 0;
@@ -129,6 +190,58 @@ int SocketSendAll(int sock, const char *buf, size_t *len)
     return rv == -1 ? -1 : 0;
 }
 
+#if defined(SOCKET_USE_POLL) && !defined(_WIN32)
+int SocketSelect(int sock, int *events, int timeout)
+{
+    struct pollfd pfd;
+    int wanted;
+    int rv;
+
+    assert(sock != -1);
+    assert(events != NULL);
+    assert(*events != 0);
+
+    wanted = *events;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = sock;
+
+    if (wanted & EV_READ)
+    {
+        pfd.events |= POLLIN;
+    }
+
+    if (wanted & EV_WRITE)
+    {
+        pfd.events |= POLLOUT;
+    }
+
+    *events = 0;
+
+    rv = poll(&pfd, 1, timeout);
+
+    if (rv <= 0)
+    {
+        return rv;
+    }
+
+    /* Errors and hangups are reported as readable so that the following
+       read notices them. */
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+    {
+        *events |= EV_READ;
+    }
+
+    if (pfd.revents & POLLOUT)
+    {
+        *events |= EV_WRITE;
+    }
+
+    *events &= wanted;
+
+    return rv;
+}
+#else
 int SocketSelect(int sock, int *events, int timeout)
 {
     fd_set rfd, wfd;
@@ -167,16 +280,98 @@ int SocketSelect(int sock, int *events, int timeout)
 
     if (FD_ISSET(sock, &wfd))
     {
-        *events = EV_WRITE;
+        *events |= EV_WRITE;
     }
 
     if (FD_ISSET(sock, &rfd))
     {
-        *events = EV_READ;
+        *events |= EV_READ;
     }
 
     return rv;
 }
+#endif
+
+int64_t SocketSendFile(int sock, int fd, int64_t offset, size_t size)
+{
+#if defined(__linux__)
+    off_t off = (off_t) offset;
+    return sendfile(sock, fd, &off, size);
+#else
+    char buf[SOCKET_SENDFILE_BUFFER_SIZE];
+    int64_t rv;
+
+    if (size > sizeof(buf))
+        size = sizeof(buf);
+
+    if ((rv = MqttFileReadAt(fd, buf, size, offset)) <= 0)
+        return rv;
+
+    /* What isn't sent now is read again on the next call */
+    return SocketSend(sock, buf, (size_t) rv, 0);
+#endif
+}
+
+int SocketEnableZeroCopy(int sock)
+{
+#if defined(SOCKET_HAVE_ZEROCOPY)
+    int one = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+#else
+    (void) sock;
+    return -1;
+#endif
+}
+
+int SocketReadZeroCopyCompletions(int sock, uint32_t *done)
+{
+#if defined(SOCKET_HAVE_ZEROCOPY)
+    int count = 0;
+
+    for (;;)
+    {
+        /* Completions carry no data, only a control message */
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (SocketWouldBlock(SocketErrno))
+                return count;
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            struct sock_extended_err err;
+
+            if (cmsg->cmsg_len < CMSG_LEN(sizeof(err)))
+                continue;
+
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* The range [ee_info, ee_data] of sends has completed */
+            if ((int32_t) (err.ee_data + 1 - *done) > 0)
+                *done = err.ee_data + 1;
+
+            ++count;
+        }
+    }
+#else
+    (void) sock;
+    (void) done;
+    return 0;
+#endif
+}
 
 void SocketSetNonblocking(int sock, int nb)
 {
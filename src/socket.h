@@ -15,11 +15,16 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#if defined(__linux__)
+/* SO_ZEROCOPY, hidden by _XOPEN_SOURCE */
+#include <asm/socket.h>
+#endif
 #define SocketErrno (errno)
 #define SOCKET_EINPROGRESS (EINPROGRESS)
 #endif
@@ -30,18 +35,68 @@ int SocketDisconnect(int sock);
 
 int SocketSendAll(int sock, const char *buf, size_t *len);
 
+/* Same values as MqttEventRead and MqttEventWrite */
 enum
 {
     EV_READ = 1,
     EV_WRITE = 2
 };
 
+/*
+    Waits at most timeout milliseconds for the events (EV_READ, EV_WRITE) in
+    *events. On return *events has every requested event that is ready, so
+    both EV_READ and EV_WRITE can be set. Uses poll() instead of select() if
+    SOCKET_USE_POLL is defined (not on Windows).
+*/
 int SocketSelect(int sock, int *events, int timeout);
 
 int64_t SocketRecv(int sock, void *buf, size_t len, int flags);
 
 int64_t SocketSend(int sock, const void *buf, size_t len, int flags);
 
+/* Maximum number of buffers SocketSendv accepts */
+#define SOCKET_IOV_MAX 64
+
+typedef struct SocketIoVec SocketIoVec;
+
+struct SocketIoVec
+{
+    const void *base;
+    size_t len;
+};
+
+/* Sends all the buffers with a single sendmsg (WSASend on Windows). */
+int64_t SocketSendv(int sock, const SocketIoVec *iov, int count, int flags);
+
+/*
+    Sends at most size bytes of the file fd from offset, with sendfile() on
+    Linux and by reading the file into a buffer elsewhere. Returns the number
+    of bytes sent, 0 if the file ended or -1 on error.
+*/
+int64_t SocketSendFile(int sock, int fd, int64_t offset, size_t size);
+
+/* Linux (4.14) can send from user memory without copying it, see
+   SocketEnableZeroCopy. */
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define SOCKET_HAVE_ZEROCOPY 1
+#endif
+
+/*
+    Allows sending with the MSG_ZEROCOPY flag. Each such send that succeeds
+    gets the next id starting from 0, and the kernel reports when it no longer
+    needs the memory of the send, see SocketReadZeroCopyCompletions. Returns
+    -1 if the platform or the socket doesn't support it.
+*/
+int SocketEnableZeroCopy(int sock);
+
+/*
+    Reads the zero copy completions from the error queue of the socket without
+    blocking. Sends complete in order, so *done is raised to one past the
+    highest completed id. Returns the number of completions read or -1 on
+    error.
+*/
+int SocketReadZeroCopyCompletions(int sock, uint32_t *done);
+
 void SocketSetNonblocking(int sock, int nb);
 
 int SocketGetError(int sock, int *error);
@@ -1,5 +1,8 @@
 #include "socketstream.h"
 #include "socket.h"
+#include "uringstream.h"
+#include "alloc.h"
+#include "misc.h"
 
 #include <assert.h>
 #include <string.h>
@@ -8,30 +11,69 @@ static int SocketStreamClose(Stream *base)
 {
     int rv;
     SocketStream *stream = (SocketStream *) base;
+#if defined(MQTT_USE_IO_URING)
+    UringStreamDetach(stream);
+#endif
     rv = SocketDisconnect(stream->sock);
     stream->sock = -1;
+    MqttFree(stream->rbuf);
+    stream->rbuf = NULL;
+    stream->rpos = stream->rlen = 0;
     return rv;
 }
 
+/* Copy up to size buffered bytes to ptr. */
+static size_t SocketStreamDrain(SocketStream *ss, unsigned char *ptr,
+                                size_t size)
+{
+    size_t available = ss->rlen - ss->rpos;
+    if (size > available)
+        size = available;
+    memcpy(ptr, ss->rbuf + ss->rpos, size);
+    ss->rpos += size;
+    return size;
+}
+
+/* Refill the (empty) receive buffer with a single recv(). */
+static int64_t SocketStreamFill(SocketStream *ss)
+{
+    int64_t rv;
+    assert(ss->rpos == ss->rlen);
+    ss->rpos = ss->rlen = 0;
+    rv = SocketRecv(ss->sock, ss->rbuf, SOCKET_STREAM_RECV_BUFFER_SIZE, 0);
+    if (rv > 0)
+        ss->rlen = (size_t) rv;
+    return rv;
+}
+
+/*
+    Reads whatever is buffered and, if that is not enough, does at most one
+    recv(). Returns the number of bytes read, which may be less than size, 0 if
+    the peer has closed the connection or -1 on error. Bytes read before a
+    would-block error are returned instead of being dropped.
+*/
 static int64_t SocketStreamRead(void *ptr, size_t size, Stream *stream)
 {
     SocketStream *ss = (SocketStream *) stream;
-    size_t received = 0;
+    unsigned char *p = (unsigned char *) ptr;
+    size_t received;
+    int64_t rv;
     if (ss->sock == -1)
         return -1;
-    while (received < size)
-    {
-        char *p = ((char *) ptr) + received;
-        int64_t rv = SocketRecv(ss->sock, p, size - received, 0);
-        /* Error */
-        if (rv == -1)
-            return -1;
-        /* TODO: Closed? */
-        if (rv == 0)
-            break;
-        received += (size_t) rv;
-    }
-    return received;
+#if defined(MQTT_USE_IO_URING)
+    if (ss->uring)
+        return UringStreamRead(ss->uring, ptr, size);
+#endif
+    received = SocketStreamDrain(ss, p, size);
+    if (received == size)
+        return received;
+    if (size - received >= SOCKET_STREAM_RECV_BUFFER_SIZE)
+        rv = SocketRecv(ss->sock, p + received, size - received, 0);
+    else if ((rv = SocketStreamFill(ss)) > 0)
+        rv = SocketStreamDrain(ss, p + received, size - received);
+    if (rv == -1)
+        return received > 0 ? (int64_t) received : -1;
+    return received + rv;
 }
 
 static int64_t SocketStreamWrite(const void *ptr, size_t size, Stream *stream)
@@ -40,24 +82,62 @@ static int64_t SocketStreamWrite(const void *ptr, size_t size, Stream *stream)
     size_t written = 0;
     if (ss->sock == -1)
         return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (ss->uring)
+    {
+        StreamIoVec iov;
+        iov.data = ptr;
+        iov.size = size;
+        return UringStreamWritev(ss->uring, &iov, 1);
+    }
+#endif
     while (written < size)
     {
         const char *p = ((char *) ptr) + written;
         int64_t rv = SocketSend(ss->sock, p, size - written, 0);
         if (rv == -1)
-            return -1;
+            return written > 0 ? (int64_t) written : -1;
         written += (size_t) rv;
     }
     return written;
 }
 
+static int64_t SocketStreamSendv(SocketStream *ss, const StreamIoVec *iov,
+                                 int iovcnt, int flags)
+{
+    SocketIoVec bufs[SOCKET_IOV_MAX];
+    int i;
+    if (iovcnt > SOCKET_IOV_MAX)
+        iovcnt = SOCKET_IOV_MAX;
+    for (i = 0; i < iovcnt; ++i)
+    {
+        bufs[i].base = iov[i].data;
+        bufs[i].len = iov[i].size;
+    }
+    return SocketSendv(ss->sock, bufs, iovcnt, flags);
+}
+
+static int64_t SocketStreamWritev(const StreamIoVec *iov, int iovcnt,
+                                  Stream *stream)
+{
+    SocketStream *ss = (SocketStream *) stream;
+    if (ss->sock == -1)
+        return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (ss->uring)
+        return UringStreamWritev(ss->uring, iov, iovcnt);
+#endif
+    return SocketStreamSendv(ss, iov, iovcnt, 0);
+}
+
 static const StreamOps SocketStreamOps =
 {
     SocketStreamRead,
     SocketStreamWrite,
     SocketStreamClose,
     NULL,
-    NULL
+    NULL,
+    SocketStreamWritev
 };
 
 int SocketStreamOpen(SocketStream *stream, int sock)
@@ -65,7 +145,87 @@ int SocketStreamOpen(SocketStream *stream, int sock)
     assert(stream != NULL);
     assert(sock != -1);
     memset(stream, 0, sizeof(*stream));
+    stream->rbuf = MqttMalloc(SOCKET_STREAM_RECV_BUFFER_SIZE);
+    if (!stream->rbuf)
+        return -1;
     stream->sock = sock;
     stream->base.ops = &SocketStreamOps;
     return 0;
 }
+
+int64_t SocketStreamSendFile(SocketStream *stream, int fd, int64_t offset,
+                             size_t size)
+{
+    assert(stream != NULL);
+    if (stream->sock == -1)
+        return -1;
+#if defined(MQTT_USE_IO_URING)
+    if (stream->uring)
+    {
+        /* The ring keeps the writes in order so the file must go through
+           it too */
+        unsigned char buf[16*1024];
+        StreamIoVec iov;
+        int64_t rv;
+        if (size > sizeof(buf))
+            size = sizeof(buf);
+        if ((rv = MqttFileReadAt(fd, buf, size, offset)) <= 0)
+            return rv;
+        iov.data = buf;
+        iov.size = (size_t) rv;
+        return UringStreamWritev(stream->uring, &iov, 1);
+    }
+#endif
+    return SocketSendFile(stream->sock, fd, offset, size);
+}
+
+int SocketStreamEnableZeroCopy(SocketStream *stream)
+{
+    assert(stream != NULL);
+    if (stream->sock == -1 || stream->uring)
+        return -1;
+    if (SocketEnableZeroCopy(stream->sock) == -1)
+        return -1;
+    stream->zeroCopy = 1;
+    return 0;
+}
+
+int64_t SocketStreamWritevZeroCopy(SocketStream *stream,
+                                   const StreamIoVec *iov, int iovcnt)
+{
+#if defined(SOCKET_HAVE_ZEROCOPY)
+    int64_t rv;
+    assert(stream != NULL);
+    if (stream->zeroCopy && stream->sock != -1 && !stream->uring)
+    {
+        rv = SocketStreamSendv(stream, iov, iovcnt, MSG_ZEROCOPY);
+        if (rv >= 0)
+        {
+            ++stream->zeroCopySent;
+            return rv;
+        }
+        /* Out of memory for pinning pages, fall back to copying */
+        if (SocketErrno != ENOBUFS)
+            return rv;
+    }
+#endif
+    return StreamWritev(iov, iovcnt, &stream->base);
+}
+
+int SocketStreamReapZeroCopy(SocketStream *stream)
+{
+    assert(stream != NULL);
+    if (!stream->zeroCopy || stream->sock == -1 || stream->uring)
+        return 0;
+    return SocketReadZeroCopyCompletions(stream->sock, &stream->zeroCopyDone);
+}
+
+size_t SocketStreamAvailable(SocketStream *stream)
+{
+    assert(stream != NULL);
+#if defined(MQTT_USE_IO_URING)
+    if (stream->uring)
+        return UringStreamAvailable(stream->uring);
+#endif
+    return stream->rlen - stream->rpos;
+}
@@ -3,14 +3,69 @@
 
 #include "stream.h"
 
+/* Size of the per-stream receive buffer. Reads at least this big bypass the
+   buffer and go straight to the caller's memory. */
+#if !defined(SOCKET_STREAM_RECV_BUFFER_SIZE)
+#define SOCKET_STREAM_RECV_BUFFER_SIZE (16*1024)
+#endif
+
 typedef struct SocketStream SocketStream;
 
+struct UringStream;
+
 struct SocketStream
 {
     Stream base;
     int sock;
+    /* received data not yet consumed is rbuf[rpos..rlen) */
+    unsigned char *rbuf;
+    size_t rpos;
+    size_t rlen;
+    /* set while the I/O goes through io_uring, see uringstream.h */
+    struct UringStream *uring;
+    /* 1 if SocketStreamWritevZeroCopy can send without copying. The ids
+       of such sends below zeroCopyDone have completed and the rest up to
+       zeroCopySent are pending. */
+    int zeroCopy;
+    uint32_t zeroCopySent;
+    uint32_t zeroCopyDone;
 };
 
 int SocketStreamOpen(SocketStream *stream, int sock);
 
+/* Returns the number of received bytes that can be read without touching the
+   socket. */
+size_t SocketStreamAvailable(SocketStream *stream);
+
+/*
+    Writes at most size bytes of the file fd from offset, see SocketSendFile.
+    With io_uring the file is read into memory and queued like other writes.
+*/
+int64_t SocketStreamSendFile(SocketStream *stream, int fd, int64_t offset,
+                             size_t size);
+
+/*
+    Enables SocketStreamWritevZeroCopy if the platform supports MSG_ZEROCOPY.
+    Not available with io_uring. Returns -1 if not enabled.
+*/
+int SocketStreamEnableZeroCopy(SocketStream *stream);
+
+/*
+    Same as StreamWritev but, if enabled, the kernel sends straight from the
+    buffers which must stay unchanged until the send has completed. Such a
+    send gets the id zeroCopySent had before the call and increments it.
+*/
+int64_t SocketStreamWritevZeroCopy(SocketStream *stream,
+                                   const StreamIoVec *iov, int iovcnt);
+
+/* Updates zeroCopyDone from the completions reported by the kernel. */
+int SocketStreamReapZeroCopy(SocketStream *stream);
+
+/* Returns 1 if the zero copy send with the id has completed. */
+static MQTT_INLINE int SocketStreamZeroCopyDone(const SocketStream *stream,
+                                                uint32_t id)
+{
+    return (int32_t) (id - stream->zeroCopyDone) < 0;
+}
+
 #endif
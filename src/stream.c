@@ -28,10 +28,10 @@ int64_t StreamRead(void *ptr, size_t size, Stream *stream)
     STREAM_CHECK_OP(stream, read);
     rv = stream->ops->read(ptr, size, stream);
 #if defined(STREAM_HEXDUMP_READ)
-    if (rv >= 0)
+    if (rv > 0)
     {
-        printf("READ %lu bytes:\n", size);
-        DumpHex(ptr, size);
+        printf("READ %lu bytes:\n", (unsigned long) rv);
+        DumpHex(ptr, (size_t) rv);
     }
 #endif
     return rv;
@@ -43,7 +43,7 @@ int64_t StreamReadUint16Be(uint16_t *v, Stream *stream)
     STREAM_CHECK_OP(stream, read);
     if (StreamRead(data, 2, stream) != 2)
         return -1;
-    *v = (data[1] << 0) | (data[0] << 1);
+    *v = (data[1] << 0) | (data[0] << 8);
     return 2;
 }
 
@@ -62,6 +62,39 @@ int64_t StreamWrite(const void *ptr, size_t size, Stream *stream)
     return stream->ops->write(ptr, size, stream);
 }
 
+int64_t StreamWritev(const StreamIoVec *iov, int iovcnt, Stream *stream)
+{
+    int64_t total = 0;
+    int i;
+
+    STREAM_CHECK_OP(stream, write);
+
+#if defined(STREAM_HEXDUMP_WRITE)
+    for (i = 0; i < iovcnt; ++i)
+    {
+        printf("WRITE %lu bytes:\n", iov[i].size);
+        DumpHex(iov[i].data, iov[i].size);
+    }
+#endif
+
+    if (stream->ops->writev)
+    {
+        return stream->ops->writev(iov, iovcnt, stream);
+    }
+
+    for (i = 0; i < iovcnt; ++i)
+    {
+        int64_t rv = stream->ops->write(iov[i].data, iov[i].size, stream);
+        if (rv == -1)
+            return total > 0 ? total : -1;
+        total += rv;
+        if ((size_t) rv < iov[i].size)
+            break;
+    }
+
+    return total;
+}
+
 int64_t StreamWriteUint16Be(uint16_t v, Stream *stream)
 {
     unsigned char data[2];
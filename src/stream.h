@@ -6,8 +6,18 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+/* Maximum number of buffers passed to StreamWritev at a time */
+#define STREAM_IOV_MAX 64
+
 typedef struct Stream Stream;
 typedef struct StreamOps StreamOps;
+typedef struct StreamIoVec StreamIoVec;
+
+struct StreamIoVec
+{
+    const void *data;
+    size_t size;
+};
 
 struct Stream
 {
@@ -21,6 +31,7 @@ struct StreamOps
     int (*close)(Stream *stream);
     int (*seek)(Stream *stream, int64_t offset, int whence);
     int64_t (*tell)(Stream *stream);
+    int64_t (*writev)(const StreamIoVec *iov, int iovcnt, Stream *stream);
 };
 
 int StreamClose(Stream *stream);
@@ -33,6 +44,13 @@ int64_t StreamWrite(const void *ptr, size_t size, Stream *stream);
 int64_t StreamWriteUint16Be(uint16_t v, Stream *stream);
 int64_t StreamWriteByte(unsigned char byte, Stream *stream);
 
+/*
+    Writes the buffers in order with as few calls to the underlying stream as
+    possible. Returns the number of bytes written, which can be less than the
+    total size of the buffers, or -1 on error.
+*/
+int64_t StreamWritev(const StreamIoVec *iov, int iovcnt, Stream *stream);
+
 int StreamSeek(Stream *stream, int64_t offset, int whence);
 
 int64_t StreamTell(Stream *stream);
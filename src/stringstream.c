@@ -91,7 +91,8 @@ static const StreamOps StringStreamOps =
     StringStreamWrite,
     StringStreamClose,
     StringStreamSeek,
-    StringStreamTell
+    StringStreamTell,
+    NULL
 };
 
 int StringStreamInit(StringStream *stream)
@@ -0,0 +1,213 @@
+#include "uring.h"
+
+#if defined(MQTT_USE_IO_URING)
+
+#include "log.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+static int UringSetup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int UringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                      unsigned flags, void *arg, size_t argSize)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+                         flags, arg, argSize);
+}
+
+int UringRegister(Uring *ring, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int) syscall(__NR_io_uring_register, ring->fd, opcode, arg,
+                         nrArgs);
+}
+
+int UringInit(Uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    unsigned char *sq, *cq;
+    unsigned *sqArray;
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = UringSetup(entries, &params);
+
+    if (ring->fd == -1)
+    {
+        return -1;
+    }
+
+    /* We wait with a timeout through IORING_ENTER_EXT_ARG (Linux 5.11) */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->features = params.features;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (ring->cqRingSize > ring->sqRingSize)
+        ring->sqRingSize = ring->cqRingSize;
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+
+    if (ring->sqRing == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    /* With IORING_FEAT_SINGLE_MMAP both rings live in the same mapping */
+    ring->cqRing = ring->sqRing;
+    ring->cqRingSize = 0;
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    sq = (unsigned char *) ring->sqRing;
+    cq = (unsigned char *) ring->cqRing;
+
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned *) (sq + params.sq_off.ring_entries);
+
+    /* SQE i is always at array slot i */
+    sqArray = (unsigned *) (sq + params.sq_off.array);
+    for (i = 0; i < ring->sqEntries; ++i)
+        sqArray[i] = i;
+
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+void UringFree(Uring *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* Makes the SQEs handed out so far visible to the kernel. */
+static unsigned UringFlush(Uring *ring)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned pending = ring->sqPending;
+    __atomic_store_n(ring->sqTail, tail + pending, __ATOMIC_RELEASE);
+    ring->sqPending = 0;
+    return pending;
+}
+
+struct io_uring_sqe *UringGetSqe(Uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned next = *ring->sqTail + ring->sqPending;
+    struct io_uring_sqe *sqe;
+
+    if (next - head >= ring->sqEntries)
+    {
+        /* Full, let the kernel consume what we have so far */
+        if (UringSubmit(ring, 0, 0) == -1)
+            return NULL;
+        head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        next = *ring->sqTail + ring->sqPending;
+        if (next - head >= ring->sqEntries)
+            return NULL;
+    }
+
+    sqe = &ring->sqes[next & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sqPending;
+
+    return sqe;
+}
+
+int UringSubmit(Uring *ring, unsigned waitNr, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned toSubmit = UringFlush(ring);
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    int rv;
+
+    if (waitNr > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    else if (toSubmit == 0)
+    {
+        return 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+
+    if (waitNr > 0 && timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    do
+    {
+        rv = UringEnter(ring->fd, toSubmit, waitNr, flags, &arg, sizeof(arg));
+    }
+    while (rv == -1 && errno == EINTR);
+
+    if (rv == -1 && errno != ETIME)
+    {
+        LOG_ERROR("io_uring_enter failed: %d", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct io_uring_cqe *UringPeekCqe(Uring *ring)
+{
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return NULL;
+
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void UringCqeSeen(Uring *ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
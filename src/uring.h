@@ -0,0 +1,73 @@
+#ifndef MQTT_URING_H
+#define MQTT_URING_H
+
+#include "config.h"
+
+#if defined(MQTT_USE_IO_URING)
+
+#include <linux/io_uring.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+    Minimal io_uring wrapper on top of the raw system calls so that we don't
+    depend on liburing.
+*/
+
+typedef struct Uring Uring;
+
+struct Uring
+{
+    int fd;
+    unsigned features;
+    /* submission queue */
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe *sqes;
+    /* SQEs handed out by UringGetSqe but not yet made visible to the kernel */
+    unsigned sqPending;
+    /* completion queue */
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    /* mappings */
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+/* Returns -1 (with errno set) if io_uring is not available. */
+int UringInit(Uring *ring, unsigned entries);
+
+void UringFree(Uring *ring);
+
+/*
+    Returns a zeroed SQE, flushing the submission queue to the kernel first if
+    it is full. Returns NULL only if that fails.
+*/
+struct io_uring_sqe *UringGetSqe(Uring *ring);
+
+/*
+    Submits all pending SQEs and, if waitNr > 0, waits at most timeout
+    milliseconds (indefinitely if negative) for that many completions. Returns
+    -1 on error, 0 otherwise (also on timeout).
+*/
+int UringSubmit(Uring *ring, unsigned waitNr, int timeout);
+
+/* Returns the next completion or NULL if there is none. */
+struct io_uring_cqe *UringPeekCqe(Uring *ring);
+
+/* Releases the completion returned by UringPeekCqe. */
+void UringCqeSeen(Uring *ring);
+
+int UringRegister(Uring *ring, unsigned opcode, void *arg, unsigned nrArgs);
+
+#endif
+
+#endif
@@ -0,0 +1,656 @@
+#include "uringstream.h"
+#include "alloc.h"
+
+#if defined(MQTT_USE_IO_URING)
+
+#include "socket.h"
+#include "log.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+
+/* Submission queue size of the ring */
+#define URING_IO_ENTRIES 1024
+
+/* Provided buffer group used for all receives */
+#define URING_IO_BUFFER_GROUP 0
+
+/* The operation is stored in the low bits of the user_data of each SQE, the
+   rest is the UringStream pointer. */
+enum
+{
+    UringOpRecv = 1,
+    UringOpSend = 2,
+    UringOpPoll = 3,
+    UringOpMask = 3
+};
+
+static uint64_t UringUserData(UringStream *us, int op)
+{
+    return (uint64_t) (uintptr_t) us | op;
+}
+
+/* Hands the buffer bid back to the kernel. */
+static void UringIoRecycle(UringIo *io, int bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &io->bufRing->bufs[io->bufferTail & (URING_IO_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t) (uintptr_t)
+        (io->buffers + (size_t) bid * URING_IO_BUFFER_SIZE);
+    buf->len = URING_IO_BUFFER_SIZE;
+    buf->bid = (uint16_t) bid;
+
+    ++io->bufferTail;
+    ++io->freeBuffers;
+
+    __atomic_store_n(&io->bufRing->tail, io->bufferTail, __ATOMIC_RELEASE);
+}
+
+int UringIoInit(UringIo *io)
+{
+    struct io_uring_buf_reg reg;
+    int bid;
+
+    memset(io, 0, sizeof(*io));
+    TAILQ_INIT(&io->starved);
+
+    if (UringInit(&io->ring, URING_IO_ENTRIES) == -1)
+    {
+        LOG_DEBUG("io_uring not available: %d", errno);
+        return -1;
+    }
+
+    io->bufRingSize = URING_IO_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    io->bufRing = mmap(NULL, io->bufRingSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (io->bufRing == MAP_FAILED)
+    {
+        UringFree(&io->ring);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) io->bufRing;
+    reg.ring_entries = URING_IO_BUFFER_COUNT;
+    reg.bgid = URING_IO_BUFFER_GROUP;
+
+    /* Provided buffer rings need Linux 5.19 */
+    if (UringRegister(&io->ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        LOG_DEBUG("provided buffer rings not available: %d", errno);
+        munmap(io->bufRing, io->bufRingSize);
+        UringFree(&io->ring);
+        return -1;
+    }
+
+    io->buffers = MqttMalloc((size_t) URING_IO_BUFFER_COUNT *
+                             URING_IO_BUFFER_SIZE);
+    io->bufferLength = MqttCalloc(URING_IO_BUFFER_COUNT, sizeof(uint32_t));
+    io->bufferNext = MqttCalloc(URING_IO_BUFFER_COUNT, sizeof(int));
+
+    if (!io->buffers || !io->bufferLength || !io->bufferNext)
+    {
+        MqttFree(io->buffers);
+        MqttFree(io->bufferLength);
+        MqttFree(io->bufferNext);
+        munmap(io->bufRing, io->bufRingSize);
+        UringFree(&io->ring);
+        return -1;
+    }
+
+    for (bid = 0; bid < URING_IO_BUFFER_COUNT; ++bid)
+    {
+        UringIoRecycle(io, bid);
+    }
+
+    return 0;
+}
+
+void UringIoFree(UringIo *io)
+{
+    struct io_uring_cqe *cqe;
+    int tries = 0;
+
+    /* The kernel may still write to the buffers of detached streams */
+    while (io->streams > 0 && tries++ < 100)
+    {
+        if (UringSubmit(&io->ring, 1, 10) == -1)
+            break;
+
+        while ((cqe = UringPeekCqe(&io->ring)) != NULL)
+        {
+            UringIoComplete(io, cqe);
+            UringCqeSeen(&io->ring);
+        }
+    }
+
+    if (io->streams > 0)
+    {
+        LOG_WARNING("%d io_uring streams still busy", io->streams);
+    }
+
+    /* Closing the ring waits for the remaining operations */
+    UringFree(&io->ring);
+
+    munmap(io->bufRing, io->bufRingSize);
+    MqttFree(io->buffers);
+    MqttFree(io->bufferLength);
+    MqttFree(io->bufferNext);
+}
+
+static struct io_uring_sqe *UringStreamSqe(UringStream *us, int op)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(&us->io->ring);
+
+    if (!sqe)
+    {
+        LOG_ERROR("io_uring submission queue full");
+        return NULL;
+    }
+
+    sqe->fd = us->fd;
+    sqe->user_data = UringUserData(us, op);
+
+    return sqe;
+}
+
+static int UringStreamArmRecv(UringStream *us)
+{
+    struct io_uring_sqe *sqe = UringStreamSqe(us, UringOpRecv);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_IO_BUFFER_GROUP;
+
+    /* One multishot receive keeps delivering data until it is stopped */
+    if (us->multishot)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    us->recvArmed = 1;
+    ++us->inflight;
+
+    return 0;
+}
+
+static int UringStreamArmSend(UringStream *us)
+{
+    struct io_uring_sqe *sqe = UringStreamSqe(us, UringOpSend);
+
+    if (!sqe)
+        return -1;
+
+    us->sending = us->slen - us->spos;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t) (uintptr_t) (us->sbuf + us->spos);
+    sqe->len = (uint32_t) us->sending;
+    sqe->msg_flags = MSG_NOSIGNAL;
+
+    ++us->inflight;
+
+    return 0;
+}
+
+/* Frees a detached stream once the kernel is done with it. */
+static void UringStreamRelease(UringStream *us)
+{
+    const MqttAllocator *previous;
+
+    if (us->stream || us->inflight > 0)
+        return;
+
+    if (us->isStarved)
+        TAILQ_REMOVE(&us->io->starved, us, starvedQueue);
+
+    /* Closing the duplicate finally closes the connection */
+    if (us->ownsFd)
+        close(us->fd);
+
+    --us->io->streams;
+
+    /* Streams may outlive their connection so they always come from the
+       global allocator, see UringStreamAttach */
+    previous = MqttAllocatorEnter(NULL);
+    MqttFree(us->sbuf);
+    MqttFree(us);
+    MqttAllocatorLeave(previous);
+}
+
+static void UringStreamDropReceived(UringStream *us)
+{
+    while (us->head != -1)
+    {
+        int bid = us->head;
+        us->head = us->io->bufferNext[bid];
+        UringIoRecycle(us->io, bid);
+    }
+
+    us->tail = -1;
+    us->headOffset = 0;
+    us->available = 0;
+}
+
+static void UringStreamCompleteRecv(UringStream *us,
+                                    struct io_uring_cqe *cqe)
+{
+    UringIo *io = us->io;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        us->recvArmed = 0;
+        --us->inflight;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        --io->freeBuffers;
+
+        if (cqe->res > 0 && us->stream)
+        {
+            io->bufferLength[bid] = (uint32_t) cqe->res;
+            io->bufferNext[bid] = -1;
+
+            if (us->tail == -1)
+                us->head = bid;
+            else
+                io->bufferNext[us->tail] = bid;
+
+            us->tail = bid;
+            us->available += (size_t) cqe->res;
+        }
+        else
+        {
+            UringIoRecycle(io, bid);
+        }
+    }
+
+    if (cqe->res == 0)
+    {
+        us->eof = 1;
+    }
+    else if (cqe->res == -ENOBUFS)
+    {
+        if (us->stream && !us->isStarved)
+        {
+            us->isStarved = 1;
+            TAILQ_INSERT_TAIL(&io->starved, us, starvedQueue);
+        }
+    }
+    else if (cqe->res == -EINVAL && us->multishot)
+    {
+        /* Multishot receive needs Linux 6.0, receive one buffer at a time */
+        LOG_DEBUG("multishot receive not supported");
+        us->multishot = 0;
+    }
+    else if (cqe->res < 0 && cqe->res != -ECANCELED)
+    {
+        us->error = -cqe->res;
+    }
+
+    if (us->stream && !us->recvArmed && !us->isStarved && !us->eof &&
+        !us->error)
+    {
+        if (UringStreamArmRecv(us) == -1)
+            us->error = ENOMEM;
+    }
+}
+
+static void UringStreamCompleteSend(UringStream *us,
+                                    struct io_uring_cqe *cqe)
+{
+    --us->inflight;
+    us->sending = 0;
+
+    if (cqe->res < 0)
+    {
+        us->error = -cqe->res;
+        return;
+    }
+
+    us->spos += (size_t) cqe->res;
+
+    /* A detached stream keeps sending until everything is sent too */
+    if (us->spos == us->slen)
+    {
+        us->spos = us->slen = 0;
+    }
+    else if (!us->error)
+    {
+        /* Short send, continue with the rest */
+        if (UringStreamArmSend(us) == -1)
+            us->error = ENOMEM;
+    }
+}
+
+UringStream *UringIoComplete(UringIo *io, struct io_uring_cqe *cqe)
+{
+    UringStream *us;
+    int op;
+
+    (void) io;
+
+    op = (int) (cqe->user_data & UringOpMask);
+    us = (UringStream *) (uintptr_t) (cqe->user_data & ~(uint64_t) UringOpMask);
+
+    /* Cancellations are not tracked */
+    if (!us)
+        return NULL;
+
+    switch (op)
+    {
+        case UringOpRecv:
+            UringStreamCompleteRecv(us, cqe);
+            break;
+
+        case UringOpSend:
+            UringStreamCompleteSend(us, cqe);
+            break;
+
+        case UringOpPoll:
+            --us->inflight;
+            us->pollArmed = 0;
+            us->pollReady = 1;
+            break;
+    }
+
+    if (!us->stream)
+    {
+        UringStreamRelease(us);
+        return NULL;
+    }
+
+    return us;
+}
+
+void UringIoRearm(UringIo *io)
+{
+    while (io->freeBuffers > 0 && !TAILQ_EMPTY(&io->starved))
+    {
+        UringStream *us = TAILQ_FIRST(&io->starved);
+        TAILQ_REMOVE(&io->starved, us, starvedQueue);
+        us->isStarved = 0;
+        if (!us->recvArmed && UringStreamArmRecv(us) == -1)
+            us->error = ENOMEM;
+    }
+}
+
+int UringStreamAttach(UringIo *io, SocketStream *stream, void *userData)
+{
+    const MqttAllocator *previous;
+    UringStream *us;
+
+    assert(io != NULL);
+    assert(stream != NULL);
+    assert(stream->uring == NULL);
+
+    /* The stream is freed when the kernel is done with it, which can be
+       after the client is gone, so it belongs to the loop rather than to
+       the client */
+    previous = MqttAllocatorEnter(NULL);
+
+    us = MqttCalloc(1, sizeof(*us));
+
+    if (us && !(us->sbuf = MqttMalloc(URING_STREAM_SEND_BUFFER_SIZE)))
+    {
+        MqttFree(us);
+        us = NULL;
+    }
+
+    MqttAllocatorLeave(previous);
+
+    if (!us)
+        return -1;
+
+    us->io = io;
+    us->stream = stream;
+    us->userData = userData;
+    us->fd = stream->sock;
+    us->multishot = 1;
+    us->head = us->tail = -1;
+
+    stream->uring = us;
+
+    ++io->streams;
+
+    return 0;
+}
+
+static void UringStreamCancel(UringStream *us, int op)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(&us->io->ring);
+
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UringUserData(us, op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+void UringStreamDetach(SocketStream *stream)
+{
+    UringStream *us = stream->uring;
+
+    if (!us)
+        return;
+
+    stream->uring = NULL;
+    us->stream = NULL;
+    us->userData = NULL;
+
+    UringStreamDropReceived(us);
+
+    /* What is left to send, such as a DISCONNECT, is still sent, through a
+       duplicate of the socket since the caller closes it. The send in
+       flight (if any) already has the socket. */
+    if (us->slen > us->spos && !us->error)
+    {
+        int fd = dup(us->fd);
+
+        if (fd != -1)
+        {
+            us->fd = fd;
+            us->ownsFd = 1;
+
+            if (us->sending == 0 && UringStreamArmSend(us) == -1)
+                us->error = ENOMEM;
+        }
+    }
+
+    /* The socket is closed by the caller but stays open as long as the
+       kernel has operations on it, cancel them. The cancellations are matched
+       by user_data since the descriptor may be reused right away. */
+    if (us->recvArmed)
+        UringStreamCancel(us, UringOpRecv);
+
+    if (us->sending && !us->ownsFd)
+        UringStreamCancel(us, UringOpSend);
+
+    if (us->pollArmed)
+        UringStreamCancel(us, UringOpPoll);
+
+    /* Operations still in the submission queue refer to the socket by its
+       number, submit them while it is open */
+    if (UringSubmit(&us->io->ring, 0, 0) == -1)
+    {
+        LOG_ERROR("failed to submit the operations of a detached stream");
+    }
+
+    UringStreamRelease(us);
+}
+
+int UringStreamStart(UringStream *us)
+{
+    us->pollReady = 0;
+
+    if (us->started)
+        return 0;
+
+    us->started = 1;
+
+    return UringStreamArmRecv(us);
+}
+
+int UringStreamPollWrite(UringStream *us)
+{
+    struct io_uring_sqe *sqe;
+
+    if (us->pollArmed || us->pollReady)
+        return 0;
+
+    sqe = UringStreamSqe(us, UringOpPoll);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLOUT;
+
+    us->pollArmed = 1;
+    ++us->inflight;
+
+    return 0;
+}
+
+static size_t UringStreamSendSpace(UringStream *us)
+{
+    size_t space = URING_STREAM_SEND_BUFFER_SIZE - us->slen;
+
+    /* Unsent data can be moved to the front when no send is in flight */
+    if (us->sending == 0)
+        space += us->spos;
+
+    return space;
+}
+
+int UringStreamEvents(UringStream *us)
+{
+    int events = 0;
+
+    if (us->available > 0 || us->eof || us->error)
+        events |= EV_READ;
+
+    if (us->pollReady ||
+        (us->started && (us->error || UringStreamSendSpace(us) > 0)))
+        events |= EV_WRITE;
+
+    return events;
+}
+
+int64_t UringStreamRead(UringStream *us, void *ptr, size_t size)
+{
+    UringIo *io = us->io;
+    unsigned char *p = (unsigned char *) ptr;
+    size_t received = 0;
+
+    while (received < size && us->head != -1)
+    {
+        int bid = us->head;
+        size_t left = io->bufferLength[bid] - us->headOffset;
+        size_t count = size - received;
+
+        if (count > left)
+            count = left;
+
+        memcpy(p + received, io->buffers + (size_t) bid * URING_IO_BUFFER_SIZE
+               + us->headOffset, count);
+
+        received += count;
+        us->headOffset += count;
+        us->available -= count;
+
+        if (us->headOffset == io->bufferLength[bid])
+        {
+            us->head = io->bufferNext[bid];
+            if (us->head == -1)
+                us->tail = -1;
+            us->headOffset = 0;
+            UringIoRecycle(io, bid);
+        }
+    }
+
+    if (received > 0)
+        return (int64_t) received;
+
+    if (us->error)
+    {
+        errno = us->error;
+        return -1;
+    }
+
+    if (us->eof)
+        return 0;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int64_t UringStreamWritev(UringStream *us, const StreamIoVec *iov,
+                          int iovcnt)
+{
+    size_t written = 0;
+    int i;
+
+    if (us->error)
+    {
+        errno = us->error;
+        return -1;
+    }
+
+    if (us->sending == 0 && us->spos > 0)
+    {
+        memmove(us->sbuf, us->sbuf + us->spos, us->slen - us->spos);
+        us->slen -= us->spos;
+        us->spos = 0;
+    }
+
+    for (i = 0; i < iovcnt && us->slen < URING_STREAM_SEND_BUFFER_SIZE; ++i)
+    {
+        size_t count = URING_STREAM_SEND_BUFFER_SIZE - us->slen;
+
+        if (count > iov[i].size)
+            count = iov[i].size;
+
+        memcpy(us->sbuf + us->slen, iov[i].data, count);
+        us->slen += count;
+        written += count;
+
+        if (count < iov[i].size)
+            break;
+    }
+
+    if (us->sending == 0 && us->slen > us->spos &&
+        UringStreamArmSend(us) == -1)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (written == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return (int64_t) written;
+}
+
+size_t UringStreamAvailable(UringStream *us)
+{
+    return us->available;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef URINGSTREAM_H
+#define URINGSTREAM_H
+
+#include "config.h"
+
+#if defined(MQTT_USE_IO_URING)
+
+#include "uring.h"
+#include "socketstream.h"
+#include "queue.h"
+
+/* Number and size of the buffers the kernel receives into. The buffers are
+   shared by all the streams of a UringIo. */
+#if !defined(URING_IO_BUFFER_COUNT)
+#define URING_IO_BUFFER_COUNT 512
+#endif
+
+#if !defined(URING_IO_BUFFER_SIZE)
+#define URING_IO_BUFFER_SIZE (8*1024)
+#endif
+
+/* Size of the per-stream buffer that outgoing data is staged in while the
+   kernel sends it. */
+#if !defined(URING_STREAM_SEND_BUFFER_SIZE)
+#define URING_STREAM_SEND_BUFFER_SIZE (64*1024)
+#endif
+
+typedef struct UringIo UringIo;
+typedef struct UringStream UringStream;
+
+/*
+    An io_uring instance with a registered ring of provided receive buffers.
+    SocketStreams attached to it do their I/O through the ring instead of
+    recv() and send().
+*/
+struct UringIo
+{
+    Uring ring;
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    unsigned char *buffers;
+    /* bytes received into each buffer */
+    uint32_t *bufferLength;
+    /* next buffer in the receive list of the stream owning the buffer */
+    int *bufferNext;
+    /* buffers currently owned by the kernel */
+    unsigned freeBuffers;
+    uint16_t bufferTail;
+    /* streams whose receive stopped because the kernel ran out of buffers */
+    TAILQ_HEAD(, UringStream) starved;
+    /* streams not yet freed (detached ones wait for their operations) */
+    int streams;
+};
+
+struct UringStream
+{
+    UringIo *io;
+    /* NULL once detached, the state lives until the kernel is done with it */
+    SocketStream *stream;
+    void *userData;
+    int fd;
+    /* 1 if fd is a duplicate the stream closes itself, see
+       UringStreamDetach */
+    int ownsFd;
+    /* operations owned by the kernel */
+    int inflight;
+    int started;
+    int recvArmed;
+    int multishot;
+    int isStarved;
+    int pollArmed;
+    int pollReady;
+    int eof;
+    int error;
+    /* received buffers, the first one consumed up to headOffset */
+    int head;
+    int tail;
+    size_t headOffset;
+    size_t available;
+    /* unsent data is sbuf[spos..slen), the first sending bytes of which are
+       owned by an in-flight send */
+    unsigned char *sbuf;
+    size_t spos;
+    size_t slen;
+    size_t sending;
+    TAILQ_ENTRY(UringStream) starvedQueue;
+};
+
+/* Returns -1 if io_uring or provided buffer rings are not available. */
+int UringIoInit(UringIo *io);
+
+/* Waits for the operations of detached streams to finish and frees io. */
+void UringIoFree(UringIo *io);
+
+/*
+    Takes the completion cqe. Returns the stream it has news for, or NULL if
+    there is none (e.g. the stream has been detached).
+*/
+UringStream *UringIoComplete(UringIo *io, struct io_uring_cqe *cqe);
+
+/* Restarts receiving on starved streams if buffers have been returned. */
+void UringIoRearm(UringIo *io);
+
+/* Routes the I/O of stream through io. userData is kept for the caller. */
+int UringStreamAttach(UringIo *io, SocketStream *stream, void *userData);
+
+/*
+    Cancels the receive of the stream and detaches it. Called before the
+    socket is closed. Data that hasn't been sent yet is still sent through
+    a duplicate of the socket.
+*/
+void UringStreamDetach(SocketStream *stream);
+
+/* Starts receiving once the socket has connected. */
+int UringStreamStart(UringStream *us);
+
+/* Waits for the socket to become writable, i.e. connect to finish. */
+int UringStreamPollWrite(UringStream *us);
+
+/* Returns the EV_READ and EV_WRITE events that would not block. */
+int UringStreamEvents(UringStream *us);
+
+int64_t UringStreamRead(UringStream *us, void *ptr, size_t size);
+
+int64_t UringStreamWritev(UringStream *us, const StreamIoVec *iov,
+                          int iovcnt);
+
+size_t UringStreamAvailable(UringStream *us);
+
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+/* Counts the allocations and the bytes in use, keeping the size of each
+   allocation in front of it */
+typedef struct Accounting
+{
+    long allocations;
+    long bytes;
+} Accounting;
+
+typedef union Header
+{
+    size_t size;
+    /* keep the user memory aligned */
+    long double align;
+} Header;
+
+static void *accountingAlloc(void *userData, size_t size)
+{
+    Accounting *accounting = userData;
+    Header *header = malloc(sizeof(*header) + size);
+    if (!header)
+        return NULL;
+    header->size = size;
+    accounting->allocations++;
+    accounting->bytes += size;
+    return header + 1;
+}
+
+static void accountingFree(void *userData, void *ptr)
+{
+    Accounting *accounting = userData;
+    Header *header = (Header *) ptr - 1;
+    accounting->bytes -= header->size;
+    free(header);
+}
+
+static void *accountingRealloc(void *userData, void *ptr, size_t size)
+{
+    void *copy;
+
+    if (!ptr)
+        return accountingAlloc(userData, size);
+
+    if (!(copy = accountingAlloc(userData, size)))
+        return NULL;
+
+    memcpy(copy, ptr, size < ((Header *) ptr - 1)->size ?
+           size : ((Header *) ptr - 1)->size);
+    accountingFree(userData, ptr);
+
+    return copy;
+}
+
+static int subscribed;
+static int received;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) data;
+    (void) size;
+    (void) qos;
+    (void) retain;
+    ++received;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+TEST allocator_test()
+{
+    Accounting global = { 0, 0 };
+    Accounting own = { 0, 0 };
+    MqttAllocator globalAllocator =
+        { accountingAlloc, accountingRealloc, accountingFree, &global };
+    MqttAllocator ownAllocator =
+        { accountingAlloc, accountingRealloc, accountingFree, &own };
+    MqttClient *client;
+    int64_t start;
+    int qos;
+
+    MqttSetAllocator(&globalAllocator);
+
+    client = MqttClientNewWithAllocator("clienta", &ownAllocator);
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    MqttClientSetWill(client, topics[1], "will", 4, 0, 0);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        int i;
+        for (i = 0; i < 10; ++i)
+        {
+            ASSERT(MqttClientPublishCString(client, qos, 0, topics[0],
+                                            "message") != -1);
+        }
+    }
+
+    start = MqttGetCurrentTime();
+
+    while (received < 30 && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(30, received);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    MqttSetAllocator(NULL);
+
+    /* Everything of the client came from its own allocator and went back */
+    ASSERT(own.allocations > 0);
+    ASSERT_EQ(0, own.bytes);
+    ASSERT_EQ(0, global.allocations);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(allocator_test);
+    GREATEST_MAIN_END();
+}
@@ -0,0 +1,171 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+static int subscribed;
+static int received;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) data;
+    (void) size;
+    (void) qos;
+    (void) retain;
+    ++received;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 1);
+}
+
+static MqttClient *connectClient()
+{
+    MqttClient *client = MqttClientNew("clienta");
+    int64_t start;
+
+    if (!client)
+        return NULL;
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+
+    if (MqttClientConnect(client, "localhost", 1883, 60, 1) == -1)
+        return client;
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        if (MqttClientRunOnce(client, 100) == -1)
+            break;
+    }
+
+    return client;
+}
+
+/* Runs the client for ms milliseconds or until count messages arrive. */
+static int runUntil(MqttClient *client, int count, int ms)
+{
+    int64_t start = MqttGetCurrentTime();
+
+    while (received < count && MqttGetCurrentTime() - start < ms)
+    {
+        if (MqttClientRunOnce(client, 10) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+TEST coalesce_delay_test()
+{
+    MqttClient *client;
+    MqttClientStats stats;
+    int i;
+
+    received = 0;
+    subscribed = 0;
+
+    client = connectClient();
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    MqttClientSetCoalescing(client, 300000, 0);
+
+    for (i = 0; i < 5; ++i)
+    {
+        ASSERT(MqttClientPublishCString(client, i % 2, 0, topics[0],
+                                        "held") != -1);
+        ASSERT_EQ(0, runUntil(client, 1, 20));
+    }
+
+    /* Nothing has been sent before the delay is over */
+    ASSERT_EQ(0, received);
+
+    ASSERT_EQ(0, runUntil(client, 5, 2000));
+    ASSERT_EQ(5, received);
+
+    MqttClientGetStats(client, &stats);
+    ASSERT(stats.coalesceFlushes >= 1);
+    ASSERT(stats.coalesceDelayMaxUs >= 300000);
+    ASSERT(stats.coalesceDelayTotalUs >= stats.coalesceDelayMaxUs);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+TEST coalesce_bytes_test()
+{
+    MqttClient *client;
+    MqttClientStats stats;
+    char payload[64];
+
+    received = 0;
+    subscribed = 0;
+
+    client = connectClient();
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    MqttClientSetCoalescing(client, 10000000, 100);
+
+    memset(payload, 'x', sizeof(payload));
+
+    ASSERT(MqttClientPublish(client, 0, 0, topics[0], payload,
+                             sizeof(payload)) != -1);
+    ASSERT_EQ(0, runUntil(client, 1, 200));
+    ASSERT_EQ(0, received);
+
+    /* The second one goes over maxBytes, both are sent right away */
+    ASSERT(MqttClientPublish(client, 0, 0, topics[0], payload,
+                             sizeof(payload)) != -1);
+    ASSERT_EQ(0, runUntil(client, 2, 2000));
+    ASSERT_EQ(2, received);
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(1, stats.coalesceFlushes);
+    ASSERT(stats.coalesceDelayMaxUs >= 200000);
+    ASSERT(stats.coalesceDelayMaxUs < 10000000);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(coalesce_delay_test);
+    RUN_TEST(coalesce_bytes_test);
+    GREATEST_MAIN_END();
+}
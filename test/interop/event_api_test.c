@@ -0,0 +1,122 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+#include "misc.h"
+
+#include <poll.h>
+
+/* Drives the client with poll() through the event loop integration API. */
+static int PollOnce(MqttClient *client, int timeout)
+{
+    struct pollfd pfd;
+    int events = MqttClientWantedEvents(client);
+    int clientTimeout = MqttClientNextTimeoutMs(client);
+    int ready = 0;
+    int rv;
+
+    if (events == 0)
+        return -1;
+
+    if (clientTimeout >= 0 && clientTimeout < timeout)
+        timeout = clientTimeout;
+
+    pfd.fd = MqttClientGetFd(client);
+    pfd.events = 0;
+    pfd.revents = 0;
+
+    if (events & MqttEventRead)
+        pfd.events |= POLLIN;
+
+    if (events & MqttEventWrite)
+        pfd.events |= POLLOUT;
+
+    rv = poll(&pfd, 1, timeout);
+
+    if (rv == -1)
+        return -1;
+
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+        ready |= MqttEventRead;
+
+    if (pfd.revents & POLLOUT)
+        ready |= MqttEventWrite;
+
+    return MqttClientHandleEvents(client, ready & events);
+}
+
+TEST event_api_test()
+{
+    TestClient *client;
+    int64_t start;
+    int id;
+
+    client = TestClientNew("clienta");
+
+    ASSERT_EQ(-1, MqttClientGetFd(client->client));
+    ASSERT_EQ(0, MqttClientWantedEvents(client->client));
+    ASSERT_EQ(-1, MqttClientNextTimeoutMs(client->client));
+
+    ASSERT_EQ(0, MqttClientConnect(client->client, "localhost", 1883, 60, 1));
+    ASSERT(MqttClientGetFd(client->client) != -1);
+    ASSERT_EQ(MqttEventWrite, MqttClientWantedEvents(client->client));
+
+    start = MqttGetCurrentTime();
+    while (client->connectionStatus == (MqttConnectionStatus) -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT_EQ(0, PollOnce(client->client, 100));
+    }
+
+    ASSERT_EQ(MqttConnectionAccepted, client->connectionStatus);
+
+    /* Connected and idle: wait for input until the keepalive is due */
+    ASSERT_EQ(MqttEventRead, MqttClientWantedEvents(client->client));
+    ASSERT(MqttClientNextTimeoutMs(client->client) > 50000);
+
+    client->subId = -1;
+    ASSERT(MqttClientSubscribe(client->client, topics[0], 1) > 0);
+    ASSERT_EQ(MqttEventRead | MqttEventWrite,
+              MqttClientWantedEvents(client->client));
+
+    start = MqttGetCurrentTime();
+    while (client->subId == -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT_EQ(0, PollOnce(client->client, 100));
+    }
+
+    client->pubId = -1;
+    id = MqttClientPublishCString(client->client, 1, 0, topics[0], "msg");
+    ASSERT(id > 0);
+
+    start = MqttGetCurrentTime();
+    while (client->pubId != id || TestClientMessageCount(client) != 1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT_EQ(0, PollOnce(client->client, 100));
+    }
+
+    MqttClientDisconnect(client->client);
+
+    start = MqttGetCurrentTime();
+    while (MqttClientGetFd(client->client) != -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT_EQ(0, PollOnce(client->client, 100));
+    }
+
+    TestClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(event_api_test);
+    GREATEST_MAIN_END();
+}
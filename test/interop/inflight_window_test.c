@@ -0,0 +1,78 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#define MESSAGE_COUNT 1000
+
+static int published;
+
+static void onPublish(MqttClient *client, int id)
+{
+    (void) client;
+    (void) id;
+    ++published;
+}
+
+/*
+    Keeps a thousand messages of each QoS in flight at once so that the
+    acknowledgements are matched against a large window.
+*/
+TEST inflight_window_test()
+{
+    TestClient *client;
+    int64_t start;
+    int qos, i;
+
+    client = TestClientNew("clienta");
+    ASSERT(TestClientConnect(client, "localhost", 1883, 60, 1));
+    ASSERT(TestClientSubscribe(client, topics[0], 2));
+
+    MqttClientSetOnPublish(client->client, onPublish);
+    MqttClientSetMaxMessagesInflight(client->client, MESSAGE_COUNT);
+    MqttClientSetMaxQueuedMessages(client->client, MESSAGE_COUNT);
+
+    for (qos = 1; qos <= 2; ++qos)
+    {
+        published = 0;
+
+        for (i = 0; i < MESSAGE_COUNT; ++i)
+        {
+            ASSERT(MqttClientPublishCString(client->client, qos, 0, topics[0],
+                                            "msg") > 0);
+        }
+
+        /* The queue is full */
+        ASSERT_EQ(-1, MqttClientPublishCString(client->client, qos, 0,
+                                               topics[0], "msg"));
+
+        start = MqttGetCurrentTime();
+
+        while ((published < MESSAGE_COUNT ||
+                TestClientMessageCount(client) < qos * MESSAGE_COUNT) &&
+               MqttGetCurrentTime() - start < 10000)
+        {
+            ASSERT(MqttClientRunOnce(client->client, 100) != -1);
+        }
+
+        ASSERT_EQ(MESSAGE_COUNT, published);
+        ASSERT_EQ(qos * MESSAGE_COUNT, TestClientMessageCount(client));
+    }
+
+    TestClientDisconnect(client);
+    TestClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(inflight_window_test);
+    GREATEST_MAIN_END();
+}
@@ -0,0 +1,205 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+#include "misc.h"
+
+static int LoopRunFor(MqttLoop *loop, int timeout)
+{
+    int64_t start = MqttGetCurrentTime();
+
+    while (MqttGetCurrentTime() - start < timeout)
+    {
+        if (MqttLoopRun(loop, 100) == -1)
+            return 0;
+    }
+
+    return 1;
+}
+
+TEST loop_test()
+{
+    MqttLoop *loop;
+    TestClient *clienta, *clientb;
+    int64_t start;
+
+    loop = MqttLoopNew();
+    ASSERT(loop != NULL);
+
+    clienta = TestClientNew("clienta");
+    clientb = TestClientNew("clientb");
+
+    ASSERT_EQ(0, MqttLoopAdd(loop, clienta->client));
+    ASSERT_EQ(0, MqttLoopAdd(loop, clientb->client));
+    ASSERT_EQ(-1, MqttLoopAdd(loop, clientb->client));
+
+    ASSERT_EQ(0, MqttClientConnect(clienta->client, "localhost", 1883, 60, 1));
+    ASSERT_EQ(0, MqttClientConnect(clientb->client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+    while (clienta->connectionStatus == (MqttConnectionStatus) -1 ||
+           clientb->connectionStatus == (MqttConnectionStatus) -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttLoopRun(loop, 100) != -1);
+    }
+
+    ASSERT_EQ(MqttConnectionAccepted, clienta->connectionStatus);
+    ASSERT_EQ(MqttConnectionAccepted, clientb->connectionStatus);
+
+    clientb->subId = -1;
+    ASSERT(MqttClientSubscribe(clientb->client, topics[0], 2) > 0);
+
+    start = MqttGetCurrentTime();
+    while (clientb->subId == -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttLoopRun(loop, 100) != -1);
+    }
+
+    ASSERT_EQ(0, MqttClientPublishCString(clienta->client, 0, 0, topics[0],
+                                          "msg0"));
+    ASSERT(MqttClientPublishCString(clienta->client, 1, 0, topics[0],
+                                    "msg1") > 0);
+    ASSERT(MqttClientPublishCString(clienta->client, 2, 0, topics[0],
+                                    "msg2") > 0);
+
+    ASSERT(LoopRunFor(loop, 2000));
+    ASSERT_EQ(3, TestClientMessageCount(clientb));
+
+    MqttClientDisconnect(clienta->client);
+    MqttClientDisconnect(clientb->client);
+
+    start = MqttGetCurrentTime();
+    while (MqttClientIsConnected(clienta->client) ||
+           MqttClientIsConnected(clientb->client))
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttLoopRun(loop, 100) != -1);
+    }
+
+    ASSERT_EQ(0, MqttLoopRemove(loop, clienta->client));
+    TestClientFree(clienta);
+    /* clientb is removed from the loop when freed */
+    TestClientFree(clientb);
+    MqttLoopFree(loop);
+
+    PASS();
+}
+
+/* A client driven by the loop sends what it queued before DISCONNECT and
+   the DISCONNECT itself, so that the broker doesn't publish its will. With
+   MQTT_IO_URING this goes through io_uring. */
+TEST loop_disconnect_test()
+{
+    MqttLoop *loop;
+    TestClient *clienta, *clientb;
+    Message *msg;
+    int64_t start;
+
+    loop = MqttLoopNew();
+    ASSERT(loop != NULL);
+
+    clienta = TestClientNew("clienta");
+    clientb = TestClientNew("clientb");
+
+    ASSERT(TestClientConnect(clientb, "localhost", 1883, 60, 1));
+    ASSERT(TestClientSubscribe(clientb, topics[1], 0));
+
+    ASSERT_EQ(0, MqttClientSetWill(clienta->client, topics[1], "will", 4, 0,
+                                   0));
+    ASSERT_EQ(0, MqttLoopAdd(loop, clienta->client));
+    ASSERT_EQ(0, MqttClientConnect(clienta->client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+    while (clienta->connectionStatus == (MqttConnectionStatus) -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttLoopRun(loop, 100) != -1);
+    }
+
+    ASSERT_EQ(MqttConnectionAccepted, clienta->connectionStatus);
+
+    ASSERT_EQ(0, MqttClientPublishCString(clienta->client, 0, 0, topics[1],
+                                          "last"));
+    MqttClientDisconnect(clienta->client);
+
+    start = MqttGetCurrentTime();
+    while (MqttClientGetFd(clienta->client) != -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttLoopRun(loop, 100) != -1);
+    }
+
+    TestClientWait(clientb, 1000);
+
+    ASSERT_EQ(1, TestClientMessageCount(clientb));
+    msg = SIMPLEQ_FIRST(&clientb->messages);
+    ASSERT_EQ(4, msg->size);
+    ASSERT_MEM_EQ("last", msg->data, 4);
+
+    TestClientDisconnect(clientb);
+    TestClientFree(clienta);
+    TestClientFree(clientb);
+    MqttLoopFree(loop);
+
+    PASS();
+}
+
+/* A client reconnecting in the loop usually gets a socket with the number of
+   the one it closed, which must be registered again. */
+TEST loop_reconnect_test()
+{
+    MqttLoop *loop;
+    TestClient *clienta;
+    int64_t start;
+    int round;
+
+    loop = MqttLoopNew();
+    ASSERT(loop != NULL);
+
+    clienta = TestClientNew("clienta");
+    ASSERT_EQ(0, MqttLoopAdd(loop, clienta->client));
+
+    for (round = 0; round < 2; ++round)
+    {
+        clienta->connectionStatus = (MqttConnectionStatus) -1;
+        ASSERT_EQ(0, MqttClientConnect(clienta->client, "localhost", 1883, 60,
+                                       1));
+
+        start = MqttGetCurrentTime();
+        while (clienta->connectionStatus == (MqttConnectionStatus) -1)
+        {
+            ASSERT(MqttGetCurrentTime() - start < 5000);
+            ASSERT(MqttLoopRun(loop, 100) != -1);
+        }
+
+        ASSERT_EQ(MqttConnectionAccepted, clienta->connectionStatus);
+
+        MqttClientDisconnect(clienta->client);
+
+        start = MqttGetCurrentTime();
+        while (MqttClientGetFd(clienta->client) != -1)
+        {
+            ASSERT(MqttGetCurrentTime() - start < 5000);
+            ASSERT(MqttLoopRun(loop, 100) != -1);
+        }
+    }
+
+    TestClientFree(clienta);
+    MqttLoopFree(loop);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(loop_test);
+    RUN_TEST(loop_disconnect_test);
+    RUN_TEST(loop_reconnect_test);
+    GREATEST_MAIN_END();
+}
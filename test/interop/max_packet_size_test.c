@@ -0,0 +1,166 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+#define MAX_SIZE 1024
+#define BIG_SIZE (10*1024)
+
+static unsigned char big[BIG_SIZE];
+static int subscribed;
+static int small;
+static int large;
+static int errors;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) data;
+    (void) qos;
+    (void) retain;
+    if (size == 5)
+        ++small;
+    else
+        ++large;
+}
+
+static void onError(MqttClient *client, MqttError error)
+{
+    (void) client;
+    if (error == MqttErrorPacketTooLarge)
+        ++errors;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 1);
+}
+
+static MqttClient *connectClient(int discard)
+{
+    MqttClient *client = MqttClientNew("clienta");
+    int64_t start;
+
+    if (!client)
+        return NULL;
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    MqttClientSetOnError(client, onError);
+    MqttClientSetMaxPacketSize(client, MAX_SIZE, discard);
+
+    subscribed = 0;
+
+    if (MqttClientConnect(client, "localhost", 1883, 60, 1) == -1)
+        return client;
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        if (MqttClientRunOnce(client, 100) == -1)
+            break;
+    }
+
+    return client;
+}
+
+TEST max_packet_size_discard_test()
+{
+    MqttClient *client;
+    MqttClientStats stats;
+    int64_t start;
+
+    small = large = errors = 0;
+
+    client = connectClient(1);
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    /* The large message is skipped and the connection stays up */
+    ASSERT(MqttClientPublish(client, 1, 0, topics[0], big, BIG_SIZE) != -1);
+    ASSERT(MqttClientPublish(client, 1, 0, topics[0], "small", 5) != -1);
+
+    start = MqttGetCurrentTime();
+
+    while (small < 1 && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(1, small);
+    ASSERT_EQ(0, large);
+    ASSERT_EQ(1, errors);
+    ASSERT(MqttClientIsConnected(client));
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(1, stats.packetsTooLarge);
+    ASSERT(stats.recvBufferPeak < BIG_SIZE);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+TEST max_packet_size_close_test()
+{
+    MqttClient *client;
+    int64_t start;
+
+    small = large = errors = 0;
+
+    client = connectClient(0);
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    ASSERT(MqttClientPublish(client, 0, 0, topics[0], big, BIG_SIZE) != -1);
+
+    start = MqttGetCurrentTime();
+
+    while (errors == 0 && MqttGetCurrentTime() - start < 5000)
+    {
+        if (MqttClientRunOnce(client, 100) == -1)
+            break;
+    }
+
+    ASSERT_EQ(1, errors);
+    ASSERT_EQ(0, large);
+    ASSERT(!MqttClientIsConnected(client));
+
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(max_packet_size_discard_test);
+    cleanup();
+    RUN_TEST(max_packet_size_close_test);
+    GREATEST_MAIN_END();
+}
@@ -0,0 +1,151 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+#define BIG_SIZE (1024*1024 + 123)
+
+static unsigned char big[BIG_SIZE];
+static int subscribed;
+static int messages;
+static int begun;
+static int ended;
+static int complete;
+static size_t announced;
+static size_t streamed;
+static size_t largestPiece;
+static int intact = 1;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic,
+                      size_t topicLength, const void *data, size_t size,
+                      int qos, int retain)
+{
+    (void) client;
+    (void) qos;
+    (void) retain;
+    if (topicLength == strlen(topics[0]) &&
+        strcmp(topic, topics[0]) == 0 &&
+        size == 5 && memcmp(data, "small", 5) == 0)
+    {
+        ++messages;
+    }
+}
+
+static void onMessageBegin(MqttClient *client, const char *topic,
+                           size_t topicLength, size_t size, int qos,
+                           int retain)
+{
+    (void) client;
+    (void) retain;
+    if (topicLength == strlen(topics[0]) &&
+        strcmp(topic, topics[0]) == 0 && qos == 1)
+        ++begun;
+    announced = size;
+    streamed = 0;
+}
+
+static void onMessageData(MqttClient *client, const void *data, size_t size)
+{
+    (void) client;
+    if (streamed + size > BIG_SIZE ||
+        memcmp(data, big + streamed, size) != 0)
+    {
+        intact = 0;
+    }
+    if (size > largestPiece)
+        largestPiece = size;
+    streamed += size;
+}
+
+static void onMessageEnd(MqttClient *client, int done)
+{
+    (void) client;
+    ++ended;
+    complete = done;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+TEST message_stream_test()
+{
+    MqttClient *client;
+    int64_t start;
+    size_t i;
+
+    for (i = 0; i < BIG_SIZE; ++i)
+        big[i] = (unsigned char) (i * 13 + i / 509);
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessageWithTopicLength(client, onMessage);
+    MqttClientSetOnMessageStream(client, 1024, onMessageBegin, onMessageData,
+                                 onMessageEnd);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    /* Below the threshold the message goes to onMessage */
+    ASSERT(MqttClientPublish(client, 1, 0, topics[0], "small", 5) != -1);
+    ASSERT(MqttClientPublish(client, 1, 0, topics[0], big, BIG_SIZE) != -1);
+
+    start = MqttGetCurrentTime();
+
+    while ((messages < 1 || ended < 1) && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(1, messages);
+    ASSERT_EQ(1, begun);
+    ASSERT_EQ(1, ended);
+    ASSERT_EQ(1, complete);
+    ASSERT_EQ(BIG_SIZE, announced);
+    ASSERT_EQ(BIG_SIZE, streamed);
+    ASSERT(intact);
+    ASSERT(largestPiece <= 16*1024);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(message_stream_test);
+    GREATEST_MAIN_END();
+}
@@ -0,0 +1,234 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+#include <poll.h>
+
+#define COUNT 5
+
+static int subscribed;
+static int received;
+static char order[COUNT][16];
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) qos;
+    (void) retain;
+
+    if (received < COUNT && size < sizeof(order[0]))
+        memcpy(order[received], data, size);
+
+    ++received;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+static int publish(MqttClient *client, int qos, const char *msg,
+                   int priority)
+{
+    return MqttClientPublishWithPriority(client, qos, 0, topics[0], msg,
+                                         strlen(msg), priority);
+}
+
+TEST priority_test()
+{
+    MqttClient *client;
+    int64_t start;
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    /* Queued in the reverse order of how they are sent */
+    ASSERT(publish(client, 0, "low", MqttPriorityLow) != -1);
+    ASSERT(publish(client, 0, "qos0", MqttPriorityNormal) != -1);
+    ASSERT(publish(client, 1, "qos1", MqttPriorityNormal) != -1);
+    ASSERT(publish(client, 2, "qos2", MqttPriorityNormal) != -1);
+    ASSERT(publish(client, 0, "high", MqttPriorityHigh) != -1);
+
+    start = MqttGetCurrentTime();
+
+    while (received < COUNT && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(COUNT, received);
+    ASSERT_STR_EQ("high", order[0]);
+    ASSERT_STR_EQ("qos2", order[1]);
+    ASSERT_STR_EQ("qos1", order[2]);
+    ASSERT_STR_EQ("qos0", order[3]);
+    ASSERT_STR_EQ("low", order[4]);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+/* Messages queued before DISCONNECT are sent before it, whatever their
+   lane, like tools/pub.c expects */
+TEST disconnect_after_publish_test()
+{
+    MqttClient *subscriber;
+    MqttClient *publisher;
+    int64_t start;
+
+    received = 0;
+    subscribed = 0;
+    memset(order, 0, sizeof(order));
+
+    subscriber = MqttClientNew("clientb");
+    ASSERT(subscriber != NULL);
+
+    MqttClientSetOnConnect(subscriber, onConnect);
+    MqttClientSetOnSubscribe(subscriber, onSubscribe);
+    MqttClientSetOnMessage(subscriber, onMessage);
+    ASSERT_EQ(0, MqttClientConnect(subscriber, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(subscriber, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    publisher = MqttClientNew("clienta");
+    ASSERT(publisher != NULL);
+    ASSERT_EQ(0, MqttClientConnect(publisher, "localhost", 1883, 60, 1));
+
+    ASSERT(publish(publisher, 0, "qos0", MqttPriorityNormal) != -1);
+    ASSERT(publish(publisher, 0, "low", MqttPriorityLow) != -1);
+    ASSERT_EQ(0, MqttClientDisconnect(publisher));
+
+    start = MqttGetCurrentTime();
+
+    while (MqttClientGetFd(publisher) != -1 &&
+           MqttGetCurrentTime() - start < 5000)
+    {
+        if (MqttClientRunOnce(publisher, 100) == -1)
+            break;
+    }
+
+    start = MqttGetCurrentTime();
+
+    while (received < 2 && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(subscriber, 100) != -1);
+    }
+
+    ASSERT_EQ(2, received);
+    ASSERT_STR_EQ("qos0", order[0]);
+    ASSERT_STR_EQ("low", order[1]);
+
+    MqttClientFree(publisher);
+
+    MqttClientDisconnect(subscriber);
+    MqttClientRunOnce(subscriber, 100);
+    MqttClientFree(subscriber);
+
+    PASS();
+}
+
+/* A QoS 2 resend queued when the PUBREC arrives is not sent after the
+   PUBREL, which the broker would take for a new message */
+TEST pubrec_before_resend_test()
+{
+    TestClient *clienta, *clientb;
+    struct pollfd pfd;
+    int64_t start;
+
+    clienta = TestClientNew("clienta");
+    clientb = TestClientNew("clientb");
+
+    ASSERT(TestClientConnect(clientb, "localhost", 1883, 60, 1));
+    ASSERT(TestClientSubscribe(clientb, topics[0], 2));
+    ASSERT(TestClientConnect(clienta, "localhost", 1883, 60, 1));
+
+    ASSERT(MqttClientPublishCString(clienta->client, 2, 0, topics[0],
+                                    "once") > 0);
+
+    /* Send the PUBLISH and wait for the PUBREC without reading it */
+    ASSERT(MqttClientWantedEvents(clienta->client) & MqttEventWrite);
+    ASSERT_EQ(0, MqttClientHandleEvents(clienta->client, MqttEventWrite));
+
+    pfd.fd = MqttClientGetFd(clienta->client);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ASSERT_EQ(1, poll(&pfd, 1, 5000));
+
+    /* Queue the resend, then handle the PUBREC */
+    MqttClientSetPublishRetryTimeout(clienta->client, 0);
+    ASSERT(MqttClientWantedEvents(clienta->client) & MqttEventWrite);
+    MqttClientSetPublishRetryTimeout(clienta->client, 20);
+    ASSERT_EQ(0, MqttClientHandleEvents(clienta->client, MqttEventRead));
+
+    clienta->pubId = -1;
+    start = MqttGetCurrentTime();
+
+    while (clienta->pubId == -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttClientRunOnce(clienta->client, 100) != -1);
+    }
+
+    TestClientWait(clientb, 1000);
+    ASSERT_EQ(1, TestClientMessageCount(clientb));
+
+    TestClientDisconnect(clienta);
+    TestClientDisconnect(clientb);
+    TestClientFree(clienta);
+    TestClientFree(clientb);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(priority_test);
+    RUN_TEST(disconnect_after_publish_test);
+    RUN_TEST(pubrec_before_resend_test);
+    GREATEST_MAIN_END();
+}
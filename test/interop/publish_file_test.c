@@ -0,0 +1,164 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+#include "packet.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_SIZE (512*1024)
+#define PAYLOAD_OFFSET 1000
+#define PAYLOAD_SIZE (300*1024)
+
+static unsigned char contents[FILE_SIZE];
+static int subscribed;
+static int received;
+static int intact;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) qos;
+    (void) retain;
+    ++received;
+    if (size == PAYLOAD_SIZE &&
+        memcmp(data, contents + PAYLOAD_OFFSET, size) == 0)
+    {
+        ++intact;
+    }
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+TEST publish_file_test()
+{
+    MqttClient *client;
+    FILE *file;
+    int64_t start;
+    int qos;
+    size_t i;
+
+    for (i = 0; i < FILE_SIZE; ++i)
+        contents[i] = (unsigned char) (i * 7 + i / 251);
+
+    file = tmpfile();
+    ASSERT(file != NULL);
+    ASSERT_EQ(FILE_SIZE, fwrite(contents, 1, FILE_SIZE, file));
+    ASSERT_EQ(0, fflush(file));
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        ASSERT(MqttClientPublishFile(client, qos, 0, topics[0],
+                                     fileno(file), PAYLOAD_OFFSET,
+                                     PAYLOAD_SIZE) != -1);
+    }
+
+    /* The client has descriptors of its own */
+    fclose(file);
+
+    start = MqttGetCurrentTime();
+
+    while (received < 3 && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(3, received);
+    ASSERT_EQ(3, intact);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+TEST copy_file_while_writing_test()
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    MqttPacket *packet;
+    FILE *file;
+    unsigned char *p;
+    StreamIoVec iov[2];
+
+    file = tmpfile();
+    ASSERT(file != NULL);
+    ASSERT_EQ(26, fwrite(alphabet, 1, 26, file));
+    ASSERT_EQ(0, fflush(file));
+
+    packet = MqttPacketNew(MqttPacketTypePublish);
+    ASSERT(packet != NULL);
+
+    p = MqttPacketAllocateFile(packet, MqttStringSize(6) + 26, fileno(file),
+                               0, 26);
+    ASSERT(p != NULL);
+    MqttEncodeString(p, topics[0], 6);
+
+    /* Write everything before the file and 10 bytes of the file */
+    MqttPacketPrepareWrite(packet);
+    ASSERT_EQ(packet->size, MqttPacketWriteAdvance(packet, packet->size));
+    ASSERT_EQ(MqttPacketStateWritePayload, packet->state);
+    ASSERT_EQ(10, MqttPacketWriteAdvance(packet, 10));
+
+    ASSERT_EQ(0, MqttPacketCopyExternal(packet));
+    fclose(file);
+
+    /* Only the rest of the file is left */
+    ASSERT_EQ(1, MqttPacketWriteIov(packet, iov, 2));
+    ASSERT_EQ(16, iov[0].size);
+    ASSERT_MEM_EQ("KLMNOPQRSTUVWXYZ", iov[0].data, 16);
+    ASSERT_EQ(16, MqttPacketWriteAdvance(packet, 16));
+    ASSERT_EQ(MqttPacketStateWriteComplete, packet->state);
+
+    MqttPacketFree(packet);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(publish_file_test);
+    RUN_TEST(copy_file_while_writing_test);
+    GREATEST_MAIN_END();
+}
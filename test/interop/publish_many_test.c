@@ -0,0 +1,170 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#define COUNT 6
+
+static int subscribed;
+static int received[COUNT];
+static int published[COUNT];
+static int ids[COUNT];
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onPublish(MqttClient *client, int id)
+{
+    int i;
+
+    (void) client;
+
+    for (i = 0; i < COUNT; ++i)
+    {
+        if (ids[i] == id)
+            ++published[i];
+    }
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    char expected[32];
+    int i;
+
+    (void) client;
+    (void) topic;
+    (void) retain;
+
+    for (i = 0; i < COUNT; ++i)
+    {
+        sprintf(expected, "message %d", i);
+
+        if (size == strlen(expected) && memcmp(data, expected, size) == 0 &&
+            qos == i % 3)
+        {
+            ++received[i];
+        }
+    }
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+TEST publish_many_test()
+{
+    MqttClient *client;
+    MqttPublishSpec specs[COUNT];
+    MqttClientStats stats;
+    char payloads[COUNT][32];
+    int64_t start;
+    int done;
+    int i;
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnPublish(client, onPublish);
+    MqttClientSetOnMessage(client, onMessage);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    for (i = 0; i < COUNT; ++i)
+    {
+        sprintf(payloads[i], "message %d", i);
+        specs[i].topic = topics[0];
+        specs[i].data = payloads[i];
+        specs[i].size = strlen(payloads[i]);
+        specs[i].qos = i % 3;
+        specs[i].retain = 0;
+        specs[i].priority = MqttPriorityNormal;
+    }
+
+    /* Four QoS 1 and 2 messages don't fit, none is published */
+    MqttClientSetMaxQueuedMessages(client, 3);
+    ASSERT_EQ(-1, MqttClientPublishMany(client, specs, COUNT, ids));
+
+    MqttClientSetMaxQueuedMessages(client, 4);
+
+    /* Neither are the others if the two QoS 0 messages would block */
+    MqttClientSetQos0Limit(client, 1, 0, MqttQueuePolicyBlock);
+    ASSERT_EQ(-1, MqttClientPublishMany(client, specs, COUNT, ids));
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(0, stats.qos0Queued);
+
+    MqttClientSetQos0Limit(client, 2, 0, MqttQueuePolicyBlock);
+    ASSERT_EQ(COUNT, MqttClientPublishMany(client, specs, COUNT, ids));
+
+    /* The user buffers aren't needed after the call */
+    memset(payloads, 0, sizeof(payloads));
+
+    for (i = 0; i < COUNT; ++i)
+    {
+        if (specs[i].qos == 0)
+            ASSERT_EQ(0, ids[i]);
+        else
+            ASSERT(ids[i] > 0);
+    }
+
+    start = MqttGetCurrentTime();
+
+    do
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+
+        for (i = 0, done = 1; i < COUNT; ++i)
+        {
+            if (!received[i] || (ids[i] > 0 && !published[i]))
+                done = 0;
+        }
+    }
+    while (!done && MqttGetCurrentTime() - start < 5000);
+
+    for (i = 0; i < COUNT; ++i)
+    {
+        ASSERT_EQ(1, received[i]);
+        ASSERT_EQ(ids[i] > 0 ? 1 : 0, published[i]);
+    }
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(publish_many_test);
+    GREATEST_MAIN_END();
+}
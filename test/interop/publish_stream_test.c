@@ -0,0 +1,169 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+#define PAYLOAD_SIZE (2*1024*1024 + 77)
+
+typedef struct Producer
+{
+    size_t pos;
+    int rewinds;
+    int releases;
+} Producer;
+
+static Producer producers[3];
+static int subscribed;
+static int received;
+static int intact;
+
+static unsigned char PayloadByte(size_t i)
+{
+    return (unsigned char) (i * 13 + i / 4093);
+}
+
+/* Produces less than asked for now and then to exercise partial pieces */
+static int64_t produce(MqttClient *client, void *buf, size_t size,
+                       int rewind, void *context)
+{
+    Producer *producer = (Producer *) context;
+    unsigned char *p = (unsigned char *) buf;
+    size_t i;
+
+    (void) client;
+
+    if (rewind)
+    {
+        producer->pos = 0;
+        ++producer->rewinds;
+    }
+
+    if (size > 1 && producer->pos % 3 == 0)
+        size = size / 2 + 1;
+
+    for (i = 0; i < size; ++i)
+        p[i] = PayloadByte(producer->pos + i);
+
+    producer->pos += size;
+
+    return (int64_t) size;
+}
+
+static void release(MqttClient *client, const void *data, void *context)
+{
+    (void) client;
+    if (data == NULL)
+        ++((Producer *) context)->releases;
+}
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    size_t i;
+
+    (void) client;
+    (void) topic;
+    (void) qos;
+    (void) retain;
+
+    ++received;
+
+    if (size != PAYLOAD_SIZE)
+        return;
+
+    for (i = 0; i < size; ++i)
+    {
+        if (p[i] != PayloadByte(i))
+            return;
+    }
+
+    ++intact;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+TEST publish_stream_test()
+{
+    MqttClient *client;
+    int64_t start;
+    int qos;
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        ASSERT(MqttClientPublishStream(client, qos, 0, topics[0],
+                                       PAYLOAD_SIZE, produce, release,
+                                       &producers[qos]) != -1);
+    }
+
+    start = MqttGetCurrentTime();
+
+    while ((received < 3 || producers[1].releases == 0 ||
+            producers[2].releases == 0) &&
+           MqttGetCurrentTime() - start < 10000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(3, received);
+    ASSERT_EQ(3, intact);
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        ASSERT_EQ(1, producers[qos].rewinds);
+        ASSERT_EQ(1, producers[qos].releases);
+        ASSERT_EQ(PAYLOAD_SIZE, producers[qos].pos);
+    }
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(publish_stream_test);
+    GREATEST_MAIN_END();
+}
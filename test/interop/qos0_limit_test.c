@@ -0,0 +1,317 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+static int subscribed;
+static int received;
+static char first[16];
+static char last[16];
+static int errors;
+static int releases;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) qos;
+    (void) retain;
+
+    /* The messages must arrive in order */
+    if (size < sizeof(last) && memcmp(data, last, size) > 0)
+    {
+        memset(last, 0, sizeof(last));
+        memcpy(last, data, size);
+        if (received == 0)
+            memcpy(first, last, sizeof(first));
+        ++received;
+    }
+}
+
+static void onError(MqttClient *client, MqttError error)
+{
+    (void) client;
+    if (error == MqttErrorQos0Dropped)
+        ++errors;
+}
+
+static void release(MqttClient *client, const void *data, void *context)
+{
+    (void) client;
+    (void) data;
+    (void) context;
+    ++releases;
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 0);
+}
+
+static MqttClient *connectClient()
+{
+    MqttClient *client = MqttClientNew("clienta");
+    int64_t start;
+
+    subscribed = 0;
+    received = 0;
+    errors = 0;
+    releases = 0;
+    memset(first, 0, sizeof(first));
+    memset(last, 0, sizeof(last));
+
+    if (!client)
+        return NULL;
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    MqttClientSetOnError(client, onError);
+
+    if (MqttClientConnect(client, "localhost", 1883, 60, 1) == -1)
+        return client;
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        if (MqttClientRunOnce(client, 100) == -1)
+            break;
+    }
+
+    return client;
+}
+
+/* Runs the client until count messages have arrived or 2 s have passed. */
+static void runUntil(MqttClient *client, int count)
+{
+    int64_t start = MqttGetCurrentTime();
+
+    while (received < count && MqttGetCurrentTime() - start < 2000)
+    {
+        if (MqttClientRunOnce(client, 100) == -1)
+            break;
+    }
+}
+
+static void disconnectClient(MqttClient *client)
+{
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+}
+
+TEST qos0_drop_oldest_test()
+{
+    MqttClient *client = connectClient();
+    MqttClientStats stats;
+    char msg[2] = { 0, 0 };
+    int i;
+
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    MqttClientSetQos0Limit(client, 3, 0, MqttQueuePolicyDropOldest);
+
+    ASSERT_EQ(0, MqttClientPublishZeroCopy(client, 0, 0, topics[0], "0", 1,
+                                           release, NULL));
+
+    for (i = 1; i < 6; ++i)
+    {
+        msg[0] = '0' + i;
+        ASSERT_EQ(0, MqttClientPublishCString(client, 0, 0, topics[0], msg));
+    }
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(3, stats.qos0Queued);
+    ASSERT_EQ(3, stats.qos0Dropped);
+    ASSERT_EQ(3, errors);
+    /* The borrowed payload was given back when it was dropped */
+    ASSERT_EQ(1, releases);
+
+    runUntil(client, 3);
+
+    /* Only the newest three arrive */
+    ASSERT_EQ(3, received);
+    ASSERT_STR_EQ("5", last);
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(0, stats.qos0Queued);
+    ASSERT_EQ(0, stats.qos0QueuedBytes);
+
+    disconnectClient(client);
+
+    PASS();
+}
+
+TEST qos0_drop_oversized_test()
+{
+    MqttClient *client = connectClient();
+    MqttClientStats stats;
+    char big[64];
+    size_t size;
+
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    /* Room for the encoded packets of two small messages */
+    size = 2 + 2 + strlen(topics[0]) + 1;
+    MqttClientSetQos0Limit(client, 0, 2 * size, MqttQueuePolicyDropOldest);
+
+    ASSERT_EQ(0, MqttClientPublishCString(client, 0, 0, topics[0], "0"));
+    ASSERT_EQ(0, MqttClientPublishCString(client, 0, 0, topics[0], "1"));
+
+    /* A message that doesn't fit on its own doesn't drop the others */
+    memset(big, 'x', sizeof(big));
+    ASSERT_EQ(0, MqttClientPublish(client, 0, 0, topics[0], big,
+                                   sizeof(big)));
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(2, stats.qos0Queued);
+    ASSERT_EQ(1, stats.qos0Dropped);
+    ASSERT_EQ(1, errors);
+
+    runUntil(client, 2);
+
+    ASSERT_EQ(2, received);
+    ASSERT_STR_EQ("1", last);
+
+    disconnectClient(client);
+
+    PASS();
+}
+
+TEST qos0_drop_priority_test()
+{
+    MqttClient *client = connectClient();
+    MqttClientStats stats;
+
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    MqttClientSetQos0Limit(client, 2, 0, MqttQueuePolicyDropOldest);
+
+    ASSERT_EQ(0, MqttClientPublishWithPriority(client, 0, 0, topics[0], "1",
+                                               1, MqttPriorityHigh));
+    ASSERT_EQ(0, MqttClientPublishWithPriority(client, 0, 0, topics[0], "0",
+                                               1, MqttPriorityNormal));
+
+    /* The older normal message goes, not the high priority one that is
+       ahead of it in the queue */
+    ASSERT_EQ(0, MqttClientPublishWithPriority(client, 0, 0, topics[0], "2",
+                                               1, MqttPriorityLow));
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(2, stats.qos0Queued);
+    ASSERT_EQ(1, stats.qos0Dropped);
+
+    runUntil(client, 2);
+
+    ASSERT_EQ(2, received);
+    ASSERT_STR_EQ("1", first);
+    ASSERT_STR_EQ("2", last);
+
+    disconnectClient(client);
+
+    PASS();
+}
+
+TEST qos0_drop_newest_test()
+{
+    MqttClient *client = connectClient();
+    MqttClientStats stats;
+    char msg[2] = { 0, 0 };
+    size_t size;
+    int i;
+
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    /* Room for the encoded packets of two messages */
+    size = 2 + 2 + strlen(topics[0]) + 1;
+    MqttClientSetQos0Limit(client, 0, 2 * size, MqttQueuePolicyDropNewest);
+
+    for (i = 0; i < 4; ++i)
+    {
+        msg[0] = '0' + i;
+        ASSERT_EQ(0, MqttClientPublishCString(client, 0, 0, topics[0], msg));
+    }
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(2, stats.qos0Queued);
+    ASSERT_EQ(2 * size, stats.qos0QueuedBytes);
+    ASSERT_EQ(2, stats.qos0Dropped);
+    ASSERT_EQ(2 * size, stats.qos0DroppedBytes);
+
+    runUntil(client, 3);
+
+    /* Only the oldest two arrive */
+    ASSERT_EQ(2, received);
+    ASSERT_STR_EQ("1", last);
+
+    disconnectClient(client);
+
+    PASS();
+}
+
+TEST qos0_block_test()
+{
+    MqttClient *client = connectClient();
+    MqttClientStats stats;
+
+    ASSERT(client != NULL);
+    ASSERT(subscribed);
+
+    MqttClientSetQos0Limit(client, 1, 0, MqttQueuePolicyBlock);
+
+    ASSERT_EQ(0, MqttClientPublishCString(client, 0, 0, topics[0], "0"));
+    ASSERT_EQ(-1, MqttClientPublishCString(client, 0, 0, topics[0], "1"));
+
+    runUntil(client, 1);
+    ASSERT_EQ(1, received);
+
+    /* There is room again once it has been sent */
+    ASSERT_EQ(0, MqttClientPublishCString(client, 0, 0, topics[0], "1"));
+
+    runUntil(client, 2);
+    ASSERT_EQ(2, received);
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(0, stats.qos0Dropped);
+    ASSERT_EQ(0, errors);
+
+    disconnectClient(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(qos0_drop_oldest_test);
+    RUN_TEST(qos0_drop_oversized_test);
+    RUN_TEST(qos0_drop_priority_test);
+    RUN_TEST(qos0_drop_newest_test);
+    RUN_TEST(qos0_block_test);
+    GREATEST_MAIN_END();
+}
@@ -0,0 +1,60 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include <poll.h>
+
+TEST recv_budget_test()
+{
+    TestClient *client;
+    int i;
+
+    client = TestClientNew("clienta");
+    ASSERT(TestClientConnect(client, "localhost", 1883, 60, 1));
+    ASSERT(TestClientSubscribe(client, topics[0], 0));
+
+    MqttClientSetRecvBudget(client->client, 5, 0);
+
+    for (i = 0; i < 20; ++i)
+    {
+        ASSERT_EQ(0, MqttClientPublishCString(client->client, 0, 0, topics[0],
+                                              "msg"));
+    }
+
+    ASSERT_EQ(MqttEventRead | MqttEventWrite,
+              MqttClientWantedEvents(client->client));
+    ASSERT_EQ(0, MqttClientHandleEvents(client->client, MqttEventWrite));
+
+    /* Let all the messages come back before reading any of them */
+    poll(NULL, 0, 500);
+
+    ASSERT_EQ(0, MqttClientHandleEvents(client->client, MqttEventRead));
+    ASSERT_EQ(5, TestClientMessageCount(client));
+
+    /* The rest is handled without waiting for the socket */
+    ASSERT_EQ(0, MqttClientNextTimeoutMs(client->client));
+    ASSERT_EQ(0, MqttClientHandleEvents(client->client, 0));
+    ASSERT_EQ(10, TestClientMessageCount(client));
+
+    /* Without a budget everything is handled at once */
+    MqttClientSetRecvBudget(client->client, 0, 0);
+    ASSERT_EQ(0, MqttClientRunOnce(client->client, 1000));
+    ASSERT_EQ(20, TestClientMessageCount(client));
+    ASSERT(MqttClientNextTimeoutMs(client->client) > 0);
+
+    TestClientDisconnect(client);
+    TestClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(recv_budget_test);
+    GREATEST_MAIN_END();
+}
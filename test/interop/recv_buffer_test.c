@@ -0,0 +1,143 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+
+#define SMALL_COUNT 100
+#define BIG_SIZE (100*1024)
+#define KEEP 1024
+
+static unsigned char big[BIG_SIZE];
+static int subscribed;
+static int received;
+static int intact;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) qos;
+    (void) retain;
+    ++received;
+    if ((size == 5 && memcmp(data, "small", 5) == 0) ||
+        (size == BIG_SIZE && memcmp(data, big, size) == 0))
+    {
+        ++intact;
+    }
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 1);
+}
+
+static int run(MqttClient *client, int count)
+{
+    int64_t start = MqttGetCurrentTime();
+
+    while (received < count && MqttGetCurrentTime() - start < 5000)
+    {
+        if (MqttClientRunOnce(client, 100) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+TEST recv_buffer_test()
+{
+    MqttClient *client;
+    MqttClientStats stats;
+    int64_t start;
+    size_t i;
+
+    for (i = 0; i < BIG_SIZE; ++i)
+        big[i] = (unsigned char) (i * 11);
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    MqttClientSetRecvBufferPolicy(client, KEEP, 0);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    /* Small messages reuse a small buffer */
+    for (i = 0; i < SMALL_COUNT; ++i)
+    {
+        ASSERT(MqttClientPublish(client, 1, 0, topics[0], "small", 5) != -1);
+    }
+
+    ASSERT_EQ(0, run(client, SMALL_COUNT));
+    ASSERT_EQ(SMALL_COUNT, received);
+
+    MqttClientGetStats(client, &stats);
+    ASSERT(stats.recvBufferSize > 0 && stats.recvBufferSize <= KEEP);
+    ASSERT(stats.recvBufferPeak <= KEEP);
+
+    /* The buffer grows for a large message and shrinks back after it */
+    ASSERT(MqttClientPublish(client, 1, 0, topics[0], big, BIG_SIZE) != -1);
+
+    ASSERT_EQ(0, run(client, SMALL_COUNT + 1));
+    ASSERT_EQ(SMALL_COUNT + 1, intact);
+
+    MqttClientGetStats(client, &stats);
+    ASSERT(stats.recvBufferSize <= KEEP);
+    ASSERT(stats.recvBufferPeak > BIG_SIZE);
+
+    /* An idle buffer is freed */
+    MqttClientSetRecvBufferPolicy(client, KEEP, 100);
+
+    start = MqttGetCurrentTime();
+
+    while (MqttGetCurrentTime() - start < 500)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    MqttClientGetStats(client, &stats);
+    ASSERT_EQ(0, stats.recvBufferSize);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(recv_buffer_test);
+    GREATEST_MAIN_END();
+}
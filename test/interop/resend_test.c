@@ -0,0 +1,224 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+#include "packet.h"
+
+#include <string.h>
+#include <poll.h>
+
+/* Returns the first byte the packet writes next. */
+static int firstByte(MqttPacket *packet)
+{
+    StreamIoVec iov[2];
+
+    if (MqttPacketWriteIov(packet, iov, 2) < 1)
+        return -1;
+
+    return *(const unsigned char *) iov[0].data;
+}
+
+/* A resend sharing the encoded message with a packet that is still queued
+   doesn't set DUP on that one */
+TEST dup_flag_test()
+{
+    MqttPacketBuffer *buffer;
+    MqttPacket *first, *resend;
+    size_t bodyLength = MqttStringSize(6) + 2 + 4;
+    size_t size = MqttPacketHeaderSize(bodyLength) + bodyLength;
+    unsigned char *p;
+
+    buffer = MqttPacketBufferNew(size);
+    ASSERT(buffer != NULL);
+
+    p = MqttEncodeFixedHeader(buffer->data, MqttPacketTypePublish, 2,
+                              bodyLength);
+    p = MqttEncodeString(p, topics[0], 6);
+    p = MqttEncodeUint16Be(p, 1);
+    MqttEncodeBytes(p, "data", 4);
+
+    first = MqttPacketWithIdNew(MqttPacketTypePublish, 1);
+    resend = MqttPacketWithIdNew(MqttPacketTypePublish, 1);
+    ASSERT(first != NULL && resend != NULL);
+
+    first->flags = 2;
+    MqttPacketUseShared(first, buffer, 0, size);
+    MqttPacketPrepareWrite(first);
+
+    resend->flags = 2 | 8;
+    MqttPacketUseShared(resend, buffer, 0, size);
+    MqttPacketPrepareWrite(resend);
+
+    ASSERT_EQ(0x32, firstByte(first));
+    ASSERT_EQ(0x3A, firstByte(resend));
+    ASSERT_EQ(0x32, buffer->data[0]);
+
+    /* The whole packet is written either way */
+    ASSERT_EQ(size, MqttPacketWriteAdvance(first, size));
+    ASSERT_EQ(MqttPacketStateWriteComplete, first->state);
+    ASSERT_EQ(1, MqttPacketWriteAdvance(resend, 1));
+    ASSERT_EQ(buffer->data[1], firstByte(resend));
+    ASSERT_EQ(size - 1, MqttPacketWriteAdvance(resend, size));
+    ASSERT_EQ(MqttPacketStateWriteComplete, resend->state);
+
+    MqttPacketFree(first);
+    MqttPacketFree(resend);
+    MqttPacketBufferUnref(buffer);
+
+    PASS();
+}
+
+/* A QoS 2 message resent before its PUBREC is read arrives once and
+   intact */
+TEST qos2_resend_test()
+{
+    TestClient *clienta, *clientb;
+    Message *msg;
+    struct pollfd pfd;
+    int64_t start;
+
+    clienta = TestClientNew("clienta");
+    clientb = TestClientNew("clientb");
+
+    ASSERT(TestClientConnect(clientb, "localhost", 1883, 60, 1));
+    ASSERT(TestClientSubscribe(clientb, topics[0], 2));
+    ASSERT(TestClientConnect(clienta, "localhost", 1883, 60, 1));
+
+    ASSERT(MqttClientPublishCString(clienta->client, 2, 0, topics[0],
+                                    "resent") > 0);
+
+    ASSERT(MqttClientWantedEvents(clienta->client) & MqttEventWrite);
+    ASSERT_EQ(0, MqttClientHandleEvents(clienta->client, MqttEventWrite));
+
+    pfd.fd = MqttClientGetFd(clienta->client);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ASSERT_EQ(1, poll(&pfd, 1, 5000));
+
+    /* Resend from the encoded message before reading the PUBREC */
+    MqttClientSetPublishRetryTimeout(clienta->client, 0);
+    ASSERT(MqttClientWantedEvents(clienta->client) & MqttEventWrite);
+    MqttClientSetPublishRetryTimeout(clienta->client, 20);
+    ASSERT_EQ(0, MqttClientHandleEvents(clienta->client, MqttEventWrite));
+
+    clienta->pubId = -1;
+    start = MqttGetCurrentTime();
+
+    while (clienta->pubId == -1)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT(MqttClientRunOnce(clienta->client, 100) != -1);
+    }
+
+    TestClientWait(clientb, 1000);
+    ASSERT_EQ(1, TestClientMessageCount(clientb));
+    msg = SIMPLEQ_FIRST(&clientb->messages);
+    ASSERT_EQ(6, msg->size);
+    ASSERT_MEM_EQ("resent", msg->data, 6);
+
+    TestClientDisconnect(clienta);
+    TestClientDisconnect(clientb);
+    TestClientFree(clienta);
+    TestClientFree(clientb);
+
+    PASS();
+}
+
+/* Sends until the client has nothing more to write for now. */
+static int sendAll(MqttClient *client)
+{
+    while (MqttClientWantedEvents(client) & MqttEventWrite)
+    {
+        if (MqttClientHandleEvents(client, MqttEventWrite) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Messages whose acknowledgements haven't been read when they time out
+   are resent once, in the order they were sent, and the acknowledgements
+   of both sends are taken */
+TEST retry_order_test()
+{
+    static const char *payloads[] = { "0", "1", "2" };
+    TestClient *clienta, *clientb;
+    Message *msg;
+    struct pollfd pfd;
+    int64_t start;
+    int i;
+
+    clienta = TestClientNew("clienta");
+    clientb = TestClientNew("clientb");
+
+    ASSERT(TestClientConnect(clientb, "localhost", 1883, 60, 1));
+    ASSERT(TestClientSubscribe(clientb, topics[0], 1));
+    ASSERT(TestClientConnect(clienta, "localhost", 1883, 60, 1));
+
+    for (i = 0; i < 3; ++i)
+    {
+        ASSERT(MqttClientPublishCString(clienta->client, 1, 0, topics[0],
+                                        payloads[i]) > 0);
+    }
+
+    ASSERT_EQ(0, sendAll(clienta->client));
+
+    pfd.fd = MqttClientGetFd(clienta->client);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ASSERT_EQ(1, poll(&pfd, 1, 5000));
+
+    /* All three time out before any PUBACK is read */
+    MqttClientSetPublishRetryTimeout(clienta->client, 0);
+    ASSERT(MqttClientWantedEvents(clienta->client) & MqttEventWrite);
+    MqttClientSetPublishRetryTimeout(clienta->client, 20);
+    ASSERT_EQ(0, sendAll(clienta->client));
+
+    start = MqttGetCurrentTime();
+
+    while (TestClientMessageCount(clientb) < 6 &&
+           MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(clienta->client, 10) != -1);
+        ASSERT(MqttClientRunOnce(clientb->client, 10) != -1);
+    }
+
+    /* Nothing more is resent */
+    for (i = 0; i < 50; ++i)
+    {
+        ASSERT(MqttClientRunOnce(clienta->client, 10) != -1);
+        ASSERT(MqttClientRunOnce(clientb->client, 10) != -1);
+    }
+
+    ASSERT(MqttClientIsConnected(clienta->client));
+    ASSERT_EQ(6, TestClientMessageCount(clientb));
+
+    i = 0;
+    SIMPLEQ_FOREACH(msg, &clientb->messages, chain)
+    {
+        ASSERT_EQ(1, msg->size);
+        ASSERT_MEM_EQ(payloads[i % 3], msg->data, 1);
+        ++i;
+    }
+
+    TestClientDisconnect(clienta);
+    TestClientDisconnect(clientb);
+    TestClientFree(clienta);
+    TestClientFree(clientb);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(dup_flag_test);
+    RUN_TEST(qos2_resend_test);
+    RUN_TEST(retry_order_test);
+    GREATEST_MAIN_END();
+}
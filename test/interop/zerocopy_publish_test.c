@@ -0,0 +1,221 @@
+#include "greatest.h"
+#include "testclient.h"
+#include "cleanup.c"
+#include "topics.c"
+
+#include "misc.h"
+
+#include <string.h>
+#include <poll.h>
+
+#define PAYLOAD_SIZE (256*1024)
+
+static unsigned char payloads[3][PAYLOAD_SIZE];
+static int released[3];
+static int subscribed;
+static int received;
+static int intact;
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    (void) client;
+    (void) id;
+    (void) qos;
+    (void) count;
+    subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    (void) client;
+    (void) topic;
+    (void) retain;
+    ++received;
+    if (qos >= 0 && qos < 3 && size == PAYLOAD_SIZE &&
+        memcmp(data, payloads[qos], size) == 0)
+    {
+        ++intact;
+    }
+}
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    (void) sessionPresent;
+    if (status == MqttConnectionAccepted)
+        MqttClientSubscribe(client, topics[0], 2);
+}
+
+static void onRelease(MqttClient *client, const void *data, void *context)
+{
+    int *qos = context;
+    (void) client;
+    if (data == payloads[*qos])
+        ++released[*qos];
+}
+
+TEST zerocopy_publish_test()
+{
+    static int qosLevels[3] = { 0, 1, 2 };
+    MqttClient *client;
+    int64_t start;
+    int qos;
+    size_t i;
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        for (i = 0; i < PAYLOAD_SIZE; ++i)
+            payloads[qos][i] = (unsigned char) (i * (qos + 3));
+    }
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetOnConnect(client, onConnect);
+    MqttClientSetOnSubscribe(client, onSubscribe);
+    MqttClientSetOnMessage(client, onMessage);
+    /* Use MSG_ZEROCOPY where the platform has it */
+    MqttClientSetZeroCopyThreshold(client, 64*1024);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+
+    start = MqttGetCurrentTime();
+
+    while (!subscribed && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT(subscribed);
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        ASSERT(MqttClientPublishZeroCopy(client, qos, 0, topics[0],
+                                         payloads[qos], PAYLOAD_SIZE,
+                                         onRelease, &qosLevels[qos]) != -1);
+    }
+
+    /* Nothing is released before it has been sent */
+    ASSERT_EQ(0, released[0] + released[1] + released[2]);
+
+    start = MqttGetCurrentTime();
+
+    while ((received < 3 || released[0] + released[1] + released[2] < 3) &&
+           MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(3, received);
+    ASSERT_EQ(3, intact);
+
+    for (qos = 0; qos < 3; ++qos)
+    {
+        ASSERT_EQ(1, released[qos]);
+    }
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    /* Each payload is released exactly once */
+    for (qos = 0; qos < 3; ++qos)
+    {
+        ASSERT_EQ(1, released[qos]);
+    }
+
+    PASS();
+}
+
+static void onCount(MqttClient *client, const void *data, void *context)
+{
+    (void) client;
+    (void) data;
+    ++*(int *) context;
+}
+
+TEST zerocopy_release_on_free_test()
+{
+    static const char payload[] = "queued";
+    MqttClient *client;
+    int count = 0;
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    /* Queued without a connection and dropped with the client */
+    ASSERT(MqttClientPublishZeroCopy(client, 1, 0, topics[0], payload,
+                                     sizeof(payload), onCount,
+                                     &count) != -1);
+    ASSERT_EQ(0, count);
+
+    MqttClientFree(client);
+
+    ASSERT_EQ(1, count);
+
+    PASS();
+}
+
+/* The completion of a zero copy send is read before the PUBACK arrives,
+   otherwise the socket keeps being reported with POLLERR */
+TEST zerocopy_completion_test()
+{
+    MqttClient *client;
+    struct pollfd pfd;
+    int64_t start;
+    int count = 0;
+
+    client = MqttClientNew("clienta");
+    ASSERT(client != NULL);
+
+    MqttClientSetZeroCopyThreshold(client, 64*1024);
+    ASSERT_EQ(0, MqttClientConnect(client, "localhost", 1883, 60, 1));
+    ASSERT(MqttClientPublishZeroCopy(client, 1, 0, topics[0], payloads[1],
+                                     PAYLOAD_SIZE, onCount, &count) != -1);
+
+    /* Send CONNECT and PUBLISH without reading anything */
+    start = MqttGetCurrentTime();
+    while (MqttClientWantedEvents(client) & MqttEventWrite)
+    {
+        ASSERT(MqttGetCurrentTime() - start < 5000);
+        ASSERT_EQ(0, MqttClientHandleEvents(client, MqttEventWrite));
+    }
+
+    pfd.fd = MqttClientGetFd(client);
+    pfd.events = 0;
+    pfd.revents = 0;
+
+    /* Only where the platform has MSG_ZEROCOPY */
+    if (poll(&pfd, 1, 1000) == 1)
+    {
+        ASSERT(pfd.revents & POLLERR);
+        ASSERT_EQ(0, MqttClientHandleEvents(client, 0));
+        ASSERT_EQ(0, poll(&pfd, 1, 100));
+    }
+
+    start = MqttGetCurrentTime();
+    while (count == 0 && MqttGetCurrentTime() - start < 5000)
+    {
+        ASSERT(MqttClientRunOnce(client, 100) != -1);
+    }
+
+    ASSERT_EQ(1, count);
+
+    MqttClientDisconnect(client);
+    MqttClientRunOnce(client, 100);
+    MqttClientFree(client);
+
+    PASS();
+}
+
+GREATEST_MAIN_DEFS();
+
+int main(int argc, char **argv)
+{
+    GREATEST_MAIN_BEGIN();
+    cleanup();
+    RUN_TEST(zerocopy_publish_test);
+    RUN_TEST(zerocopy_release_on_free_test);
+    RUN_TEST(zerocopy_completion_test);
+    GREATEST_MAIN_END();
+}
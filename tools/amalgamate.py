@@ -12,14 +12,21 @@ sources = (
     'queue.h',
     'log.h',
     'misc.c',
+    'alloc.c',
+    'memdbg.h',
     'lib/bstrlib/bstrlib.c',
     'socket.c',
     'stream.c',
+    'socketstream.h',
+    'uring.c',
+    'uringstream.c',
     'socketstream.c',
     'stringstream.c',
     'stream_mqtt.c',
     'packet.c',
     'message.c',
+    'private.h',
+    'loop.c',
     'client.c'
 )
 
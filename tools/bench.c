@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mqtt.h"
+#include "optparse.h"
+
+/*
+    Every client subscribes to a topic of its own and publishes messages to
+    it, keeping at most window messages on the way. The run ends when all the
+    messages have come back. With a batch of more than one, the messages are
+    published batch at a time with MqttClientPublishMany.
+*/
+
+enum
+{
+    MODE_RUNONCE,
+    MODE_LOOP
+};
+
+struct options
+{
+    const char *host;
+    int port;
+    int clients;
+    int messages;
+    int size;
+    int qos;
+    int window;
+    int batch;
+    int coalesceUs;
+    int coalesceBytes;
+    int mode;
+};
+
+struct bench_client
+{
+    MqttClient *client;
+    char topic[64];
+    int subscribed;
+    int sent;
+    int received;
+};
+
+static void onConnect(MqttClient *client, MqttConnectionStatus status,
+                      int sessionPresent)
+{
+    struct bench_client *bc = MqttClientGetUserData(client);
+    (void) sessionPresent;
+    if (status != MqttConnectionAccepted)
+    {
+        fprintf(stderr, "connection refused: %d\n", status);
+        exit(1);
+    }
+    MqttClientSubscribe(client, bc->topic, 2);
+}
+
+static void onSubscribe(MqttClient *client, int id, int *qos, int count)
+{
+    struct bench_client *bc = MqttClientGetUserData(client);
+    (void) id;
+    (void) qos;
+    (void) count;
+    bc->subscribed = 1;
+}
+
+static void onMessage(MqttClient *client, const char *topic, const void *data,
+                      size_t size, int qos, int retain)
+{
+    struct bench_client *bc = MqttClientGetUserData(client);
+    (void) topic;
+    (void) data;
+    (void) size;
+    (void) qos;
+    (void) retain;
+    bc->received++;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "%s [--host HOST] [--port PORT] [--clients N] "
+        "[--messages N] [--size BYTES] [--qos QOS] [--window N] "
+        "[--batch N] [--coalesce US] [--coalesce-bytes BYTES] "
+        "[--mode runonce|loop]\n", prog);
+    exit(1);
+}
+
+static void parse_args(struct options *options, int argc, char **argv)
+{
+    int option;
+
+    struct optparse_long longopts[] =
+    {
+        { "host", 'H', OPTPARSE_REQUIRED },
+        { "port", 'p', OPTPARSE_REQUIRED },
+        { "clients", 'c', OPTPARSE_REQUIRED },
+        { "messages", 'n', OPTPARSE_REQUIRED },
+        { "size", 's', OPTPARSE_REQUIRED },
+        { "qos", 'q', OPTPARSE_REQUIRED },
+        { "window", 'w', OPTPARSE_REQUIRED },
+        { "batch", 'b', OPTPARSE_REQUIRED },
+        { "coalesce", 'C', OPTPARSE_REQUIRED },
+        { "coalesce-bytes", 'B', OPTPARSE_REQUIRED },
+        { "mode", 'm', OPTPARSE_REQUIRED },
+        { "help", 'h', OPTPARSE_NONE },
+        { NULL }
+    };
+
+    struct optparse parser;
+
+    (void) argc;
+
+    optparse_init(&parser, argv);
+
+    while ((option = optparse_long(&parser, longopts, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'H':
+                options->host = parser.optarg;
+                break;
+
+            case 'p':
+                options->port = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'c':
+                options->clients = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'n':
+                options->messages = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 's':
+                options->size = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'q':
+                options->qos = strtol(parser.optarg, NULL, 10);
+                if (options->qos < 0 || options->qos > 2)
+                {
+                    fprintf(stderr, "invalid qos: %s\n", parser.optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'w':
+                options->window = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'b':
+                options->batch = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'C':
+                options->coalesceUs = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'B':
+                options->coalesceBytes = strtol(parser.optarg, NULL, 10);
+                break;
+
+            case 'm':
+                if (strcmp(parser.optarg, "runonce") == 0)
+                    options->mode = MODE_RUNONCE;
+                else if (strcmp(parser.optarg, "loop") == 0)
+                    options->mode = MODE_LOOP;
+                else
+                    usage(argv[0]);
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                break;
+
+            case '?':
+                fprintf(stderr, "%s: %s\n", argv[0], parser.errmsg);
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (options->clients < 1 || options->messages < 1 || options->size < 0 ||
+        options->window < 1 || options->batch < 1 ||
+        options->coalesceUs < 0 || options->coalesceBytes < 0)
+        usage(argv[0]);
+}
+
+/* Drives all the clients once. */
+static void run(struct options *options, MqttLoop *loop,
+                struct bench_client *clients)
+{
+    int i;
+
+    if (options->mode == MODE_LOOP)
+    {
+        if (MqttLoopRun(loop, 100) == -1)
+        {
+            fprintf(stderr, "MqttLoopRun failed\n");
+            exit(1);
+        }
+        return;
+    }
+
+    /* With more than one client we can't block on any single one of them */
+    for (i = 0; i < options->clients; ++i)
+    {
+        if (MqttClientRunOnce(clients[i].client,
+                              options->clients == 1 ? 100 : 0) == -1)
+        {
+            fprintf(stderr, "MqttClientRunOnce failed\n");
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct options options;
+    struct bench_client *clients;
+    MqttPublishSpec *specs;
+    MqttLoop *loop = NULL;
+    char *payload;
+    long total, received;
+    double start, elapsed, cpu;
+    int i;
+
+    options.host = "localhost";
+    options.port = 1883;
+    options.clients = 1;
+    options.messages = 10000;
+    options.size = 64;
+    options.qos = 0;
+    options.window = 100;
+    options.batch = 1;
+    options.coalesceUs = 0;
+    options.coalesceBytes = 0;
+    options.mode = MODE_RUNONCE;
+
+    parse_args(&options, argc, argv);
+
+    payload = calloc(1, options.size + 1);
+    clients = calloc(options.clients, sizeof(*clients));
+    specs = calloc(options.batch, sizeof(*specs));
+
+    if (options.mode == MODE_LOOP && (loop = MqttLoopNew()) == NULL)
+    {
+        fprintf(stderr, "MqttLoopNew failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < options.clients; ++i)
+    {
+        struct bench_client *bc = &clients[i];
+        char id[32];
+
+        sprintf(id, "bench-%d", i);
+        sprintf(bc->topic, "bench/%d", i);
+
+        bc->client = MqttClientNew(id);
+        MqttClientSetUserData(bc->client, bc);
+        MqttClientSetOnConnect(bc->client, onConnect);
+        MqttClientSetOnSubscribe(bc->client, onSubscribe);
+        MqttClientSetOnMessage(bc->client, onMessage);
+        MqttClientSetMaxMessagesInflight(bc->client, options.window);
+        MqttClientSetMaxQueuedMessages(bc->client, options.window);
+        MqttClientSetCoalescing(bc->client, options.coalesceUs,
+                                options.coalesceBytes);
+
+        if (loop)
+            MqttLoopAdd(loop, bc->client);
+
+        if (MqttClientConnect(bc->client, options.host, options.port, 60,
+                              1) == -1)
+        {
+            fprintf(stderr, "failed to connect to %s:%d\n", options.host,
+                    options.port);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < options.clients; ++i)
+    {
+        while (!clients[i].subscribed)
+            run(&options, loop, clients);
+    }
+
+    total = (long) options.clients * options.messages;
+    received = 0;
+
+    start = now_seconds();
+    cpu = cpu_seconds();
+
+    while (received < total)
+    {
+        received = 0;
+
+        for (i = 0; i < options.clients; ++i)
+        {
+            struct bench_client *bc = &clients[i];
+
+            while (options.batch > 1 && bc->sent < options.messages &&
+                   bc->sent - bc->received < options.window)
+            {
+                int count = options.batch;
+                int j, rv;
+
+                if (count > options.window - (bc->sent - bc->received))
+                    count = options.window - (bc->sent - bc->received);
+                if (count > options.messages - bc->sent)
+                    count = options.messages - bc->sent;
+
+                for (j = 0; j < count; ++j)
+                {
+                    specs[j].topic = bc->topic;
+                    specs[j].data = payload;
+                    specs[j].size = options.size;
+                    specs[j].qos = options.qos;
+                    specs[j].retain = 0;
+                    specs[j].priority = MqttPriorityNormal;
+                }
+
+                if ((rv = MqttClientPublishMany(bc->client, specs, count,
+                                                NULL)) == -1)
+                    break;
+                bc->sent += rv;
+            }
+
+            while (options.batch == 1 && bc->sent < options.messages &&
+                   bc->sent - bc->received < options.window)
+            {
+                if (MqttClientPublish(bc->client, options.qos, 0, bc->topic,
+                                      payload, options.size) == -1)
+                    break;
+                bc->sent++;
+            }
+
+            received += bc->received;
+        }
+
+        if (received < total)
+            run(&options, loop, clients);
+    }
+
+    elapsed = now_seconds() - start;
+    cpu = cpu_seconds() - cpu;
+
+    printf("mode=%s clients=%d messages=%ld size=%d qos=%d batch=%d\n",
+           options.mode == MODE_LOOP ? "loop" : "runonce", options.clients,
+           total, options.size, options.qos, options.batch);
+    printf("%.3f s, %.0f msg/s, %.2f us cpu/msg\n", elapsed, total / elapsed,
+           cpu * 1e6 / total);
+
+    if (options.coalesceUs > 0)
+    {
+        uint64_t flushes = 0, delay = 0;
+
+        for (i = 0; i < options.clients; ++i)
+        {
+            MqttClientStats stats;
+            MqttClientGetStats(clients[i].client, &stats);
+            flushes += stats.coalesceFlushes;
+            delay += stats.coalesceDelayTotalUs;
+        }
+
+        printf("%llu coalesced writes, %.0f us average delay\n",
+               (unsigned long long) flushes,
+               flushes > 0 ? (double) delay / flushes : 0.0);
+    }
+
+    for (i = 0; i < options.clients; ++i)
+    {
+        if (loop)
+            MqttLoopRemove(loop, clients[i].client);
+        MqttClientFree(clients[i].client);
+    }
+
+    MqttLoopFree(loop);
+    free(specs);
+    free(clients);
+    free(payload);
+
+    return 0;
+}